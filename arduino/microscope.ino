@@ -1,7 +1,12 @@
-#include <Stepper.h>
+#include "motion.h"
 
 int lastPosChange_M2 = 0;
 
+// Steps of M2 that do not move the stage after a change of the direction.
+// The host measures it with the backlash calibration and sends it after
+// connecting, the default is the conservative value of the first stage.
+int backlashM2 = 1900;
+
 // True if new data are available
 volatile bool newData = false;
 
@@ -11,16 +16,94 @@ bool motorSelected = false;
 // Name of the motor that has been selected
 String motorSelection = "M1";
 
+// True if a scan has been selected and its parameters are expected
+bool scanSelected = false;
+
+// Scan plan, uploaded as one message: grid size, steps between two
+// positions, dwell time at every position (0 waits for CAPTURED from the host),
+// a serpentine flag and the order (0 column by column, 1 row by row)
+bool scanActive = false;
+bool scanWaiting = false;
+int scanColumns = 0;
+int scanRows = 0;
+int scanStepsX = 0;
+int scanStepsY = 0;
+unsigned long scanDwell = 0;
+bool scanSerpentine = true;
+bool scanRowMajor = false;
+int scanX = 0;
+int scanY = 0;
+unsigned long scanArrival = 0;
+
 // Variables for command buffering
 const byte numChars = 32;
 char recievedChars[numChars];
 
+// Binary protocol, negotiated by the host with "BINARY <baud>". A frame is
+// 0xA5 | type | seq | length | payload | crc16 (high byte first), the CRC-16
+// CCITT covers everything between sync byte and checksum.
+#define FRAME_SYNC 0xA5
+#define FRAME_MOVE 0x01
+#define FRAME_SCAN 0x02
+#define FRAME_CAPTURED 0x03
+#define FRAME_ABORT 0x04
+#define FRAME_BACKLASH 0x05
+#define FRAME_SWEEP 0x06
+#define FRAME_ACK 0x80
+#define FRAME_READY 0x81
+#define FRAME_AT 0x82
+#define FRAME_DONE 0x83
+#define FRAME_ABORTED 0x84
+#define FRAME_NAK 0x85
+#define FRAME_POSITION 0x86
+const byte maxPayload = 32;
+
+bool binaryMode = false;
+byte frameType = 0;
+byte frameSeq = 0;
+byte frameLength = 0;
+byte framePayload[maxPayload];
+byte eventSeq = 0;
+
+// Sequence number of the last command, a repeated command is only
+// acknowledged again, but not executed twice
+int lastCommandSeq = -1;
+
+// Last event sent, repeated if the host reports it as corrupted
+byte lastEvent[maxPayload + 6];
+byte lastEventSize = 0;
+
 // Number of steps per 360°
 const int spr = 2048;
 
-// Stepper initialization
-Stepper m1(spr, 8, 10, 9, 11);
-Stepper m2(spr, 4, 6, 5, 7);
+// Pins of the coils in the order of the Stepper library: Stepper(spr, 8, 10,
+// 9, 11) and Stepper(spr, 4, 6, 5, 7)
+const byte pinsM1[4] = {8, 10, 9, 11};
+const byte pinsM2[4] = {4, 6, 5, 7};
+byte phaseM1 = 0;
+byte phaseM2 = 0;
+
+// Speeds in steps per second. Every move starts and ends with the old fixed
+// speed of 5 rpm, which never stalls, and ramps up to about 15 rpm between.
+const float startSpeed = spr * 5 / 60.0;
+const float maxSpeed = 500;
+const float acceleration = 1000;
+Motion motion(startSpeed, maxSpeed, acceleration);
+
+// What the end of the running move is reported to
+#define MOVE_NONE 0
+#define MOVE_COMMAND 1
+#define MOVE_SCAN 2
+#define MOVE_MANUAL 3
+#define MOVE_SWEEP 4
+byte moveOwner = MOVE_NONE;
+
+// A sweep moves one motor with a constant speed and reports its position
+// with the time every sweepInterval microseconds, so the host can tell where
+// the stage was when a camera frame has been taken
+unsigned long sweepInterval = 0;
+unsigned long sweepLastSample = 0;
+int8_t sweepSign = 1;
 
 // LEDs
 #define PIN_LED_M1 13
@@ -35,10 +118,11 @@ Stepper m2(spr, 4, 6, 5, 7);
 void setup() {
   Serial.begin(9600);
 
-  m1.setSpeed(5);
-  m2.setSpeed(5);
-  
   // Pin modes
+  for (byte i = 0; i < 4; i++) {
+    pinMode(pinsM1[i], OUTPUT);
+    pinMode(pinsM2[i], OUTPUT);
+  }
   pinMode(PIN_LED_M1, OUTPUT);
   pinMode(PIN_BUTTON_M1, INPUT_PULLUP);
   pinMode(PIN_LED_M2, OUTPUT);
@@ -48,10 +132,18 @@ void setup() {
 }
 
 void loop() {
-  // First of all, handle the manual buttons
+  // Step the motors first, everything but an abort has to wait for the end
+  // of the move like with the blocking steps before
+  runMotors();
+  if (moveOwner != MOVE_NONE) {
+    recieveAbort();
+    return;
+  }
+
+  // Handle the manual buttons
   if (digitalRead(PIN_BUTTON_M1) == LOW) {
     digitalWrite(PIN_LED_M1, HIGH);
-    m1.step(10);
+    manualMove(10, 0);
     
     // Clear all data that might have been read, cause manual mode is more important
     newData = false;
@@ -62,7 +154,7 @@ void loop() {
   }
   if (digitalRead(PIN_BUTTON_M2) == LOW) {
     digitalWrite(PIN_LED_M2, HIGH);
-    m2.step(-10);
+    manualMove(0, -10);
     
     // Clear all data that might have been read, cause manual mode is more important
     newData = false;
@@ -73,7 +165,7 @@ void loop() {
   }
   if (digitalRead(PIN_BUTTON_M22) == LOW) {
     digitalWrite(PIN_LED_M22, HIGH);
-    m2.step(10);
+    manualMove(0, 10);
     
     // Clear all data that might have been read, cause manual mode is more important
     newData = false;
@@ -83,8 +175,31 @@ void loop() {
     digitalWrite(PIN_LED_M22, LOW);
   }
   
-  recieveData();
+  if (binaryMode) {
+    recieveFrame();
+  } else {
+    recieveData();
+  }
   handleCommand();
+  runScan();
+}
+
+void recieveAbort() {
+  // The host waits for the acknowledge of an abort only a short time, but a
+  // move might take seconds. Other commands stay buffered till its end.
+  if (binaryMode) {
+    recieveFrame();
+    if (newData == true &&
+        (frameType == FRAME_ABORT || frameType == FRAME_NAK)) {
+      handleFrame();
+    }
+  } else {
+    recieveData();
+    if (newData == true && scanActive &&
+        strcmp(recievedChars, "ABORT") == 0) {
+      handleCommand();
+    }
+  }
 }
 
 void recieveData() {
@@ -106,12 +221,456 @@ void recieveData() {
   }
 }
 
+unsigned int crc16(const byte *data, byte length, unsigned int crc) {
+  for (byte i = 0; i < length; i++) {
+    crc ^= (unsigned int)data[i] << 8;
+    for (byte bit = 0; bit < 8; bit++) {
+      if (crc & 0x8000) {
+        crc = (crc << 1) ^ 0x1021;
+      } else {
+        crc <<= 1;
+      }
+    }
+  }
+  return crc;
+}
+
+void recieveFrame() {
+  // Position in the current frame: 0 sync, 1 type, 2 seq, 3 length,
+  // then payload and checksum
+  static byte pos = 0;
+  static byte header[3];
+  static unsigned int crc = 0;
+
+  while (Serial.available() > 0 && newData == false) {
+    byte rc = Serial.read();
+    if (pos == 0) {
+      if (rc == FRAME_SYNC) {
+        pos = 1;
+      }
+      continue;
+    }
+
+    if (pos < 4) {
+      header[pos - 1] = rc;
+      pos++;
+      if (pos == 4 && header[2] > maxPayload) {
+        // Not a header, wait for the next sync byte
+        pos = 0;
+      }
+      continue;
+    }
+
+    byte index = pos - 4;
+    if (index < header[2]) {
+      framePayload[index] = rc;
+      pos++;
+    } else if (index == header[2]) {
+      crc = (unsigned int)rc << 8;
+      pos++;
+    } else {
+      crc |= rc;
+      pos = 0;
+      unsigned int expected = crc16(header, 3, 0xFFFF);
+      expected = crc16(framePayload, header[2], expected);
+      if (crc != expected) {
+        sendFrame(FRAME_NAK, header[1], NULL, 0);
+        continue;
+      }
+
+      frameType = header[0];
+      frameSeq = header[1];
+      frameLength = header[2];
+      newData = true;
+    }
+  }
+}
+
+byte writeFrame(byte *frame, byte type, byte seq, const byte *payload,
+                byte length) {
+  frame[0] = FRAME_SYNC;
+  frame[1] = type;
+  frame[2] = seq;
+  frame[3] = length;
+  for (byte i = 0; i < length; i++) {
+    frame[4 + i] = payload[i];
+  }
+  unsigned int crc = crc16(frame + 1, length + 3, 0xFFFF);
+  frame[4 + length] = crc >> 8;
+  frame[5 + length] = crc & 0xFF;
+  return length + 6;
+}
+
+void sendFrame(byte type, byte seq, const byte *payload, byte length) {
+  byte frame[maxPayload + 6];
+  Serial.write(frame, writeFrame(frame, type, seq, payload, length));
+}
+
+void sendEvent(byte type, const byte *payload, byte length) {
+  lastEventSize = writeFrame(lastEvent, type, eventSeq++, payload, length);
+  Serial.write(lastEvent, lastEventSize);
+}
+
+void putInt32(byte *data, long value) {
+  for (byte i = 0; i < 4; i++) {
+    data[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+long getInt32(const byte *data) {
+  long value = 0;
+  for (byte i = 0; i < 4; i++) {
+    value |= (long)data[i] << (8 * i);
+  }
+  return value;
+}
+
+void sendReady() {
+  if (binaryMode) {
+    sendEvent(FRAME_READY, NULL, 0);
+  } else {
+    Serial.write("READY\n");
+  }
+}
+
+void stepMotor(const byte *pins, byte &phase, int8_t direction) {
+  // Full step sequence of the Stepper library, pin 1 is the highest bit
+  static const byte sequence[4] = {0b1010, 0b0110, 0b0101, 0b1001};
+  phase = (phase + direction) & 3;
+  for (byte i = 0; i < 4; i++) {
+    digitalWrite(pins[i], (sequence[phase] >> (3 - i)) & 1);
+  }
+}
+
+void startMove(long stepsM1, long stepsM2, byte owner) {
+  // Compensate the backlash on every change of the direction, the first
+  // motor runs meanwhile
+  if ((lastPosChange_M2 < 0 && stepsM2 > 0) ||
+      (lastPosChange_M2 > 0 && stepsM2 < 0)) {
+    if (stepsM2 > 0) {
+      stepsM2 += backlashM2;
+    } else {
+      stepsM2 -= backlashM2;
+    }
+  }
+  if (stepsM2 != 0) {
+    lastPosChange_M2 = stepsM2 > 0 ? 1 : -1;
+  }
+  moveOwner = owner;
+  motion.move(stepsM1, stepsM2, micros());
+}
+
+void manualMove(long stepsM1, long stepsM2) {
+  // Manual moves are short and do not compensate the backlash
+  moveOwner = MOVE_MANUAL;
+  motion.move(stepsM1, stepsM2, micros());
+}
+
+void runMotors() {
+  if (moveOwner == MOVE_NONE) {
+    return;
+  }
+
+  byte due = motion.update(micros());
+  if (due & 1) {
+    stepMotor(pinsM1, phaseM1, motion.direction(0));
+  }
+  if (due & 2) {
+    stepMotor(pinsM2, phaseM2, motion.direction(1));
+  }
+  if (motion.isRunning()) {
+    if (moveOwner == MOVE_SWEEP) {
+      runSweep();
+    }
+    return;
+  }
+
+  byte owner = moveOwner;
+  moveOwner = MOVE_NONE;
+  if (owner == MOVE_COMMAND) {
+    sendReady();
+  } else if (owner == MOVE_SCAN && scanActive) {
+    reportPosition();
+  } else if (owner == MOVE_SWEEP) {
+    // The last position is the end of the sweep
+    sendSample(micros());
+    motion.setMaxSpeed(maxSpeed);
+    sendReady();
+  }
+}
+
+void runSweep() {
+  unsigned long now = micros();
+  if (now - sweepLastSample >= sweepInterval) {
+    sweepLastSample = now;
+    sendSample(now);
+  }
+}
+
+void sendSample(unsigned long now) {
+  byte payload[8];
+  putInt32(payload, (long)now);
+  putInt32(payload + 4, sweepSign * motion.position());
+  sendEvent(FRAME_POSITION, payload, 8);
+}
+
+void startSweep(byte motor, long steps, long speed, long interval) {
+  if ((motor != 1 && motor != 2) || speed <= 0 || interval <= 0) {
+    sendReady();
+    return;
+  }
+
+  motion.setMaxSpeed(speed < maxSpeed ? speed : maxSpeed);
+  sweepInterval = interval * 1000;
+  sweepSign = steps < 0 ? -1 : 1;
+  if (motor == 1) {
+    startMove(steps, 0, MOVE_SWEEP);
+  } else {
+    startMove(0, steps, MOVE_SWEEP);
+  }
+  sweepLastSample = micros();
+  sendSample(sweepLastSample);
+}
+
+void setBacklash(long steps) {
+  if (steps >= 0 && steps <= 4 * spr) {
+    backlashM2 = steps;
+  }
+}
+
+void reportPosition() {
+  if (binaryMode) {
+    byte payload[8];
+    putInt32(payload, scanX);
+    putInt32(payload + 4, scanY);
+    sendEvent(FRAME_AT, payload, 8);
+  } else {
+    Serial.print("AT ");
+    Serial.print(scanX);
+    Serial.print(" ");
+    Serial.print(scanY);
+    Serial.print("\n");
+  }
+  scanWaiting = true;
+  scanArrival = millis();
+}
+
+void startScan(char *params) {
+  long values[7] = {0, 0, 0, 0, 0, 1, 0};
+  char *token = strtok(params, " ");
+  for (int i = 0; i < 7 && token != NULL; i++) {
+    values[i] = atol(token);
+    token = strtok(NULL, " ");
+  }
+  beginScan(values);
+}
+
+void beginScan(const long *values) {
+  scanColumns = values[0];
+  scanRows = values[1];
+  scanStepsX = values[2];
+  scanStepsY = values[3];
+  scanDwell = values[4];
+  scanSerpentine = values[5] != 0;
+  scanRowMajor = values[6] != 0;
+
+  if (scanColumns <= 0 || scanRows <= 0) {
+    finishScan(true);
+    return;
+  }
+
+  // The current position is the first one of the scan
+  scanActive = true;
+  scanX = 0;
+  scanY = 0;
+  reportPosition();
+}
+
+void finishScan(bool completed) {
+  scanActive = false;
+  scanWaiting = false;
+  if (moveOwner == MOVE_SCAN) {
+    // Aborted on the way to the next position, stop there
+    motion.stop();
+    moveOwner = MOVE_NONE;
+  }
+  if (binaryMode) {
+    sendEvent(completed ? FRAME_DONE : FRAME_ABORTED, NULL, 0);
+  } else if (completed) {
+    Serial.write("DONE\n");
+  } else {
+    Serial.write("ABORTED\n");
+  }
+}
+
+void moveCells(int columns, int rows) {
+  // Positive cells move to higher columns or rows, the position is reported
+  // at the end of the move
+  startMove(-(long)columns * scanStepsX, (long)rows * scanStepsY, MOVE_SCAN);
+}
+
+void nextScanPosition() {
+  scanWaiting = false;
+
+  // The inner axis runs along a line, the outer one moves to the next line
+  int &inner = scanRowMajor ? scanX : scanY;
+  int &outer = scanRowMajor ? scanY : scanX;
+  int innerCount = scanRowMajor ? scanColumns : scanRows;
+  int outerCount = scanRowMajor ? scanRows : scanColumns;
+
+  // Direction of the inner axis in this line
+  bool backwards = scanSerpentine && outer % 2 != 0;
+  int last = backwards ? 0 : innerCount - 1;
+
+  int innerCells = 0;
+  int outerCells = 0;
+  if (inner != last) {
+    innerCells = backwards ? -1 : 1;
+  } else if (outer < outerCount - 1) {
+    outerCells = 1;
+    if (!scanSerpentine) {
+      // Raster scan, move back to the start of the line on the way to the
+      // next one
+      innerCells = -(innerCount - 1);
+    }
+  } else {
+    finishScan(true);
+    return;
+  }
+  inner += innerCells;
+  outer += outerCells;
+  if (scanRowMajor) {
+    moveCells(innerCells, outerCells);
+  } else {
+    moveCells(outerCells, innerCells);
+  }
+}
+
+void runScan() {
+  if (!scanActive || !scanWaiting) {
+    return;
+  }
+  if (scanDwell > 0 && millis() - scanArrival >= scanDwell) {
+    nextScanPosition();
+  }
+}
+
+void switchToBinary(long baud) {
+  if (baud < 9600) {
+    return;
+  }
+
+  // Answer with the old rate, the host switches after reading it
+  Serial.print("BINARY ");
+  Serial.print(baud);
+  Serial.print("\n");
+  Serial.flush();
+  Serial.end();
+  Serial.begin(baud);
+  binaryMode = true;
+  lastCommandSeq = -1;
+  motorSelected = false;
+  scanSelected = false;
+}
+
+void handleFrame() {
+  newData = false;
+
+  if (frameType == FRAME_NAK) {
+    // The host could not read the last event
+    if (lastEventSize > 0 && lastEvent[2] == frameSeq) {
+      Serial.write(lastEvent, lastEventSize);
+    }
+    return;
+  }
+
+  // Every command is acknowledged before it is executed, so the host can
+  // measure the latency independent of the motor moves
+  sendFrame(FRAME_ACK, frameSeq, NULL, 0);
+  if (frameSeq == lastCommandSeq) {
+    return;
+  }
+  lastCommandSeq = frameSeq;
+
+  switch (frameType) {
+  case FRAME_MOVE:
+    if (frameLength == 5 && !scanActive) {
+      long steps = getInt32(framePayload + 1);
+      if (framePayload[0] == 1) {
+        startMove(steps, 0, MOVE_COMMAND);
+      } else if (framePayload[0] == 2) {
+        startMove(0, steps, MOVE_COMMAND);
+      } else {
+        sendReady();
+      }
+    }
+    break;
+  case FRAME_SCAN:
+    if ((frameLength == 24 || frameLength == 28) && !scanActive) {
+      long values[7] = {0, 0, 0, 0, 0, 1, 0};
+      for (byte i = 0; i < frameLength / 4; i++) {
+        values[i] = getInt32(framePayload + 4 * i);
+      }
+      beginScan(values);
+    }
+    break;
+  case FRAME_CAPTURED:
+    if (scanActive && scanWaiting) {
+      nextScanPosition();
+    }
+    break;
+  case FRAME_ABORT:
+    if (scanActive) {
+      finishScan(false);
+    }
+    break;
+  case FRAME_BACKLASH:
+    if (frameLength == 4) {
+      setBacklash(getInt32(framePayload));
+    }
+    break;
+  case FRAME_SWEEP:
+    if (frameLength == 13 && !scanActive) {
+      startSweep(framePayload[0], getInt32(framePayload + 1),
+                 getInt32(framePayload + 5), getInt32(framePayload + 9));
+    }
+    break;
+  }
+}
+
 void handleCommand() {
+  if (binaryMode) {
+    if (newData == true) {
+      handleFrame();
+    }
+    return;
+  }
+
   if (newData == true) {
     // Data available, test for reset
     if (strcmp(recievedChars, "RESET") == 0) {
       motorSelected = false;
+      scanSelected = false;
+      newData = false;
+      return;
+    }
+
+    // Commands while a scan is running
+    if (scanActive) {
+      if (strcmp(recievedChars, "CAPTURED") == 0 && scanWaiting) {
+        nextScanPosition();
+      } else if (strcmp(recievedChars, "ABORT") == 0) {
+        finishScan(false);
+      }
+      newData = false;
+      return;
+    }
+
+    if (scanSelected) {
+      // Scan selected, read the plan
+      scanSelected = false;
       newData = false;
+      startScan(recievedChars);
       return;
     }
     
@@ -119,22 +678,19 @@ void handleCommand() {
       String runSteps = recievedChars;
       // Motor selected, read run
       if (motorSelection == "M1") {
-        m1.step(runSteps.toInt());
+        startMove(runSteps.toInt(), 0, MOVE_COMMAND);
       } else if (motorSelection == "M2") {
-        int steps = runSteps.toInt();
-        if ((lastPosChange_M2 < 0 && steps > 0) ||
-            (lastPosChange_M2 > 0 && steps < 0)) {
-          if (steps > 0) {
-            m2.step(1900);
-          } else {
-            m2.step(-1900); 
-          }
-        }
-        lastPosChange_M2 = steps;
-        m2.step(steps);
+        startMove(0, runSteps.toInt(), MOVE_COMMAND);
+      } else {
+        sendReady();
       }
       motorSelected = false;
-      Serial.write("READY\n");
+    } else if (strncmp(recievedChars, "BINARY ", 7) == 0) {
+      switchToBinary(atol(recievedChars + 7));
+    } else if (strncmp(recievedChars, "BACKLASH ", 9) == 0) {
+      setBacklash(atol(recievedChars + 9));
+    } else if (strcmp(recievedChars, "SCAN") == 0) {
+      scanSelected = true;
     } else {
       // Motor not selected, select motor
       if (strcmp(recievedChars, "M1") == 0) {
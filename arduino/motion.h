@@ -0,0 +1,131 @@
+// Non-blocking stepping of both motors with acceleration ramps.
+//
+// The pace of a move is set by the motor with more steps: it starts with
+// startSpeed, accelerates to maxSpeed and slows down again before the
+// target, so it never has to start or stop faster than the stall-safe
+// speed. The other motor is interleaved with the Bresenham algorithm, both
+// arrive at the same time.
+//
+// The class only decides when to step. It does not know about pins or the
+// clock, so the same code runs in the firmware and in the simulations on the
+// host (bench/motionsim.cpp, bench/controllersim.cpp).
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <math.h>
+#include <stdint.h>
+
+class Motion {
+public:
+  // Speeds in steps per second, acceleration in steps per second²
+  Motion(float startSpeed, float maxSpeed, float acceleration)
+    : startSpeed(startSpeed), maxSpeed(maxSpeed), acceleration(acceleration),
+      total(0), done(0), error(0), lastStep(0) {
+    for (uint8_t i = 0; i < 2; i++) {
+      count[i] = 0;
+      dir[i] = 1;
+    }
+  }
+
+  // Start a move of both motors, relative in steps. now is the time in
+  // microseconds, the first step follows after one interval.
+  void move(long steps0, long steps1, unsigned long now) {
+    count[0] = steps0 < 0 ? -steps0 : steps0;
+    count[1] = steps1 < 0 ? -steps1 : steps1;
+    dir[0] = steps0 < 0 ? -1 : 1;
+    dir[1] = steps1 < 0 ? -1 : 1;
+    total = count[0] > count[1] ? count[0] : count[1];
+    done = 0;
+    error = 0;
+    lastStep = now;
+  }
+
+  // Stop at once, without slowing down
+  void stop() {
+    total = done;
+  }
+
+  // Highest speed of the following moves. Below the start speed a move runs
+  // at this constant speed from the first step, like the sweeps of a
+  // continuous scan.
+  void setMaxSpeed(float speed) {
+    maxSpeed = speed;
+  }
+
+  bool isRunning() const {
+    return done < total;
+  }
+
+  // Direction of a motor in the running move, 1 or -1
+  int8_t direction(uint8_t motor) const {
+    return dir[motor];
+  }
+
+  // Steps of the pacing motor done in the running move
+  long position() const {
+    return done;
+  }
+
+  // Get the motors to step now: bit 0 for the first, bit 1 for the second
+  uint8_t update(unsigned long now) {
+    if (!isRunning() || now - lastStep < interval(done)) {
+      return 0;
+    }
+    // A late call does not shorten the next interval, a motor that has
+    // been stepped too late must not be hurried
+    lastStep = now;
+
+    uint8_t major = count[0] >= count[1] ? 0 : 1;
+    uint8_t minor = 1 - major;
+    uint8_t due = 1 << major;
+    error += count[minor];
+    if (2 * error >= total) {
+      error -= total;
+      due |= 1 << minor;
+    }
+    done++;
+    return due;
+  }
+
+  // Time between the previous and this step of the pacing motor
+  unsigned long interval(long step) const {
+    return interval(step, total);
+  }
+
+  // Time a move takes in microseconds
+  unsigned long duration(long steps0, long steps1) const {
+    long a = steps0 < 0 ? -steps0 : steps0;
+    long b = steps1 < 0 ? -steps1 : steps1;
+    long steps = a > b ? a : b;
+    unsigned long sum = 0;
+    for (long i = 0; i < steps; i++) {
+      sum += interval(i, steps);
+    }
+    return sum;
+  }
+
+private:
+  // Trapezoidal profile: the speed grows with the square root of the steps
+  // from the start and to the end, v² = v0² + 2 a s
+  unsigned long interval(long step, long steps) const {
+    long ramp = step < steps - 1 - step ? step : steps - 1 - step;
+    float speed = sqrt(startSpeed * startSpeed + 2 * acceleration * ramp);
+    if (speed > maxSpeed) {
+      speed = maxSpeed;
+    }
+    return (unsigned long)(1000000.0 / speed);
+  }
+
+  float startSpeed;
+  float maxSpeed;
+  float acceleration;
+  long count[2];
+  int8_t dir[2];
+  long total;
+  long done;
+  long error;
+  unsigned long lastStep;
+};
+
+#endif // MOTION_H
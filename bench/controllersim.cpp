@@ -0,0 +1,714 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QStringList>
+#include <QtCore/QQueue>
+#include <QtCore/QPair>
+#include <QtCore/QTimer>
+
+#include "serialframe.hpp"
+#include "motion.h"
+
+
+// Steps per turn of the motors and the speed of the old firmware, which
+// stepped one motor after another with Stepper::step at 5 rpm
+static const int STEPS_PER_REVOLUTION = 2048;
+static const int MOTOR_RPM = 5;
+
+// Ramp of arduino/microscope.ino: start at 5 rpm, accelerate to 500 steps/s
+static const float MAX_SPEED = 500;
+static const float ACCELERATION = 1000;
+
+// Backlash move of the second motor on a change of direction, until the
+// host sends another one
+static const int BACKLASH_STEPS = 1900;
+
+///
+/// \brief Stand-in for the microscope controller on a pseudo terminal
+/// It speaks the protocol of arduino/microscope.ino, line and binary, and
+/// takes as long for every move as the motors. Like the firmware it does not
+/// read any command while a motor moves.
+///
+class ControllerSim : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param master File descriptor of the master side of the terminal
+    /// \param binarySupport False to behave like firmware without the binary
+    /// protocol
+    /// \param modelLink True to delay every answer by its transfer time at
+    /// the current baud rate
+    /// \param verbose True to log every command on stderr
+    /// \param blockingMotors True to move the motors like the old firmware,
+    /// one after another without acceleration
+    ///
+    ControllerSim(int master, bool binarySupport, bool modelLink,
+                  bool verbose, bool blockingMotors)
+        : QObject(nullptr),
+        master(master),
+        binarySupport(binarySupport),
+        modelLink(modelLink),
+        verbose(verbose),
+        blockingMotors(blockingMotors),
+        motion(
+            STEPS_PER_REVOLUTION * MOTOR_RPM / 60.0f, MAX_SPEED, ACCELERATION
+        ),
+        baudRate(9600),
+        binaryMode(false),
+        motorSelected(false),
+        motorSelection(1),
+        scanSelected(false),
+        scanActive(false),
+        scanWaiting(false),
+        lastPosChange(0),
+        backlash(BACKLASH_STEPS),
+        lastCommandSeq(-1),
+        eventSeq(0),
+        busy(false),
+        framePending(false),
+        lineFreeAt(0),
+        positionM1(0),
+        positionM2(0),
+        notifier(new QSocketNotifier(master, QSocketNotifier::Read, this)),
+        writeTimer(new QTimer(this)),
+        dwellTimer(new QTimer(this)),
+        moveTimer(new QTimer(this))
+    {
+        for (int i = 0; i < 7; i++)
+            scan[i] = 0;
+        scanX = 0;
+        scanY = 0;
+
+        clock.start();
+        writeTimer->setSingleShot(true);
+        dwellTimer->setSingleShot(true);
+        moveTimer->setSingleShot(true);
+        connect(
+            notifier, &QSocketNotifier::activated, this, &ControllerSim::readInput
+        );
+        connect(writeTimer, &QTimer::timeout, this, &ControllerSim::flushOutput);
+        connect(dwellTimer, &QTimer::timeout, this, [this]() {
+            if (scanActive && scanWaiting && !busy)
+                nextScanPosition();
+        });
+        connect(moveTimer, &QTimer::timeout, this, [this]() {
+            busy = false;
+            moveDone();
+            processInput();
+        });
+    }
+
+private slots:
+    ///
+    /// \brief Read everything available from the terminal
+    ///
+    void readInput()
+    {
+        char data[256];
+        ssize_t count = ::read(master, data, sizeof(data));
+        if (count > 0)
+            input.append(data, static_cast<int>(count));
+        processInput();
+    }
+
+    ///
+    /// \brief Write the answers, whose transfer time has passed
+    ///
+    void flushOutput()
+    {
+        qint64 now = clock.nsecsElapsed() / 1000;
+        while (!output.isEmpty() && output.head().first <= now) {
+            QByteArray data = output.dequeue().second;
+            if (::write(master, data.constData(), data.size()) < 0)
+                std::perror("write");
+        }
+        if (!output.isEmpty()) {
+            writeTimer->start(static_cast<int>(
+                (output.head().first - now + 999) / 1000
+            ));
+        }
+    }
+
+private:
+    ///
+    /// \brief Handle the buffered commands, till a move starts
+    /// Like the firmware, only an abort is handled while the motors run.
+    ///
+    void processInput()
+    {
+        for (;;) {
+            if (binaryMode) {
+                frameParser.append(input);
+                input.clear();
+
+                QByteArray corrupted = frameParser.takeCorrupted();
+                for (int i = 0; i < corrupted.size(); i++)
+                    sendFrame(FrameType::NAK, static_cast<quint8>(corrupted.at(i)));
+
+                if (!framePending) {
+                    if (!frameParser.next(pendingFrame))
+                        return;
+                    framePending = true;
+                }
+                if (busy && pendingFrame.type != FrameType::ABORT
+                        && pendingFrame.type != FrameType::NAK)
+                    return;
+                framePending = false;
+                handleFrame(pendingFrame);
+            } else {
+                int idx = input.indexOf('\n');
+                if (idx < 0)
+                    return;
+                QByteArray line = input.left(idx);
+                if (line.endsWith('\r'))
+                    line.chop(1);
+                if (busy && !(scanActive && line == "ABORT"))
+                    return;
+                input.remove(0, idx + 1);
+                handleLine(line);
+            }
+        }
+    }
+
+    ///
+    /// \brief Queue bytes for the host
+    ///
+    void send(const QByteArray &data)
+    {
+        qint64 now = clock.nsecsElapsed() / 1000;
+        qint64 due = now;
+        if (modelLink) {
+            // Start bit, 8 data bits and stop bit per byte
+            lineFreeAt = std::max(lineFreeAt, now)
+                + data.size() * 10 * 1000000LL / baudRate;
+            due = lineFreeAt;
+        }
+        output.enqueue(qMakePair(due, data));
+        flushOutput();
+    }
+
+    void sendLine(const QByteArray &line)
+    {
+        if (verbose)
+            std::fprintf(stderr, "sim > %s\n", line.constData());
+        send(line + "\n");
+    }
+
+    void sendFrame(FrameType type, quint8 seq,
+                   const QByteArray &payload = QByteArray())
+    {
+        SerialFrame frame;
+        frame.type = type;
+        frame.seq = seq;
+        frame.payload = payload;
+        if (verbose)
+            std::fprintf(stderr, "sim > frame %02x seq %d\n",
+                static_cast<int>(type), seq);
+        send(frame.encode());
+    }
+
+    void sendEvent(FrameType type, const QByteArray &payload = QByteArray())
+    {
+        SerialFrame frame;
+        frame.type = type;
+        frame.seq = eventSeq++;
+        frame.payload = payload;
+        lastEvent = frame.encode();
+        send(lastEvent);
+    }
+
+    ///
+    /// \brief Move both motors like the firmware, blocking the commands
+    /// \param stepsM1 Steps of the first motor
+    /// \param stepsM2 Steps of the second motor, with backlash compensation
+    /// \param done Called when the motors stopped
+    ///
+    void move(int stepsM1, int stepsM2, std::function<void()> done)
+    {
+        long driven = stepsM2;
+        if ((lastPosChange < 0 && stepsM2 > 0)
+                || (lastPosChange > 0 && stepsM2 < 0))
+            driven += stepsM2 > 0 ? backlash : -backlash;
+        if (stepsM2 != 0)
+            lastPosChange = stepsM2;
+        positionM1 += stepsM1;
+        positionM2 += stepsM2;
+
+        int ms;
+        if (blockingMotors) {
+            double stepDelayUs = 60.0 * 1000 * 1000
+                / STEPS_PER_REVOLUTION / MOTOR_RPM;
+            long total = std::abs(stepsM1) + std::abs(driven);
+            ms = static_cast<int>(std::lround(total * stepDelayUs / 1000));
+        } else {
+            ms = static_cast<int>(motion.duration(stepsM1, driven) / 1000);
+        }
+        if (verbose)
+            std::fprintf(stderr, "sim   move %d %d (%d ms) -> %ld %ld\n",
+                stepsM1, stepsM2, ms, positionM1, positionM2);
+
+        busy = true;
+        moveDone = done;
+        moveTimer->start(ms);
+    }
+
+    ///
+    /// \brief Move one motor with a constant speed and report its position
+    /// \param motor The motor, 1 or 2
+    /// \param steps Steps to move, with backlash compensation on the second
+    /// \param speed Highest speed in steps per second
+    /// \param intervalMs Time between two positions
+    ///
+    void sweep(int motor, int steps, int speed, int intervalMs)
+    {
+        if ((motor != 1 && motor != 2) || speed <= 0 || intervalMs <= 0) {
+            sendReady();
+            return;
+        }
+
+        long driven = steps;
+        if (motor == 2) {
+            if ((lastPosChange < 0 && steps > 0)
+                    || (lastPosChange > 0 && steps < 0))
+                driven += steps > 0 ? backlash : -backlash;
+            if (steps != 0)
+                lastPosChange = steps;
+            positionM2 += steps;
+        } else {
+            positionM1 += steps;
+        }
+
+        // Time of every step from the start of the sweep, like the ramps of
+        // the firmware
+        motion.setMaxSpeed(std::min(static_cast<float>(speed), MAX_SPEED));
+        long total = std::abs(driven);
+        motion.move(total, 0, 0);
+        std::vector<qint64> stepTimes;
+        qint64 time = 0;
+        for (long i = 0; i < total; i++) {
+            time += motion.interval(i);
+            stepTimes.push_back(time);
+        }
+        motion.stop();
+        motion.setMaxSpeed(MAX_SPEED);
+        if (verbose)
+            std::fprintf(stderr, "sim   sweep %d %d (%lld ms) -> %ld %ld\n",
+                motor, steps, time / 1000, positionM1, positionM2);
+
+        busy = true;
+        int sign = driven < 0 ? -1 : 1;
+        qint64 start = clock.nsecsElapsed() / 1000;
+        sendSample(start, 0);
+        QTimer *timer = new QTimer(this);
+        connect(timer, &QTimer::timeout, this,
+                [this, timer, stepTimes, start, sign, total]() {
+            qint64 now = clock.nsecsElapsed() / 1000;
+            long done = std::upper_bound(
+                stepTimes.begin(), stepTimes.end(), now - start
+            ) - stepTimes.begin();
+            if (done < total) {
+                sendSample(now, sign * done);
+                return;
+            }
+            timer->stop();
+            timer->deleteLater();
+            sendSample(start + (total > 0 ? stepTimes.back() : 0),
+                sign * total);
+            busy = false;
+            sendReady();
+            processInput();
+        });
+        timer->start(intervalMs);
+    }
+
+    ///
+    /// \brief Report the position of a sweep
+    /// \param time Time of the simulated controller in microseconds
+    /// \param steps Steps of the sweep done, with the sign of the sweep
+    ///
+    void sendSample(qint64 time, long steps)
+    {
+        SerialFrame frame;
+        frame.appendInt32(static_cast<qint32>(static_cast<quint32>(time)));
+        frame.appendInt32(static_cast<int>(steps));
+        sendEvent(FrameType::POSITION, frame.payload);
+    }
+
+    void reportPosition()
+    {
+        if (binaryMode) {
+            SerialFrame frame;
+            frame.appendInt32(scanX);
+            frame.appendInt32(scanY);
+            sendEvent(FrameType::AT, frame.payload);
+        } else {
+            sendLine(QString("AT %1 %2").arg(scanX).arg(scanY).toLatin1());
+        }
+        scanWaiting = true;
+        if (scan[4] > 0)
+            dwellTimer->start(scan[4]);
+    }
+
+    void sendReady()
+    {
+        if (binaryMode)
+            sendEvent(FrameType::READY);
+        else
+            sendLine("READY");
+    }
+
+    void beginScan()
+    {
+        if (scan[0] <= 0 || scan[1] <= 0) {
+            finishScan(true);
+            return;
+        }
+        scanActive = true;
+        scanX = 0;
+        scanY = 0;
+        reportPosition();
+    }
+
+    void finishScan(bool completed)
+    {
+        scanActive = false;
+        scanWaiting = false;
+        dwellTimer->stop();
+        if (moveTimer->isActive()) {
+            // Aborted on the way to the next position, stop there
+            moveTimer->stop();
+            busy = false;
+        }
+        if (binaryMode)
+            sendEvent(completed ? FrameType::DONE : FrameType::ABORTED);
+        else
+            sendLine(completed ? "DONE" : "ABORTED");
+    }
+
+    ///
+    /// \brief Move by cells, both axes at once
+    /// \param columns Columns to move, positive to higher columns
+    /// \param rows Rows to move, positive to higher rows
+    ///
+    void moveCells(int columns, int rows)
+    {
+        move(-columns * scan[2], rows * scan[3], [this]() {
+            if (scanActive)
+                reportPosition();
+        });
+    }
+
+    void nextScanPosition()
+    {
+        scanWaiting = false;
+        dwellTimer->stop();
+
+        // The inner axis runs along a line, the outer one to the next line
+        bool rowMajor = scan[6] != 0;
+        bool serpentine = scan[5] != 0;
+        int &inner = rowMajor ? scanX : scanY;
+        int &outer = rowMajor ? scanY : scanX;
+        int innerCount = rowMajor ? scan[0] : scan[1];
+        int outerCount = rowMajor ? scan[1] : scan[0];
+
+        bool backwards = serpentine && outer % 2 != 0;
+        int last = backwards ? 0 : innerCount - 1;
+
+        int innerCells = 0;
+        int outerCells = 0;
+        if (inner != last) {
+            innerCells = backwards ? -1 : 1;
+        } else if (outer < outerCount - 1) {
+            outerCells = 1;
+            // Raster scan, move back to the start of the line on the way
+            if (!serpentine)
+                innerCells = -(innerCount - 1);
+        } else {
+            finishScan(true);
+            return;
+        }
+        inner += innerCells;
+        outer += outerCells;
+        if (rowMajor)
+            moveCells(innerCells, outerCells);
+        else
+            moveCells(outerCells, innerCells);
+    }
+
+    ///
+    /// \brief Set the backlash compensation of the second motor
+    ///
+    void setBacklash(int steps)
+    {
+        if (steps < 0 || steps > 4 * STEPS_PER_REVOLUTION)
+            return;
+        backlash = steps;
+        if (verbose)
+            std::fprintf(stderr, "sim   backlash %d\n", backlash);
+    }
+
+    void handleLine(QByteArray line)
+    {
+        if (line.endsWith('\r'))
+            line.chop(1);
+        if (verbose)
+            std::fprintf(stderr, "sim < %s\n", line.constData());
+
+        if (line == "RESET") {
+            motorSelected = false;
+            scanSelected = false;
+            return;
+        }
+
+        if (scanActive) {
+            if (line == "CAPTURED" && scanWaiting)
+                nextScanPosition();
+            else if (line == "ABORT")
+                finishScan(false);
+            return;
+        }
+
+        if (scanSelected) {
+            scanSelected = false;
+            QList<QByteArray> parts = line.simplified().split(' ');
+            int defaults[7] = {0, 0, 0, 0, 0, 1, 0};
+            for (int i = 0; i < 7; i++)
+                scan[i] = i < parts.size() ? parts.at(i).toInt() : defaults[i];
+            beginScan();
+            return;
+        }
+
+        if (motorSelected) {
+            motorSelected = false;
+            int steps = line.toInt();
+            move(
+                motorSelection == 1 ? steps : 0,
+                motorSelection == 2 ? steps : 0,
+                [this]() { sendReady(); }
+            );
+        } else if (binarySupport && line.startsWith("BINARY ")) {
+            long baud = line.mid(7).toLong();
+            if (baud < 9600)
+                return;
+            sendLine(line);
+            baudRate = baud;
+            binaryMode = true;
+            lastCommandSeq = -1;
+        } else if (line.startsWith("BACKLASH ")) {
+            setBacklash(line.mid(9).toInt());
+        } else if (line == "SCAN") {
+            scanSelected = true;
+        } else {
+            // Like the firmware, every other line selects a motor
+            if (line == "M1")
+                motorSelection = 1;
+            else if (line == "M2")
+                motorSelection = 2;
+            motorSelected = true;
+        }
+    }
+
+    void handleFrame(const SerialFrame &frame)
+    {
+        if (verbose)
+            std::fprintf(stderr, "sim < frame %02x seq %d\n",
+                static_cast<int>(frame.type), frame.seq);
+
+        if (frame.type == FrameType::NAK) {
+            if (!lastEvent.isEmpty()
+                    && static_cast<quint8>(lastEvent.at(2)) == frame.seq)
+                send(lastEvent);
+            return;
+        }
+
+        sendFrame(FrameType::ACK, frame.seq);
+        if (frame.seq == lastCommandSeq)
+            return;
+        lastCommandSeq = frame.seq;
+
+        switch (frame.type) {
+        case FrameType::MOVE:
+            if (frame.payload.size() == 5 && !scanActive) {
+                int steps = frame.int32At(1);
+                int motor = frame.payload.at(0);
+                move(
+                    motor == 1 ? steps : 0, motor == 2 ? steps : 0,
+                    [this]() { sendReady(); }
+                );
+            }
+            break;
+        case FrameType::SCAN: {
+            int size = frame.payload.size();
+            if ((size == 24 || size == 28) && !scanActive) {
+                for (int i = 0; i < 7; i++)
+                    scan[i] = i < size / 4 ? frame.int32At(4 * i) : 0;
+                beginScan();
+            }
+            break;
+        }
+        case FrameType::CAPTURED:
+            if (scanActive && scanWaiting)
+                nextScanPosition();
+            break;
+        case FrameType::ABORT:
+            if (scanActive)
+                finishScan(false);
+            break;
+        case FrameType::BACKLASH:
+            if (frame.payload.size() == 4)
+                setBacklash(frame.int32At(0));
+            break;
+        case FrameType::SWEEP:
+            if (frame.payload.size() == 13 && !scanActive) {
+                sweep(
+                    frame.payload.at(0), frame.int32At(1), frame.int32At(5),
+                    frame.int32At(9)
+                );
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    int master;
+    bool binarySupport;
+    bool modelLink;
+    bool verbose;
+    bool blockingMotors;
+    Motion motion;
+    long baudRate;
+    bool binaryMode;
+    bool motorSelected;
+    int motorSelection;
+    bool scanSelected;
+    bool scanActive;
+    bool scanWaiting;
+    int scan[7];
+    int scanX;
+    int scanY;
+    int lastPosChange;
+    int backlash;
+    int lastCommandSeq;
+    quint8 eventSeq;
+    bool busy;
+    bool framePending;
+    qint64 lineFreeAt;
+    long positionM1;
+    long positionM2;
+
+    QSocketNotifier *notifier;
+    QTimer *writeTimer;
+    QTimer *dwellTimer;
+    QTimer *moveTimer;
+    std::function<void()> moveDone;
+    QElapsedTimer clock;
+    FrameParser frameParser;
+    SerialFrame pendingFrame;
+    QByteArray input;
+    QByteArray lastEvent;
+    QQueue<QPair<qint64, QByteArray> > output;
+};
+
+///
+/// \brief Open a pseudo terminal in raw mode
+/// \param slavePath The path the host opens
+/// \param slave The slave side, kept open so the master never sees a hangup
+/// \return The master side or -1
+///
+static int openTerminal(QString &slavePath, int &slave)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+        return -1;
+
+    slavePath = QString::fromLocal8Bit(ptsname(master));
+    slave = ::open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        return -1;
+
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    return master;
+}
+
+///
+/// \brief Simulated microscope controller
+/// Prints the path of its terminal as first line and runs till it is killed.
+///
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("controllersim");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Simulates the microscope controller on a pseudo terminal."
+    );
+    parser.addHelpOption();
+    parser.addOptions({
+        {"no-binary", "Behave like firmware without the binary protocol."},
+        {"model-link", "Delay the answers by their transfer time."},
+        {"verbose", "Log the communication on stderr."},
+        {"blocking-motors", "Move the motors like the old firmware, one "
+            "after another at 5 rpm."}
+    });
+    parser.process(app);
+
+    QString slavePath;
+    int slave = -1;
+    int master = openTerminal(slavePath, slave);
+    if (master < 0) {
+        std::perror("controllersim");
+        return 1;
+    }
+
+    ControllerSim sim(
+        master, !parser.isSet("no-binary"), parser.isSet("model-link"),
+        parser.isSet("verbose"), parser.isSet("blocking-motors")
+    );
+    std::printf("%s\n", slavePath.toLocal8Bit().constData());
+    std::fflush(stdout);
+
+    int result = app.exec();
+    ::close(slave);
+    ::close(master);
+    return result;
+}
+
+#include "controllersim.moc"
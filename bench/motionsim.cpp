@@ -0,0 +1,218 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "motion.h"
+
+
+// Motors and speeds of arduino/microscope.ino
+static const int STEPS_PER_REVOLUTION = 2048;
+static const double OLD_SPEED = STEPS_PER_REVOLUTION * 5 / 60.0;
+static const float MAX_SPEED = 500;
+static const float ACCELERATION = 1000;
+
+///
+/// \brief One move of a scan, in motor steps
+///
+struct MotorMove {
+    long stepsM1;
+    long stepsM2;
+};
+
+///
+/// \brief Parameters of the simulated scan
+///
+struct SimConfig {
+    int columns;
+    int rows;
+    long stepsX;
+    long stepsY;
+    long backlash;
+    bool rowMajor;
+    bool serpentine;
+};
+
+///
+/// \brief The moves of a scan like nextScanPosition of the firmware
+/// The backlash of the second motor is added on every change of its
+/// direction.
+///
+static std::vector<MotorMove> scanMoves(const SimConfig &config)
+{
+    std::vector<MotorMove> moves;
+    int x = 0;
+    int y = 0;
+    int &inner = config.rowMajor ? x : y;
+    int &outer = config.rowMajor ? y : x;
+    int innerCount = config.rowMajor ? config.columns : config.rows;
+    int outerCount = config.rowMajor ? config.rows : config.columns;
+    int lastDirection = 0;
+
+    while (true) {
+        bool backwards = config.serpentine && outer % 2 != 0;
+        int last = backwards ? 0 : innerCount - 1;
+        int innerCells = 0;
+        int outerCells = 0;
+        if (inner != last) {
+            innerCells = backwards ? -1 : 1;
+        } else if (outer < outerCount - 1) {
+            outerCells = 1;
+            if (!config.serpentine)
+                innerCells = -(innerCount - 1);
+        } else {
+            break;
+        }
+        inner += innerCells;
+        outer += outerCells;
+
+        int columns = config.rowMajor ? innerCells : outerCells;
+        int rows = config.rowMajor ? outerCells : innerCells;
+        MotorMove move;
+        move.stepsM1 = -columns * config.stepsX;
+        move.stepsM2 = rows * config.stepsY;
+        if ((lastDirection < 0 && move.stepsM2 > 0)
+                || (lastDirection > 0 && move.stepsM2 < 0))
+            move.stepsM2 += move.stepsM2 > 0
+                ? config.backlash : -config.backlash;
+        if (move.stepsM2 != 0)
+            lastDirection = move.stepsM2 > 0 ? 1 : -1;
+        moves.push_back(move);
+    }
+    return moves;
+}
+
+///
+/// \brief Run a move through the engine step by step
+/// The clock advances in microseconds like micros() on the board, every
+/// step is counted to check that both motors reach their target.
+/// \param motion The engine
+/// \param move The move
+/// \param ok Cleared if a motor does not reach its target
+/// \return The time of the move in microseconds
+///
+static unsigned long runMove(Motion &motion, const MotorMove &move, bool &ok)
+{
+    unsigned long now = 0;
+    long steps[2] = {0, 0};
+    motion.move(move.stepsM1, move.stepsM2, now);
+    while (motion.isRunning()) {
+        now++;
+        uint8_t due = motion.update(now);
+        for (uint8_t i = 0; i < 2; i++) {
+            if (due & (1 << i))
+                steps[i] += motion.direction(i);
+        }
+    }
+    if (steps[0] != move.stepsM1 || steps[1] != move.stepsM2)
+        ok = false;
+    return now;
+}
+
+///
+/// \brief Read the value of an option
+/// \return True if the option has been found
+///
+static bool option(int argc, char *argv[], const char *name, long &value)
+{
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            value = std::atol(argv[i + 1]);
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// \brief Check for a flag
+///
+static bool flag(int argc, char *argv[], const char *name)
+{
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+///
+/// \brief Timing of the firmware motion without hardware
+/// Compares the moves of a scan with the old firmware (one motor after the
+/// other at 5 rpm) and with the accelerated engine of arduino/motion.h. It
+/// needs nothing but a C++ compiler:
+///
+///     g++ -I arduino bench/motionsim.cpp -o motionsim
+///
+int main(int argc, char *argv[])
+{
+    if (flag(argc, argv, "--help")) {
+        std::printf(
+            "Usage: motionsim [--columns n] [--rows n] [--steps-x n] "
+            "[--steps-y n]\n"
+            "                 [--backlash n] [--row-major] [--raster]\n"
+        );
+        return 0;
+    }
+
+    SimConfig config;
+    long value;
+    config.columns = option(argc, argv, "--columns", value) ? value : 5;
+    config.rows = option(argc, argv, "--rows", value) ? value : 7;
+    config.stepsX = option(argc, argv, "--steps-x", value) ? value : 80;
+    config.stepsY = option(argc, argv, "--steps-y", value) ? value : 400;
+    config.backlash = option(argc, argv, "--backlash", value) ? value : 1900;
+    config.rowMajor = flag(argc, argv, "--row-major");
+    config.serpentine = !flag(argc, argv, "--raster");
+    if (config.columns < 1 || config.rows < 1) {
+        std::fprintf(stderr, "motionsim: the grid needs a cell\n");
+        return 1;
+    }
+
+    std::vector<MotorMove> moves = scanMoves(config);
+    Motion motion(OLD_SPEED, MAX_SPEED, ACCELERATION);
+    bool ok = true;
+    double oldSeconds = 0;
+    double newSeconds = 0;
+    long longest = 0;
+    for (size_t i = 0; i < moves.size(); i++) {
+        long m1 = std::labs(moves[i].stepsM1);
+        long m2 = std::labs(moves[i].stepsM2);
+        oldSeconds += (m1 + m2) / OLD_SPEED;
+        newSeconds += runMove(motion, moves[i], ok) / 1e6;
+        longest = std::max(longest, std::max(m1, m2));
+    }
+
+    std::printf(
+        "{\"columns\":%d,\"rows\":%d,\"order\":\"%s\",\"serpentine\":%s,"
+        "\"moves\":%d,\"longest_move_steps\":%ld,\"old_seconds\":%.3f,"
+        "\"new_seconds\":%.3f,\"speedup\":%.2f,\"targets_reached\":%s}\n",
+        config.columns, config.rows, config.rowMajor ? "row" : "column",
+        config.serpentine ? "true" : "false",
+        static_cast<int>(moves.size()), longest, oldSeconds, newSeconds,
+        newSeconds > 0 ? oldSeconds / newSeconds : 0.0,
+        ok ? "true" : "false"
+    );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cstdio>
+#include <algorithm>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QProcess>
+#include <QtCore/QThread>
+#include <QtCore/QDir>
+#include <opencv2/core.hpp>
+
+#include "controller.hpp"
+#include "scanpipeline.hpp"
+#include "synthetic.hpp"
+#include "scanplanner.hpp"
+#include "adaptivescan.hpp"
+
+
+///
+/// \brief End to end benchmark of the auto scan without hardware
+/// The controller is simulated on a pseudo terminal, the camera crops a
+/// synthetic reference image. The scan runs through the same Controller and
+/// ScanPipeline as the application.
+///
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("scanbench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Runs an auto scan against the simulated controller and reports the "
+        "throughput and the command latency."
+    );
+    parser.addHelpOption();
+    parser.addOptions({
+        {"sim", "Path of the controller simulation.", "file",
+            QDir(QCoreApplication::applicationDirPath())
+                .absoluteFilePath("controllersim")},
+        {"columns", "Number of columns.", "n", "5"},
+        {"rows", "Number of rows.", "n", "7"},
+        {"steps-x", "Steps of the first motor per column.", "n", "80"},
+        {"steps-y", "Steps of the second motor per row.", "n", "400"},
+        {"exposure", "Exposure time of the camera.", "ms", "30"},
+        {"tile-width", "Frame width in pixels.", "px", "640"},
+        {"tile-height", "Frame height in pixels.", "px", "480"},
+        {"order", "Scan order: auto, column or row.", "order", "auto"},
+        {"raster", "Raster instead of serpentine, if the order is fixed."},
+        {"line", "Use the line protocol at 9600 baud."},
+        {"model-link", "Let the simulation model the transfer time."},
+        {"blocking-motors", "Simulate the old firmware, which moves one "
+            "motor after another at 5 rpm."},
+        {"adaptive", "Skip the empty tiles, the host sends every move."},
+        {"specimen", "Axes of the elliptic specimen relative to the scanned "
+            "area, the rest is empty glass.", "fraction", "1"},
+        {"threshold", "Least content score of a tile with specimen.", "score",
+            "20"}
+    });
+    parser.process(app);
+
+    int columns = std::max(1, parser.value("columns").toInt());
+    int rows = std::max(1, parser.value("rows").toInt());
+    int stepsX = parser.value("steps-x").toInt();
+    int stepsY = parser.value("steps-y").toInt();
+    int exposure = std::max(0, parser.value("exposure").toInt());
+    cv::Size frameSize(
+        std::max(64, parser.value("tile-width").toInt()),
+        std::max(64, parser.value("tile-height").toInt())
+    );
+
+    ScanPlanner planner;
+    planner.setSteps(stepsX, stepsY);
+    if (parser.isSet("blocking-motors"))
+        planner.setRamp(0, 0);
+    ScanPlan plan = planner.plan(columns, rows);
+    if (parser.value("order") != "auto") {
+        plan = planner.estimate(
+            columns, rows,
+            parser.value("order") == "row"
+                ? GridOrder::ROW_MAJOR : GridOrder::COLUMN_MAJOR,
+            !parser.isSet("raster")
+        );
+    }
+
+    // Start the simulation, it prints its terminal first
+    QProcess sim;
+    sim.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    QStringList simArgs;
+    if (parser.isSet("model-link"))
+        simArgs << "--model-link";
+    if (parser.isSet("blocking-motors"))
+        simArgs << "--blocking-motors";
+    sim.start(parser.value("sim"), simArgs);
+    if (!sim.waitForStarted() || !sim.waitForReadyRead(5000)) {
+        std::fprintf(stderr, "Cannot start %s\n",
+            parser.value("sim").toUtf8().constData());
+        return 1;
+    }
+    QString device = QString::fromLocal8Bit(sim.readLine()).trimmed();
+
+    // The controller runs in its own thread like in the application
+    QThread thread;
+    Controller *controller = new Controller();
+    controller->moveToThread(&thread);
+    QObject::connect(
+        &thread, &QThread::finished, controller, &QObject::deleteLater
+    );
+    thread.start();
+    controller->setDevice(device);
+    controller->setBaudRate(parser.isSet("line") ? 9600 : 115200);
+    controller->setMotorIntervall(stepsX, stepsY);
+
+    SyntheticCamera camera(
+        frameSize, cv::Point(frameSize.width * 3 / 4, frameSize.height * 3 / 4)
+    );
+    camera.setImperfections(4, 2);
+    camera.setSpecimen(parser.value("specimen").toDouble());
+    camera.prepare(columns, rows);
+
+    // The adaptive scan lives in this thread like in the application
+    bool adaptive = parser.isSet("adaptive");
+    AdaptiveScan adaptiveScan(controller);
+    adaptiveScan.setGrid(columns, rows);
+    adaptiveScan.setSteps(stepsX, stepsY);
+    adaptiveScan.setThreshold(parser.value("threshold").toDouble());
+
+    ScanPipeline pipeline;
+    QElapsedTimer scanTimer;
+    std::vector<qint64> latencies;
+    int tiles = 0;
+    int exitCode = 0;
+
+    QObject::connect(
+        controller, &Controller::connectionChanged, &app,
+        [&](bool connected) {
+            if (!connected)
+                return;
+            scanTimer.start();
+            if (adaptive) {
+                adaptiveScan.start();
+                return;
+            }
+            controller->startScan(
+                columns, rows, 0, plan.serpentine, plan.order
+            );
+        }
+    );
+    QObject::connect(
+        controller, &Controller::error, &app, [&](const QString &message) {
+            std::fprintf(stderr, "Controller error: %s\n",
+                message.toUtf8().constData());
+            exitCode = 1;
+            app.quit();
+        }
+    );
+    QObject::connect(
+        controller, &Controller::commandAcknowledged, &app,
+        [&](qint64 latency) { latencies.push_back(latency); }
+    );
+    auto positionReached = [&](int x, int y) {
+        // The camera integrates, then the stage may move on. The adaptive
+        // scan needs the frame to decide where to go and may finish with it.
+        QThread::msleep(static_cast<unsigned long>(exposure));
+        cv::Mat frame;
+        camera.grab(cv::Point(x, y), frame);
+        if (!adaptive)
+            controller->acknowledgeCapture();
+        pipeline.submit(frame, cv::Point(x, y));
+        tiles++;
+        if (adaptive)
+            adaptiveScan.tileCaptured(frame);
+    };
+    auto scanFinished = [&](bool completed) {
+        double scanSeconds = scanTimer.nsecsElapsed() / 1e9;
+        pipeline.waitForDone();
+        double totalSeconds = scanTimer.nsecsElapsed() / 1e9;
+        if (adaptive)
+            planner.estimatePath(adaptiveScan.path(), plan);
+        double motor = plan.seconds;
+
+        QJsonObject result;
+        result["protocol"] = controller->isBinary() ? "binary" : "line";
+        result["status"] = completed ? "ok" : "aborted";
+        result["order"] = plan.order == GridOrder::ROW_MAJOR
+            ? "row" : "column";
+        result["serpentine"] = plan.serpentine;
+        result["reversals"] = plan.reversals;
+        result["tiles"] = tiles;
+        result["grid_tiles"] = columns * rows;
+        result["adaptive"] = adaptive;
+        if (adaptive)
+            result["occupied"] = adaptiveScan.occupied();
+        result["scan_seconds"] = scanSeconds;
+        result["total_seconds"] = totalSeconds;
+        result["tiles_per_sec"] = scanSeconds > 0
+            ? tiles / scanSeconds : 0.0;
+        result["motor_seconds"] = motor;
+        result["exposure_seconds"] = tiles * exposure / 1000.0;
+        result["overhead_seconds"] = scanSeconds - motor
+            - tiles * exposure / 1000.0;
+        if (!latencies.empty()) {
+            double sum = 0;
+            for (size_t i = 0; i < latencies.size(); i++)
+                sum += latencies[i];
+            result["mean_latency_us"] = sum / latencies.size();
+            result["max_latency_us"] = static_cast<double>(
+                *std::max_element(latencies.begin(), latencies.end())
+            );
+        } else {
+            result["mean_latency_us"] = QJsonValue();
+            result["max_latency_us"] = QJsonValue();
+        }
+        std::printf(
+            "%s\n", QJsonDocument(result).toJson(QJsonDocument::Compact)
+                .constData()
+        );
+        std::fflush(stdout);
+        exitCode = completed ? 0 : 1;
+        app.quit();
+    };
+    QObject::connect(
+        controller, &Controller::positionReached, &app, positionReached
+    );
+    QObject::connect(
+        controller, &Controller::scanFinished, &app, scanFinished
+    );
+    QObject::connect(
+        &adaptiveScan, &AdaptiveScan::positionReached, &app, positionReached
+    );
+    QObject::connect(
+        &adaptiveScan, &AdaptiveScan::finished, &app, scanFinished
+    );
+
+    controller->connectPort();
+    app.exec();
+
+    thread.quit();
+    thread.wait();
+    sim.kill();
+    sim.waitForFinished();
+    return exitCode;
+}
@@ -0,0 +1,378 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QProcess>
+#include <QtCore/QStringList>
+#include <opencv2/opencv.hpp>
+
+#include "gridblender.hpp"
+#include "stitchingengine.hpp"
+#include "tilegrid.hpp"
+#include "synthetic.hpp"
+
+
+///
+/// \brief Parameters of the synthetic scan
+///
+struct BenchConfig {
+    QString reference;
+    int columns;
+    int rows;
+    cv::Size tileSize;
+    double overlap;
+    double noise;
+    double vignetting;
+    int jitter;
+    double exposure;
+    int seed;
+};
+
+///
+/// \brief Peak resident set size of this process
+/// \return Peak RSS in kilobytes
+///
+static long peakRssKb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;
+}
+
+///
+/// \brief Cut the reference into overlapping tiles with known positions
+/// \param config The scan parameters
+/// \param tiles The distorted tiles in column major serpentine order
+/// \param cells The grid cell of every tile
+/// \param truth The true top left position of every tile
+///
+static void createTiles(
+    const BenchConfig &config, std::vector<cv::Mat> &tiles,
+    std::vector<cv::Point> &cells, std::vector<cv::Point> &truth)
+{
+    cv::RNG rng(config.seed);
+
+    cv::Point step(
+        cvRound(config.tileSize.width * (1.0 - config.overlap)),
+        cvRound(config.tileSize.height * (1.0 - config.overlap))
+    );
+    cv::Size needed(
+        step.x * (config.columns - 1) + config.tileSize.width
+            + 2 * config.jitter,
+        step.y * (config.rows - 1) + config.tileSize.height
+            + 2 * config.jitter
+    );
+
+    cv::Mat ref;
+    if (!config.reference.isEmpty())
+        ref = cv::imread(config.reference.toStdString(), cv::IMREAD_COLOR);
+    if (ref.empty()) {
+        ref = syntheticReference(needed, rng);
+    } else if (ref.cols < needed.width || ref.rows < needed.height) {
+        double scale = std::max(
+            static_cast<double>(needed.width) / ref.cols,
+            static_cast<double>(needed.height) / ref.rows
+        );
+        cv::resize(ref, ref, cv::Size(), scale, scale, cv::INTER_CUBIC);
+    }
+
+    // Radial vignetting of the optics, the same for every tile
+    cv::Mat vignette(config.tileSize, CV_32FC3);
+    cv::Point2f center(
+        config.tileSize.width / 2.0f, config.tileSize.height / 2.0f
+    );
+    float maxRadius = std::sqrt(center.x * center.x + center.y * center.y);
+    for (int y = 0; y < vignette.rows; y++) {
+        for (int x = 0; x < vignette.cols; x++) {
+            float r = std::hypot(x - center.x, y - center.y) / maxRadius;
+            float v = 1.0f - static_cast<float>(config.vignetting) * r * r;
+            vignette.at<cv::Vec3f>(y, x) = cv::Vec3f(v, v, v);
+        }
+    }
+
+    // The auto scan takes the tiles column by column
+    TileGrid grid(
+        config.columns, config.rows, GridOrder::COLUMN_MAJOR, true
+    );
+    for (int i = 0; i < grid.size(); i++) {
+        cv::Point cell = grid.cell(i);
+        cv::Point corner(
+            config.jitter + cell.x * step.x
+                + rng.uniform(-config.jitter, config.jitter + 1),
+            config.jitter + cell.y * step.y
+                + rng.uniform(-config.jitter, config.jitter + 1)
+        );
+
+        cv::Mat tile;
+        ref(cv::Rect(corner, config.tileSize)).convertTo(tile, CV_32FC3);
+        double gain = 1.0 + rng.uniform(-config.exposure, config.exposure);
+        tile = tile.mul(vignette, gain);
+        if (config.noise > 0) {
+            cv::Mat noise(tile.size(), CV_32FC3);
+            rng.fill(noise, cv::RNG::NORMAL, 0, config.noise);
+            tile += noise;
+        }
+
+        cv::Mat tile8;
+        tile.convertTo(tile8, CV_8UC3);
+        tiles.push_back(tile8);
+        cells.push_back(cell);
+        truth.push_back(corner);
+    }
+}
+
+///
+/// \brief Run one stitching mode and measure it
+/// \return The result as json object
+///
+static QJsonObject runMode(const BenchConfig &config, StitchingMode mode)
+{
+    std::vector<cv::Mat> tiles;
+    std::vector<cv::Point> cells;
+    std::vector<cv::Point> truth;
+    createTiles(config, tiles, cells, truth);
+
+    StitchingEngine engine(mode);
+    engine.setCells(cells);
+
+    cv::Mat pano;
+    QElapsedTimer timer;
+    timer.start();
+    StitchingEngine::Status status = engine.stitch(tiles, pano);
+    double seconds = timer.nsecsElapsed() / 1e9;
+
+    QJsonObject result;
+    result["mode"] = StitchingEngine::modeName(mode);
+    result["tiles"] = static_cast<int>(tiles.size());
+    result["tile_width"] = config.tileSize.width;
+    result["tile_height"] = config.tileSize.height;
+    result["overlap"] = config.overlap;
+    result["noise"] = config.noise;
+    result["vignetting"] = config.vignetting;
+    result["jitter"] = config.jitter;
+    result["status"] = status == StitchingEngine::Status::OK
+        ? "ok" : "failed";
+    result["seconds"] = seconds;
+    result["tiles_per_sec"] = seconds > 0 ? tiles.size() / seconds : 0.0;
+    result["peak_rss_kb"] = static_cast<double>(peakRssKb());
+    result["pano_width"] = pano.cols;
+    result["pano_height"] = pano.rows;
+
+    // Registration error relative to the first tile, so the unknown origin
+    // of the mosaic does not matter.
+    std::vector<cv::Point> corners = engine.corners();
+    if (status == StitchingEngine::Status::OK
+            && corners.size() == truth.size()) {
+        double sum = 0;
+        double max = 0;
+        for (size_t i = 0; i < corners.size(); i++) {
+            cv::Point est = corners[i] - corners[0];
+            cv::Point exp = truth[i] - truth[0];
+            double err = cv::norm(est - exp);
+            sum += err;
+            max = std::max(max, err);
+        }
+        result["mean_error_px"] = sum / corners.size();
+        result["max_error_px"] = max;
+    } else {
+        result["mean_error_px"] = QJsonValue();
+        result["max_error_px"] = QJsonValue();
+    }
+    return result;
+}
+
+///
+/// \brief Compare the block wise multiband blend with one single block
+/// The tiles are placed at their true positions, so only the blending is
+/// measured. The margin of the blocks has to hide the block borders.
+/// \return The result as json object
+///
+static QJsonObject runBlockCheck(const BenchConfig &config)
+{
+    std::vector<cv::Mat> tiles;
+    std::vector<cv::Point> cells;
+    std::vector<cv::Point> truth;
+    createTiles(config, tiles, cells, truth);
+
+    GridBlender blender;
+    blender.setMode(BlendMode::MULTIBAND);
+
+    cv::Mat blocks;
+    QElapsedTimer timer;
+    timer.start();
+    blender.setBlockSize(256);
+    blender.blend(tiles, truth, std::vector<double>(), blocks);
+    double seconds = timer.nsecsElapsed() / 1e9;
+
+    cv::Mat whole;
+    blender.setBlockSize(std::max(blocks.cols, blocks.rows));
+    blender.blend(tiles, truth, std::vector<double>(), whole);
+
+    cv::Mat diff;
+    cv::absdiff(blocks, whole, diff);
+    double maxDiff = 0;
+    cv::minMaxLoc(diff.reshape(1), nullptr, &maxDiff);
+    double meanDiff = cv::mean(diff.reshape(1))[0];
+
+    // Rounding of the float pyramids may flip single values by one step
+    QJsonObject result;
+    result["mode"] = "multiband_blocks";
+    result["tiles"] = static_cast<int>(tiles.size());
+    result["status"] = maxDiff <= 2 && meanDiff < 0.05 ? "ok" : "failed";
+    result["seconds"] = seconds;
+    result["tiles_per_sec"] = seconds > 0 ? tiles.size() / seconds : 0.0;
+    result["peak_rss_kb"] = static_cast<double>(peakRssKb());
+    result["pano_width"] = blocks.cols;
+    result["pano_height"] = blocks.rows;
+    result["max_diff"] = maxDiff;
+    result["mean_diff"] = meanDiff;
+    return result;
+}
+
+///
+/// \brief Columns of the csv output
+///
+static QStringList csvKeys()
+{
+    return {
+        "mode", "status", "tiles", "seconds", "tiles_per_sec", "peak_rss_kb",
+        "mean_error_px", "max_error_px", "pano_width", "pano_height"
+    };
+}
+
+///
+/// \brief Print one result
+/// \param result The result of one mode
+/// \param csv True for a csv line, else one json line
+///
+static void printResult(const QJsonObject &result, bool csv)
+{
+    if (!csv) {
+        std::printf(
+            "%s\n", QJsonDocument(result).toJson(QJsonDocument::Compact)
+                .constData()
+        );
+    } else {
+        QStringList values;
+        for (const QString &key : csvKeys())
+            values.append(result.value(key).toVariant().toString());
+        std::printf("%s\n", values.join(',').toUtf8().constData());
+    }
+    std::fflush(stdout);
+}
+
+///
+/// \brief Benchmark for accuracy and throughput of the stitching modes
+/// Every mode runs in its own process, so the peak memory is its own.
+///
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("stitchbench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Cuts a reference image into overlapping tiles with known offsets, "
+        "stitches them with every mode and reports speed and accuracy."
+    );
+    parser.addHelpOption();
+    parser.addOptions({
+        {"reference", "Reference image (synthetic if not given).", "file"},
+        {"columns", "Number of grid columns.", "n", "6"},
+        {"rows", "Number of grid rows.", "n", "4"},
+        {"tile-width", "Tile width in pixels.", "px", "640"},
+        {"tile-height", "Tile height in pixels.", "px", "480"},
+        {"overlap", "Overlap of neighbouring tiles (0-1).", "f", "0.2"},
+        {"noise", "Standard deviation of the pixel noise.", "f", "3"},
+        {"vignetting", "Brightness loss in the corners (0-1).", "f", "0.2"},
+        {"jitter", "Maximum position jitter in pixels.", "px", "8"},
+        {"exposure", "Maximum exposure variation (0-1).", "f", "0.1"},
+        {"seed", "Seed of the random generator.", "n", "1"},
+        {"mode", "Run only this mode in this process.", "name"},
+        {"csv", "Print csv instead of json lines."}
+    });
+    parser.process(app);
+
+    BenchConfig config;
+    config.reference = parser.value("reference");
+    config.columns = std::max(1, parser.value("columns").toInt());
+    config.rows = std::max(1, parser.value("rows").toInt());
+    config.tileSize = cv::Size(
+        std::max(64, parser.value("tile-width").toInt()),
+        std::max(64, parser.value("tile-height").toInt())
+    );
+    config.overlap = std::max(0.0, std::min(0.9, parser.value("overlap").toDouble()));
+    config.noise = parser.value("noise").toDouble();
+    config.vignetting = parser.value("vignetting").toDouble();
+    config.jitter = std::max(0, parser.value("jitter").toInt());
+    config.exposure = parser.value("exposure").toDouble();
+    config.seed = parser.value("seed").toInt();
+    bool csv = parser.isSet("csv");
+
+    if (parser.isSet("mode")) {
+        StitchingMode mode;
+        if (!StitchingEngine::modeFromName(parser.value("mode"), mode)) {
+            std::fprintf(
+                stderr, "Unknown mode %s\n",
+                parser.value("mode").toUtf8().constData()
+            );
+            return -1;
+        }
+        printResult(runMode(config, mode), csv);
+        return 0;
+    }
+
+    // Run every mode in a child process with the same arguments
+    QStringList args = app.arguments().mid(1);
+    std::vector<StitchingMode> modes = StitchingEngine::modes();
+    int failed = 0;
+    if (csv)
+        std::printf("%s\n", csvKeys().join(',').toUtf8().constData());
+    for (size_t i = 0; i < modes.size(); i++) {
+        QProcess child;
+        child.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        child.start(
+            app.applicationFilePath(),
+            QStringList(args) << "--mode" << StitchingEngine::modeName(modes[i])
+        );
+        if (!child.waitForFinished(-1) || child.exitCode() != 0) {
+            failed++;
+            continue;
+        }
+        std::printf("%s", child.readAllStandardOutput().constData());
+        std::fflush(stdout);
+    }
+
+    // Blocks of the multiband blender against one single block
+    QJsonObject check = runBlockCheck(config);
+    printResult(check, csv);
+    if (check["status"].toString() != "ok")
+        failed++;
+    return failed == 0 ? 0 : -1;
+}
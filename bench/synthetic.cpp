@@ -0,0 +1,106 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "synthetic.hpp"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+
+cv::Mat syntheticReference(cv::Size size, cv::RNG &rng)
+{
+    cv::Mat ref(size, CV_8UC3);
+    rng.fill(ref, cv::RNG::UNIFORM, 0, 255);
+    cv::GaussianBlur(ref, ref, cv::Size(0, 0), 4);
+    for (int i = 0; i < size.area() / 4000; i++) {
+        cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        cv::Scalar color(
+            rng.uniform(0, 255), rng.uniform(0, 255), rng.uniform(0, 255)
+        );
+        cv::circle(ref, center, rng.uniform(3, 40), color, cv::FILLED);
+    }
+    return ref;
+}
+
+SyntheticCamera::SyntheticCamera(cv::Size frameSize, cv::Point step, int seed)
+    : frameSize(frameSize),
+    step(step),
+    rng(seed),
+    jitter(0),
+    noise(0),
+    specimen(1)
+{
+}
+
+SyntheticCamera::~SyntheticCamera()
+{
+}
+
+void SyntheticCamera::setImperfections(int jitter, double noise)
+{
+    this->jitter = std::max(0, jitter);
+    this->noise = noise;
+}
+
+void SyntheticCamera::setSpecimen(double extent)
+{
+    specimen = std::max(0.0, extent);
+}
+
+void SyntheticCamera::prepare(int columns, int rows)
+{
+    cv::Size needed(
+        step.x * (columns - 1) + frameSize.width + 2 * jitter,
+        step.y * (rows - 1) + frameSize.height + 2 * jitter
+    );
+    if (reference.cols >= needed.width && reference.rows >= needed.height)
+        return;
+
+    reference = syntheticReference(needed, rng);
+    if (specimen < 1) {
+        // Flat glass around the specimen, the sensor noise is added later
+        cv::Mat mask(needed, CV_8U, cv::Scalar(255));
+        cv::ellipse(
+            mask, cv::Point(needed.width / 2, needed.height / 2),
+            cv::Size(
+                static_cast<int>(needed.width * specimen / 2),
+                static_cast<int>(needed.height * specimen / 2)
+            ), 0, 0, 360, cv::Scalar(0), cv::FILLED
+        );
+        reference.setTo(cv::Scalar(200, 200, 200), mask);
+    }
+}
+
+cv::Point SyntheticCamera::grab(cv::Point cell, cv::Mat &frame)
+{
+    cv::Point corner(
+        jitter + cell.x * step.x + rng.uniform(-jitter, jitter + 1),
+        jitter + cell.y * step.y + rng.uniform(-jitter, jitter + 1)
+    );
+    corner.x = std::max(0, std::min(corner.x, reference.cols - frameSize.width));
+    corner.y = std::max(0, std::min(corner.y, reference.rows - frameSize.height));
+
+    reference(cv::Rect(corner, frameSize)).copyTo(frame);
+    if (noise > 0) {
+        cv::Mat n(frame.size(), CV_16SC3);
+        rng.fill(n, cv::RNG::NORMAL, 0, noise);
+        cv::add(frame, n, frame, cv::noArray(), CV_8UC3);
+    }
+    return corner;
+}
@@ -0,0 +1,96 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Create a textured reference image
+/// Blurred noise with filled circles, which has enough structure for the
+/// registration at every position.
+/// \param size Size of the image
+/// \param rng Random generator
+/// \return The image
+///
+cv::Mat syntheticReference(cv::Size size, cv::RNG &rng);
+
+///
+/// \brief Camera looking at a reference image through a moving stage
+///
+class SyntheticCamera
+{
+public:
+    ///
+    /// \brief Constructor
+    /// \param frameSize Size of the frames
+    /// \param step Offset of two neighbouring cells in pixels
+    /// \param seed Seed of the random generator
+    ///
+    SyntheticCamera(cv::Size frameSize, cv::Point step, int seed = 1);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~SyntheticCamera();
+
+    ///
+    /// \brief Set the imperfections of the stage and the sensor
+    /// \param jitter Maximum position error in pixels
+    /// \param noise Standard deviation of the pixel noise
+    ///
+    void setImperfections(int jitter, double noise);
+
+    ///
+    /// \brief Limit the structure to a specimen on empty glass
+    /// The specimen is an ellipse in the middle of the reference.
+    /// \param extent Axes of the ellipse relative to the reference size, 1
+    /// or more fills the whole reference
+    ///
+    void setSpecimen(double extent);
+
+    ///
+    /// \brief Make the reference large enough for a grid
+    /// \param columns Number of columns
+    /// \param rows Number of rows
+    ///
+    void prepare(int columns, int rows);
+
+    ///
+    /// \brief Take a frame at a cell
+    /// \param cell The grid cell
+    /// \param frame The frame
+    /// \return The true top left position of the frame in the reference
+    ///
+    cv::Point grab(cv::Point cell, cv::Mat &frame);
+
+private:
+    cv::Size frameSize;
+    cv::Point step;
+    cv::RNG rng;
+    int jitter;
+    double noise;
+    double specimen;
+    cv::Mat reference;
+};
+
+
+#endif // SYNTHETIC_H
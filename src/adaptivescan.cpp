@@ -0,0 +1,360 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "adaptivescan.hpp"
+#include "controller.hpp"
+#include "scanpipeline.hpp"
+
+#include <cstdlib>
+#include <algorithm>
+#include <QtCore/QTimer>
+#include <opencv2/imgproc.hpp>
+
+
+// Width of the gray copy that is scored
+static const int SCORE_WIDTH = 160;
+
+
+AdaptiveScan::AdaptiveScan(Controller *controller, QObject *parent)
+    : QObject(parent),
+    controller(controller),
+    columns(1),
+    rows(1),
+    stepsX(0),
+    stepsY(0),
+    seedSpacing(2),
+    threshold(20),
+    referenceInterval(0),
+    running(false),
+    growing(true),
+    arrived(false),
+    atReference(false),
+    pendingCommand(-1),
+    lastDirectionY(0),
+    wanted(0),
+    withContent(0)
+{
+    // The controller runs in its own thread, its results arrive queued
+    connect(
+        controller, &Controller::commandFinished,
+        this, &AdaptiveScan::controllerCommandFinished
+    );
+}
+
+AdaptiveScan::~AdaptiveScan()
+{
+}
+
+void AdaptiveScan::setGrid(int columns, int rows)
+{
+    this->columns = std::max(1, columns);
+    this->rows = std::max(1, rows);
+}
+
+void AdaptiveScan::setSteps(int stepsX, int stepsY)
+{
+    this->stepsX = std::abs(stepsX);
+    this->stepsY = std::abs(stepsY);
+}
+
+void AdaptiveScan::setSeedSpacing(int cells)
+{
+    seedSpacing = std::max(1, cells);
+}
+
+void AdaptiveScan::setThreshold(double threshold)
+{
+    this->threshold = threshold;
+}
+
+void AdaptiveScan::setReferenceInterval(int ms)
+{
+    referenceInterval = std::max(0, ms);
+}
+
+void AdaptiveScan::start()
+{
+    if (running)
+        return;
+    begin(cv::Point(0, 0));
+    moveOn();
+}
+
+void AdaptiveScan::resume(cv::Point current, const std::vector<cv::Point> &done,
+    const std::vector<cv::Mat> &frames)
+{
+    if (running)
+        return;
+    begin(current);
+
+    for (size_t i = 0; i < done.size() && i < frames.size(); i++) {
+        cv::Point cell = done[i];
+        if (cell.x < 0 || cell.x >= columns || cell.y < 0 || cell.y >= rows
+                || state(cell) == CellState::TAKEN)
+            continue;
+        if (state(cell) == CellState::WANTED)
+            wanted--;
+        state(cell) = CellState::TAKEN;
+        taken.push_back(cell);
+        if (contentScore(frames[i]) >= threshold) {
+            withContent++;
+            expand(cell);
+        }
+    }
+    moveOn();
+}
+
+void AdaptiveScan::revisit(cv::Point current,
+    const std::vector<cv::Point> &cells)
+{
+    if (running)
+        return;
+    begin(current);
+
+    // No survey, only the given cells
+    growing = false;
+    this->cells.assign(columns * rows, CellState::SKIPPED);
+    wanted = 0;
+    for (size_t i = 0; i < cells.size(); i++) {
+        cv::Point cell = cells[i];
+        if (cell.x < 0 || cell.x >= columns || cell.y < 0 || cell.y >= rows
+                || state(cell) == CellState::WANTED)
+            continue;
+        state(cell) = CellState::WANTED;
+        wanted++;
+    }
+    moveOn();
+}
+
+void AdaptiveScan::begin(cv::Point cell)
+{
+    // The survey, the rest of the cells is only taken next to content
+    cells.assign(columns * rows, CellState::SKIPPED);
+    wanted = 0;
+    for (int x = 0; x < columns; x += seedSpacing) {
+        for (int y = 0; y < rows; y += seedSpacing) {
+            state(cv::Point(x, y)) = CellState::WANTED;
+            wanted++;
+        }
+    }
+
+    taken.clear();
+    withContent = 0;
+    growing = true;
+    current = cell;
+    origin = cell;
+    lastDirectionY = 0;
+    atReference = false;
+    sinceReference.invalidate();
+    running = true;
+    controller->reset();
+}
+
+void AdaptiveScan::tileCaptured(const cv::Mat &frame)
+{
+    if (!running || !arrived || atReference)
+        return;
+    arrived = false;
+
+    state(current) = CellState::TAKEN;
+    taken.push_back(current);
+    wanted--;
+    if (growing && contentScore(frame) >= threshold) {
+        withContent++;
+        expand(current);
+    }
+    moveOn();
+}
+
+void AdaptiveScan::referenceCaptured()
+{
+    if (!running || !arrived || !atReference)
+        return;
+    arrived = false;
+    atReference = false;
+    sinceReference.start();
+    moveOn();
+}
+
+void AdaptiveScan::abort()
+{
+    if (running)
+        finish(false);
+}
+
+bool AdaptiveScan::isRunning() const
+{
+    return running;
+}
+
+cv::Point AdaptiveScan::position() const
+{
+    return current;
+}
+
+std::vector<cv::Point> AdaptiveScan::path() const
+{
+    return taken;
+}
+
+int AdaptiveScan::remaining() const
+{
+    return wanted;
+}
+
+int AdaptiveScan::occupied() const
+{
+    return withContent;
+}
+
+double AdaptiveScan::contentScore(const cv::Mat &frame)
+{
+    if (frame.empty())
+        return 0;
+
+    cv::Mat gray;
+    if (frame.channels() == 3)
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = frame;
+    double scale = std::min(1.0, static_cast<double>(SCORE_WIDTH) / gray.cols);
+    cv::Mat small;
+    cv::resize(gray, small, cv::Size(), scale, scale, cv::INTER_AREA);
+    return ScanPipeline::sharpness(small);
+}
+
+void AdaptiveScan::controllerCommandFinished(int id, bool success)
+{
+    if (id != pendingCommand || !running)
+        return;
+    pendingCommand = -1;
+
+    if (!success) {
+        finish(false);
+        return;
+    }
+    arrive();
+}
+
+void AdaptiveScan::arrive()
+{
+    if (!running)
+        return;
+    arrived = true;
+    if (atReference)
+        emit referenceReached();
+    else
+        emit positionReached(current.x, current.y);
+}
+
+AdaptiveScan::CellState &AdaptiveScan::state(cv::Point cell)
+{
+    return cells[cell.y * columns + cell.x];
+}
+
+void AdaptiveScan::expand(cv::Point cell)
+{
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            cv::Point next = cell + cv::Point(dx, dy);
+            if (next.x < 0 || next.x >= columns || next.y < 0
+                    || next.y >= rows)
+                continue;
+            if (state(next) == CellState::SKIPPED) {
+                state(next) = CellState::WANTED;
+                wanted++;
+            }
+        }
+    }
+}
+
+void AdaptiveScan::moveOn()
+{
+    if (referenceInterval > 0 && wanted > 0 && (!sinceReference.isValid()
+            || sinceReference.elapsed() >= referenceInterval)) {
+        visitReference();
+        return;
+    }
+
+    // Nearest wanted cell by the motor with the longer way, a reversal of the
+    // second motor adds its backlash. Ties go column by column.
+    int backlash = controller->backlash();
+    cv::Point best(-1, -1);
+    long bestCost = 0;
+    for (int x = 0; x < columns; x++) {
+        for (int y = 0; y < rows; y++) {
+            cv::Point cell(x, y);
+            if (state(cell) != CellState::WANTED)
+                continue;
+
+            cv::Point delta = cell - current;
+            long costY = static_cast<long>(std::abs(delta.y)) * stepsY;
+            int direction = delta.y > 0 ? 1 : (delta.y < 0 ? -1 : 0);
+            if (direction != 0 && lastDirectionY != 0
+                    && direction != lastDirectionY)
+                costY += backlash;
+            long cost = std::max(
+                static_cast<long>(std::abs(delta.x)) * stepsX, costY
+            );
+            if (best.x < 0 || cost < bestCost) {
+                best = cell;
+                bestCost = cost;
+            }
+        }
+    }
+
+    if (best.x < 0) {
+        finish(true);
+        return;
+    }
+
+    if (best.y != current.y)
+        lastDirectionY = best.y > current.y ? 1 : -1;
+    current = best;
+    pendingCommand = controller->moveToCell(
+        QPoint(best.x - origin.x, best.y - origin.y)
+    );
+
+    // No move is needed for the first cell
+    if (pendingCommand < 0)
+        QTimer::singleShot(0, this, &AdaptiveScan::arrive);
+}
+
+void AdaptiveScan::visitReference()
+{
+    cv::Point reference(0, 0);
+    if (reference.y != current.y)
+        lastDirectionY = reference.y > current.y ? 1 : -1;
+    current = reference;
+    atReference = true;
+    pendingCommand = controller->moveToCell(
+        QPoint(reference.x - origin.x, reference.y - origin.y)
+    );
+    if (pendingCommand < 0)
+        QTimer::singleShot(0, this, &AdaptiveScan::arrive);
+}
+
+void AdaptiveScan::finish(bool completed)
+{
+    running = false;
+    arrived = false;
+    atReference = false;
+    pendingCommand = -1;
+    emit finished(completed);
+}
@@ -0,0 +1,271 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef ADAPTIVESCAN_H
+#define ADAPTIVESCAN_H
+
+#include <vector>
+#include <QtCore/QObject>
+#include <QtCore/QElapsedTimer>
+#include <opencv2/core.hpp>
+
+
+class Controller;
+
+///
+/// \brief Scan that skips the empty parts of a grid
+/// A survey takes every seedSpacing-th cell of both axes. Every tile is
+/// scored on arrival with a cheap texture measure. Around tiles with
+/// content all eight neighbours are added, so the scan grows over the
+/// specimen and stops one tile behind its border. The stage always moves to
+/// the nearest cell still to take. Unlike the scans of the firmware, every
+/// move is sent by the host, so the scan can also return to a reference cell
+/// every now and then to measure the drift of the stage.
+///
+class AdaptiveScan : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param controller The connected controller
+    /// \param parent Parent object
+    ///
+    explicit AdaptiveScan(Controller *controller, QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~AdaptiveScan() override;
+
+    ///
+    /// \brief Set the grid to scan
+    /// \param columns Number of positions of the first motor
+    /// \param rows Number of positions of the second motor
+    ///
+    void setGrid(int columns, int rows);
+
+    ///
+    /// \brief Set the steps between two cells, to find the nearest cell
+    /// \param stepsX Steps of the first motor
+    /// \param stepsY Steps of the second motor
+    ///
+    void setSteps(int stepsX, int stepsY);
+
+    ///
+    /// \brief Set the distance of the cells of the survey
+    /// Specimens of this size in both directions are always found, 1 takes
+    /// every cell.
+    /// \param cells Distance in cells
+    ///
+    void setSeedSpacing(int cells);
+
+    ///
+    /// \brief Set the least score of a tile with content
+    /// \param threshold The score, see contentScore
+    ///
+    void setThreshold(double threshold);
+
+    ///
+    /// \brief Set the time between two visits of the reference cell
+    /// The first cell of the grid is the reference. It is visited before the
+    /// first tile and again, when the time has passed, before the next one.
+    /// \param ms Time in milliseconds, 0 for no visits
+    ///
+    void setReferenceInterval(int ms);
+
+    ///
+    /// \brief Start the scan at the current position of the stage
+    /// The controller counts the cells from here. Every position is reported
+    /// with positionReached, the scan waits there for tileCaptured.
+    ///
+    void start();
+
+    ///
+    /// \brief Continue an interrupted scan at the current position
+    /// The survey is planned again, the cells already taken are kept and
+    /// their tiles are scored again to find the cells next to content.
+    /// \param current The cell the stage is at, the controller counts the
+    /// cells from here
+    /// \param done The cells already taken
+    /// \param frames Their tiles, in the order of done
+    ///
+    void resume(cv::Point current, const std::vector<cv::Point> &done,
+        const std::vector<cv::Mat> &frames);
+
+    ///
+    /// \brief Take some cells again, without looking for content
+    /// \param current The cell the stage is at, the controller counts the
+    /// cells from here
+    /// \param cells The cells to take
+    ///
+    void revisit(cv::Point current, const std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief The tile of the current position has been captured
+    /// \param frame The frame
+    ///
+    void tileCaptured(const cv::Mat &frame);
+
+    ///
+    /// \brief The frame of the reference cell has been captured
+    ///
+    void referenceCaptured();
+
+    ///
+    /// \brief Stop the scan, finished is emitted
+    ///
+    void abort();
+
+    ///
+    /// \brief Get the info if the scan is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Get the cell the stage is at or moving to
+    /// \return The cell
+    ///
+    cv::Point position() const;
+
+    ///
+    /// \brief Get the cells taken so far
+    /// \return The cells in the order they have been taken
+    ///
+    std::vector<cv::Point> path() const;
+
+    ///
+    /// \brief Get the number of cells still to take
+    /// More cells are added, when tiles with content are found.
+    /// \return Number of cells
+    ///
+    int remaining() const;
+
+    ///
+    /// \brief Get the number of tiles with content
+    /// \return Number of tiles
+    ///
+    int occupied() const;
+
+    ///
+    /// \brief Score the content of a frame
+    /// Variance of the laplacian of a small gray copy. The noise averages
+    /// out and the vignetting has no edges, so empty glass scores low.
+    /// \param frame The frame
+    /// \return The score
+    ///
+    static double contentScore(const cv::Mat &frame);
+
+signals:
+    ///
+    /// \brief The scan reached a position and waits for the capture
+    /// \param x Column of the position
+    /// \param y Row of the position
+    ///
+    void positionReached(int x, int y);
+
+    ///
+    /// \brief The scan reached the reference cell and waits for the capture
+    ///
+    void referenceReached();
+
+    ///
+    /// \brief The scan has been finished
+    /// \param completed True if all wanted cells were taken, false if aborted
+    ///
+    void finished(bool completed);
+
+private slots:
+    ///
+    /// \brief A command of the controller has been finished
+    /// \param id The id of the command
+    /// \param success True if it has been executed, else false
+    ///
+    void controllerCommandFinished(int id, bool success);
+
+    ///
+    /// \brief Report the position, the stage has arrived
+    ///
+    void arrive();
+
+private:
+    ///
+    /// State of a cell of the grid
+    ///
+    enum class CellState { SKIPPED, WANTED, TAKEN };
+
+    ///
+    /// \brief Get the state of a cell
+    ///
+    CellState &state(cv::Point cell);
+
+    ///
+    /// \brief Add the neighbours of a cell with content
+    ///
+    void expand(cv::Point cell);
+
+    ///
+    /// \brief Plan the survey and start at a cell
+    ///
+    void begin(cv::Point cell);
+
+    ///
+    /// \brief Move to the nearest wanted cell or finish
+    ///
+    void moveOn();
+
+    ///
+    /// \brief Move to the reference cell
+    ///
+    void visitReference();
+
+    ///
+    /// \brief Stop the scan
+    /// \param completed True if all wanted cells were taken
+    ///
+    void finish(bool completed);
+
+    Controller *controller;
+    int columns;
+    int rows;
+    int stepsX;
+    int stepsY;
+    int seedSpacing;
+    double threshold;
+    int referenceInterval;
+
+    bool running;
+    bool growing;
+    bool arrived;
+    bool atReference;
+    QElapsedTimer sinceReference;
+    int pendingCommand;
+    cv::Point current;
+    cv::Point origin;
+    int lastDirectionY;
+    std::vector<CellState> cells;
+    std::vector<cv::Point> taken;
+    int wanted;
+    int withContent;
+};
+
+
+#endif // ADAPTIVESCAN_H
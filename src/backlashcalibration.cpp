@@ -0,0 +1,269 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "backlashcalibration.hpp"
+#include "stagecalibrator.hpp"
+#include "controller.hpp"
+#include "livecamera.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <QtCore/QTimer>
+
+
+// Moves to measure the pixels per step before the first reversal
+static const int SCALE_MOVES = 4;
+
+// A move has engaged the gears, if it moves the image at least this part of
+// the expected distance. Some moves in a row have to do so.
+static const double ENGAGED_RATIO = 0.7;
+static const int ENGAGED_MOVES = 3;
+
+// Lowest phase correlation response accepted as registration
+static const double MIN_RESPONSE = 0.05;
+
+// Least image motion per move in full resolution pixels
+static const double MIN_MOTION = 1.0;
+
+
+BacklashCalibration::BacklashCalibration(
+        Controller *controller, LiveCamera *camera, QObject *parent)
+    : QObject(parent),
+    controller(controller),
+    camera(camera),
+    stepSize(32),
+    settleTime(300),
+    maxBacklash(2400),
+    phase(Phase::IDLE),
+    pendingCommand(-1),
+    previousBacklash(0),
+    moves(0),
+    commanded(0),
+    measured(0),
+    engaged(0),
+    backlashSum(0),
+    measuredBacklash(-1),
+    scale(0)
+{
+    // The controller runs in its own thread, its results arrive queued
+    connect(
+        controller, &Controller::commandFinished,
+        this, &BacklashCalibration::controllerCommandFinished
+    );
+}
+
+BacklashCalibration::~BacklashCalibration()
+{
+}
+
+void BacklashCalibration::setStepSize(int steps)
+{
+    stepSize = std::max(1, steps);
+}
+
+void BacklashCalibration::setSettleTime(int ms)
+{
+    settleTime = std::max(0, ms);
+}
+
+void BacklashCalibration::setMaxBacklash(int steps)
+{
+    maxBacklash = std::max(0, steps);
+}
+
+void BacklashCalibration::start()
+{
+    if (isRunning())
+        return;
+
+    measuredBacklash = -1;
+    scale = 0;
+    backlashSum = 0;
+    lastError.clear();
+    lastFrame.release();
+    previousBacklash = controller->backlash();
+
+    // Without compensation every step of the motor is seen in the image
+    phase = Phase::DISABLE;
+    emit progress(tr("Switching off the backlash compensation..."));
+    pendingCommand = controller->setBacklash(0);
+}
+
+void BacklashCalibration::abort()
+{
+    if (isRunning())
+        fail(tr("The calibration has been aborted."));
+}
+
+bool BacklashCalibration::isRunning() const
+{
+    return phase != Phase::IDLE;
+}
+
+int BacklashCalibration::backlash() const
+{
+    return measuredBacklash;
+}
+
+double BacklashCalibration::pixelsPerStep() const
+{
+    return scale;
+}
+
+QString BacklashCalibration::errorString() const
+{
+    return lastError;
+}
+
+void BacklashCalibration::controllerCommandFinished(int id, bool success)
+{
+    if (id != pendingCommand || !isRunning())
+        return;
+    pendingCommand = -1;
+
+    if (phase == Phase::DISABLE) {
+        if (!success) {
+            fail(tr("The controller cannot change the backlash. A firmware "
+                "with the binary protocol is needed."));
+            return;
+        }
+
+        // Move forward further than any backlash, so the gears engage
+        phase = Phase::TAKE_UP;
+        emit progress(tr("Taking up the slack..."));
+        move(maxBacklash);
+        return;
+    }
+
+    if (!success) {
+        fail(tr("The stage could not be moved."));
+        return;
+    }
+    QTimer::singleShot(settleTime, this, &BacklashCalibration::measure);
+}
+
+void BacklashCalibration::measure()
+{
+    if (!isRunning())
+        return;
+
+    cv::Mat frame = StageCalibrator::registrationFrame(
+        camera->getCurrentImage()
+    );
+    if (frame.empty()) {
+        fail(tr("There is no camera image."));
+        return;
+    }
+
+    if (phase == Phase::TAKE_UP) {
+        lastFrame = frame;
+        phase = Phase::SCALE;
+        motion = cv::Point2d();
+        moves = 0;
+        emit progress(tr("Measuring the image motion..."));
+        move(stepSize);
+        return;
+    }
+
+    cv::Point2d shift;
+    double response = StageCalibrator::registerFrames(
+        lastFrame, frame, shift
+    );
+    lastFrame = frame;
+    if (response < MIN_RESPONSE) {
+        fail(tr("The images cannot be registered, use a sample with more "
+            "structure."));
+        return;
+    }
+
+    if (phase == Phase::SCALE) {
+        motion += shift;
+        moves++;
+        if (moves < SCALE_MOVES) {
+            move(stepSize);
+            return;
+        }
+
+        double length = cv::norm(motion);
+        if (length < MIN_MOTION * moves) {
+            fail(tr("The image does not move, use a larger step size."));
+            return;
+        }
+        scale = length / (moves * stepSize);
+        motion *= 1.0 / length;
+
+        // Now backwards, the image stands still until the gears engage
+        phase = Phase::REVERSE;
+        commanded = 0;
+        measured = 0;
+        engaged = 0;
+        move(-stepSize);
+        return;
+    }
+
+    // Distance moved in the direction of this phase
+    int sign = phase == Phase::REVERSE ? -1 : 1;
+    double distance = sign * shift.dot(motion);
+    commanded += stepSize;
+    measured += distance;
+    if (distance >= ENGAGED_RATIO * scale * stepSize)
+        engaged++;
+    else
+        engaged = 0;
+
+    if (engaged >= ENGAGED_MOVES) {
+        // Every step not seen in the image has been lost in the gears
+        backlashSum += std::max(0.0, commanded - measured / scale);
+        if (phase == Phase::REVERSE) {
+            phase = Phase::FORWARD;
+            commanded = 0;
+            measured = 0;
+            engaged = 0;
+            move(stepSize);
+            return;
+        }
+
+        measuredBacklash = static_cast<int>(std::lround(backlashSum / 2));
+        phase = Phase::IDLE;
+        controller->setBacklash(measuredBacklash);
+        emit finished(true);
+        return;
+    }
+
+    if (commanded > maxBacklash + ENGAGED_MOVES * stepSize) {
+        fail(tr("The stage does not move after %1 steps.").arg(commanded));
+        return;
+    }
+    emit progress(tr("Measuring the backlash: %1 steps...").arg(commanded));
+    move(sign * stepSize);
+}
+
+void BacklashCalibration::move(int steps)
+{
+    pendingCommand = controller->moveSteps(MotorNumber::TWO, steps);
+}
+
+void BacklashCalibration::fail(const QString &message)
+{
+    lastError = message;
+    phase = Phase::IDLE;
+    pendingCommand = -1;
+    controller->setBacklash(previousBacklash);
+    emit finished(false);
+}
@@ -0,0 +1,179 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef BACKLASHCALIBRATION_H
+#define BACKLASHCALIBRATION_H
+
+#include <QtCore/QObject>
+#include <QtCore/QString>
+#include <opencv2/core.hpp>
+
+
+class Controller;
+class LiveCamera;
+
+///
+/// \brief Measures the backlash of the second motor with the camera
+/// The firmware compensation is switched off and the stage is moved in small
+/// steps. The first steps give the pixels per step and the direction of the
+/// image motion. After a reversal the image stands still until the gears
+/// engage again, the steps missing in the measured motion are the backlash.
+/// It is measured in both directions and the mean is sent to the firmware.
+///
+class BacklashCalibration : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param controller The connected controller
+    /// \param camera The running camera
+    /// \param parent Parent object
+    ///
+    BacklashCalibration(
+        Controller *controller, LiveCamera *camera, QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~BacklashCalibration() override;
+
+    ///
+    /// \brief Set the steps of one measuring move
+    /// The image has to move at least a pixel per move.
+    /// \param steps Steps of the second motor
+    ///
+    void setStepSize(int steps);
+
+    ///
+    /// \brief Set the time to wait for a still image after every move
+    /// \param ms Time in milliseconds
+    ///
+    void setSettleTime(int ms);
+
+    ///
+    /// \brief Set the largest backlash that is searched for
+    /// \param steps Steps of the second motor
+    ///
+    void setMaxBacklash(int steps);
+
+    ///
+    /// \brief Start the calibration
+    /// The result is reported with finished.
+    ///
+    void start();
+
+    ///
+    /// \brief Stop the calibration, the firmware gets its old backlash
+    ///
+    void abort();
+
+    ///
+    /// \brief Get the info if the calibration is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Get the measured backlash
+    /// \return The backlash in steps or -1 if not measured
+    ///
+    int backlash() const;
+
+    ///
+    /// \brief Get the measured image motion of the second motor
+    /// \return Pixels per step or 0 if not measured
+    ///
+    double pixelsPerStep() const;
+
+    ///
+    /// \brief Get the reason of the last failure
+    /// \return The error message
+    ///
+    QString errorString() const;
+
+signals:
+    ///
+    /// \brief Description of the current state for the status bar
+    /// \param message The description
+    ///
+    void progress(const QString &message);
+
+    ///
+    /// \brief The calibration has been finished
+    /// \param success True if the backlash has been measured, else false
+    /// with the reason in errorString
+    ///
+    void finished(bool success);
+
+private slots:
+    ///
+    /// \brief A command of the controller has been finished
+    /// \param id The id of the command
+    /// \param success True if it has been executed, else false
+    ///
+    void controllerCommandFinished(int id, bool success);
+
+    ///
+    /// \brief Grab a frame after the move and plan the next move
+    ///
+    void measure();
+
+private:
+    ///
+    /// Parts of the calibration, in this order
+    ///
+    enum class Phase { DISABLE, TAKE_UP, SCALE, REVERSE, FORWARD, IDLE };
+
+    ///
+    /// \brief Move the second motor and measure afterwards
+    /// \param steps Steps to move
+    ///
+    void move(int steps);
+
+    ///
+    /// \brief Stop with an error
+    /// \param message Description of the error
+    ///
+    void fail(const QString &message);
+
+    Controller *controller;
+    LiveCamera *camera;
+    int stepSize;
+    int settleTime;
+    int maxBacklash;
+
+    Phase phase;
+    int pendingCommand;
+    int previousBacklash;
+    cv::Mat lastFrame;
+    cv::Point2d motion;
+    int moves;
+    int commanded;
+    double measured;
+    int engaged;
+    double backlashSum;
+    int measuredBacklash;
+    double scale;
+    QString lastError;
+};
+
+
+#endif // BACKLASHCALIBRATION_H
@@ -0,0 +1,307 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
+#include <opencv2/opencv.hpp>
+
+#include "stitchingengine.hpp"
+#include "tilegrid.hpp"
+#include "sessionfile.hpp"
+#include "driftmodel.hpp"
+#include "tileimporter.hpp"
+#include "pyramidimage.hpp"
+#include "tileserver.hpp"
+
+
+///
+/// \brief Print an error message
+///
+static void printError(const QString &message)
+{
+    std::fprintf(stderr, "microscope-batch: %s\n", message.toUtf8().constData());
+}
+
+///
+/// \brief Encoder parameters for the output format
+///
+static std::vector<int> writeParams(const QString &suffix)
+{
+    std::vector<int> params;
+    if (suffix == "png")
+        params = {cv::IMWRITE_PNG_COMPRESSION, 1};
+    else if (suffix == "jpg" || suffix == "jpeg")
+        params = {cv::IMWRITE_JPEG_QUALITY, 95};
+    else if (suffix == "webp")
+        params = {cv::IMWRITE_WEBP_QUALITY, 101};
+    return params;
+}
+
+///
+/// \brief Headless batch stitching of recorded scans
+/// This executable does not link any widget code and runs without a display.
+///
+int main(int argc, char *argv[])
+{
+    QElapsedTimer totalTimer;
+    totalTimer.start();
+
+    QCoreApplication app(argc, argv);
+    app.setOrganizationName("Krippendorf");
+    app.setApplicationName("microscope-batch");
+    app.setApplicationVersion("1.0.0");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Stitch the tiles of a directory, manifest or session into one "
+        "mosaic."
+    );
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument(
+        "input", "Directory with tiles, manifest file (file [column row]) or "
+        "session (.msession)."
+    );
+    parser.addOptions({
+        {{"o", "output"}, "Output file.", "file", "mosaic.png"},
+        {{"e", "engine"}, "Stitching engine: scans, feather or multiband.",
+            "name", "feather"},
+        {{"t", "threads"}, "Number of worker threads (0 for all cores).",
+            "n", "0"},
+        {{"m", "memory-budget"}, "Memory budget in MiB (0 for unlimited).",
+            "mib", "0"},
+        {{"f", "format"}, "Output format (png, jpg, tif, webp or mpyramid "
+            "for tiles), default from the output suffix.", "suffix"},
+        {{"c", "columns"}, "Columns of the grid, if the input has no cells.",
+            "n"},
+        {"order", "Order of the tiles: row or column.", "order", "row"},
+        {"report", "Write the quality of the tiles and their registrations "
+            "(grid engines only).", "file"},
+        {"serpentine", "Every second row (or column) is reversed."},
+        {"serve", "Serve the mosaic over http when written, needs the "
+            "mpyramid format.", "address:port"}
+    });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+    QString outputSuffix = parser.isSet("format") ? parser.value("format")
+        : QFileInfo(parser.value("output")).suffix();
+    if (parser.isSet("serve") && outputSuffix.toLower() != "mpyramid") {
+        printError("Only an mpyramid output can be served");
+        return 1;
+    }
+
+    StitchingMode mode;
+    if (!StitchingEngine::modeFromName(parser.value("engine"), mode)) {
+        printError(QString("Unknown engine %1").arg(parser.value("engine")));
+        return 1;
+    }
+
+    cv::setNumThreads(parser.value("threads").toInt() > 0
+        ? parser.value("threads").toInt() : -1);
+
+    // Collect the tile files, a session holds the tiles with their cells and
+    // the drift of the stage itself
+    QString input = parser.positionalArguments().first();
+    QStringList files;
+    std::vector<cv::Point> cells;
+    SessionFile session;
+    std::vector<cv::Point2d> priors;
+    bool isSession = QFileInfo(input).suffix().toLower() == "msession";
+    if (isSession) {
+        if (!session.open(input)) {
+            printError(QString("Cannot open session %1: %2").arg(input)
+                .arg(session.errorString()));
+            return 1;
+        }
+        std::vector<qint64> times;
+        bool known = true;
+        for (int i = 0; i < session.size(); i++) {
+            const SessionFile::Tile &tile = session.tiles()[i];
+            cells.push_back(tile.cell);
+            times.push_back(tile.time);
+            known = known && tile.cell.x >= 0 && tile.cell.y >= 0;
+        }
+        if (!known)
+            cells.clear();
+        DriftModel drift;
+        drift.addJson(session.metadata().value("drift").toArray());
+        if (!drift.isEmpty())
+            priors = drift.tileShifts(times);
+    } else if (QFileInfo(input).isDir()) {
+        files = TileImporter::readDirectory(input);
+        if (!parser.isSet("columns"))
+            cells = TileImporter::cellsFromNames(files);
+    } else if (!TileImporter::readManifest(input, files, cells)) {
+        printError(QString("Cannot read manifest %1").arg(input));
+        return 1;
+    }
+    int count = isSession ? session.size() : files.size();
+    if (count == 0) {
+        printError(QString("No tiles found in %1").arg(input));
+        return 1;
+    }
+
+    if (cells.empty()) {
+        int columns = parser.isSet("columns")
+            ? parser.value("columns").toInt()
+            : static_cast<int>(std::ceil(std::sqrt(count)));
+        columns = std::max(1, columns);
+        GridOrder order = parser.value("order") == "column"
+            ? GridOrder::COLUMN_MAJOR : GridOrder::ROW_MAJOR;
+        int rows = (count + columns - 1) / columns;
+        TileGrid grid(columns, rows, order, parser.isSet("serpentine"));
+        cells = grid.cells(count);
+    }
+
+    // Load the tiles, uncompressed tiles of a session are only mapped
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<cv::Mat> tiles;
+    size_t tileBytes = 0;
+    for (int i = 0; i < count; i++) {
+        cv::Mat tile = isSession ? session.image(i)
+            : cv::imread(files.at(i).toStdString(), cv::IMREAD_COLOR);
+        if (tile.empty()) {
+            printError(QString("Cannot load tile %1")
+                .arg(isSession ? QString::number(i) : files.at(i)));
+            return 1;
+        }
+        tileBytes += tile.total() * tile.elemSize();
+        tiles.push_back(tile);
+    }
+    double loadSeconds = timer.nsecsElapsed() / 1e9;
+
+    // The tiles and the mosaic (at most as large as all tiles) have to fit
+    // into the budget, the rest is left for blending.
+    size_t budget = static_cast<size_t>(
+        parser.value("memory-budget").toLongLong()) * 1024 * 1024;
+    StitchingEngine engine(mode);
+    engine.setCells(cells);
+    engine.setPositionPriors(priors);
+    if (budget > 0) {
+        if (2 * tileBytes >= budget) {
+            printError(QString(
+                "The tiles need %1 MiB, the memory budget is too small"
+            ).arg(tileBytes / (1024 * 1024)));
+            return 1;
+        }
+        engine.setMemoryBudget(budget - 2 * tileBytes);
+    }
+
+    timer.restart();
+    cv::Mat pano;
+    StitchingEngine::Status status = engine.stitch(tiles, pano);
+    double stitchSeconds = timer.nsecsElapsed() / 1e9;
+
+    // The report also tells why the registration has failed
+    const StitchReport &report = engine.report();
+    if (parser.isSet("report") && !report.isEmpty()
+            && !report.write(parser.value("report"))) {
+        printError(QString("Cannot write report %1").arg(parser.value("report")));
+    }
+    if (status != StitchingEngine::Status::OK) {
+        printError("Cannot stitch images!");
+        return 1;
+    }
+
+    // Write the mosaic
+    QString output = parser.value("output");
+    if (parser.isSet("format"))
+        output = QString("%1/%2.%3").arg(QFileInfo(output).path())
+            .arg(QFileInfo(output).completeBaseName())
+            .arg(parser.value("format"));
+    timer.restart();
+    QString suffix = QFileInfo(output).suffix().toLower();
+    if (suffix == "mpyramid") {
+        PyramidImage pyramid;
+        if (!pyramid.save(output, pano)) {
+            printError(QString("Cannot write %1: %2").arg(output)
+                .arg(pyramid.errorString()));
+            return 1;
+        }
+    } else if (!cv::imwrite(
+            output.toStdString(), pano, writeParams(suffix))) {
+        printError(QString("Cannot write %1").arg(output));
+        return 1;
+    }
+    double writeSeconds = timer.nsecsElapsed() / 1e9;
+
+    std::printf(
+        "tiles:       %d\n"
+        "engine:      %s\n"
+        "threads:     %d\n"
+        "mosaic:      %dx%d\n"
+        "load:        %.3f s\n"
+        "stitch:      %.3f s (%.1f tiles/s)\n"
+        "write:       %.3f s\n"
+        "total:       %.3f s\n"
+        "output:      %s\n",
+        static_cast<int>(tiles.size()),
+        StitchingEngine::modeName(mode).toUtf8().constData(),
+        cv::getNumThreads(), pano.cols, pano.rows,
+        loadSeconds, stitchSeconds,
+        stitchSeconds > 0 ? tiles.size() / stitchSeconds : 0.0,
+        writeSeconds, totalTimer.nsecsElapsed() / 1e9,
+        output.toUtf8().constData()
+    );
+    if (!report.isEmpty()) {
+        std::printf(
+            "flagged:     %d %s\n",
+            static_cast<int>(report.flaggedTiles().size()),
+            report.summary().toUtf8().constData()
+        );
+    }
+    if (!parser.isSet("serve"))
+        return 0;
+
+    // Serve till the process is ended
+    QString serve = parser.value("serve");
+    int colon = serve.lastIndexOf(':');
+    QHostAddress address(
+        colon > 0 ? serve.left(colon) : QString("127.0.0.1")
+    );
+    quint16 port = static_cast<quint16>(serve.mid(colon + 1).toUInt());
+    TileServer server;
+    server.setPyramid(output);
+    if (isSession)
+        server.setMetadata(session.metadata());
+    QObject::connect(
+        &server, &TileServer::listening, &app,
+        [&app](bool success, const QString &message) {
+            if (success) {
+                std::printf("serving:     %s\n", message.toUtf8().constData());
+                std::fflush(stdout);
+            } else {
+                printError(QString("Cannot serve: %1").arg(message));
+                app.exit(1);
+            }
+        }
+    );
+    server.listen(address, port);
+    return app.exec();
+}
@@ -0,0 +1,524 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "continuousscan.hpp"
+#include "controller.hpp"
+#include "livecamera.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <QtCore/QTimer>
+
+
+// Motion of the firmware: every move starts with 5 rpm of 2048 steps per turn
+// and accelerates to at most 500 steps per second
+static const double START_SPEED = 2048 * 5 / 60.0;
+static const int MAX_SPEED = 500;
+static const double ACCELERATION = 1000;
+
+// Time between two positions of a sweep
+static const int SAMPLE_MS = 10;
+
+// Time to wait for the last frames of a sweep, besides the camera latency
+static const int DRAIN_MS = 100;
+
+// Time to wait before a tile is taken stop-and-go
+static const int SETTLE_MS = 300;
+
+
+ContinuousScan::ContinuousScan(
+        Controller *controller, LiveCamera *camera, QObject *parent)
+    : QObject(parent),
+    controller(controller),
+    camera(camera),
+    columns(1),
+    rows(1),
+    stepsX(0),
+    stepsY(0),
+    speed(static_cast<int>(START_SPEED)),
+    tolerance(0.125),
+    latency(0),
+    exposure(0),
+    pixelsPerStep(0),
+    maxBlur(0),
+    referenceInterval(0),
+    phase(Phase::IDLE),
+    pendingCommand(-1),
+    row(0),
+    direction(1),
+    runUp(0),
+    position(0),
+    positionY(0),
+    sweepStart(0),
+    lastFrameTime(0),
+    candidateColumn(-1),
+    candidateDistance(0),
+    swept(0),
+    retaken(0),
+    referenceNextRow(0)
+{
+    // The controller and the camera run in their own threads, their signals
+    // arrive queued
+    connect(
+        controller, &Controller::commandFinished,
+        this, &ContinuousScan::controllerCommandFinished
+    );
+    connect(
+        controller, &Controller::stagePosition,
+        this, &ContinuousScan::stagePosition
+    );
+    connect(
+        camera, &LiveCamera::liveImageUpdated,
+        this, &ContinuousScan::frameArrived
+    );
+}
+
+ContinuousScan::~ContinuousScan()
+{
+}
+
+void ContinuousScan::setGrid(int columns, int rows)
+{
+    this->columns = std::max(1, columns);
+    this->rows = std::max(1, rows);
+}
+
+void ContinuousScan::setSteps(int stepsX, int stepsY)
+{
+    this->stepsX = std::abs(stepsX);
+    this->stepsY = std::abs(stepsY);
+}
+
+void ContinuousScan::setSpeed(int stepsPerSecond)
+{
+    speed = std::max(1, std::min(stepsPerSecond, MAX_SPEED));
+}
+
+void ContinuousScan::setTolerance(double fraction)
+{
+    tolerance = std::max(0.0, std::min(fraction, 0.5));
+}
+
+void ContinuousScan::setCameraLatency(double ms)
+{
+    latency = static_cast<qint64>(std::max(0.0, ms) * 1000);
+}
+
+void ContinuousScan::setBlurLimit(
+        double exposureMs, double pixelsPerStep, double maxBlur)
+{
+    exposure = std::max(0.0, exposureMs);
+    this->pixelsPerStep = std::max(0.0, pixelsPerStep);
+    this->maxBlur = maxBlur;
+}
+
+void ContinuousScan::setReferenceInterval(int ms)
+{
+    referenceInterval = std::max(0, ms);
+}
+
+void ContinuousScan::start()
+{
+    if (isRunning())
+        return;
+
+    // The sweeps start and end so far outside the grid, that the motor runs
+    // with its full speed over every column
+    runUp = rampSteps(speed) + stepsX / 2;
+    taken.assign(columns * rows, false);
+    missed.clear();
+    swept = 0;
+    retaken = 0;
+    row = 0;
+    position = 0;
+    positionY = 0;
+    controller->reset();
+
+    // The reference is taken at the start, before anything can drift
+    if (referenceInterval > 0) {
+        visitReference(0);
+        return;
+    }
+
+    phase = Phase::RUN_UP;
+    pendingCommand = moveTo(rowStart(0), 0);
+    if (pendingCommand < 0)
+        sweepRow();
+}
+
+void ContinuousScan::referenceCaptured()
+{
+    if (phase != Phase::REFERENCE || pendingCommand >= 0)
+        return;
+    sinceReference.start();
+
+    int next = referenceNextRow;
+    if (next == 0) {
+        phase = Phase::RUN_UP;
+        pendingCommand = moveTo(rowStart(0), 0);
+        if (pendingCommand < 0)
+            sweepRow();
+        return;
+    }
+
+    // Like the move to the next row, which counts the row on arrival
+    row = next - 1;
+    phase = Phase::NEXT_ROW;
+    pendingCommand = moveTo(rowStart(next), next * stepsY);
+    if (pendingCommand < 0) {
+        row++;
+        sweepRow();
+    }
+}
+
+void ContinuousScan::abort()
+{
+    if (isRunning())
+        finish(false);
+}
+
+bool ContinuousScan::isRunning() const
+{
+    return phase != Phase::IDLE;
+}
+
+int ContinuousScan::sweptTiles() const
+{
+    return swept;
+}
+
+cv::Point ContinuousScan::stageSteps() const
+{
+    // A sweep has not moved the position yet
+    if (phase == Phase::SWEEP || phase == Phase::DRAIN) {
+        return cv::Point(
+            sweepStart + direction * ((columns - 1) * stepsX + 2 * runUp),
+            positionY
+        );
+    }
+    return cv::Point(position, positionY);
+}
+
+int ContinuousScan::retakenTiles() const
+{
+    return retaken;
+}
+
+int ContinuousScan::speedFor(int stepsX, double tolerance, double fps,
+        double exposureMs, double pixelsPerStep, double maxBlur)
+{
+    double limit = MAX_SPEED;
+    if (fps > 0)
+        limit = std::min(limit, 2 * tolerance * std::abs(stepsX) * fps);
+    if (maxBlur > 0 && pixelsPerStep > 0 && exposureMs > 0) {
+        limit = std::min(
+            limit, maxBlur / (pixelsPerStep * exposureMs / 1000)
+        );
+    }
+    return std::max(1, static_cast<int>(limit));
+}
+
+int ContinuousScan::rampSteps(int speed)
+{
+    // v² = v0² + 2 a s, like the motion of the firmware
+    if (speed <= START_SPEED)
+        return 0;
+    return static_cast<int>(std::ceil(
+        (static_cast<double>(speed) * speed - START_SPEED * START_SPEED)
+            / (2 * ACCELERATION)
+    ));
+}
+
+void ContinuousScan::controllerCommandFinished(int id, bool success)
+{
+    if (id != pendingCommand || !isRunning())
+        return;
+    pendingCommand = -1;
+
+    if (!success) {
+        finish(false);
+        return;
+    }
+
+    switch (phase) {
+    case Phase::RUN_UP:
+        sweepRow();
+        break;
+    case Phase::SWEEP:
+        // The frames of the end of the sweep are still on their way
+        phase = Phase::DRAIN;
+        QTimer::singleShot(
+            static_cast<int>(latency / 1000) + DRAIN_MS,
+            this, &ContinuousScan::endRow
+        );
+        break;
+    case Phase::NEXT_ROW:
+        row++;
+        sweepRow();
+        break;
+    case Phase::REFERENCE:
+        QTimer::singleShot(
+            static_cast<int>(latency / 1000) + SETTLE_MS,
+            this, &ContinuousScan::settleReference
+        );
+        break;
+    case Phase::RETAKE:
+        QTimer::singleShot(
+            static_cast<int>(latency / 1000) + SETTLE_MS,
+            this, &ContinuousScan::captureRetake
+        );
+        break;
+    default:
+        break;
+    }
+}
+
+void ContinuousScan::stagePosition(
+        qint64 received, quint32 controllerTime, int steps)
+{
+    if (phase != Phase::SWEEP && phase != Phase::DRAIN)
+        return;
+    track.addSample(received, controllerTime, steps);
+    processFrames(false);
+}
+
+void ContinuousScan::frameArrived()
+{
+    if (phase != Phase::SWEEP && phase != Phase::DRAIN)
+        return;
+
+    // Queued signals of frames read meanwhile all see the newest one
+    qint64 time;
+    cv::Mat image = camera->getCurrentImage(time);
+    if (image.empty() || time == lastFrameTime)
+        return;
+    lastFrameTime = time;
+
+    Frame frame;
+    frame.image = image;
+    frame.time = time - latency;
+    frames.push_back(frame);
+    processFrames(false);
+}
+
+void ContinuousScan::endRow()
+{
+    if (phase != Phase::DRAIN)
+        return;
+
+    processFrames(true);
+    if (!isRunning())
+        return;
+    emitCandidate();
+    if (!isRunning())
+        return;
+
+    // Every column without a tile is taken when all rows have been swept
+    for (int i = 0; i < columns; i++) {
+        int x = direction > 0 ? i : columns - 1 - i;
+        if (!taken[row * columns + x])
+            missed.push_back(cv::Point(x, row));
+    }
+
+    track.clear();
+    frames.clear();
+    position = sweepStart + direction * ((columns - 1) * stepsX + 2 * runUp);
+    if (row + 1 < rows && referenceInterval > 0
+            && sinceReference.elapsed() >= referenceInterval) {
+        visitReference(row + 1);
+        return;
+    }
+    if (row + 1 < rows) {
+        phase = Phase::NEXT_ROW;
+        pendingCommand = moveTo(position, positionY + stepsY);
+        if (pendingCommand < 0) {
+            row++;
+            sweepRow();
+        }
+        return;
+    }
+
+    phase = Phase::RETAKE;
+    retakeNext();
+}
+
+void ContinuousScan::captureRetake()
+{
+    if (phase != Phase::RETAKE || missed.empty())
+        return;
+
+    cv::Point cell = missed.front();
+    missed.erase(missed.begin());
+    qint64 time;
+    cv::Mat frame = camera->getCurrentImage(time);
+    if (frame.empty()) {
+        finish(false);
+        return;
+    }
+
+    taken[cell.y * columns + cell.x] = true;
+    retaken++;
+    emit tileCaptured(frame, cell.x, cell.y);
+    if (isRunning())
+        retakeNext();
+}
+
+void ContinuousScan::settleReference()
+{
+    if (phase == Phase::REFERENCE)
+        emit referenceReached();
+}
+
+void ContinuousScan::sweepRow()
+{
+    // Rows alternate their direction, the stage waits behind the first
+    // column of the row
+    direction = row % 2 == 0 ? 1 : -1;
+    sweepStart = position;
+    track.clear();
+    frames.clear();
+    candidate.release();
+    candidateColumn = -1;
+
+    phase = Phase::SWEEP;
+    int length = (columns - 1) * stepsX + 2 * runUp;
+    pendingCommand = controller->sweep(
+        MotorNumber::ONE, -direction * length, speed, SAMPLE_MS
+    );
+}
+
+void ContinuousScan::processFrames(bool drain)
+{
+    while (!frames.empty() && isRunning()) {
+        // Wait for the position after the frame
+        Frame frame = frames.front();
+        if (!drain && frame.time > track.lastTime())
+            return;
+        frames.pop_front();
+
+        double steps;
+        if (!track.positionAt(frame.time, steps))
+            continue;
+
+        // Higher columns need negative steps of the first motor
+        double at = sweepStart - steps;
+        int column = static_cast<int>(std::lround(at / std::max(1, stepsX)));
+        double distance = std::abs(at - column * stepsX);
+        if (column != candidateColumn) {
+            emitCandidate();
+            if (!isRunning())
+                return;
+        }
+
+        if (column < 0 || column >= columns || taken[row * columns + column]
+                || distance > tolerance * stepsX)
+            continue;
+
+        // The blur is the distance moved while exposing
+        if (maxBlur > 0 && pixelsPerStep > 0) {
+            double blur = std::abs(track.speedAt(frame.time)) * exposure
+                / 1000 * pixelsPerStep;
+            if (blur > maxBlur)
+                continue;
+        }
+
+        if (candidateColumn != column || distance < candidateDistance) {
+            candidate = frame.image;
+            candidateColumn = column;
+            candidateDistance = distance;
+        }
+    }
+}
+
+void ContinuousScan::emitCandidate()
+{
+    if (candidateColumn < 0)
+        return;
+
+    int column = candidateColumn;
+    cv::Mat frame = candidate;
+    candidateColumn = -1;
+    candidate.release();
+    taken[row * columns + column] = true;
+    swept++;
+    emit tileCaptured(frame, column, row);
+}
+
+void ContinuousScan::retakeNext()
+{
+    if (missed.empty()) {
+        finish(true);
+        return;
+    }
+
+    cv::Point cell = missed.front();
+    pendingCommand = moveTo(cell.x * stepsX, cell.y * stepsY);
+    if (pendingCommand < 0) {
+        QTimer::singleShot(
+            static_cast<int>(latency / 1000) + SETTLE_MS,
+            this, &ContinuousScan::captureRetake
+        );
+    }
+}
+
+void ContinuousScan::visitReference(int nextRow)
+{
+    // The second motor reverses here, the firmware adds its backlash
+    phase = Phase::REFERENCE;
+    referenceNextRow = nextRow;
+    pendingCommand = moveTo(0, 0);
+    if (pendingCommand < 0) {
+        QTimer::singleShot(
+            static_cast<int>(latency / 1000) + SETTLE_MS,
+            this, &ContinuousScan::settleReference
+        );
+    }
+}
+
+int ContinuousScan::rowStart(int row) const
+{
+    // Rows alternate their direction, every sweep starts behind its first
+    // column
+    return row % 2 == 0 ? -runUp : (columns - 1) * stepsX + runUp;
+}
+
+int ContinuousScan::moveTo(int position, int positionY)
+{
+    // The scan counts the position itself, the sweeps do not end on cells
+    int id = -1;
+    if (position != this->position)
+        id = controller->moveSteps(MotorNumber::ONE, this->position - position);
+    if (positionY != this->positionY)
+        id = controller->moveSteps(MotorNumber::TWO, positionY - this->positionY);
+    this->position = position;
+    this->positionY = positionY;
+    return id;
+}
+
+void ContinuousScan::finish(bool completed)
+{
+    phase = Phase::IDLE;
+    pendingCommand = -1;
+    track.clear();
+    frames.clear();
+    candidate.release();
+    candidateColumn = -1;
+    emit finished(completed);
+}
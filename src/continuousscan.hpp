@@ -0,0 +1,337 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CONTINUOUSSCAN_H
+#define CONTINUOUSSCAN_H
+
+#include <deque>
+#include <vector>
+#include <QtCore/QObject>
+#include <QtCore/QElapsedTimer>
+#include <opencv2/core.hpp>
+
+#include "stagetrack.hpp"
+
+
+class Controller;
+class LiveCamera;
+
+///
+/// \brief Scan that captures the tiles of a row without stopping
+/// Every row is one sweep of the first motor with a constant speed. The
+/// firmware reports the position of the sweep, every camera frame gets the
+/// position of the time it has been exposed. Of the frames near a column
+/// the nearest one becomes its tile, frames with too much motion blur are
+/// rejected. Between the rows the second motor moves one row further, so it
+/// never reverses. Columns without a good frame are taken stop-and-go at the
+/// end. Sweeps need the binary protocol. Between two rows the stage can
+/// return to the first cell to measure its drift.
+///
+class ContinuousScan : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param controller The connected controller
+    /// \param camera The running camera
+    /// \param parent Parent object
+    ///
+    ContinuousScan(Controller *controller, LiveCamera *camera,
+        QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~ContinuousScan() override;
+
+    ///
+    /// \brief Set the grid to scan
+    /// \param columns Number of positions of the first motor
+    /// \param rows Number of positions of the second motor
+    ///
+    void setGrid(int columns, int rows);
+
+    ///
+    /// \brief Set the steps between two cells
+    /// \param stepsX Steps of the first motor
+    /// \param stepsY Steps of the second motor
+    ///
+    void setSteps(int stepsX, int stepsY);
+
+    ///
+    /// \brief Set the speed of the sweeps
+    /// \param stepsPerSecond Speed of the first motor, see speedFor
+    ///
+    void setSpeed(int stepsPerSecond);
+
+    ///
+    /// \brief Set the distance of a frame to its column
+    /// \param fraction Largest distance as part of the steps between columns
+    ///
+    void setTolerance(double fraction);
+
+    ///
+    /// \brief Set the time from the middle of the exposure to the frame
+    /// \param ms Latency of the camera in milliseconds
+    ///
+    void setCameraLatency(double ms);
+
+    ///
+    /// \brief Set the motion blur a tile may have
+    /// \param exposureMs Exposure time of the camera in milliseconds
+    /// \param pixelsPerStep Image motion of one step of the first motor
+    /// \param maxBlur Largest blur in pixels, 0 takes every frame
+    ///
+    void setBlurLimit(double exposureMs, double pixelsPerStep, double maxBlur);
+
+    ///
+    /// \brief Set the time between two visits of the reference cell
+    /// The first cell of the grid is the reference. It is visited before the
+    /// first row and again, when the time has passed, before the next row.
+    /// \param ms Time in milliseconds, 0 for no visits
+    ///
+    void setReferenceInterval(int ms);
+
+    ///
+    /// \brief Start the scan at the current position of the stage
+    /// The stage is at the first cell. The tiles are reported with
+    /// tileCaptured, not in the order of the grid.
+    ///
+    void start();
+
+    ///
+    /// \brief The frame of the reference cell has been captured
+    ///
+    void referenceCaptured();
+
+    ///
+    /// \brief Stop the scan, finished is emitted
+    /// A running sweep cannot be stopped, it ends on its own.
+    ///
+    void abort();
+
+    ///
+    /// \brief Get the info if the scan is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Get the number of tiles taken while moving
+    /// \return Number of tiles
+    ///
+    int sweptTiles() const;
+
+    ///
+    /// \brief Get where the stage is or moves to
+    /// The sweeps end outside of the grid.
+    /// \return Steps of both motors from the first cell, higher columns and
+    /// rows are positive
+    ///
+    cv::Point stageSteps() const;
+
+    ///
+    /// \brief Get the number of tiles taken stop-and-go
+    /// \return Number of tiles
+    ///
+    int retakenTiles() const;
+
+    ///
+    /// \brief Get the fastest sweep for a frame rate and a blur
+    /// Every column needs a frame within the tolerance, so the stage may
+    /// move twice the tolerance per frame. The blur is the distance moved
+    /// while exposing.
+    /// \param stepsX Steps between two columns
+    /// \param tolerance Distance of a frame to its column, see setTolerance
+    /// \param fps Frames per second of the camera
+    /// \param exposureMs Exposure time in milliseconds
+    /// \param pixelsPerStep Image motion of one step, 0 if unknown
+    /// \param maxBlur Largest blur in pixels, 0 for no limit
+    /// \return Speed in steps per second, at least 1
+    ///
+    static int speedFor(int stepsX, double tolerance, double fps,
+        double exposureMs, double pixelsPerStep, double maxBlur);
+
+    ///
+    /// \brief Get the distance to reach a speed and to stop from it
+    /// \param speed Speed in steps per second
+    /// \return Steps the motor accelerates, 0 below the start speed
+    ///
+    static int rampSteps(int speed);
+
+signals:
+    ///
+    /// \brief A tile has been captured
+    /// \param frame The frame, it is not shared with the camera
+    /// \param x Column of the tile
+    /// \param y Row of the tile
+    ///
+    void tileCaptured(const cv::Mat &frame, int x, int y);
+
+    ///
+    /// \brief The stage settled at the reference cell and waits for the
+    /// capture
+    ///
+    void referenceReached();
+
+    ///
+    /// \brief The scan has been finished
+    /// \param completed True if every tile has been taken, false if aborted
+    ///
+    void finished(bool completed);
+
+private slots:
+    ///
+    /// \brief A command of the controller has been finished
+    /// \param id The id of the command
+    /// \param success True if it has been executed, else false
+    ///
+    void controllerCommandFinished(int id, bool success);
+
+    ///
+    /// \brief A sweep reported its position
+    ///
+    void stagePosition(qint64 received, quint32 controllerTime, int steps);
+
+    ///
+    /// \brief The camera has a new frame
+    ///
+    void frameArrived();
+
+    ///
+    /// \brief The last frames of a sweep have arrived
+    ///
+    void endRow();
+
+    ///
+    /// \brief The stage has settled for a tile taken stop-and-go
+    ///
+    void captureRetake();
+
+    ///
+    /// \brief The stage has settled at the reference cell
+    ///
+    void settleReference();
+
+private:
+    ///
+    /// \brief What the scan waits for
+    ///
+    enum class Phase {
+        IDLE, RUN_UP, SWEEP, DRAIN, NEXT_ROW, REFERENCE, RETAKE
+    };
+
+    ///
+    /// \brief Frame of the camera with the time it has been read
+    ///
+    struct Frame {
+        cv::Mat image;
+        qint64 time;
+    };
+
+    ///
+    /// \brief Start the sweep of the current row
+    ///
+    void sweepRow();
+
+    ///
+    /// \brief Assign the frames the positions have arrived for
+    /// \param drain True to drop the frames after the last position
+    ///
+    void processFrames(bool drain);
+
+    ///
+    /// \brief Report the best frame of a column
+    ///
+    void emitCandidate();
+
+    ///
+    /// \brief Move to the next cell without a tile or finish
+    ///
+    void retakeNext();
+
+    ///
+    /// \brief Move to the reference cell
+    /// \param nextRow The row to sweep after the capture
+    ///
+    void visitReference(int nextRow);
+
+    ///
+    /// \brief Get the position the sweep of a row starts at
+    /// \param row The row
+    /// \return Steps of the first motor from the first column
+    ///
+    int rowStart(int row) const;
+
+    ///
+    /// \brief Move the stage
+    /// \param position Target on the first motor, steps from the first column
+    /// \param positionY Target on the second motor, steps from the first row
+    /// \return The id of the last move or -1 without a move
+    ///
+    int moveTo(int position, int positionY);
+
+    ///
+    /// \brief Stop the scan
+    /// \param completed True if every tile has been taken
+    ///
+    void finish(bool completed);
+
+    Controller *controller;
+    LiveCamera *camera;
+    int columns;
+    int rows;
+    int stepsX;
+    int stepsY;
+    int speed;
+    double tolerance;
+    qint64 latency;
+    double exposure;
+    double pixelsPerStep;
+    double maxBlur;
+    int referenceInterval;
+
+    Phase phase;
+    int pendingCommand;
+    int row;
+    int direction;
+    int runUp;
+    int position;
+    int positionY;
+    int sweepStart;
+    StageTrack track;
+    std::deque<Frame> frames;
+    qint64 lastFrameTime;
+
+    int candidateColumn;
+    double candidateDistance;
+    cv::Mat candidate;
+
+    std::vector<bool> taken;
+    std::vector<cv::Point> missed;
+    int swept;
+    int retaken;
+    int referenceNextRow;
+    QElapsedTimer sinceReference;
+};
+
+
+#endif // CONTINUOUSSCAN_H
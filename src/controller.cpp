@@ -18,44 +18,99 @@
 //
 
 #include "controller.hpp"
-#include "mainwin.hpp"
+#include "stagetrack.hpp"
 
 #include <QtSerialPort/QSerialPort>
 #include <QtSerialPort/QSerialPortInfo>
 #include <QtCore/QDebug>
-#include <QtWidgets/QMessageBox>
+#include <QtCore/QStringList>
+#include <QtCore/QTimer>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QFileInfo>
+
+#include <cstdlib>
+#include <algorithm>
+
+
+// Baud rate of the line protocol, every connection starts with it
+static const int LINE_BAUD_RATE = 9600;
+
+// Attempts and time per attempt to switch to the binary protocol. The board
+// resets on opening the port and needs some time for its boot loader.
+static const int NEGOTIATION_ATTEMPTS = 5;
+static const int NEGOTIATION_TIMEOUT_MS = 500;
+
+// Resends of a command that has not been acknowledged
+static const int MAX_RETRIES = 3;
+
+// Speed of the motors (2048 steps per turn at 5 rpm) and the backlash the
+// firmware adds on a change of direction until it gets another one, to know
+// how long a move may take
+static const double MOTOR_STEPS_PER_SECOND = 2048 * 5 / 60.0;
+static const int BACKLASH_STEPS = 1900;
 
 
 Controller::Controller(QObject *parent)
     : QObject(parent),
     portConnected(false),
-    serialPort(new QSerialPort()),
     stepsPerMoveX(0),
     stepsPerMoveY(0),
     maxMovesX(0),
     maxMovesY(0),
     currPosX(0),
     currPosY(0),
-    waiting(false)
+    baudRate(115200),
+    binary(false),
+    negotiating(false),
+    nextSeq(0),
+    lastEventSeq(-1),
+    latency(-1),
+    commandTimeout(500),
+    backlashSteps(BACKLASH_STEPS),
+    nextCommandId(1),
+    busy(false),
+    acknowledged(false),
+    retries(0),
+    currentSeq(0),
+    sentAt(0),
+    serialPort(new QSerialPort(this)),
+    timeoutTimer(new QTimer(this)),
+    frameParser(new FrameParser())
 {
+    timeoutTimer->setSingleShot(true);
+    clock.start();
+
     // Connections
     connect(serialPort, &QSerialPort::readyRead, this, &Controller::readData);
+    connect(
+        timeoutTimer, &QTimer::timeout, this, &Controller::commandTimedOut
+    );
 }
 
 Controller::~Controller()
 {
-    delete serialPort;
+    delete frameParser;
 }
 
-bool Controller::connectPort()
+int Controller::connectPort()
 {
-    // Is the port already open?
-    if (portConnected) {
-        QMessageBox::information(
-            MainWin::instance(), tr("Connect port"),
-            tr("Port is already connected.")
-        );
-        return false;
+    return enqueue(CommandType::CONNECT);
+}
+
+bool Controller::openPort()
+{
+    QString device;
+    int baudRate;
+    {
+        QMutexLocker locker(&mutex);
+        // Is the port already open?
+        if (portConnected) {
+            locker.unlock();
+            setError(tr("Port is already connected."));
+            return false;
+        }
+        device = this->device;
+        baudRate = this->baudRate;
     }
 
     QList<QSerialPortInfo> portInfos = QSerialPortInfo::availablePorts();
@@ -69,94 +124,216 @@ bool Controller::connectPort()
         }
     }
 
-    if (!portFound) {
-        QMessageBox::critical(
-            MainWin::instance(), tr("Connect port"),
-            tr("Port is not available!")
-        );
+    // Devices not listed as serial port (like pseudo terminals of a
+    // simulation) are opened by their path
+    if (portFound) {
+        serialPort->setPort(portInfo);
+    } else if (QFileInfo::exists(device)) {
+        serialPort->setPortName(device);
+    } else {
+        setError(tr("Port is not available!"));
         return false;
     }
-    
-    serialPort->setPort(portInfo);
+
+    serialPort->setBaudRate(LINE_BAUD_RATE);
     if (!serialPort->open(QIODevice::ReadWrite)) {
-        QMessageBox::critical(
-            MainWin::instance(), tr("Connect port"),
-            tr("Cannot open port!")
-        );
+        setError(tr("Cannot open port: %1").arg(serialPort->errorString()));
         return false;
     }
 
-    portConnected = true;
+    {
+        QMutexLocker locker(&mutex);
+        portConnected = true;
+        binary = false;
+        latency = -1;
+        backlashSteps = BACKLASH_STEPS;
+        lastError.clear();
+    }
+    lastEventSeq = -1;
+    cmdBuffer.clear();
+    frameParser->clear();
+
+    if (baudRate > LINE_BAUD_RATE && !negotiateBinary(baudRate)) {
+        qDebug() << "Controller has no binary protocol, using lines";
+    }
 
     return true;
 }
 
+bool Controller::negotiateBinary(int baudRate)
+{
+    // The answer arrives in readData, which switches the protocol
+    negotiating = true;
+    for (int i = 0; i < NEGOTIATION_ATTEMPTS && !isBinary(); i++) {
+        writeLine(QString("BINARY %1").arg(baudRate));
+        QElapsedTimer timer;
+        timer.start();
+        while (!isBinary() && timer.elapsed() < NEGOTIATION_TIMEOUT_MS) {
+            serialPort->waitForReadyRead(
+                NEGOTIATION_TIMEOUT_MS - static_cast<int>(timer.elapsed())
+            );
+        }
+    }
+    negotiating = false;
+
+    // Firmware without the binary protocol took the request as motor
+    // selection, so its state is reset
+    if (!isBinary())
+        writeLine("RESET");
+    return isBinary();
+}
+
+QString Controller::errorString() const
+{
+    QMutexLocker locker(&mutex);
+    return lastError;
+}
+
+void Controller::setError(const QString &message)
+{
+    {
+        QMutexLocker locker(&mutex);
+        lastError = message;
+    }
+    emit error(message);
+}
+
+void Controller::setBaudRate(int baudRate)
+{
+    QMutexLocker locker(&mutex);
+    this->baudRate = baudRate;
+}
+
+bool Controller::isBinary() const
+{
+    QMutexLocker locker(&mutex);
+    return binary;
+}
+
+qint64 Controller::lastLatency() const
+{
+    QMutexLocker locker(&mutex);
+    return latency;
+}
+
+void Controller::setCommandTimeout(int timeoutMs)
+{
+    QMutexLocker locker(&mutex);
+    commandTimeout = timeoutMs;
+}
+
+int Controller::pendingCommands() const
+{
+    QMutexLocker locker(&mutex);
+    return queue.size() + (busy ? 1 : 0);
+}
+
+bool Controller::isConnected() const
+{
+    QMutexLocker locker(&mutex);
+    return portConnected;
+}
+
 void Controller::setMotorIntervall(int stepsPerMoveX, int stepsPerMoveY)
 {
+    QMutexLocker locker(&mutex);
     this->stepsPerMoveX = stepsPerMoveX;
     this->stepsPerMoveY = stepsPerMoveY;
 }
 
-void Controller::moveMotor(Direction direction, MotorNumber motor)
+int Controller::moveMotor(Direction direction, MotorNumber motor)
 {
-    if (!portConnected) {
-        qDebug() << "Port is not connected for a move!";
-        return;
+    int steps;
+    {
+        QMutexLocker locker(&mutex);
+        steps = motor == MotorNumber::ONE ? stepsPerMoveX : stepsPerMoveY;
     }
+    if (direction == Direction::LEFT)
+        steps = -steps;
 
-    waiting = true;
+    return moveSteps(motor, steps);
+}
 
-    switch (motor) {
-    case MotorNumber::ONE:
-        serialPort->write("M1\n");
-        serialPort->waitForBytesWritten();
-        switch (direction) {
-        case Direction::LEFT:
-            serialPort->write(QString("-%1\n").arg(stepsPerMoveX).toLatin1());
-            serialPort->waitForBytesWritten();
-            break;
-        case Direction::RIGHT:
-            serialPort->write(QString("%1\n").arg(stepsPerMoveX).toLatin1());
-            serialPort->waitForBytesWritten();
-            break;
-        default:
-            return;
-        }
-        break;
-    case MotorNumber::TWO:
-        serialPort->write("M2\n");
-        serialPort->waitForBytesWritten();
-        switch (direction) {
-        case Direction::LEFT:
-            serialPort->write(QString("-%1\n").arg(stepsPerMoveY).toLatin1());
-            serialPort->waitForBytesWritten();
-            break;
-        case Direction::RIGHT:
-            serialPort->write(QString("%1\n").arg(stepsPerMoveY).toLatin1());
-            serialPort->waitForBytesWritten();
-            break;
-        default:
-            return;
-        }
-        break;
-    default:
-        return;
+int Controller::moveSteps(MotorNumber motor, int steps)
+{
+    return enqueue(
+        CommandType::MOVE,
+        QVector<int>() << (motor == MotorNumber::ONE ? 1 : 2) << steps
+    );
+}
+
+int Controller::setBacklash(int steps)
+{
+    return enqueue(CommandType::BACKLASH, QVector<int>() << steps);
+}
+
+int Controller::sweep(MotorNumber motor, int steps, int speed, int sampleMs)
+{
+    return enqueue(
+        CommandType::SWEEP,
+        QVector<int>() << (motor == MotorNumber::ONE ? 1 : 2) << steps
+            << speed << sampleMs
+    );
+}
+
+int Controller::backlash() const
+{
+    QMutexLocker locker(&mutex);
+    return backlashSteps;
+}
+
+int Controller::moveDuration(int steps) const
+{
+    QMutexLocker locker(&mutex);
+    return static_cast<int>(
+        (std::abs(steps) + backlashSteps) * 1000 / MOTOR_STEPS_PER_SECOND
+    );
+}
+
+int Controller::runDuration() const
+{
+    if (current.type != CommandType::SWEEP)
+        return moveDuration(current.args.at(1));
+
+    // Slow sweeps run with their speed, fast ones at least with it
+    int speed = std::max(1, current.args.at(2));
+    return static_cast<int>(
+        std::abs(static_cast<qint64>(current.args.at(1))) * 1000 / speed
+    ) + moveDuration(0);
+}
+
+int Controller::disconnectPort()
+{
+    // Commands behind the disconnect would never be executed
+    QList<int> dropped;
+    {
+        QMutexLocker locker(&mutex);
+        while (!queue.isEmpty())
+            dropped.append(queue.dequeue().id);
     }
+    for (int i = 0; i < dropped.size(); i++)
+        emit commandFinished(dropped.at(i), false);
+
+    return enqueue(CommandType::DISCONNECT);
 }
 
-void Controller::disconnectPort()
+void Controller::closePort()
 {
     serialPort->close();
+    QMutexLocker locker(&mutex);
     portConnected = false;
+    binary = false;
 }
 
 void Controller::setDevice(const QString &device)
 {
+    QMutexLocker locker(&mutex);
     this->device = device;
 }
 
 QString Controller::getDevice()
 {
+    QMutexLocker locker(&mutex);
     return device;
 }
 
@@ -170,73 +347,445 @@ QList<QString> Controller::availablePortNames()
     return names;
 }
 
+int Controller::enqueue(CommandType type, const QVector<int> &args)
+{
+    Command command;
+    command.type = type;
+    command.args = args;
+    {
+        QMutexLocker locker(&mutex);
+        command.id = nextCommandId++;
+        queue.enqueue(command);
+    }
+
+    // Runs in the thread of the controller
+    QMetaObject::invokeMethod(this, "processQueue", Qt::QueuedConnection);
+    return command.id;
+}
+
+void Controller::processQueue()
+{
+    {
+        QMutexLocker locker(&mutex);
+        if (busy || queue.isEmpty())
+            return;
+        current = queue.dequeue();
+        busy = true;
+    }
+    acknowledged = false;
+    retries = 0;
+    execute();
+}
+
+void Controller::execute()
+{
+    if (current.type == CommandType::CONNECT) {
+        bool connected = openPort();
+        emit connectionChanged(connected);
+        finishCommand(connected);
+        return;
+    }
+    if (current.type == CommandType::DISCONNECT) {
+        closePort();
+        emit connectionChanged(false);
+        finishCommand(true);
+        return;
+    }
+
+    if (!isConnected()) {
+        setError(tr("Port is not connected!"));
+        finishCommand(false);
+        return;
+    }
+
+    bool binary = isBinary();
+    int timeout;
+    {
+        QMutexLocker locker(&mutex);
+        timeout = commandTimeout;
+    }
+
+    switch (current.type) {
+    case CommandType::MOVE:
+        if (binary) {
+            SerialFrame frame;
+            frame.payload.append(static_cast<char>(current.args.at(0)));
+            frame.appendInt32(current.args.at(1));
+            sendFrame(FrameType::MOVE, frame.payload);
+        } else {
+            // The line protocol has no acknowledge, wait for the move
+            writeLine(current.args.at(0) == 1 ? "M1" : "M2");
+            writeLine(QString::number(current.args.at(1)));
+            timeout += moveDuration(current.args.at(1));
+        }
+        break;
+    case CommandType::SCAN:
+        if (binary) {
+            SerialFrame frame;
+            for (int i = 0; i < current.args.size(); i++)
+                frame.appendInt32(current.args.at(i));
+            sendFrame(FrameType::SCAN, frame.payload);
+        } else {
+            QStringList values;
+            for (int i = 0; i < current.args.size(); i++)
+                values.append(QString::number(current.args.at(i)));
+            writeLine("SCAN");
+            writeLine(values.join(' '));
+        }
+        break;
+    case CommandType::CAPTURED:
+        if (binary)
+            sendFrame(FrameType::CAPTURED);
+        else
+            writeLine("CAPTURED");
+        break;
+    case CommandType::ABORT:
+        if (binary)
+            sendFrame(FrameType::ABORT);
+        else
+            writeLine("ABORT");
+        break;
+    case CommandType::BACKLASH:
+        if (binary) {
+            SerialFrame frame;
+            frame.appendInt32(current.args.at(0));
+            sendFrame(FrameType::BACKLASH, frame.payload);
+        } else {
+            // Firmware with the line protocol only might not know it and
+            // would take it as motor selection
+            qDebug() << "Backlash needs the binary protocol";
+            finishCommand(false);
+            return;
+        }
+        break;
+    case CommandType::SWEEP:
+        if (binary) {
+            SerialFrame frame;
+            frame.payload.append(static_cast<char>(current.args.at(0)));
+            frame.appendInt32(current.args.at(1));
+            frame.appendInt32(current.args.at(2));
+            frame.appendInt32(current.args.at(3));
+            sendFrame(FrameType::SWEEP, frame.payload);
+        } else {
+            // The line protocol is too slow for the positions
+            qDebug() << "Sweep needs the binary protocol";
+            finishCommand(false);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Without acknowledge everything but a move is done, once it is written
+    if (!binary && current.type != CommandType::MOVE) {
+        finishCommand(true);
+        return;
+    }
+    timeoutTimer->start(timeout);
+}
+
+void Controller::finishCommand(bool success)
+{
+    timeoutTimer->stop();
+    int id = current.id;
+    {
+        QMutexLocker locker(&mutex);
+        busy = false;
+    }
+    emit commandFinished(id, success);
+
+    // Not called directly, so a long queue does not recurse
+    QMetaObject::invokeMethod(this, "processQueue", Qt::QueuedConnection);
+}
+
+void Controller::commandTimedOut()
+{
+    if (!busy)
+        return;
+
+    // A frame without acknowledge is sent again, the firmware ignores
+    // repeated sequence numbers
+    if (isBinary() && !acknowledged && retries < MAX_RETRIES) {
+        retries++;
+        qDebug() << "Command" << current.id << "not acknowledged, retry"
+            << retries;
+        sentAt = clock.nsecsElapsed() / 1000;
+        serialPort->write(currentFrame);
+        QMutexLocker locker(&mutex);
+        timeoutTimer->start(commandTimeout);
+        return;
+    }
+
+    setError(tr("The controller does not answer!"));
+    finishCommand(false);
+}
+
 void Controller::readData()
 {
-    QByteArray data = serialPort->readAll();
-    if (!data.contains('\n')) {
-        cmdBuffer.append(data);
+    if (isBinary()) {
+        // Handle every complete frame, there might be more than one per read
+        frameParser->append(serialPort->readAll());
+        SerialFrame frame;
+        while (frameParser->next(frame))
+            handleFrame(frame);
+
+        // Ask for corrupted events again
+        QByteArray corrupted = frameParser->takeCorrupted();
+        for (int i = 0; i < corrupted.size(); i++) {
+            SerialFrame nak;
+            nak.type = FrameType::NAK;
+            nak.seq = static_cast<quint8>(corrupted.at(i));
+            serialPort->write(nak.encode());
+        }
         return;
-    } else {
-        int idx = data.indexOf('\n');
-        cmdBuffer.append(data.left(idx));
-        cmd = QString(cmdBuffer);
-        cmdBuffer.clear();
-        cmdBuffer.append(data.right(data.length()-idx-1));
-        if (cmd == "READY") {
-            waiting = false;
-            qDebug() << cmd;
-            qDebug() << cmdBuffer;
-            cmd.clear();
-            emit ready();
+    }
+
+    // Handle every complete line, there might be more than one per read
+    cmdBuffer.append(serialPort->readAll());
+    int idx = cmdBuffer.indexOf('\n');
+    while (idx >= 0 && !isBinary()) {
+        cmd = QString::fromLatin1(cmdBuffer.left(idx)).trimmed();
+        cmdBuffer.remove(0, idx + 1);
+        handleLine(cmd);
+        idx = cmdBuffer.indexOf('\n');
+    }
+    cmd.clear();
+}
+
+void Controller::handleFrame(const SerialFrame &frame)
+{
+    // Events repeated after a corrupted frame are handled only once
+    bool event = frame.type != FrameType::ACK && frame.type != FrameType::NAK;
+    if (event) {
+        if (frame.seq == lastEventSeq)
+            return;
+        lastEventSeq = frame.seq;
+    }
+
+    switch (frame.type) {
+    case FrameType::ACK:
+        if (busy && !acknowledged && frame.seq == currentSeq) {
+            acknowledged = true;
+            qint64 usecs = clock.nsecsElapsed() / 1000 - sentAt;
+            {
+                QMutexLocker locker(&mutex);
+                latency = usecs;
+            }
+            emit commandAcknowledged(usecs);
+
+            if (current.type == CommandType::BACKLASH) {
+                QMutexLocker locker(&mutex);
+                backlashSteps = current.args.at(0);
+            }
+            if (current.type != CommandType::MOVE
+                    && current.type != CommandType::SWEEP) {
+                finishCommand(true);
+            } else {
+                // Now the move runs, wait for its end
+                int timeout;
+                {
+                    QMutexLocker locker(&mutex);
+                    timeout = commandTimeout;
+                }
+                timeoutTimer->start(timeout + runDuration());
+            }
+        }
+        break;
+    case FrameType::NAK:
+        if (busy && !acknowledged && frame.seq == currentSeq) {
+            if (retries < MAX_RETRIES) {
+                retries++;
+                sentAt = clock.nsecsElapsed() / 1000;
+                serialPort->write(currentFrame);
+            } else {
+                setError(tr("Controller does not receive the commands!"));
+                finishCommand(false);
+            }
         }
+        break;
+    case FrameType::READY:
+        emit ready();
+        if (busy && (current.type == CommandType::MOVE
+                || current.type == CommandType::SWEEP))
+            finishCommand(true);
+        break;
+    case FrameType::AT:
+        emit positionReached(frame.int32At(0), frame.int32At(4));
+        break;
+    case FrameType::DONE:
+        emit scanFinished(true);
+        break;
+    case FrameType::ABORTED:
+        emit scanFinished(false);
+        break;
+    case FrameType::POSITION: {
+        // The frame has been sent before its transfer time: start bit, 8
+        // data bits and stop bit per byte
+        int baudRate;
+        {
+            QMutexLocker locker(&mutex);
+            baudRate = std::max(1, this->baudRate);
+        }
+        qint64 transfer = (frame.payload.size() + 6) * 10 * 1000000LL
+            / baudRate;
+        emit stagePosition(
+            StageTrack::now() - transfer,
+            static_cast<quint32>(frame.int32At(0)), frame.int32At(4)
+        );
+        break;
+    }
+    default:
+        qDebug() << "Unknown frame" << static_cast<int>(frame.type);
+        break;
+    }
+}
+
+void Controller::sendFrame(FrameType type, const QByteArray &payload)
+{
+    SerialFrame frame;
+    frame.type = type;
+    frame.seq = nextSeq++;
+    frame.payload = payload;
+
+    currentSeq = frame.seq;
+    currentFrame = frame.encode();
+    sentAt = clock.nsecsElapsed() / 1000;
+    serialPort->write(currentFrame);
+}
+
+void Controller::handleLine(const QString &line)
+{
+    qDebug() << line;
+
+    if (negotiating && line.startsWith("BINARY ")) {
+        // The firmware switches after this answer, the rest of the buffer
+        // belongs to the old protocol
+        serialPort->setBaudRate(line.mid(7).toInt());
+        cmdBuffer.clear();
+        QMutexLocker locker(&mutex);
+        binary = true;
+    } else if (line == "READY") {
+        emit ready();
+        if (busy && current.type == CommandType::MOVE)
+            finishCommand(true);
+    } else if (line.startsWith("AT ")) {
+        QStringList parts = line.split(' ', QString::SkipEmptyParts);
+        if (parts.size() == 3)
+            emit positionReached(parts.at(1).toInt(), parts.at(2).toInt());
+    } else if (line == "DONE") {
+        emit scanFinished(true);
+    } else if (line == "ABORTED") {
+        emit scanFinished(false);
     }
 }
 
+void Controller::writeLine(const QString &line)
+{
+    serialPort->write(QString("%1\n").arg(line).toLatin1());
+    serialPort->waitForBytesWritten();
+}
+
+int Controller::startScan(
+    int columns, int rows, int dwellMs, bool serpentine, GridOrder order)
+{
+    QVector<int> args;
+    {
+        QMutexLocker locker(&mutex);
+        args << columns << rows << stepsPerMoveX << stepsPerMoveY << dwellMs
+            << (serpentine ? 1 : 0) << (order == GridOrder::ROW_MAJOR ? 1 : 0);
+    }
+    return enqueue(CommandType::SCAN, args);
+}
+
+int Controller::acknowledgeCapture()
+{
+    return enqueue(CommandType::CAPTURED);
+}
+
+int Controller::abortScan()
+{
+    return enqueue(CommandType::ABORT);
+}
+
 void Controller::reset()
 {
+    QMutexLocker locker(&mutex);
     currPosX = 0;
     currPosY = 0;
 }
 
-void Controller::moveToNextPos()
+int Controller::moveToNextPos()
 {
     qDebug() << "Move to next position";
 
-    // Don't send any command, if controller is still waiting
-    if (waiting)
-        return;
-
-    // Switch direction on odd X numbers
-    Direction directionTWO = Direction::RIGHT;
-    if (currPosX % 2 != 0)
-        directionTWO = Direction::LEFT;
+    QPoint next;
+    {
+        QMutexLocker locker(&mutex);
 
-    if (currPosY == maxMovesY && currPosX < maxMovesX) {
-        moveMotor(Direction::LEFT, MotorNumber::ONE);
-        currPosX++;
-        currPosY = 0;
-        return;
-    }
-    if (currPosY < maxMovesY) {
-        moveMotor(directionTWO, MotorNumber::TWO);
-        currPosY++;
-        return;
+        // Switch direction on odd X numbers
+        int directionTWO = currPosX % 2 != 0 ? -1 : 1;
+        int nextY = currPosY + directionTWO;
+        if (nextY >= 0 && nextY <= maxMovesY) {
+            next = QPoint(currPosX, nextY);
+        } else if (currPosX < maxMovesX) {
+            next = QPoint(currPosX + 1, currPosY);
+        } else {
+            // Reached end of positioning
+            return -1;
+        }
     }
-    if (currPosY == maxMovesY && currPosX == maxMovesX) {
-        // Reached end of positioning
-        return;
+    return moveToCell(next);
+}
+
+int Controller::moveToCell(const QPoint &cell)
+{
+    // The positions are counted when the move is queued, so a move can be
+    // queued while the last one is still running. Like the scan of the
+    // firmware, higher columns move the first motor backwards.
+    int stepsM1;
+    int stepsM2;
+    {
+        QMutexLocker locker(&mutex);
+        stepsM1 = -(cell.x() - currPosX) * stepsPerMoveX;
+        stepsM2 = (cell.y() - currPosY) * stepsPerMoveY;
+        currPosX = cell.x();
+        currPosY = cell.y();
     }
+
+    int id = -1;
+    if (stepsM1 != 0)
+        id = moveSteps(MotorNumber::ONE, stepsM1);
+    if (stepsM2 != 0)
+        id = moveSteps(MotorNumber::TWO, stepsM2);
+    return id;
 }
 
 bool Controller::hasReachedPosEnd()
 {
-    if (currPosX == maxMovesX && currPosY == maxMovesY)
+    QMutexLocker locker(&mutex);
+    // The last column runs backwards, if it is an odd one
+    int lastY = maxMovesX % 2 != 0 ? 0 : maxMovesY;
+    if (currPosX == maxMovesX && currPosY == lastY)
         return true;
     return false;
 }
 
 void Controller::setMaxMoves(int maxMovesX, int maxMovesY)
 {
+    QMutexLocker locker(&mutex);
     this->maxMovesX = maxMovesX;
     this->maxMovesY = maxMovesY;
 }
+
+QPoint Controller::maxMoves() const
+{
+    QMutexLocker locker(&mutex);
+    return QPoint(maxMovesX, maxMovesY);
+}
+
+QPoint Controller::currentCell() const
+{
+    QMutexLocker locker(&mutex);
+    return QPoint(currPosX, currPosY);
+}
@@ -21,15 +21,29 @@
 #define CONTROLLER_H
 
 #include <QtCore/QObject>
+#include <QtCore/QPoint>
+#include <QtCore/QQueue>
+#include <QtCore/QVector>
+#include <QtCore/QMutex>
+#include <QtCore/QElapsedTimer>
+
+#include "serialframe.hpp"
+#include "tilegrid.hpp"
 
 
 class QSerialPort;
+class QTimer;
 
 enum class Direction { LEFT, RIGHT };
 enum class MotorNumber { ONE, TWO };
 
 /**
  * Class for working with the microscope controller
+ *
+ * The controller is meant to live in its own thread (see moveToThread). All
+ * commands can be called from any thread, they are put into a queue and
+ * executed one after another in the thread of the controller. Every command
+ * gets an id, its result is reported with commandFinished.
  */
 class Controller : public QObject
 {
@@ -48,13 +62,30 @@ public:
 
     /**
      * Connect to controller
+     * The result is reported with connectionChanged and commandFinished, see
+     * errorString for the reason of a failure.
+     * @return The id of the command
+     */
+    int connectPort();
+
+    /**
+     * Get the description of the last error
+     * @return The error message
      */
-    bool connectPort();
+    QString errorString() const;
 
     /**
      * Disconnect the port if it is connected
+     * All queued commands are dropped.
+     * @return The id of the command
      */
-    void disconnectPort();
+    int disconnectPort();
+
+    /**
+     * Get the info if the port is connected
+     * @return True if connected, else false
+     */
+    bool isConnected() const;
 
     /**
      * Set the device path
@@ -68,6 +99,41 @@ public:
      */
     QString getDevice();
 
+    /**
+     * Set the baud rate for the binary protocol
+     * The connection starts with the line protocol at 9600 baud. If the
+     * firmware knows the binary protocol, both switch to it and this rate.
+     * @param baudRate The baud rate, 9600 or less keeps the line protocol
+     */
+    void setBaudRate(int baudRate);
+
+    /**
+     * Get the info if the binary protocol is in use
+     * @return True for the binary protocol, false for the line protocol
+     */
+    bool isBinary() const;
+
+    /**
+     * Get the round trip time of the last acknowledged command
+     * Only the binary protocol acknowledges every command.
+     * @return The latency in microseconds or -1 if unknown
+     */
+    qint64 lastLatency() const;
+
+    /**
+     * Set the time to wait for the acknowledge of a command
+     * Commands without acknowledge are sent again a few times, before they
+     * fail. Moves additionally wait for their end, depending on the steps.
+     * @param timeoutMs Timeout in milliseconds
+     */
+    void setCommandTimeout(int timeoutMs);
+
+    /**
+     * Get the number of commands waiting or running
+     * @return Number of commands
+     */
+    int pendingCommands() const;
+
     /**
      * Get a list of available port names
      * @return A list ov available port names as strings
@@ -78,8 +144,50 @@ public:
      * Move motor for one intervall
      * @param direction LEFT or RIGHT
      * @param motor THe motor number to move
+     * @return The id of the command
+     */
+    int moveMotor(Direction direction, MotorNumber motor);
+
+    /**
+     * Move a motor by a number of steps
+     * The firmware adds the backlash of the second motor when its direction
+     * changes.
+     * @param motor The motor number to move
+     * @param steps Steps to move, negative for the other direction
+     * @return The id of the command
+     */
+    int moveSteps(MotorNumber motor, int steps);
+
+    /**
+     * Set the backlash the firmware adds on a change of direction of the
+     * second motor
+     * The firmware forgets it on every reset, so it has to be sent after
+     * every connect. Only the binary protocol knows this command, with the
+     * line protocol it fails without sending anything.
+     * @param steps The backlash in steps
+     * @return The id of the command
      */
-    void moveMotor(Direction direction, MotorNumber motor);
+    int setBacklash(int steps);
+
+    /**
+     * Move a motor with a constant speed and report its position
+     * While the motor runs, the firmware sends its position with its time
+     * every sampleMs, see stagePosition. Faster sweeps than the start speed
+     * of the motors accelerate first. Only the binary protocol knows this
+     * command, with the line protocol it fails without sending anything.
+     * @param motor The motor number to move
+     * @param steps Steps to move, negative for the other direction
+     * @param speed Speed in steps per second
+     * @param sampleMs Time between two positions in milliseconds
+     * @return The id of the command
+     */
+    int sweep(MotorNumber motor, int steps, int speed, int sampleMs = 10);
+
+    /**
+     * Get the backlash the firmware uses
+     * @return The backlash of the second motor in steps
+     */
+    int backlash() const;
 
     /**
      * Set the motor intervall for every move
@@ -95,8 +203,20 @@ public:
 
     /**
      * Move to the next position
+     * The positions run column by column, the second motor backwards on
+     * every odd column. The move is queued behind the running one.
+     * @return The id of the command or -1 if the end has been reached
+     */
+    int moveToNextPos();
+
+    /**
+     * Move to a grid cell
+     * The cell is counted when the move is queued, so further moves can be
+     * queued behind it. Both motors are moved one after another.
+     * @param cell The cell with x for the first and y for the second motor
+     * @return The id of the last command or -1 if the stage is already there
      */
-    void moveToNextPos();
+    int moveToCell(const QPoint &cell);
 
     /**
      * Has reached position end
@@ -111,6 +231,47 @@ public:
      */
     void setMaxMoves(int maxMovesX, int maxMovesY);
 
+    /**
+     * Get the maximum allowed moves per axis
+     * @return Maximum moves with x for the first and y for the second motor
+     */
+    QPoint maxMoves() const;
+
+    /**
+     * Get the grid cell of the current position
+     * Neighbouring cells are neighbouring positions on the stage.
+     * @return The cell with x for the first and y for the second motor
+     */
+    QPoint currentCell() const;
+
+    /**
+     * Upload a whole scan plan and start it
+     * The firmware runs the plan on its own and reports every position with
+     * positionReached. It waits there for acknowledgeCapture or the dwell
+     * time.
+     * @param columns Number of positions of the first motor
+     * @param rows Number of positions of the second motor
+     * @param dwellMs Time to wait at every position, 0 waits for the host
+     * @param serpentine True to reverse the inner axis on every line
+     * @param order COLUMN_MAJOR runs the second motor along a column,
+     * ROW_MAJOR the first motor along a row
+     * @return The id of the command
+     */
+    int startScan(int columns, int rows, int dwellMs = 0,
+        bool serpentine = true, GridOrder order = GridOrder::COLUMN_MAJOR);
+
+    /**
+     * The tile of the current scan position has been captured
+     * @return The id of the command
+     */
+    int acknowledgeCapture();
+
+    /**
+     * Abort the running scan
+     * @return The id of the command
+     */
+    int abortScan();
+
 public slots:
     /**
      * Read data
@@ -123,7 +284,163 @@ signals:
      */
     void ready();
 
+    /**
+     * An error occured
+     * @param message Description of the error
+     */
+    void error(const QString &message);
+
+    /**
+     * The scan reached a position and waits for the capture
+     * @param x Column of the position
+     * @param y Row of the position
+     */
+    void positionReached(int x, int y);
+
+    /**
+     * The scan has been finished
+     * @param completed True if all positions were visited, false if aborted
+     */
+    void scanFinished(bool completed);
+
+    /**
+     * A sweep reported its position
+     * @param received Time the position has been sent, in the clock of
+     * StageTrack::now
+     * @param controllerTime Time of the position in the clock of the
+     * firmware in microseconds, it wraps after about 71 minutes
+     * @param steps Steps of the sweep done
+     */
+    void stagePosition(qint64 received, quint32 controllerTime, int steps);
+
+    /**
+     * A command has been acknowledged by the controller
+     * @param latency Round trip time in microseconds
+     */
+    void commandAcknowledged(qint64 latency);
+
+    /**
+     * A queued command has been finished
+     * @param id The id of the command
+     * @param success True if it has been executed, else false
+     */
+    void commandFinished(int id, bool success);
+
+    /**
+     * The port has been connected or disconnected
+     * @param connected True if connected, else false
+     */
+    void connectionChanged(bool connected);
+
+private slots:
+    /**
+     * Start the next queued command, if none is running
+     */
+    void processQueue();
+
+    /**
+     * The running command has not been answered in time
+     */
+    void commandTimedOut();
+
 private:
+    /**
+     * Commands of the queue
+     */
+    enum class CommandType {
+        CONNECT, DISCONNECT, MOVE, SCAN, CAPTURED, ABORT, BACKLASH, SWEEP
+    };
+
+    /**
+     * A queued command with its parameters
+     */
+    struct Command {
+        int id;
+        CommandType type;
+        QVector<int> args;
+    };
+
+    /**
+     * Put a command into the queue
+     * @param type The command
+     * @param args The parameters
+     * @return The id of the command
+     */
+    int enqueue(CommandType type, const QVector<int> &args = QVector<int>());
+
+    /**
+     * Execute the running command
+     */
+    void execute();
+
+    /**
+     * Finish the running command and start the next one
+     * @param success True if it has been executed, else false
+     */
+    void finishCommand(bool success);
+
+    /**
+     * Open the port and negotiate the protocol
+     * @return True if connected, else false
+     */
+    bool openPort();
+
+    /**
+     * Close the port and drop all queued commands
+     */
+    void closePort();
+
+    /**
+     * Get the time a move may take
+     * @param steps The steps of the move
+     * @return The time in milliseconds, without the command timeout
+     */
+    int moveDuration(int steps) const;
+
+    /**
+     * Get the time the running move or sweep may take
+     * @return The time in milliseconds, without the command timeout
+     */
+    int runDuration() const;
+
+    /**
+     * Ask the firmware to switch to the binary protocol
+     * @param baudRate The baud rate of the binary protocol
+     * @return True if it has switched, else false
+     */
+    bool negotiateBinary(int baudRate);
+
+    /**
+     * Handle one frame received from the controller
+     * @param frame The frame
+     */
+    void handleFrame(const SerialFrame &frame);
+
+    /**
+     * Send the frame of the running command
+     * @param type The command
+     * @param payload The parameters of the command
+     */
+    void sendFrame(FrameType type, const QByteArray &payload = QByteArray());
+
+    /**
+     * Handle one line received from the controller
+     * @param line The line without newline
+     */
+    void handleLine(const QString &line);
+
+    /**
+     * Write one command line to the controller
+     * @param line The line without newline
+     */
+    void writeLine(const QString &line);
+
+    /**
+     * Remember the error and emit it
+     * @param message Description of the error
+     */
+    void setError(const QString &message);
+
     QString device;
     bool portConnected;
     int stepsPerMoveX;
@@ -132,11 +449,33 @@ private:
     int maxMovesY;
     int currPosX;
     int currPosY;
-    bool waiting;
+    int baudRate;
+    bool binary;
+    bool negotiating;
+    quint8 nextSeq;
+    int lastEventSeq;
+    qint64 latency;
+    int commandTimeout;
+    int backlashSteps;
+
+    int nextCommandId;
+    QQueue<Command> queue;
+    Command current;
+    bool busy;
+    bool acknowledged;
+    int retries;
+    QByteArray currentFrame;
+    quint8 currentSeq;
+    qint64 sentAt;
 
     QSerialPort *serialPort;
+    QTimer *timeoutTimer;
+    FrameParser *frameParser;
+    QElapsedTimer clock;
     QByteArray cmdBuffer;
     QString cmd;
+    QString lastError;
+    mutable QMutex mutex;
 };
 
 
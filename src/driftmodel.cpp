@@ -0,0 +1,198 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "driftmodel.hpp"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+
+// Scale of the frames for registration, the drift is small
+static const double REGISTRATION_SCALE = 0.5;
+
+// Least correlation of a registered frame
+static const double MIN_CONFIDENCE = 0.3;
+
+
+DriftModel::DriftModel()
+{
+}
+
+DriftModel::~DriftModel()
+{
+}
+
+void DriftModel::clear()
+{
+    reference.release();
+    measures.clear();
+}
+
+void DriftModel::setReference(const cv::Mat &frame)
+{
+    reference = prepare(frame);
+}
+
+bool DriftModel::hasReference() const
+{
+    return !reference.empty();
+}
+
+bool DriftModel::measure(const cv::Mat &frame, qint64 time, cv::Point2d &drift)
+{
+    cv::Mat current = prepare(frame);
+    if (reference.empty() || current.size() != reference.size())
+        return false;
+
+    cv::Mat window;
+    cv::createHanningWindow(window, reference.size(), CV_32F);
+    cv::Point2d shift = cv::phaseCorrelate(reference, current, window);
+
+    // Both signs are checked by correlating the overlap they imply, the
+    // drift is less than half a frame
+    double best = -1;
+    cv::Point2d offset;
+    cv::Rect full(cv::Point(), reference.size());
+    for (int sign = -1; sign <= 1; sign += 2) {
+        cv::Point2d candidate = sign * shift;
+        cv::Point rounded(cvRound(candidate.x), cvRound(candidate.y));
+        cv::Rect overlap = full & cv::Rect(rounded, full.size());
+        if (overlap.area() < full.area() / 4)
+            continue;
+
+        cv::Scalar meanA;
+        cv::Scalar stdA;
+        cv::Scalar meanB;
+        cv::Scalar stdB;
+        cv::Mat a = reference(overlap);
+        cv::Mat b = current(overlap - rounded);
+        cv::meanStdDev(a, meanA, stdA);
+        cv::meanStdDev(b, meanB, stdB);
+        if (stdA[0] < 1e-3 || stdB[0] < 1e-3)
+            continue;
+        cv::Mat da = a - meanA[0];
+        cv::Mat db = b - meanB[0];
+        double ncc = da.dot(db) / static_cast<double>(a.total())
+            / (stdA[0] * stdB[0]);
+        if (ncc > best) {
+            best = ncc;
+            offset = candidate;
+        }
+    }
+    if (best < MIN_CONFIDENCE)
+        return false;
+
+    // The frame lies at the offset, its content moved the other way
+    drift = -offset / REGISTRATION_SCALE;
+    addSample(time, drift);
+    return true;
+}
+
+void DriftModel::addSample(qint64 time, cv::Point2d drift)
+{
+    Sample sample;
+    sample.time = time;
+    sample.drift = drift;
+    auto after = std::upper_bound(
+        measures.begin(), measures.end(), time,
+        [](qint64 time, const Sample &sample) { return time < sample.time; }
+    );
+    measures.insert(after, sample);
+}
+
+bool DriftModel::isEmpty() const
+{
+    return measures.empty();
+}
+
+const std::vector<DriftModel::Sample>& DriftModel::samples() const
+{
+    return measures;
+}
+
+cv::Point2d DriftModel::driftAt(qint64 time) const
+{
+    if (measures.empty() || time < measures.front().time)
+        return cv::Point2d();
+    if (time >= measures.back().time)
+        return measures.back().drift;
+
+    auto after = std::upper_bound(
+        measures.begin(), measures.end(), time,
+        [](qint64 time, const Sample &sample) { return time < sample.time; }
+    );
+    const Sample &a = *(after - 1);
+    const Sample &b = *after;
+    double t = static_cast<double>(time - a.time) / (b.time - a.time);
+    return a.drift + t * (b.drift - a.drift);
+}
+
+std::vector<cv::Point2d> DriftModel::tileShifts(
+    const std::vector<qint64> &times) const
+{
+    std::vector<cv::Point2d> shifts;
+    for (size_t i = 0; i < times.size(); i++)
+        shifts.push_back(times[i] >= 0 ? -driftAt(times[i]) : cv::Point2d());
+    return shifts;
+}
+
+QJsonArray DriftModel::toJson() const
+{
+    QJsonArray samples;
+    for (size_t i = 0; i < measures.size(); i++) {
+        const Sample &sample = measures[i];
+        samples.append(QJsonArray({
+            static_cast<double>(sample.time), sample.drift.x, sample.drift.y
+        }));
+    }
+    return samples;
+}
+
+void DriftModel::addJson(const QJsonArray &samples)
+{
+    for (int i = 0; i < samples.size(); i++) {
+        QJsonArray sample = samples.at(i).toArray();
+        if (sample.size() != 3)
+            continue;
+        addSample(
+            static_cast<qint64>(sample.at(0).toDouble()),
+            cv::Point2d(sample.at(1).toDouble(), sample.at(2).toDouble())
+        );
+    }
+}
+
+cv::Mat DriftModel::prepare(const cv::Mat &frame)
+{
+    if (frame.empty())
+        return cv::Mat();
+
+    cv::Mat gray;
+    if (frame.channels() == 3)
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = frame;
+    cv::Mat small;
+    cv::resize(
+        gray, small, cv::Size(), REGISTRATION_SCALE, REGISTRATION_SCALE,
+        cv::INTER_AREA
+    );
+    cv::Mat result;
+    small.convertTo(result, CV_32F);
+    return result;
+}
@@ -0,0 +1,141 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef DRIFTMODEL_H
+#define DRIFTMODEL_H
+
+#include <vector>
+#include <QtCore/QtGlobal>
+#include <QtCore/QJsonArray>
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Drift of the stage over the time of a scan
+/// The scan returns to a reference position every now and then. The frame
+/// taken there is registered against the one of the start, the shift of the
+/// image is the drift. Between two measures the drift is interpolated
+/// linearly, after the last one it is kept.
+///
+class DriftModel
+{
+public:
+    ///
+    /// \brief Drift measured at a time
+    ///
+    struct Sample {
+        qint64 time;
+        cv::Point2d drift;
+    };
+
+    ///
+    /// \brief Constructor
+    ///
+    DriftModel();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~DriftModel();
+
+    ///
+    /// \brief Forget the reference and all measures
+    ///
+    void clear();
+
+    ///
+    /// \brief Set the frame of the reference position without any drift
+    /// \param frame The frame
+    ///
+    void setReference(const cv::Mat &frame);
+
+    ///
+    /// \brief Get the info if there is a reference
+    /// \return True if set, else false
+    ///
+    bool hasReference() const;
+
+    ///
+    /// \brief Measure the drift with a new frame of the reference position
+    /// The measure is added, if the frame has been registered.
+    /// \param frame The frame
+    /// \param time Time of the frame in milliseconds
+    /// \param drift Shift of the image against the reference in pixels
+    /// \return True if registered, else false
+    ///
+    bool measure(const cv::Mat &frame, qint64 time, cv::Point2d &drift);
+
+    ///
+    /// \brief Add a measure
+    /// \param time Time in milliseconds, measures are sorted by it
+    /// \param drift Shift of the image in pixels
+    ///
+    void addSample(qint64 time, cv::Point2d drift);
+
+    ///
+    /// \brief Get the info if there are no measures
+    /// \return True if empty, else false
+    ///
+    bool isEmpty() const;
+
+    ///
+    /// \brief Get the measures
+    /// \return The measures in the order of time
+    ///
+    const std::vector<Sample>& samples() const;
+
+    ///
+    /// \brief Get the drift at a time
+    /// \param time Time in milliseconds
+    /// \return Shift of the image in pixels, before the first measure none
+    ///
+    cv::Point2d driftAt(qint64 time) const;
+
+    ///
+    /// \brief Get the shift of tiles from their grid positions
+    /// The content of the image moves with the drift, the tile the other way.
+    /// \param times Time of every tile in milliseconds, -1 if unknown
+    /// \return Shift of every tile in pixels, none for an unknown time
+    ///
+    std::vector<cv::Point2d> tileShifts(const std::vector<qint64> &times) const;
+
+    ///
+    /// \brief Get the measures as json
+    /// \return One array [time, x, y] per measure
+    ///
+    QJsonArray toJson() const;
+
+    ///
+    /// \brief Add the measures of json
+    /// \param samples The measures, see toJson
+    ///
+    void addJson(const QJsonArray &samples);
+
+private:
+    ///
+    /// \brief Gray copy of a frame at the registration scale
+    ///
+    static cv::Mat prepare(const cv::Mat &frame);
+
+    cv::Mat reference;
+    std::vector<Sample> measures;
+};
+
+
+#endif // DRIFTMODEL_H
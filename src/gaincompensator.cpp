@@ -0,0 +1,222 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "gaincompensator.hpp"
+
+#include <opencv2/core.hpp>
+
+
+// Weights of the error function. These are the same as the ones used by the
+// gain compensator of opencv: standard deviation of the normalized intensity
+// errors (10) and of the gains (0.1).
+static const double ALPHA = 1.0 / (10.0 * 10.0);
+static const double BETA = 1.0 / (0.1 * 0.1);
+
+GainCompensator::GainCompensator()
+    : sampleStep(4)
+{
+}
+
+GainCompensator::~GainCompensator()
+{
+}
+
+void GainCompensator::setSampleStep(int step)
+{
+    sampleStep = step < 1 ? 1 : step;
+}
+
+double GainCompensator::gain(int index) const
+{
+    if (index < 0 || index >= static_cast<int>(tileGains.size()))
+        return 1.0;
+    return tileGains[index];
+}
+
+std::vector<double> GainCompensator::gains() const
+{
+    return tileGains;
+}
+
+void GainCompensator::computeGains(
+    const std::vector<cv::Point> &corners, const std::vector<cv::Mat> &images)
+{
+    CV_Assert(corners.size() == images.size());
+
+    int numTiles = static_cast<int>(images.size());
+    std::vector<Overlap> overlaps;
+    cv::Mat noMask;
+
+    // Only rectangles of neighbouring tiles intersect, so the pair test is
+    // cheap compared to looking at any pixel.
+    for (int i = 0; i < numTiles; i++) {
+        cv::Rect rectI(corners[i], images[i].size());
+        for (int j = i + 1; j < numTiles; j++) {
+            cv::Rect rectJ(corners[j], images[j].size());
+            if ((rectI & rectJ).area() <= 0)
+                continue;
+
+            Overlap overlap;
+            overlap.i = i;
+            overlap.j = j;
+            if (overlapMeans(
+                    images[i], noMask, corners[i],
+                    images[j], noMask, corners[j], overlap))
+                overlaps.push_back(overlap);
+        }
+    }
+
+    solve(numTiles, overlaps);
+}
+
+void GainCompensator::feed(
+    const std::vector<cv::Point> &corners,
+    const std::vector<cv::UMat> &images,
+    const std::vector<std::pair<cv::UMat, uchar>> &masks)
+{
+    CV_Assert(corners.size() == images.size());
+    CV_Assert(images.size() == masks.size());
+
+    int numTiles = static_cast<int>(images.size());
+    std::vector<cv::Mat> imgs(numTiles);
+    std::vector<cv::Mat> msks(numTiles);
+    for (int i = 0; i < numTiles; i++) {
+        imgs[i] = images[i].getMat(cv::ACCESS_READ);
+        msks[i] = masks[i].first.getMat(cv::ACCESS_READ);
+    }
+
+    std::vector<Overlap> overlaps;
+    for (int i = 0; i < numTiles; i++) {
+        cv::Rect rectI(corners[i], imgs[i].size());
+        for (int j = i + 1; j < numTiles; j++) {
+            cv::Rect rectJ(corners[j], imgs[j].size());
+            if ((rectI & rectJ).area() <= 0)
+                continue;
+
+            Overlap overlap;
+            overlap.i = i;
+            overlap.j = j;
+            if (overlapMeans(
+                    imgs[i], msks[i], corners[i],
+                    imgs[j], msks[j], corners[j], overlap))
+                overlaps.push_back(overlap);
+        }
+    }
+
+    solve(numTiles, overlaps);
+}
+
+void GainCompensator::apply(
+    int index, cv::Point, cv::InputOutputArray image, cv::InputArray)
+{
+    double g = gain(index);
+    if (g == 1.0)
+        return;
+    cv::multiply(image, cv::Scalar::all(g), image);
+}
+
+bool GainCompensator::overlapMeans(
+    const cv::Mat &imageI, const cv::Mat &maskI, cv::Point cornerI,
+    const cv::Mat &imageJ, const cv::Mat &maskJ, cv::Point cornerJ,
+    Overlap &overlap) const
+{
+    CV_Assert(imageI.depth() == CV_8U && imageJ.depth() == CV_8U);
+    CV_Assert(imageI.channels() == imageJ.channels());
+
+    cv::Rect rect = cv::Rect(cornerI, imageI.size())
+        & cv::Rect(cornerJ, imageJ.size());
+    int channels = imageI.channels();
+    double sumI = 0;
+    double sumJ = 0;
+    double count = 0;
+
+    for (int y = rect.y; y < rect.br().y; y += sampleStep) {
+        const uchar *rowI = imageI.ptr<uchar>(y - cornerI.y);
+        const uchar *rowJ = imageJ.ptr<uchar>(y - cornerJ.y);
+        const uchar *rowMaskI = maskI.empty()
+            ? nullptr : maskI.ptr<uchar>(y - cornerI.y);
+        const uchar *rowMaskJ = maskJ.empty()
+            ? nullptr : maskJ.ptr<uchar>(y - cornerJ.y);
+
+        for (int x = rect.x; x < rect.br().x; x += sampleStep) {
+            int xI = x - cornerI.x;
+            int xJ = x - cornerJ.x;
+            if (rowMaskI != nullptr && rowMaskI[xI] == 0)
+                continue;
+            if (rowMaskJ != nullptr && rowMaskJ[xJ] == 0)
+                continue;
+
+            const uchar *pixI = rowI + xI * channels;
+            const uchar *pixJ = rowJ + xJ * channels;
+            int valueI = 0;
+            int valueJ = 0;
+            for (int c = 0; c < channels; c++) {
+                valueI += pixI[c];
+                valueJ += pixJ[c];
+            }
+            sumI += valueI;
+            sumJ += valueJ;
+            count++;
+        }
+    }
+
+    if (count <= 0)
+        return false;
+
+    overlap.meanI = sumI / (count * channels);
+    overlap.meanJ = sumJ / (count * channels);
+    overlap.count = count;
+    return true;
+}
+
+void GainCompensator::solve(int numTiles, const std::vector<Overlap> &overlaps)
+{
+    tileGains.assign(numTiles, 1.0);
+    if (numTiles < 2 || overlaps.empty())
+        return;
+
+    // Normal equations of
+    //   sum N_ij * (ALPHA * (g_i * I_ij - g_j * I_ji)^2 + BETA * (1 - g_i)^2)
+    // The small prior on every tile keeps the system positive definite even
+    // for tiles without any overlap.
+    cv::Mat_<double> A(numTiles, numTiles, 0.0);
+    cv::Mat_<double> b(numTiles, 1, 0.0);
+    for (int i = 0; i < numTiles; i++) {
+        A(i, i) = BETA;
+        b(i) = BETA;
+    }
+
+    for (size_t k = 0; k < overlaps.size(); k++) {
+        const Overlap &o = overlaps[k];
+        double n = o.count;
+
+        A(o.i, o.i) += n * (2 * ALPHA * o.meanI * o.meanI + BETA);
+        A(o.j, o.j) += n * (2 * ALPHA * o.meanJ * o.meanJ + BETA);
+        A(o.i, o.j) -= n * 2 * ALPHA * o.meanI * o.meanJ;
+        A(o.j, o.i) -= n * 2 * ALPHA * o.meanI * o.meanJ;
+        b(o.i) += n * BETA;
+        b(o.j) += n * BETA;
+    }
+
+    cv::Mat_<double> g;
+    if (!cv::solve(A, b, g, cv::DECOMP_CHOLESKY))
+        return;
+    for (int i = 0; i < numTiles; i++)
+        tileGains[i] = g(i);
+}
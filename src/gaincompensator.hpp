@@ -0,0 +1,126 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef GAINCOMPENSATOR_H
+#define GAINCOMPENSATOR_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/stitching/detail/exposure_compensate.hpp>
+
+
+///
+/// \brief Lightweight per tile gain compensation
+/// The camera runs with auto exposure, so neighboring tiles differ in
+/// brightness. Only the overlapping rectangles of the tiles are looked at
+/// (sparsely sampled) and all gains are calculated with one linear solve. The
+/// class can be used directly with the known tile arrangement or as exposure
+/// compensator of cv::Stitcher.
+///
+class GainCompensator : public cv::detail::ExposureCompensator
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    GainCompensator();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~GainCompensator() override;
+
+    ///
+    /// \brief Calculate the gains from the known tile arrangement
+    /// \param corners Top left position of every tile in the mosaic
+    /// \param images The tiles (CV_8UC1 or CV_8UC3)
+    ///
+    void computeGains(
+        const std::vector<cv::Point> &corners,
+        const std::vector<cv::Mat> &images);
+
+    ///
+    /// \brief Override from cv::detail::ExposureCompensator
+    ///
+    virtual void feed(
+        const std::vector<cv::Point> &corners,
+        const std::vector<cv::UMat> &images,
+        const std::vector<std::pair<cv::UMat, uchar>> &masks) override;
+
+    ///
+    /// \brief Override from cv::detail::ExposureCompensator
+    /// The gain is multiplied in place while the tile is being composed.
+    ///
+    virtual void apply(
+        int index, cv::Point corner, cv::InputOutputArray image,
+        cv::InputArray mask) override;
+
+    ///
+    /// \brief Get the gain of one tile
+    /// \param index Index of the tile
+    /// \return The gain or 1.0 if no gain has been calculated for the index
+    ///
+    double gain(int index) const;
+
+    ///
+    /// \brief Get all calculated gains
+    /// \return The gains in order of the tiles
+    ///
+    std::vector<double> gains() const;
+
+    ///
+    /// \brief Set the sample distance in the overlap areas
+    /// \param step Use every step-th row and column for the statistics
+    ///
+    void setSampleStep(int step);
+
+private:
+    ///
+    /// \brief Statistics of one overlapping pair of tiles
+    ///
+    struct Overlap {
+        int i;
+        int j;
+        double meanI;
+        double meanJ;
+        double count;
+    };
+
+    ///
+    /// \brief Mean intensities of two tiles in their overlap rectangle
+    /// \return False if there are no valid pixels in the overlap
+    ///
+    bool overlapMeans(
+        const cv::Mat &imageI, const cv::Mat &maskI, cv::Point cornerI,
+        const cv::Mat &imageJ, const cv::Mat &maskJ, cv::Point cornerJ,
+        Overlap &overlap) const;
+
+    ///
+    /// \brief Solve the gains from the collected overlap statistics
+    /// \param numTiles Number of tiles
+    /// \param overlaps Statistics of all overlapping pairs
+    ///
+    void solve(int numTiles, const std::vector<Overlap> &overlaps);
+
+    std::vector<double> tileGains;
+    int sampleStep;
+};
+
+
+#endif // GAINCOMPENSATOR_H
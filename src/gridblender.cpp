@@ -0,0 +1,397 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "gridblender.hpp"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+
+///
+/// \brief Distance of a coordinate to the nearer border of a range
+/// \return At least one inside the range
+///
+static inline float borderDistance(int pos, int start, int end)
+{
+    return static_cast<float>(std::min(pos - start + 1, end - pos));
+}
+
+///
+/// \brief Sorted coordinates without duplicates
+///
+static void uniqueSorted(std::vector<int> &values)
+{
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+///
+/// \brief Accumulate one weighted row of a tile
+/// acc += src * wx * scale and wsum += wx * wy for every channel value.
+/// \param src Row of the tile (interleaved channels)
+/// \param wx Horizontal weights per channel value
+/// \param scale Vertical weight multiplied with the gain of the tile
+/// \param wy Vertical weight
+/// \param acc Weighted sum of the values
+/// \param wsum Sum of the weights
+/// \param len Number of channel values in the row
+///
+static void accumulateRow(
+    const uchar *src, const float *wx, float scale, float wy, float *acc,
+    float *wsum, int len)
+{
+    int i = 0;
+#if CV_SIMD128
+    cv::v_float32x4 vScale = cv::v_setall_f32(scale);
+    cv::v_float32x4 vWy = cv::v_setall_f32(wy);
+    cv::v_float32x4 vZero = cv::v_setzero_f32();
+    for (; i <= len - 4; i += 4) {
+        cv::v_float32x4 w = cv::v_load(wx + i);
+        cv::v_float32x4 value = cv::v_cvt_f32(
+            cv::v_reinterpret_as_s32(cv::v_load_expand_q(src + i))
+        );
+        cv::v_float32x4 weight = cv::v_muladd(w, vScale, vZero);
+        cv::v_store(acc + i, cv::v_muladd(value, weight, cv::v_load(acc + i)));
+        cv::v_store(wsum + i, cv::v_muladd(w, vWy, cv::v_load(wsum + i)));
+    }
+#endif
+    for (; i < len; i++) {
+        acc[i] += src[i] * wx[i] * scale;
+        wsum[i] += wx[i] * wy;
+    }
+}
+
+///
+/// \brief Multiply every channel of a matrix with a one channel weight
+///
+static cv::Mat expandChannels(const cv::Mat &weight, int channels)
+{
+    if (channels == 1)
+        return weight;
+    cv::Mat expanded;
+    std::vector<cv::Mat> planes(channels, weight);
+    cv::merge(planes, expanded);
+    return expanded;
+}
+
+GridBlender::GridBlender()
+    : blendMode(BlendMode::FEATHER),
+    numBands(5),
+    blockSize(1024)
+{
+}
+
+GridBlender::~GridBlender()
+{
+}
+
+void GridBlender::setMode(BlendMode mode)
+{
+    blendMode = mode;
+}
+
+BlendMode GridBlender::mode() const
+{
+    return blendMode;
+}
+
+void GridBlender::setNumBands(int bands)
+{
+    numBands = std::max(1, std::min(bands, 10));
+}
+
+void GridBlender::setBlockSize(int size)
+{
+    blockSize = std::max(64, size);
+}
+
+void GridBlender::blend(
+    const std::vector<cv::Mat> &tiles, const std::vector<cv::Point> &corners,
+    const std::vector<double> &gains, cv::Mat &dst)
+{
+    CV_Assert(tiles.size() == corners.size());
+    CV_Assert(gains.empty() || gains.size() == tiles.size());
+
+    if (tiles.empty()) {
+        dst.release();
+        return;
+    }
+
+    // Bounding box of the mosaic
+    int type = tiles.front().type();
+    cv::Rect bounds(corners.front(), tiles.front().size());
+    for (size_t i = 0; i < tiles.size(); i++) {
+        CV_Assert(tiles[i].type() == type && tiles[i].depth() == CV_8U);
+        bounds |= cv::Rect(corners[i], tiles[i].size());
+    }
+
+    std::vector<cv::Rect> rects(tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++)
+        rects[i] = cv::Rect(corners[i] - bounds.tl(), tiles[i].size());
+
+    std::vector<double> tileGains = gains;
+    if (tileGains.empty())
+        tileGains.assign(tiles.size(), 1.0);
+
+    dst.create(bounds.size(), type);
+    dst.setTo(cv::Scalar::all(0));
+
+    if (blendMode == BlendMode::FEATHER) {
+        blendFeather(tiles, rects, tileGains, dst);
+        return;
+    }
+
+    // Multiband blending one block after another keeps the pyramids small
+    for (int y = 0; y < dst.rows; y += blockSize) {
+        for (int x = 0; x < dst.cols; x += blockSize) {
+            cv::Rect block = cv::Rect(x, y, blockSize, blockSize)
+                & cv::Rect(0, 0, dst.cols, dst.rows);
+            blendMultiBandBlock(tiles, rects, tileGains, block, dst);
+        }
+    }
+}
+
+void GridBlender::blendFeather(
+    const std::vector<cv::Mat> &tiles, const std::vector<cv::Rect> &rects,
+    const std::vector<double> &gains, cv::Mat &dst)
+{
+    int channels = dst.channels();
+
+    // Horizontal bands between all top and bottom edges. Inside one band the
+    // covering tiles and therefore all segments stay the same.
+    std::vector<int> ys;
+    for (size_t i = 0; i < rects.size(); i++) {
+        ys.push_back(rects[i].y);
+        ys.push_back(rects[i].br().y);
+    }
+    uniqueSorted(ys);
+
+    std::vector<int> active;
+    std::vector<int> xs;
+    std::vector<int> covering;
+    std::vector<std::vector<float>> wx;
+    std::vector<float> acc;
+    std::vector<float> wsum;
+
+    for (size_t b = 0; b + 1 < ys.size(); b++) {
+        int ya = ys[b];
+        int yb = ys[b + 1];
+
+        active.clear();
+        xs.clear();
+        for (size_t i = 0; i < rects.size(); i++) {
+            if (rects[i].y <= ya && rects[i].br().y >= yb) {
+                active.push_back(static_cast<int>(i));
+                xs.push_back(rects[i].x);
+                xs.push_back(rects[i].br().x);
+            }
+        }
+        if (active.empty())
+            continue;
+        uniqueSorted(xs);
+
+        for (size_t s = 0; s + 1 < xs.size(); s++) {
+            int xa = xs[s];
+            int xb = xs[s + 1];
+            cv::Rect segment(xa, ya, xb - xa, yb - ya);
+
+            covering.clear();
+            for (size_t k = 0; k < active.size(); k++) {
+                const cv::Rect &r = rects[active[k]];
+                if (r.x <= xa && r.br().x >= xb)
+                    covering.push_back(active[k]);
+            }
+
+            if (covering.empty())
+                continue;
+
+            // Only one tile, copy it. The gain is applied by the same pass.
+            if (covering.size() == 1) {
+                int t = covering.front();
+                tiles[t](segment - rects[t].tl()).convertTo(
+                    dst(segment), dst.type(), gains[t]
+                );
+                continue;
+            }
+
+            // Overlap strip: horizontal weights per channel value once, the
+            // vertical weight is constant for a row.
+            int len = segment.width * channels;
+            wx.resize(covering.size());
+            for (size_t k = 0; k < covering.size(); k++) {
+                const cv::Rect &r = rects[covering[k]];
+                wx[k].resize(len);
+                for (int x = 0; x < segment.width; x++) {
+                    float w = borderDistance(xa + x, r.x, r.br().x);
+                    for (int c = 0; c < channels; c++)
+                        wx[k][x * channels + c] = w;
+                }
+            }
+            acc.resize(len);
+            wsum.resize(len);
+
+            for (int y = ya; y < yb; y++) {
+                std::fill(acc.begin(), acc.end(), 0.0f);
+                std::fill(wsum.begin(), wsum.end(), 0.0f);
+
+                for (size_t k = 0; k < covering.size(); k++) {
+                    int t = covering[k];
+                    const cv::Rect &r = rects[t];
+                    float wy = borderDistance(y, r.y, r.br().y);
+                    const uchar *src = tiles[t].ptr<uchar>(y - r.y)
+                        + (xa - r.x) * channels;
+                    accumulateRow(
+                        src, wx[k].data(), wy * static_cast<float>(gains[t]),
+                        wy, acc.data(), wsum.data(), len
+                    );
+                }
+
+                uchar *out = dst.ptr<uchar>(y) + xa * channels;
+                for (int i = 0; i < len; i++)
+                    out[i] = cv::saturate_cast<uchar>(acc[i] / wsum[i]);
+            }
+        }
+    }
+}
+
+void GridBlender::blendMultiBandBlock(
+    const std::vector<cv::Mat> &tiles, const std::vector<cv::Rect> &rects,
+    const std::vector<double> &gains, cv::Rect block, cv::Mat &dst)
+{
+    int channels = dst.channels();
+    int floatType = CV_32FC(channels);
+
+    // The block is blended with a margin, so the pyramid of the inner part
+    // does not see the block border. The 5 tap filters of the pyramid reach
+    // about 4 << numBands pixels on the coarsest level. The margin starts on
+    // the sample grid of the coarsest level, so every block samples the
+    // pyramid like one blend of the whole mosaic.
+    int align = 1 << numBands;
+    int margin = 5 * align;
+    int left = std::max(0, (block.x - margin) / align * align);
+    int top = std::max(0, (block.y - margin) / align * align);
+    cv::Rect outer = cv::Rect(
+        left, top,
+        block.br().x + margin - left, block.br().y + margin - top
+    ) & cv::Rect(0, 0, dst.cols, dst.rows);
+    cv::Size padded(
+        (outer.width + align - 1) / align * align,
+        (outer.height + align - 1) / align * align
+    );
+
+    std::vector<int> involved;
+    for (size_t i = 0; i < rects.size(); i++) {
+        if ((rects[i] & outer).area() > 0)
+            involved.push_back(static_cast<int>(i));
+    }
+    if (involved.empty())
+        return;
+
+    // Every pixel belongs to the tile with the highest feather weight. These
+    // seams are smoothed by the mask pyramids.
+    cv::Mat bestWeight(padded, CV_32F, cv::Scalar(0));
+    cv::Mat bestTile(padded, CV_32S, cv::Scalar(-1));
+    for (size_t k = 0; k < involved.size(); k++) {
+        const cv::Rect &r = rects[involved[k]];
+        cv::Rect part = r & outer;
+        for (int y = part.y; y < part.br().y; y++) {
+            float wy = borderDistance(y, r.y, r.br().y);
+            float *rowWeight = bestWeight.ptr<float>(y - outer.y);
+            int *rowTile = bestTile.ptr<int>(y - outer.y);
+            for (int x = part.x; x < part.br().x; x++) {
+                float w = wy * borderDistance(x, r.x, r.br().x);
+                if (w > rowWeight[x - outer.x]) {
+                    rowWeight[x - outer.x] = w;
+                    rowTile[x - outer.x] = involved[k];
+                }
+            }
+        }
+    }
+
+    std::vector<cv::Mat> bands(numBands + 1);
+    std::vector<cv::Mat> weights(numBands + 1);
+    cv::Size levelSize = padded;
+    for (int l = 0; l <= numBands; l++) {
+        bands[l] = cv::Mat::zeros(levelSize, floatType);
+        weights[l] = cv::Mat::zeros(levelSize, CV_32F);
+        levelSize = cv::Size((levelSize.width + 1) / 2, (levelSize.height + 1) / 2);
+    }
+
+    for (size_t k = 0; k < involved.size(); k++) {
+        int t = involved[k];
+
+        cv::Mat mask;
+        cv::compare(bestTile, cv::Scalar(t), mask, cv::CMP_EQ);
+        if (cv::countNonZero(mask) == 0)
+            continue;
+
+        cv::Rect part = rects[t] & outer;
+        cv::Mat image = cv::Mat::zeros(padded, floatType);
+        tiles[t](part - rects[t].tl()).convertTo(
+            image(part - outer.tl()), floatType, gains[t]
+        );
+
+        cv::Mat maskLevel;
+        mask.convertTo(maskLevel, CV_32F, 1.0 / 255.0);
+        cv::Mat imageLevel = image;
+        for (int l = 0; l <= numBands; l++) {
+            cv::Mat laplace;
+            cv::Mat imageDown;
+            if (l < numBands) {
+                cv::pyrDown(imageLevel, imageDown);
+                cv::Mat imageUp;
+                cv::pyrUp(imageDown, imageUp, imageLevel.size());
+                cv::subtract(imageLevel, imageUp, laplace);
+            } else {
+                laplace = imageLevel;
+            }
+
+            bands[l] += laplace.mul(expandChannels(maskLevel, channels));
+            weights[l] += maskLevel;
+
+            if (l < numBands) {
+                cv::Mat maskDown;
+                cv::pyrDown(maskLevel, maskDown);
+                maskLevel = maskDown;
+                imageLevel = imageDown;
+            }
+        }
+    }
+
+    // Normalize every band and collapse the pyramid
+    for (int l = 0; l <= numBands; l++) {
+        cv::Mat w = weights[l] + 1e-5f;
+        cv::divide(bands[l], expandChannels(w, channels), bands[l]);
+    }
+    cv::Mat result = bands[numBands];
+    for (int l = numBands - 1; l >= 0; l--) {
+        cv::Mat up;
+        cv::pyrUp(result, up, bands[l].size());
+        result = up + bands[l];
+    }
+
+    // Only the inner block is written, uncovered pixels stay black
+    cv::Rect inner = block - outer.tl();
+    cv::Mat covered;
+    cv::compare(bestTile(inner), cv::Scalar(0), covered, cv::CMP_GE);
+    cv::Mat out;
+    result(inner).convertTo(out, dst.type());
+    out.copyTo(dst(block), covered);
+}
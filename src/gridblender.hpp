@@ -0,0 +1,116 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef GRIDBLENDER_H
+#define GRIDBLENDER_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+///
+/// Blending modes of the grid blender:
+/// - FEATHER: Distance weighted average, only calculated in the overlaps
+/// - MULTIBAND: Laplacian pyramid blending, calculated block by block
+///
+enum class BlendMode {
+    FEATHER,
+    MULTIBAND
+};
+
+///
+/// \brief Blender for tiles that have been placed by pure translation
+/// Tiles of a grid scan are axis aligned rectangles. The mosaic is swept in
+/// horizontal bands in which the set of covering tiles does not change. Parts
+/// covered by one tile only are copied (multiplied with its gain), only the
+/// overlap strips are blended.
+///
+class GridBlender
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    GridBlender();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~GridBlender();
+
+    ///
+    /// \brief Set the blending mode
+    /// \param mode FEATHER for speed or MULTIBAND for quality
+    ///
+    void setMode(BlendMode mode);
+
+    ///
+    /// \brief Get the blending mode
+    /// \return The blending mode
+    ///
+    BlendMode mode() const;
+
+    ///
+    /// \brief Set the number of pyramid levels for multiband blending
+    /// \param bands Number of bands
+    ///
+    void setNumBands(int bands);
+
+    ///
+    /// \brief Set the edge length of one output block for multiband blending
+    /// \param size Edge length in pixels
+    ///
+    void setBlockSize(int size);
+
+    ///
+    /// \brief Blend the tiles into one mosaic
+    /// \param tiles The tiles (all with the same type, 8 bit)
+    /// \param corners Top left position of every tile
+    /// \param gains Gain of every tile or empty for no gains
+    /// \param dst The mosaic
+    ///
+    void blend(
+        const std::vector<cv::Mat> &tiles,
+        const std::vector<cv::Point> &corners,
+        const std::vector<double> &gains, cv::Mat &dst);
+
+private:
+    ///
+    /// \brief Feather blending of the whole mosaic
+    ///
+    void blendFeather(
+        const std::vector<cv::Mat> &tiles,
+        const std::vector<cv::Rect> &rects,
+        const std::vector<double> &gains, cv::Mat &dst);
+
+    ///
+    /// \brief Multiband blending of one output block
+    ///
+    void blendMultiBandBlock(
+        const std::vector<cv::Mat> &tiles,
+        const std::vector<cv::Rect> &rects,
+        const std::vector<double> &gains, cv::Rect block, cv::Mat &dst);
+
+    BlendMode blendMode;
+    int numBands;
+    int blockSize;
+};
+
+
+#endif // GRIDBLENDER_H
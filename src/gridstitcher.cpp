@@ -0,0 +1,504 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "gridstitcher.hpp"
+#include "gaincompensator.hpp"
+#include "tilegrid.hpp"
+
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+
+// Edges with a lower correlation are replaced by the typical grid offset
+static const double MIN_CONFIDENCE = 0.3;
+
+// Smallest overlap accepted as registration result, relative to the tile
+static const double MIN_OVERLAP = 0.03;
+
+///
+/// \brief Median of a list of values
+///
+static double median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0;
+    size_t mid = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + mid, values.end());
+    return values[mid];
+}
+
+///
+/// \brief Normalized cross correlation of two equally sized images
+///
+static double crossCorrelation(const cv::Mat &a, const cv::Mat &b)
+{
+    cv::Scalar meanA;
+    cv::Scalar stdA;
+    cv::Scalar meanB;
+    cv::Scalar stdB;
+    cv::meanStdDev(a, meanA, stdA);
+    cv::meanStdDev(b, meanB, stdB);
+    if (stdA[0] < 1e-3 || stdB[0] < 1e-3)
+        return -1;
+
+    cv::Mat da = a - meanA[0];
+    cv::Mat db = b - meanB[0];
+    double cov = da.dot(db) / static_cast<double>(a.total());
+    return cov / (stdA[0] * stdB[0]);
+}
+
+GridStitcher::GridStitcher()
+    : blendMode(BlendMode::FEATHER),
+    registrationScale(0.25),
+    blockSize(1024)
+{
+    quality.setMinConfidence(MIN_CONFIDENCE);
+}
+
+GridStitcher::~GridStitcher()
+{
+}
+
+void GridStitcher::setCells(const std::vector<cv::Point> &cells)
+{
+    tileCells = cells;
+}
+
+void GridStitcher::setPositionPriors(const std::vector<cv::Point2d> &priors)
+{
+    tilePriors = priors;
+}
+
+void GridStitcher::setBlendMode(BlendMode mode)
+{
+    blendMode = mode;
+}
+
+void GridStitcher::setRegistrationScale(double scale)
+{
+    registrationScale = std::max(0.05, std::min(scale, 1.0));
+}
+
+void GridStitcher::setBlockSize(int size)
+{
+    blockSize = size;
+}
+
+std::vector<cv::Point> GridStitcher::corners() const
+{
+    return tileCorners;
+}
+
+std::vector<double> GridStitcher::gains() const
+{
+    return tileGains;
+}
+
+const StitchReport& GridStitcher::report() const
+{
+    return quality;
+}
+
+GridStitcher::Status GridStitcher::stitch(
+    const std::vector<cv::Mat> &tiles, cv::Mat &pano)
+{
+    Status status = estimatePositions(tiles);
+    if (status != Status::OK)
+        return status;
+    return composePanorama(tiles, pano);
+}
+
+double GridStitcher::registerPair(
+    const cv::Mat &a, const cv::Mat &b, cv::Point2d &offset) const
+{
+    cv::Size size(std::min(a.cols, b.cols), std::min(a.rows, b.rows));
+    cv::Mat ra = a(cv::Rect(cv::Point(), size));
+    cv::Mat rb = b(cv::Rect(cv::Point(), size));
+
+    cv::Mat window;
+    cv::createHanningWindow(window, size, CV_32F);
+    cv::Point2d shift = cv::phaseCorrelate(ra, rb, window);
+
+    // The phase correlation only knows the shift modulo the image size.
+    // Every wrapped candidate (and both signs) is checked by correlating the
+    // overlap it implies.
+    double best = -1;
+    cv::Rect full(cv::Point(), size);
+    for (int sign = -1; sign <= 1; sign += 2) {
+        for (int kx = -1; kx <= 1; kx++) {
+            for (int ky = -1; ky <= 1; ky++) {
+                cv::Point2d candidate(
+                    sign * shift.x + kx * size.width,
+                    sign * shift.y + ky * size.height
+                );
+                cv::Point rounded(
+                    cvRound(candidate.x), cvRound(candidate.y)
+                );
+                cv::Rect overlap = full & cv::Rect(rounded, size);
+                if (overlap.area() < MIN_OVERLAP * full.area())
+                    continue;
+
+                double ncc = crossCorrelation(
+                    ra(overlap), rb(overlap - rounded)
+                );
+                if (ncc > best) {
+                    best = ncc;
+                    offset = candidate;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+GridStitcher::Status GridStitcher::estimatePositions(
+    const std::vector<cv::Mat> &tiles)
+{
+    int numTiles = static_cast<int>(tiles.size());
+    tileCorners.clear();
+    tileGains.clear();
+    tileEdges.clear();
+    quality.clear();
+    mosaicSize = cv::Size();
+    if (numTiles < 1)
+        return Status::ERR_NEED_MORE_IMGS;
+
+    // Without known cells, assume an almost square row major grid
+    if (static_cast<int>(tileCells.size()) != numTiles) {
+        int columns = static_cast<int>(std::ceil(std::sqrt(numTiles)));
+        tileCells = TileGrid::fromColumns(numTiles, columns).cells(numTiles);
+    }
+
+    // Downscaled gray images for registration
+    std::vector<cv::Mat> small(numTiles);
+    for (int i = 0; i < numTiles; i++)
+        prepareTile(i, tiles[i], small[i]);
+
+    std::map<std::pair<int, int>, int> cellIndex;
+    for (int i = 0; i < numTiles; i++)
+        cellIndex[std::make_pair(tileCells[i].x, tileCells[i].y)] = i;
+
+    // Register every tile with its right and lower neighbour
+    for (int i = 0; i < numTiles; i++) {
+        for (int dir = 0; dir < 2; dir++) {
+            cv::Point next = tileCells[i]
+                + (dir == 0 ? cv::Point(1, 0) : cv::Point(0, 1));
+            auto it = cellIndex.find(std::make_pair(next.x, next.y));
+            if (it == cellIndex.end())
+                continue;
+
+            Edge edge;
+            edge.i = i;
+            edge.j = it->second;
+            edge.horizontal = dir == 0;
+            edge.confidence = registerPair(
+                small[edge.i], small[edge.j], edge.offset
+            );
+            tileEdges.push_back(edge);
+        }
+    }
+
+    if (numTiles > 1) {
+        bool registered = false;
+        for (size_t e = 0; e < tileEdges.size(); e++) {
+            if (tileEdges[e].confidence >= MIN_CONFIDENCE)
+                registered = true;
+        }
+        if (!registered) {
+            updateReport();
+            return Status::ERR_REGISTRATION_FAIL;
+        }
+    }
+
+    solvePositions(numTiles, tileEdges);
+    updateReport();
+    return Status::OK;
+}
+
+void GridStitcher::prepareTile(int index, const cv::Mat &tile, cv::Mat &small)
+{
+    cv::Mat gray;
+    if (tile.channels() == 3)
+        cv::cvtColor(tile, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = tile;
+    quality.measureTile(index, tileCells[index], gray);
+
+    cv::Mat resized;
+    cv::resize(
+        gray, resized, cv::Size(), registrationScale, registrationScale,
+        cv::INTER_AREA
+    );
+    resized.convertTo(small, CV_32F);
+}
+
+void GridStitcher::updateReport()
+{
+    // A large residual shows a registration that does not fit to the others
+    for (size_t e = 0; e < tileEdges.size(); e++) {
+        const Edge &edge = tileEdges[e];
+        double residual = -1;
+        if (static_cast<int>(tileCorners.size()) > std::max(edge.i, edge.j)) {
+            cv::Point2d solved = cv::Point2d(
+                tileCorners[edge.j] - tileCorners[edge.i]
+            ) * registrationScale;
+            residual = cv::norm(solved - edge.offset) / registrationScale;
+        }
+        quality.setEdge(
+            edge.i, edge.j, edge.horizontal, edge.confidence, residual
+        );
+    }
+    quality.evaluate();
+}
+
+cv::Point2d GridStitcher::prior(int index) const
+{
+    if (index < 0 || index >= static_cast<int>(tilePriors.size()))
+        return cv::Point2d();
+    return tilePriors[index] * registrationScale;
+}
+
+void GridStitcher::solvePositions(int numTiles, const std::vector<Edge> &edges)
+{
+    // Typical offsets of the grid from the reliable edges, without the known
+    // shifts of the tiles. They replace the unreliable ones and give every
+    // tile a weak prior.
+    cv::Point2d step[2];
+    for (int dir = 0; dir < 2; dir++) {
+        std::vector<double> xs;
+        std::vector<double> ys;
+        std::vector<double> allXs;
+        std::vector<double> allYs;
+        for (size_t e = 0; e < edges.size(); e++) {
+            if (edges[e].horizontal != (dir == 0))
+                continue;
+            cv::Point2d offset = edges[e].offset
+                - (prior(edges[e].j) - prior(edges[e].i));
+            allXs.push_back(offset.x);
+            allYs.push_back(offset.y);
+            if (edges[e].confidence >= MIN_CONFIDENCE) {
+                xs.push_back(offset.x);
+                ys.push_back(offset.y);
+            }
+        }
+        if (xs.empty()) {
+            xs = allXs;
+            ys = allYs;
+        }
+        step[dir] = cv::Point2d(median(xs), median(ys));
+    }
+
+    // Normal equations of the weighted least squares problem for both axes
+    const double priorWeight = 1e-3;
+    cv::Mat_<double> A(numTiles, numTiles, 0.0);
+    cv::Mat_<double> bx(numTiles, 1, 0.0);
+    cv::Mat_<double> by(numTiles, 1, 0.0);
+    for (int i = 0; i < numTiles; i++) {
+        cv::Point2d nominal = tileCells[i].x * step[0]
+            + tileCells[i].y * step[1] + prior(i);
+        A(i, i) += priorWeight;
+        bx(i) += priorWeight * nominal.x;
+        by(i) += priorWeight * nominal.y;
+    }
+    for (size_t e = 0; e < edges.size(); e++) {
+        const Edge &edge = edges[e];
+        double w = edge.confidence;
+        cv::Point2d offset = edge.offset;
+        if (w < MIN_CONFIDENCE) {
+            w = 0.1 * MIN_CONFIDENCE;
+            offset = step[edge.horizontal ? 0 : 1]
+                + prior(edge.j) - prior(edge.i);
+        }
+
+        A(edge.i, edge.i) += w;
+        A(edge.j, edge.j) += w;
+        A(edge.i, edge.j) -= w;
+        A(edge.j, edge.i) -= w;
+        bx(edge.j) += w * offset.x;
+        bx(edge.i) -= w * offset.x;
+        by(edge.j) += w * offset.y;
+        by(edge.i) -= w * offset.y;
+    }
+
+    cv::Mat_<double> px;
+    cv::Mat_<double> py;
+    cv::solve(A, bx, px, cv::DECOMP_CHOLESKY);
+    cv::solve(A, by, py, cv::DECOMP_CHOLESKY);
+
+    // Back to the full resolution with the mosaic starting at zero
+    double minX = 0;
+    double minY = 0;
+    for (int i = 0; i < numTiles; i++) {
+        minX = i == 0 ? px(i) : std::min(minX, px(i));
+        minY = i == 0 ? py(i) : std::min(minY, py(i));
+    }
+
+    tileCorners.resize(numTiles);
+    for (int i = 0; i < numTiles; i++) {
+        tileCorners[i] = cv::Point(
+            cvRound((px(i) - minX) / registrationScale),
+            cvRound((py(i) - minY) / registrationScale)
+        );
+    }
+}
+
+GridStitcher::Status GridStitcher::composePanorama(
+    const std::vector<cv::Mat> &tiles, cv::Mat &pano)
+{
+    if (tiles.empty())
+        return Status::ERR_NEED_MORE_IMGS;
+    if (tileCorners.size() != tiles.size())
+        return Status::ERR_REGISTRATION_FAIL;
+
+    GainCompensator compensator;
+    compensator.setSampleStep(8);
+    compensator.computeGains(tileCorners, tiles);
+    tileGains = compensator.gains();
+
+    GridBlender blender;
+    blender.setMode(blendMode);
+    blender.setBlockSize(blockSize);
+    blender.blend(tiles, tileCorners, tileGains, pano);
+    mosaicSize = pano.size();
+    return Status::OK;
+}
+
+GridStitcher::Status GridStitcher::replaceTiles(
+    const std::vector<cv::Mat> &tiles, const std::vector<int> &indices,
+    cv::Mat &pano)
+{
+    int numTiles = static_cast<int>(tiles.size());
+    if (numTiles != static_cast<int>(tileCorners.size())
+            || tileGains.size() != tiles.size() || pano.size() != mosaicSize)
+        return Status::ERR_REGISTRATION_FAIL;
+
+    std::vector<bool> replaced(numTiles, false);
+    for (size_t k = 0; k < indices.size(); k++) {
+        if (indices[k] < 0 || indices[k] >= numTiles)
+            return Status::ERR_REGISTRATION_FAIL;
+        replaced[indices[k]] = true;
+    }
+
+    // Only the edges of the new tiles are registered again
+    std::vector<cv::Mat> small(numTiles);
+    for (size_t k = 0; k < indices.size(); k++)
+        prepareTile(indices[k], tiles[indices[k]], small[indices[k]]);
+    for (size_t e = 0; e < tileEdges.size(); e++) {
+        Edge &edge = tileEdges[e];
+        if (!replaced[edge.i] && !replaced[edge.j])
+            continue;
+        if (small[edge.i].empty())
+            prepareTile(edge.i, tiles[edge.i], small[edge.i]);
+        if (small[edge.j].empty())
+            prepareTile(edge.j, tiles[edge.j], small[edge.j]);
+        edge.confidence = registerPair(
+            small[edge.i], small[edge.j], edge.offset
+        );
+    }
+
+    // The kept neighbours place every new tile, solving all positions again
+    // would move the whole mosaic. The mosaic keeps its size.
+    cv::Rect area;
+    for (size_t k = 0; k < indices.size(); k++) {
+        int index = indices[k];
+        cv::Point2d sum(0, 0);
+        double weight = 0;
+        for (size_t e = 0; e < tileEdges.size(); e++) {
+            const Edge &edge = tileEdges[e];
+            if (edge.confidence < MIN_CONFIDENCE
+                    || (edge.i != index && edge.j != index))
+                continue;
+            int other = edge.i == index ? edge.j : edge.i;
+            if (replaced[other])
+                continue;
+            cv::Point2d offset = edge.offset / registrationScale;
+            cv::Point2d corner = edge.j == index
+                ? cv::Point2d(tileCorners[other]) + offset
+                : cv::Point2d(tileCorners[other]) - offset;
+            sum += edge.confidence * corner;
+            weight += edge.confidence;
+        }
+
+        cv::Size size = tiles[index].size();
+        cv::Point corner = tileCorners[index];
+        if (weight > 0)
+            corner = cv::Point(cvRound(sum.x / weight), cvRound(sum.y / weight));
+        corner.x = std::max(0, std::min(corner.x, mosaicSize.width - size.width));
+        corner.y = std::max(0, std::min(corner.y, mosaicSize.height - size.height));
+        area |= cv::Rect(tileCorners[index], size) | cv::Rect(corner, size);
+        tileCorners[index] = corner;
+    }
+    area &= cv::Rect(cv::Point(), mosaicSize);
+    updateReport();
+    if (area.area() == 0)
+        return Status::OK;
+
+    // Every tile reaching into the area is composed again
+    std::vector<int> part;
+    std::vector<cv::Mat> partTiles;
+    std::vector<cv::Point> partCorners;
+    cv::Rect partBounds;
+    for (int i = 0; i < numTiles; i++) {
+        cv::Rect rect(tileCorners[i], tiles[i].size());
+        if ((rect & area).area() == 0)
+            continue;
+        part.push_back(i);
+        partTiles.push_back(tiles[i]);
+        partCorners.push_back(tileCorners[i]);
+        partBounds |= rect;
+    }
+    if (part.empty()) {
+        pano(area).setTo(cv::Scalar::all(0));
+        return Status::OK;
+    }
+
+    // The gains of a part are only known up to a common factor, the kept
+    // tiles keep their gains and give the factor
+    GainCompensator compensator;
+    compensator.setSampleStep(8);
+    compensator.computeGains(partCorners, partTiles);
+    std::vector<double> partGains = compensator.gains();
+    if (partGains.size() != part.size())
+        partGains.assign(part.size(), 1.0);
+    std::vector<double> ratios;
+    for (size_t n = 0; n < part.size(); n++) {
+        if (!replaced[part[n]] && partGains[n] > 0)
+            ratios.push_back(tileGains[part[n]] / partGains[n]);
+    }
+    double factor = ratios.empty() ? 1.0 : median(ratios);
+    for (size_t n = 0; n < part.size(); n++) {
+        if (replaced[part[n]])
+            tileGains[part[n]] = partGains[n] * factor;
+        partGains[n] = tileGains[part[n]];
+    }
+
+    GridBlender blender;
+    blender.setMode(blendMode);
+    blender.setBlockSize(blockSize);
+    cv::Mat composed;
+    blender.blend(partTiles, partCorners, partGains, composed);
+
+    // Where an old tile has been is empty now, if no other tile covers it
+    pano(area).setTo(cv::Scalar::all(0));
+    cv::Rect covered = area & partBounds;
+    composed(covered - partBounds.tl()).copyTo(pano(covered));
+    return Status::OK;
+}
@@ -0,0 +1,206 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef GRIDSTITCHER_H
+#define GRIDSTITCHER_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "gridblender.hpp"
+#include "stitchreport.hpp"
+
+
+///
+/// \brief Stitcher for tiles of a regular grid scan
+/// The stage only translates, so every tile is registered against its right
+/// and lower grid neighbour by phase correlation on downscaled images. The
+/// global positions are solved by least squares over all neighbour offsets.
+/// Known shifts of the tiles, like the drift of the stage, correct the grid
+/// offsets that stand in for failed registrations and the prior of every
+/// position. Composition uses the overlap gains and the grid blender. The
+/// quality of every tile and registration is kept in a report, tiles taken
+/// again can replace their old ones in the mosaic.
+///
+class GridStitcher
+{
+public:
+    ///
+    /// Status of the stitching process
+    ///
+    enum class Status {
+        OK,
+        ERR_NEED_MORE_IMGS,
+        ERR_REGISTRATION_FAIL
+    };
+
+    ///
+    /// \brief Constructor
+    ///
+    GridStitcher();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~GridStitcher();
+
+    ///
+    /// \brief Set the grid cell of every tile
+    /// \param cells Cell per tile with x as column and y as row
+    ///
+    void setCells(const std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Set the known shift of every tile from its grid position
+    /// \param priors Shift per tile in pixels, empty for none
+    ///
+    void setPositionPriors(const std::vector<cv::Point2d> &priors);
+
+    ///
+    /// \brief Set the blending mode
+    /// \param mode The blending mode
+    ///
+    void setBlendMode(BlendMode mode);
+
+    ///
+    /// \brief Set the scale of the images for registration
+    /// \param scale Scale between 0 and 1
+    ///
+    void setRegistrationScale(double scale);
+
+    ///
+    /// \brief Set the edge length of the output blocks for multiband blending
+    /// \param size Edge length in pixels
+    ///
+    void setBlockSize(int size);
+
+    ///
+    /// \brief Register and compose the tiles
+    /// \param tiles The tiles in the order of the cells
+    /// \param pano The mosaic
+    /// \return The status
+    ///
+    Status stitch(const std::vector<cv::Mat> &tiles, cv::Mat &pano);
+
+    ///
+    /// \brief Estimate the positions of the tiles
+    /// \param tiles The tiles in the order of the cells
+    /// \return The status
+    ///
+    Status estimatePositions(const std::vector<cv::Mat> &tiles);
+
+    ///
+    /// \brief Compose the tiles with the estimated positions
+    /// \param tiles The tiles in the order of the cells
+    /// \param pano The mosaic
+    /// \return The status
+    ///
+    Status composePanorama(const std::vector<cv::Mat> &tiles, cv::Mat &pano);
+
+    ///
+    /// \brief Replace some tiles in the last mosaic
+    /// The new tiles are registered with their neighbours and placed by
+    /// them, all other tiles keep their positions and gains. Only the area
+    /// of the old and the new tiles is composed again. Multiband blending
+    /// may differ slightly at the border of the area.
+    /// \param tiles All tiles in the order of the cells, with the new ones
+    /// \param indices The indices of the new tiles
+    /// \param pano The mosaic of the last composition, it is changed in place
+    /// \return The status
+    ///
+    Status replaceTiles(const std::vector<cv::Mat> &tiles,
+        const std::vector<int> &indices, cv::Mat &pano);
+
+    ///
+    /// \brief Get the estimated top left positions of the tiles
+    /// \return The positions in the mosaic
+    ///
+    std::vector<cv::Point> corners() const;
+
+    ///
+    /// \brief Get the gains of the tiles from the last composition
+    /// \return The gains
+    ///
+    std::vector<double> gains() const;
+
+    ///
+    /// \brief Get the quality of the tiles and their registrations
+    /// \return The report of the last estimation
+    ///
+    const StitchReport& report() const;
+
+private:
+    ///
+    /// \brief Registration result of two neighbouring tiles
+    ///
+    struct Edge {
+        int i;
+        int j;
+        bool horizontal;
+        cv::Point2d offset;
+        double confidence;
+    };
+
+    ///
+    /// \brief Measure a tile and downscale it for registration
+    /// \param index Index of the tile
+    /// \param tile The tile
+    /// \param small The gray, downscaled tile
+    ///
+    void prepareTile(int index, const cv::Mat &tile, cv::Mat &small);
+
+    ///
+    /// \brief Register two tiles
+    /// \param a The first (downscaled) tile
+    /// \param b The second (downscaled) tile
+    /// \param offset Position of b relative to a
+    /// \return Normalized cross correlation of the overlap or -1
+    ///
+    double registerPair(
+        const cv::Mat &a, const cv::Mat &b, cv::Point2d &offset) const;
+
+    ///
+    /// \brief Solve the global positions from the edges
+    ///
+    void solvePositions(int numTiles, const std::vector<Edge> &edges);
+
+    ///
+    /// \brief Enter the residuals of the solved positions into the report
+    ///
+    void updateReport();
+
+    ///
+    /// \brief Get the known shift of a tile at the registration scale
+    ///
+    cv::Point2d prior(int index) const;
+
+    std::vector<cv::Point> tileCells;
+    std::vector<cv::Point2d> tilePriors;
+    std::vector<cv::Point> tileCorners;
+    std::vector<double> tileGains;
+    std::vector<Edge> tileEdges;
+    StitchReport quality;
+    cv::Size mosaicSize;
+    BlendMode blendMode;
+    double registrationScale;
+    int blockSize;
+};
+
+
+#endif // GRIDSTITCHER_H
@@ -0,0 +1,240 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "lenscalibration.hpp"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+#include <QtCore/QSettings>
+#include <QtCore/QVariant>
+#include <QtCore/QList>
+
+
+///
+/// \brief Convert a double matrix to a list for the settings
+///
+static QList<QVariant> matToList(const cv::Mat &mat)
+{
+    QList<QVariant> list;
+    cv::Mat_<double> values = mat;
+    for (int r = 0; r < values.rows; r++) {
+        for (int c = 0; c < values.cols; c++)
+            list.append(values(r, c));
+    }
+    return list;
+}
+
+///
+/// \brief Convert a list from the settings to a double matrix
+///
+static cv::Mat listToMat(const QList<QVariant> &list, int rows, int cols)
+{
+    if (list.size() != rows * cols)
+        return cv::Mat();
+
+    cv::Mat_<double> mat(rows, cols);
+    for (int i = 0; i < list.size(); i++)
+        mat(i / cols, i % cols) = list.at(i).toDouble();
+    return mat;
+}
+
+LensCalibration::LensCalibration()
+    : boardSize(9, 6)
+{
+}
+
+LensCalibration::~LensCalibration()
+{
+}
+
+void LensCalibration::setBoardSize(cv::Size size)
+{
+    if (size != boardSize)
+        imagePoints.clear();
+    boardSize = size;
+}
+
+bool LensCalibration::addView(const cv::Mat &image)
+{
+    if (image.empty())
+        return false;
+
+    cv::Mat gray;
+    if (image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+
+    // All views need the same size, the camera model depends on it
+    if (!imagePoints.empty() && gray.size() != imageSize)
+        return false;
+
+    std::vector<cv::Point2f> corners;
+    bool found = cv::findChessboardCorners(
+        gray, boardSize, corners,
+        cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE
+    );
+    if (!found)
+        return false;
+
+    cv::cornerSubPix(
+        gray, corners, cv::Size(11, 11), cv::Size(-1, -1),
+        cv::TermCriteria(
+            cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01
+        )
+    );
+
+    imageSize = gray.size();
+    imagePoints.push_back(corners);
+    return true;
+}
+
+int LensCalibration::numViews() const
+{
+    return static_cast<int>(imagePoints.size());
+}
+
+void LensCalibration::clearViews()
+{
+    imagePoints.clear();
+}
+
+double LensCalibration::calibrate()
+{
+    if (imagePoints.empty())
+        return -1;
+
+    // The target is flat, the square size does not matter for distortion
+    std::vector<cv::Point3f> board;
+    for (int y = 0; y < boardSize.height; y++) {
+        for (int x = 0; x < boardSize.width; x++)
+            board.push_back(cv::Point3f(x, y, 0));
+    }
+    std::vector<std::vector<cv::Point3f>> objectPoints(
+        imagePoints.size(), board
+    );
+
+    cv::Mat camera;
+    cv::Mat coeffs;
+    std::vector<cv::Mat> rvecs;
+    std::vector<cv::Mat> tvecs;
+    double rms = cv::calibrateCamera(
+        objectPoints, imagePoints, imageSize, camera, coeffs, rvecs, tvecs,
+        cv::CALIB_FIX_K3
+    );
+    if (!cv::checkRange(camera) || !cv::checkRange(coeffs))
+        return -1;
+
+    cameraMatrix = camera;
+    distCoeffs = coeffs;
+    mapSize = cv::Size();
+    return rms;
+}
+
+bool LensCalibration::isValid() const
+{
+    return !cameraMatrix.empty() && !distCoeffs.empty();
+}
+
+void LensCalibration::clear()
+{
+    cameraMatrix.release();
+    distCoeffs.release();
+    map1.release();
+    map2.release();
+    mapSize = cv::Size();
+}
+
+void LensCalibration::initMaps(cv::Size frameSize)
+{
+    // The camera matrix belongs to the calibration image size. Scale it, if
+    // the camera delivers a different resolution now.
+    cv::Mat_<double> camera = cameraMatrix.clone();
+    if (imageSize.width > 0 && imageSize.height > 0) {
+        double sx = static_cast<double>(frameSize.width) / imageSize.width;
+        double sy = static_cast<double>(frameSize.height) / imageSize.height;
+        camera(0, 0) *= sx;
+        camera(0, 2) *= sx;
+        camera(1, 1) *= sy;
+        camera(1, 2) *= sy;
+    }
+
+    // CV_16SC2 creates the fixed point maps, which are the fastest for remap
+    cv::initUndistortRectifyMap(
+        camera, distCoeffs, cv::Mat(), camera, frameSize, CV_16SC2,
+        map1, map2
+    );
+    mapSize = frameSize;
+}
+
+void LensCalibration::undistort(const cv::Mat &src, cv::Mat &dst)
+{
+    if (!isValid() || src.empty()) {
+        if (&src != &dst)
+            src.copyTo(dst);
+        return;
+    }
+
+    if (src.size() != mapSize)
+        initMaps(src.size());
+
+    cv::remap(src, dst, map1, map2, cv::INTER_LINEAR);
+}
+
+bool LensCalibration::readSettings()
+{
+    QSettings settings;
+    settings.beginGroup("lens_calibration");
+    cv::Mat camera = listToMat(
+        settings.value("camera_matrix").toList(), 3, 3
+    );
+    QList<QVariant> coeffList = settings.value("dist_coeffs").toList();
+    cv::Mat coeffs = listToMat(coeffList, 1, coeffList.size());
+    imageSize = cv::Size(
+        settings.value("image_width", 0).toInt(),
+        settings.value("image_height", 0).toInt()
+    );
+    settings.endGroup();
+
+    if (camera.empty() || coeffs.empty()) {
+        clear();
+        return false;
+    }
+
+    cameraMatrix = camera;
+    distCoeffs = coeffs;
+    mapSize = cv::Size();
+    return true;
+}
+
+void LensCalibration::writeSettings() const
+{
+    QSettings settings;
+    settings.beginGroup("lens_calibration");
+    if (isValid()) {
+        settings.setValue("camera_matrix", matToList(cameraMatrix));
+        settings.setValue("dist_coeffs", matToList(distCoeffs));
+        settings.setValue("image_width", imageSize.width);
+        settings.setValue("image_height", imageSize.height);
+    } else {
+        settings.remove("");
+    }
+    settings.endGroup();
+    settings.sync();
+}
@@ -0,0 +1,128 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef LENSCALIBRATION_H
+#define LENSCALIBRATION_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Lens distortion calibration of the camera
+/// The distortion parameters are estimated from images of a chessboard
+/// target and persisted in the application settings. For undistortion the
+/// remap lookup tables are calculated once per frame size as fixed point maps,
+/// so every frame only costs one cv::remap call.
+///
+class LensCalibration
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    LensCalibration();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~LensCalibration();
+
+    ///
+    /// \brief Set the size of the chessboard target
+    /// \param size Number of inner corners per row and column
+    ///
+    void setBoardSize(cv::Size size);
+
+    ///
+    /// \brief Add an image of the calibration target
+    /// \param image Image showing the whole chessboard
+    /// \return True if the chessboard has been found, else false
+    ///
+    bool addView(const cv::Mat &image);
+
+    ///
+    /// \brief Get the number of views with a found chessboard
+    /// \return Number of usable views
+    ///
+    int numViews() const;
+
+    ///
+    /// \brief Remove all collected views
+    ///
+    void clearViews();
+
+    ///
+    /// \brief Estimate the distortion parameters from the collected views
+    /// \return The RMS reprojection error in pixels or a negative value if
+    /// the calibration failed
+    ///
+    double calibrate();
+
+    ///
+    /// \brief Get the calibration state
+    /// \return True if distortion parameters are available, else false
+    ///
+    bool isValid() const;
+
+    ///
+    /// \brief Forget the distortion parameters and maps
+    ///
+    void clear();
+
+    ///
+    /// \brief Undistort a frame
+    /// The lookup tables are calculated on the first call for a frame size.
+    /// \param src The distorted frame
+    /// \param dst The undistorted frame
+    ///
+    void undistort(const cv::Mat &src, cv::Mat &dst);
+
+    ///
+    /// \brief Read the distortion parameters from the settings
+    /// \return True if a calibration has been found, else false
+    ///
+    bool readSettings();
+
+    ///
+    /// \brief Write the distortion parameters to the settings
+    ///
+    void writeSettings() const;
+
+private:
+    ///
+    /// \brief Calculate the remap lookup tables for the given frame size
+    /// \param frameSize Size of the frames to undistort
+    ///
+    void initMaps(cv::Size frameSize);
+
+    cv::Size boardSize;
+    cv::Size imageSize;
+    std::vector<std::vector<cv::Point2f>> imagePoints;
+
+    cv::Mat cameraMatrix;
+    cv::Mat distCoeffs;
+
+    cv::Size mapSize;
+    cv::Mat map1;
+    cv::Mat map2;
+};
+
+
+#endif // LENSCALIBRATION_H
@@ -18,6 +18,7 @@
 //
 
 #include "livecamera.hpp"
+#include "stagetrack.hpp"
 
 #include <QtCore/QDebug>
 
@@ -26,13 +27,16 @@ LiveCamera::LiveCamera(QObject *parent)
     : QObject(parent),
     exit(false),
     liveImage(new cv::Mat()),
-    videoCapture(nullptr)
+    imageTime(0),
+    videoCapture(nullptr),
+    lensCalibration(new LensCalibration())
 {
 }
 
 LiveCamera::~LiveCamera()
 {
     delete liveImage;
+    delete lensCalibration;
 }
 
 void LiveCamera::runLiveCamera()
@@ -42,11 +46,31 @@ void LiveCamera::runLiveCamera()
         return;
     }
 
+    cv::Mat frame;
     exit = false;
     while (!exit) {
-        *videoCapture >> *liveImage;
-        if (liveImage->empty())
+        *videoCapture >> frame;
+        if (frame.empty())
             break;
+        qint64 time = StageTrack::now();
+
+        // Undistort with the precalculated lookup tables into a new buffer,
+        // so an image that has been handed out is never written again
+        cv::Mat image;
+        calibrationMutex.lock();
+        if (lensCalibration->isValid()) {
+            lensCalibration->undistort(frame, image);
+        } else {
+            // The next read must not overwrite the handed over frame
+            image = frame;
+            frame.release();
+        }
+        calibrationMutex.unlock();
+
+        imageMutex.lock();
+        *liveImage = image;
+        imageTime = time;
+        imageMutex.unlock();
 
         emit liveImageUpdated();
     }
@@ -60,7 +84,15 @@ void LiveCamera::exitLiveCamera()
 
 cv::Mat LiveCamera::getCurrentImage()
 {
-    return *liveImage;
+    QMutexLocker locker(&imageMutex);
+    return liveImage->clone();
+}
+
+cv::Mat LiveCamera::getCurrentImage(qint64 &timestamp)
+{
+    QMutexLocker locker(&imageMutex);
+    timestamp = imageTime;
+    return liveImage->clone();
 }
 
 cv::VideoCapture* LiveCamera::setVideoCaptureDevice(cv::VideoCapture *cap)
@@ -68,4 +100,10 @@ cv::VideoCapture* LiveCamera::setVideoCaptureDevice(cv::VideoCapture *cap)
     cv::VideoCapture *tmp = this->videoCapture;
     this->videoCapture = cap;
     return tmp;
-}
\ No newline at end of file
+}
+
+void LiveCamera::setLensCalibration(const LensCalibration &calibration)
+{
+    QMutexLocker locker(&calibrationMutex);
+    *lensCalibration = calibration;
+}
@@ -21,8 +21,11 @@
 #define LIVECAMERA_H
 
 #include <QtCore/QThread>
+#include <QtCore/QMutex>
 #include <opencv2/opencv.hpp>
 
+#include "lenscalibration.hpp"
+
 
 ///
 /// \brief The LiveCamera class, showing a live image from the usb-camera
@@ -52,6 +55,14 @@ public:
     ///
     cv::VideoCapture* setVideoCaptureDevice(cv::VideoCapture *cap);
 
+    ///
+    /// \brief Set the lens calibration used to undistort every frame
+    /// The calibration is copied, so it can be changed while the camera is
+    /// running. An invalid calibration disables the undistortion.
+    /// \param calibration The lens calibration
+    ///
+    void setLensCalibration(const LensCalibration &calibration);
+
 public slots:
     ///
     /// \brief Show the live camera image
@@ -65,10 +76,17 @@ public slots:
 
     ///
     /// \brief Get the current live image
-    /// \return The current live image as cv::Mat
+    /// \return A copy of the current live image
     ///
     cv::Mat getCurrentImage();
 
+    ///
+    /// \brief Get the current live image with the time it has been read
+    /// \param timestamp Time after reading the frame, see StageTrack::now
+    /// \return A copy of the current live image
+    ///
+    cv::Mat getCurrentImage(qint64 &timestamp);
+
 signals:
     ///
     /// \brief Emited when live image has been updated
@@ -83,7 +101,12 @@ signals:
 private:
     bool exit;
     cv::Mat *liveImage;
+    qint64 imageTime;
+    QMutex imageMutex;
     cv::VideoCapture *videoCapture;
+
+    LensCalibration *lensCalibration;
+    QMutex calibrationMutex;
 };
 
 
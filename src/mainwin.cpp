@@ -17,11 +17,17 @@
 // along with microscope. If not, see <http://www.gnu.org/licenses/>.
 //
 
+#include <cmath>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 #include <QtCore/QDateTime>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
 #include <QtCore/QThread>
 #include <QtGui/QPixmap>
 #include <QtGui/QImage>
+#include <QtGui/QImageReader>
 #include <QtGui/QList>
 #include <QtCore/QDebug>
 #include <QtWidgets/QDialog>
@@ -34,6 +40,7 @@
 #include <QtWidgets/QSpacerItem>
 #include <QtWidgets/QScrollArea>
 #include <QtWidgets/QInputDialog>
+#include <QtWidgets/QApplication>
 #include <QtSerialPort/QSerialPort>
 #include <QtSerialPort/QSerialPortInfo>
 
@@ -43,6 +50,26 @@
 #include "controller.hpp"
 #include "stitchingwidget.hpp"
 #include "autostitchingstatus.hpp"
+#include "lenscalibration.hpp"
+#include "imagecalibration.hpp"
+#include "stitchingengine.hpp"
+#include "tilegrid.hpp"
+#include "tileset.hpp"
+#include "scanplanner.hpp"
+#include "backlashcalibration.hpp"
+#include "stagecalibration.hpp"
+#include "stagecalibrator.hpp"
+#include "adaptivescan.hpp"
+#include "continuousscan.hpp"
+#include "scanjournal.hpp"
+#include "driftmodel.hpp"
+#include "sessionfile.hpp"
+#include "stitchreport.hpp"
+#include "tileexporter.hpp"
+#include "pyramidimage.hpp"
+#include "pyramidcache.hpp"
+#include "mosaicview.hpp"
+#include "tileserver.hpp"
 
 
 // Initialize the singleton instance for working with it in static functions
@@ -50,7 +77,7 @@ MainWin* MainWin::_instance = nullptr;
 
 MainWin::MainWin(QWidget *parent, Qt::WindowFlags flags)
     : QMainWindow(parent, flags),
-    mats(new QVector<cv::Mat>()),
+    tiles(new TileSet()),
     cap(nullptr),
     cameraConnected(false),
     controllerConnected(false),
@@ -63,18 +90,54 @@ MainWin::MainWin(QWidget *parent, Qt::WindowFlags flags)
     previewLiveCamera(new ImagePreview(nullptr, false)),
     layoutMain(new QVBoxLayout()),
     controller(new Controller()),
+    controllerThread(new QThread()),
+    scanPipeline(new ScanPipeline()),
+    stitchAfterProcessing(false),
+    recomposeAfterProcessing(false),
     gridNumMaxX(5),
     gridNumMaxY(5),
     stitchWidget(new StitchingWidget()),
     statusWidget(new AutoStitchingStatus(tr(""), nullptr, false)),
-    stopAutoScanning(false)
+    stopAutoScanning(false),
+    lensCalibration(new LensCalibration()),
+    calibrationPreview(new ImageCalibration()),
+    backlashCalibration(new BacklashCalibration(controller, liveCamera, this)),
+    stageCalibrator(new StageCalibrator(controller, liveCamera, this)),
+    adaptiveScan(new AdaptiveScan(controller, this)),
+    continuousScan(new ContinuousScan(controller, liveCamera, this)),
+    scanJournal(new ScanJournal()),
+    stitchingEngine(new StitchingEngine()),
+    retakingTiles(false),
+    driftModel(new DriftModel()),
+    session(new SessionFile()),
+    tileExporter(new TileExporter()),
+    tileImporter(new TileImporter()),
+    fileStatus(new AutoStitchingStatus(tr(""), nullptr, false)),
+    pyramidCache(new PyramidCache()),
+    mosaicView(new MosaicView()),
+    serverThread(new QThread()),
+    tileServer(new TileServer())
 {
     ui.setupUi(this);
 
+    // Undistort the live camera with the last lens calibration
+    lensCalibration->readSettings();
+    liveCamera->setLensCalibration(*lensCalibration);
+    calibrationPreview->setVisible(false);
+    calibrationPreview->setWindowTitle(tr("Lens calibration"));
+
     statusWidget->setWindowModality(Qt::ApplicationModal);
     liveCamera->moveToThread(thread);
     thread->start();
 
+    // Serial communication never blocks the gui
+    controller->moveToThread(controllerThread);
+    controllerThread->start();
+
+    // Neither are the requests for tiles
+    tileServer->moveToThread(serverThread);
+    serverThread->start();
+
     QScrollArea *scrollArea = new QScrollArea(this);
     scrollArea->setWidget(stitchWidget);
     setCentralWidget(scrollArea);
@@ -82,6 +145,8 @@ MainWin::MainWin(QWidget *parent, Qt::WindowFlags flags)
     preview->setVisible(false);
     previewLiveCamera->setVisible(false);
     previewLiveCamera->setWindowTitle(tr("Live camera"));
+    mosaicView->setVisible(false);
+    mosaicView->resize(1024, 768);
 
     // Add status labels
     statusBar()->addPermanentWidget(labelStatusCamera);
@@ -97,6 +162,16 @@ MainWin::MainWin(QWidget *parent, Qt::WindowFlags flags)
         settings.value("window_width", 1000).toInt(),
         settings.value("window_height", 1000).toInt()
     );
+    ui.actAdaptiveScan->setChecked(
+        settings.value("adaptive_scan", false).toBool()
+    );
+    ui.actContinuousScan->setChecked(
+        settings.value("continuous_scan", false).toBool()
+        && !ui.actAdaptiveScan->isChecked()
+    );
+    ui.actDriftCorrection->setChecked(
+        settings.value("drift_correction", false).toBool()
+    );
 
     updateRecentMenu();
     buildConnections();
@@ -106,15 +181,33 @@ MainWin::~MainWin()
 {
     thread->quit();
     thread->wait();
+    controllerThread->quit();
+    controllerThread->wait();
+    serverThread->quit();
+    serverThread->wait();
 
+    delete scanPipeline;
     delete thread;
+    delete controllerThread;
+    delete serverThread;
     delete liveCamera;
-    delete mats;
-    delete controller;
+    delete tiles;
+    delete lensCalibration;
+    delete calibrationPreview;
+    delete scanJournal;
+    delete stitchingEngine;
+    delete driftModel;
+
+    // The export may still write tiles of the session
+    delete tileExporter;
+    delete tileImporter;
+    delete fileStatus;
+    delete mosaicView;
+    delete pyramidCache;
+    delete session;
 
     // Delete opencv objects
     delete cap;
-    delete mats;
 }
 
 void MainWin::buildConnections()
@@ -135,12 +228,144 @@ void MainWin::buildConnections()
         thread, &QThread::finished, liveCamera, &QObject::deleteLater
     );
     connect(
-        controller, &Controller::ready, this, &MainWin::controllerReady
+        controller, &Controller::positionReached, this,
+        &MainWin::scanPositionReached
+    );
+    connect(
+        controller, &Controller::scanFinished, this, &MainWin::scanFinished
+    );
+    connect(
+        scanPipeline, &ScanPipeline::tileProcessed, this,
+        &MainWin::scanTileProcessed
+    );
+    connect(
+        scanPipeline, &ScanPipeline::idle, this, &MainWin::scanProcessingDone
+    );
+    connect(
+        controller, &Controller::connectionChanged, this,
+        &MainWin::controllerConnectionChanged
+    );
+    connect(
+        controller, &Controller::error, this, &MainWin::controllerError
+    );
+    connect(
+        controllerThread, &QThread::finished, controller,
+        &QObject::deleteLater
     );
     connect(
         statusWidget, &AutoStitchingStatus::stopAutoScanning, this,
         &MainWin::stopAutoScanningProcess
     );
+    connect(
+        tileExporter, &TileExporter::progress, fileStatus,
+        [this](int done, int total) {
+            fileStatus->setProgressInformation(total, done);
+        }
+    );
+    connect(
+        tileExporter, &TileExporter::finished, this,
+        &MainWin::saveAllImagesFinished
+    );
+    connect(
+        tileImporter, &TileImporter::tileImported, this,
+        &MainWin::importTileLoaded
+    );
+    connect(
+        tileImporter, &TileImporter::progress, fileStatus,
+        [this](int done, int total) {
+            fileStatus->setProgressInformation(total, done);
+        }
+    );
+    connect(
+        tileImporter, &TileImporter::finished, this,
+        &MainWin::importTilesFinished
+    );
+    connect(
+        pyramidCache, &PyramidCache::converted, this,
+        &MainWin::pyramidConverted
+    );
+    connect(
+        serverThread, &QThread::finished, tileServer, &QObject::deleteLater
+    );
+    connect(
+        tileServer, &TileServer::listening, this,
+        &MainWin::tileServerListening
+    );
+    connect(
+        ui.actShareMosaic, &QAction::toggled, this, &MainWin::shareMosaic
+    );
+    connect(
+        fileStatus, &AutoStitchingStatus::stopAutoScanning, tileExporter,
+        &TileExporter::cancel
+    );
+    connect(
+        fileStatus, &AutoStitchingStatus::stopAutoScanning, tileImporter,
+        &TileImporter::cancel
+    );
+    connect(
+        backlashCalibration, &BacklashCalibration::progress, this,
+        [this](const QString &message) { statusBar()->showMessage(message); }
+    );
+    connect(
+        backlashCalibration, &BacklashCalibration::finished, this,
+        &MainWin::backlashCalibrationFinished
+    );
+    connect(
+        stageCalibrator, &StageCalibrator::progress, this,
+        [this](const QString &message) { statusBar()->showMessage(message); }
+    );
+    connect(
+        stageCalibrator, &StageCalibrator::finished, this,
+        &MainWin::stageCalibrationFinished
+    );
+    connect(
+        adaptiveScan, &AdaptiveScan::positionReached, this,
+        &MainWin::scanPositionReached
+    );
+    connect(
+        adaptiveScan, &AdaptiveScan::finished, this, &MainWin::scanFinished
+    );
+    connect(
+        continuousScan, &ContinuousScan::tileCaptured, this,
+        &MainWin::continuousTileCaptured
+    );
+    connect(
+        continuousScan, &ContinuousScan::finished, this,
+        &MainWin::scanFinished
+    );
+    connect(
+        adaptiveScan, &AdaptiveScan::referenceReached, this,
+        &MainWin::scanReferenceReached
+    );
+    connect(
+        continuousScan, &ContinuousScan::referenceReached, this,
+        &MainWin::scanReferenceReached
+    );
+
+    // The adaptive scan decides on every tile where to go, so it cannot
+    // sweep over a row
+    connect(
+        ui.actAdaptiveScan, &QAction::toggled, this, [this](bool checked) {
+            QSettings settings;
+            settings.setValue("adaptive_scan", checked);
+            if (checked)
+                ui.actContinuousScan->setChecked(false);
+        }
+    );
+    connect(
+        ui.actContinuousScan, &QAction::toggled, this, [this](bool checked) {
+            QSettings settings;
+            settings.setValue("continuous_scan", checked);
+            if (checked)
+                ui.actAdaptiveScan->setChecked(false);
+        }
+    );
+    connect(
+        ui.actDriftCorrection, &QAction::toggled, this, [](bool checked) {
+            QSettings settings;
+            settings.setValue("drift_correction", checked);
+        }
+    );
 }
 
 void MainWin::stopAutoScanningProcess()
@@ -199,19 +424,54 @@ bool MainWin::initController()
     if (device.isEmpty())
         return false;
     controller->setDevice(device);
-    if (!controller->connectPort()) {
-        QMessageBox::critical(
-            this, tr("Initialize camera"),
-            tr("Cannot connect the controller!")
-        );
-        labelStatusController->setText(tr("Controller disconnected!"));
-        return false;
-    }
-    statusBar()->showMessage(tr("Controller connected!"));
-    labelStatusController->setText(tr("Controller connected!"));
+    controller->connectPort();
+    labelStatusController->setText(tr("Connecting controller..."));
     return true;
 }
 
+void MainWin::controllerConnectionChanged(bool connected)
+{
+    if (connected) {
+        statusBar()->showMessage(tr("Controller connected!"));
+        labelStatusController->setText(tr("Controller connected!"));
+
+        // The firmware starts with its default backlash after every reset
+        QSettings settings;
+        if (settings.contains("backlash_m2"))
+            controller->setBacklash(settings.value("backlash_m2").toInt());
+        return;
+    }
+
+    // Either disconnected or the connection failed
+    controllerConnected = false;
+    ui.actConnController->setChecked(false);
+    labelStatusController->setText(tr("Controller disconnected!"));
+}
+
+void MainWin::controllerError(const QString &message)
+{
+    QString text = tr("Controller error: %1").arg(message);
+    bool retaking = retakingTiles;
+    if (guiMode == GuiMode::AUTOMATIC_CAMERA_STITCHING) {
+        guiMode = GuiMode::NORMAL;
+        stopAutoScanning = false;
+        retakingTiles = false;
+        statusWidget->setVisible(false);
+        if (scanJournal->isOpen() && !retaking) {
+            text += "\n\n" + tr("The scan can be continued with Hardware > "
+                "Resume scan.");
+        }
+    }
+
+    QMessageBox::critical(this, tr("Controller"), text);
+
+    // The tiles taken again so far are kept
+    if (retaking && scanPipeline->pending() > 0)
+        recomposeAfterProcessing = true;
+    else if (retaking)
+        recomposeRetakenTiles();
+}
+
 void MainWin::connectController()
 {
     if (controllerConnected) {
@@ -281,48 +541,35 @@ void MainWin::takeImageFromCamera()
 {
     cv::Mat liveMat;
     liveCamera->getCurrentImage().copyTo(liveMat);
-    mats->push_back(liveMat);
+    tiles->append(liveMat);
     stitchWidget->addImage(liveMat);
 }
 
-void MainWin::runAutoCameraStitching()
+bool MainWin::connectScanHardware()
 {
     // The camera and the controller needs to be connected. If they are not
     // the system will try to connect them, otherwise abort the process.
     if (!cameraConnected) {
         cameraConnected = initCamera();
         if (!cameraConnected)
-            return;
+            return false;
     }
     if (!controllerConnected) {
         controllerConnected = initController();
         if (!controllerConnected)
-            return;
+            return false;
     }
+    return true;
+}
 
+void MainWin::beginAutoScan(cv::Point steps, cv::Size grid)
+{
     // Show the status dialog
     statusWidget->setVisible(true);
 
     // Change gui to auto camera stitching mode.
     guiMode = GuiMode::AUTOMATIC_CAMERA_STITCHING;
 
-    // The auto camera stitching mode works mainly as the manual mode, extended
-    // by an automatic camera moving mode. Therefore some parameter are needed
-    // to determin how much every part of the motor should run. Additionally
-    // the system needs to know what position both motors have on start. This
-    // should be controlled directly on the arduino firmware wil electronic
-    // sensors.
-
-    // How much should everything move in both direction. One move is defined
-    // by a camera step with a fixed motor move. For 360° the motor here has
-    // 2048 steps.
-    int maxMovesY = 6;
-    int maxMovesX = 4;
-
-    // Steps per move
-    int stepsPerMoveX = 80;
-    int stepsPerMoveY = 400;
-
     // Set video capture device
     liveCamera->setVideoCaptureDevice(cap);
 
@@ -331,177 +578,1484 @@ void MainWin::runAutoCameraStitching()
     QThread::sleep(2);
 
     // Empty the picture buffer
-    mats->clear();
+    tiles->clear();
+    scanPipeline->reset();
+    stitchAfterProcessing = false;
+    recomposeAfterProcessing = false;
+    retakingTiles = false;
+    retakenTiles.clear();
+    retakeTargets.clear();
+    driftModel->clear();
+
+    // Tiles are written while scanning, if a directory has been set
+    QSettings settings;
+    scanPipeline->setOutputDirectory(
+        settings.value("scan_directory").toString()
+    );
 
     // Send a reset signal to the controller
     controller->reset();
-    controller->setMotorIntervall(stepsPerMoveX, stepsPerMoveY);
-    controller->setMaxMoves(maxMovesX, maxMovesY);
+    controller->setMotorIntervall(steps.x, steps.y);
+    controller->setMaxMoves(grid.width - 1, grid.height - 1);
+    scanSteps = steps;
+    scanStage = cv::Point();
 
     // Set progress information
     statusWidget->setLabel(
-        tr("Scanning picture number %1 from %2").arg(1).arg(
-            maxMovesX * maxMovesY
-        )
+        tr("Scanning picture number %1 from %2").arg(1).arg(grid.area())
     );
-    statusWidget->setProgressInformation(maxMovesX * maxMovesY, 1);
+    statusWidget->setProgressInformation(grid.area(), 0);
+}
 
-    // Start by moving motor once
-    stopAutoScanning = false;
-    controller->moveToNextPos();
+void MainWin::recordStage(cv::Point steps)
+{
+    scanStage = steps;
+    scanJournal->appendStage(steps);
 }
 
-void MainWin::controllerReady()
+int MainWin::referenceInterval() const
 {
-    if (stopAutoScanning) {
-        stopAutoScanning = false;
-        takeImageFromCamera();
-        statusWidget->setVisible(false);
-        return;
-    }
-    
-    if (guiMode == GuiMode::AUTOMATIC_CAMERA_STITCHING) {
-        takeImageFromCamera();
-        if (!controller->hasReachedPosEnd())
-            controller->moveToNextPos();
-        else
-            stitchImages();
-    }
+    if (!ui.actDriftCorrection->isChecked())
+        return 0;
+
+    QSettings settings;
+    int minutes = settings.value("drift_interval_min", 10).toInt();
+    return std::max(1, minutes) * 60 * 1000;
 }
 
-void MainWin::openImage()
+cv::Point MainWin::alignStageToCell(cv::Size grid)
 {
-    QString fileName = QFileDialog::getOpenFileName(
-        this, tr("Open image file"), QDir::homePath()
+    // A sweep of the continuous scan ends between the cells, the stage goes
+    // to the nearest one first
+    cv::Point cell(
+        static_cast<int>(std::lround(
+            static_cast<double>(scanStage.x) / std::max(1, scanSteps.x))),
+        static_cast<int>(std::lround(
+            static_cast<double>(scanStage.y) / std::max(1, scanSteps.y)))
     );
-    if (fileName.isEmpty())
-        return;
+    cell.x = std::max(0, std::min(cell.x, grid.width - 1));
+    cell.y = std::max(0, std::min(cell.y, grid.height - 1));
+    int stepsM1 = cell.x * scanSteps.x - scanStage.x;
+    int stepsM2 = cell.y * scanSteps.y - scanStage.y;
+    if (stepsM1 != 0)
+        controller->moveSteps(MotorNumber::ONE, -stepsM1);
+    if (stepsM2 != 0)
+        controller->moveSteps(MotorNumber::TWO, stepsM2);
+    recordStage(cv::Point(cell.x * scanSteps.x, cell.y * scanSteps.y));
+    return cell;
+}
 
-    cv::Mat matTmp = cv::imread(fileName.toStdString());
-    QPixmap tmpPix;
-    if (!tmpPix.load(fileName) || matTmp.data == nullptr) {
-        QMessageBox::warning(
-            this, tr("Cannot load image"),
-            tr("Cannot load image from file name!")
-        );
+void MainWin::runAutoCameraStitching()
+{
+    if (!connectScanHardware())
         return;
-    }
 
-    matTmp.copyTo(currMat);
-    stitchWidget->addImage(matTmp);
-    addImagePathToRecent(fileName);
-}
+    // The auto camera stitching mode works mainly as the manual mode, extended
+    // by an automatic camera moving mode. Therefore some parameter are needed
+    // to determin how much every part of the motor should run. Additionally
+    // the system needs to know what position both motors have on start. This
+    // should be controlled directly on the arduino firmware wil electronic
+    // sensors.
 
-void MainWin::stitchImages()
-{
-    QPixmap tmpPix;
-    cv::Mat stitchedMat;
-    QVector<cv::Mat> mats = stitchWidget->getImages();
+    // How much should everything move in both direction. One move is defined
+    // by a camera step with a fixed motor move. For 360° the motor here has
+    // 2048 steps. The start position is part of the scan. With a calibrated
+    // objective the steps follow from the overlap and the grid from the
+    // area, else the fixed defaults are used.
+    cv::Point steps(80, 400);
+    cv::Size grid(5, 7);
+    StageCalibration stage;
+    if (stage.readSettings(StageCalibration::currentObjective())) {
+        if (!selectScanArea(stage, steps, grid))
+            return;
+    }
+    int maxMovesX = grid.width - 1;
+    int maxMovesY = grid.height - 1;
 
-    // No need to stitch, when there is only one in pipe
-    if (mats.size() > 1) {
-        // Stitch images
-        cv::Ptr<cv::Stitcher> stitcher = cv::Stitcher::create(
-            cv::Stitcher::SCANS
-        );
-        cv::Stitcher::Status status = stitcher->stitch(
-            mats.toStdVector(), stitchedMat
+    // Steps per move
+    int stepsPerMoveX = steps.x;
+    int stepsPerMoveY = steps.y;
+
+    // Choose the order with the least motor time. About 0.2 s are spent at
+    // every position for settling and the capture.
+    ScanPlanner planner;
+    planner.setMotorModel(2048, 5, controller->backlash());
+    planner.setSteps(stepsPerMoveX, stepsPerMoveY);
+    planner.setTileTime(0.2);
+    ScanPlan plan = planner.plan(maxMovesX + 1, maxMovesY + 1);
+    bool adaptive = ui.actAdaptiveScan->isChecked();
+    bool continuous = ui.actContinuousScan->isChecked() && !adaptive;
+    if (continuous && !controller->isBinary()) {
+        QMessageBox::information(
+            this, tr("Auto camera stitching"),
+            tr("The controller does not support the continuous motion, the "
+                "stage stops at every tile.")
         );
+        continuous = false;
+    }
 
-        if (status != cv::Stitcher::OK) {
-            QMessageBox::critical(
-                this, tr("Stitch Images"), tr("Cannot stitch images!")
-            );
-            return;
-        }
+    // The firmware cannot leave its plan for the reference cell, with the
+    // drift corrected a grid scan sends every move itself like the adaptive
+    // scan
+    bool hostDriven = adaptive
+        || (!continuous && ui.actDriftCorrection->isChecked());
 
-        tmpPix = matToPixmap(stitchedMat);
-        stitchedMat.copyTo(currMat);
-    } else if (mats.size() == 1) {
-        tmpPix = matToPixmap(mats.first());
-    } else {
-        QMessageBox::critical(
-            this, tr("Stitch Images"), tr("There are no images to stitch!")
+    // Sweep as fast as the camera delivers a frame near every column and
+    // the motion blur allows. Without a calibration of the objective the
+    // blur is unknown.
+    QSettings settings;
+    int sweepSpeed = 0;
+    if (continuous) {
+        double fps = cap->get(cv::CAP_PROP_FPS);
+        double pixelsPerStep = stage.isValid()
+            ? cv::norm(stage.motion(true)) : 0;
+        sweepSpeed = ContinuousScan::speedFor(
+            stepsPerMoveX,
+            settings.value("continuous_tolerance", 0.125).toDouble(),
+            fps > 0 ? fps : 30,
+            settings.value("camera_exposure_ms", 10.0).toDouble(),
+            pixelsPerStep,
+            settings.value("continuous_max_blur", 1.0).toDouble()
+        );
+        continuousScan->setBlurLimit(
+            settings.value("camera_exposure_ms", 10.0).toDouble(),
+            pixelsPerStep,
+            settings.value("continuous_max_blur", 1.0).toDouble()
         );
+    }
+    QString question = tr(
+        "Scanning %1 x %2 tiles %3 takes about %4. Start the scan?"
+    ).arg(plan.columns).arg(plan.rows)
+        .arg(plan.order == GridOrder::ROW_MAJOR
+            ? tr("row by row") : tr("column by column"))
+        .arg(ScanPlanner::formatDuration(plan.seconds));
+    if (adaptive) {
+        question = tr(
+            "Scanning up to %1 x %2 tiles, empty ones are skipped. The full "
+            "grid takes about %3. Start the scan?"
+        ).arg(plan.columns).arg(plan.rows)
+            .arg(ScanPlanner::formatDuration(plan.seconds));
+    } else if (continuous) {
+        question = tr(
+            "Scanning %1 x %2 tiles row by row while moving with %3 steps "
+            "per second. Start the scan?"
+        ).arg(plan.columns).arg(plan.rows).arg(sweepSpeed);
+    }
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Auto camera stitching"), question
+    );
+    if (answer != QMessageBox::Yes)
         return;
+    beginAutoScan(steps, cv::Size(maxMovesX + 1, maxMovesY + 1));
+
+    // With a scan directory every tile and stage position is recorded, so
+    // the scan can be resumed after a crash or a lost connection
+    QString directory = settings.value("scan_directory").toString();
+    scanPath = plan.cells;
+    if (!directory.isEmpty() && !scanJournal->start(
+            directory, cv::Size(plan.columns, plan.rows), steps,
+            adaptive ? ScanJournal::Mode::ADAPTIVE : ScanJournal::Mode::GRID)) {
+        statusBar()->showMessage(
+            tr("The scan cannot be resumed: %1").arg(scanJournal->errorString())
+        );
     }
 
-    // Send picture to preview widget
-    preview->setPixmap(tmpPix);
-    preview->setVisible(true);
+    // The whole plan is uploaded at once. The firmware reports every position
+    // and waits there till the tile has been captured. Errors are reported
+    // with controllerError. The adaptive scan decides on every tile where to
+    // go next, so it sends every move itself. Without skipping it takes
+    // every cell. The continuous scan sweeps over every row and takes the
+    // tiles while moving.
+    stopAutoScanning = false;
+    if (hostDriven) {
+        adaptiveScan->setGrid(plan.columns, plan.rows);
+        adaptiveScan->setSteps(stepsPerMoveX, stepsPerMoveY);
+        adaptiveScan->setSeedSpacing(
+            adaptive ? settings.value("adaptive_scan_spacing", 2).toInt() : 1
+        );
+        adaptiveScan->setThreshold(
+            settings.value("adaptive_scan_threshold", 20.0).toDouble()
+        );
+        adaptiveScan->setReferenceInterval(referenceInterval());
+        adaptiveScan->start();
+    } else if (continuous) {
+        continuousScan->setGrid(plan.columns, plan.rows);
+        continuousScan->setSteps(stepsPerMoveX, stepsPerMoveY);
+        continuousScan->setSpeed(sweepSpeed);
+        continuousScan->setTolerance(
+            settings.value("continuous_tolerance", 0.125).toDouble()
+        );
+        continuousScan->setCameraLatency(
+            settings.value("camera_latency_ms", 0.0).toDouble()
+        );
+        continuousScan->setReferenceInterval(referenceInterval());
+        continuousScan->start();
+    } else {
+        controller->startScan(
+            plan.columns, plan.rows, 0, plan.serpentine, plan.order
+        );
+    }
 }
 
-void MainWin::deleteImage()
+void MainWin::resumeAutoCameraStitching()
 {
-    ImagePreview *preview = stitchWidget->getSelectedImagePreview();
-    if (preview == nullptr)
+    QSettings settings;
+    QString directory = settings.value("scan_directory").toString();
+    if (directory.isEmpty() || !scanJournal->read(directory)) {
+        QMessageBox::information(
+            this, tr("Resume scan"),
+            tr("There is no scan to resume. Scans are recorded in the scan "
+                "directory.")
+        );
         return;
-    stitchWidget->removeImage(preview);
-}
-
-void MainWin::saveSelectedImage()
-{
-    if (!stitchWidget->isImageSelected()) {
-        QMessageBox::critical(
-            this, tr("Save selected image"), 
-            tr("No image selected for saving!")
+    }
+    if (scanJournal->isFinished()) {
+        QMessageBox::information(
+            this, tr("Resume scan"),
+            tr("The last scan in %1 has been finished.").arg(directory)
         );
         return;
     }
-    cv::Mat mat = stitchWidget->getSelectedImage();
-    QString fileName = QFileDialog::getSaveFileName(
-        this, tr("Save selected image"), QDir::homePath()
+
+    // Only the tiles that can still be read are kept, the rest is taken
+    // again
+    std::vector<cv::Point> cells;
+    std::vector<cv::Mat> frames;
+    std::vector<QString> fileNames;
+    std::vector<qint64> times;
+    for (size_t i = 0; i < scanJournal->fileNames().size(); i++) {
+        cv::Mat frame = cv::imread(scanJournal->fileNames()[i].toStdString());
+        if (frame.empty())
+            continue;
+        cells.push_back(scanJournal->cells()[i]);
+        frames.push_back(frame);
+        fileNames.push_back(scanJournal->fileNames()[i]);
+        times.push_back(scanJournal->times()[i]);
+    }
+
+    cv::Size grid = scanJournal->grid();
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Resume scan"),
+        tr("%1 of the %2 x %3 tiles of the scan in %4 have been taken. The "
+            "stage must not have been moved since. Resume the scan?")
+            .arg(cells.size()).arg(grid.width).arg(grid.height)
+            .arg(directory)
     );
-    if (fileName.isEmpty())
+    if (answer != QMessageBox::Yes || !connectScanHardware())
         return;
-    if (!cv::imwrite(fileName.toStdString(), mat)) {
-        QMessageBox::critical(
-            this, tr("Save selected image"), 
-            tr("Error while saving image!")
+
+    cv::Point steps = scanJournal->steps();
+    beginAutoScan(steps, grid);
+    for (size_t i = 0; i < cells.size(); i++) {
+        tiles->append(frames[i], cells[i], times[i]);
+        scanPipeline->submit(frames[i], cells[i], fileNames[i]);
+    }
+
+    // The drift goes on from the reference of the start
+    cv::Mat reference = cv::imread(
+        scanJournal->referenceFile().toStdString()
+    );
+    if (!reference.empty()) {
+        driftModel->setReference(reference);
+        const std::vector<DriftModel::Sample> &samples
+            = scanJournal->drift().samples();
+        for (size_t i = 0; i < samples.size(); i++)
+            driftModel->addSample(samples[i].time, samples[i].drift);
+    }
+    if (!scanJournal->resume()) {
+        statusBar()->showMessage(
+            tr("The scan cannot be resumed again: %1")
+                .arg(scanJournal->errorString())
         );
     }
+
+    scanStage = scanJournal->stage();
+    cv::Point cell = alignStageToCell(grid);
+
+    // The rest is taken stop-and-go, a grid scan takes every cell left
+    stopAutoScanning = false;
+    adaptiveScan->setGrid(grid.width, grid.height);
+    adaptiveScan->setSteps(steps.x, steps.y);
+    adaptiveScan->setSeedSpacing(
+        scanJournal->mode() == ScanJournal::Mode::ADAPTIVE
+            ? settings.value("adaptive_scan_spacing", 2).toInt() : 1
+    );
+    adaptiveScan->setThreshold(
+        settings.value("adaptive_scan_threshold", 20.0).toDouble()
+    );
+    adaptiveScan->setReferenceInterval(referenceInterval());
+    adaptiveScan->resume(cell, cells, frames);
 }
 
-void MainWin::saveAllImages()
+void MainWin::retakeFlaggedTiles()
 {
-    QVector<cv::Mat> mats = stitchWidget->getImages();
+    if (guiMode != GuiMode::NORMAL)
+        return;
 
-    // Get a folder path
-    QString path = QFileDialog::getExistingDirectory(
-        this, tr("Folder for saving images"), QDir::homePath()
-    );
-    if (path.isEmpty())
+    const StitchReport &report = stitchingEngine->report();
+    std::vector<int> flagged = report.flaggedTiles();
+    if (flagged.empty()) {
+        QMessageBox::information(
+            this, tr("Take tiles again"),
+            tr("The last stitching has not flagged any tile.")
+        );
         return;
-    for (int i = 0; i < mats.size(); i++) {
-        cv::imwrite(
-            QString("%1/img_%2.png").arg(path).arg(i).toStdString(), 
-            mats.at(i)
+    }
+    if (!isScanStitched() || !cameraConnected || !controllerConnected) {
+        QMessageBox::information(
+            this, tr("Take tiles again"),
+            tr("Only the tiles of the last scan can be taken again, with the "
+                "camera and the controller connected.")
         );
+        return;
     }
 
-    QMessageBox::information(
-        this, tr("Save all images"), tr("All images have been saved!")
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Take tiles again"),
+        tr("%1 of the %2 tiles are flagged: %3. The stage must not have been "
+            "moved since the scan. Take them again?")
+            .arg(flagged.size()).arg(report.tiles().size())
+            .arg(report.summary())
     );
+    if (answer == QMessageBox::Yes)
+        retakeTiles(flagged);
 }
 
-// ---- NEW NEW NEW
-
-void MainWin::abortCameraStitching()
+bool MainWin::isScanStitched() const
 {
-    liveCamera->exitLiveCamera();
-    guiMode = GuiMode::NORMAL;
+    return scanSteps != cv::Point() && tiles->hasCells()
+        && tiles->size() == stitchWidget->getImages().size();
 }
 
-void MainWin::abortAutoCameraStitching()
+void MainWin::reviewStitchReport()
 {
-    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+    const StitchReport &report = stitchingEngine->report();
+    if (report.isEmpty() || !isScanStitched())
         return;
 
-    liveCamera->exitLiveCamera();
-    guiMode = GuiMode::NORMAL;
-}
-
-QPixmap MainWin::matToPixmap(cv::Mat mat)
+    // The report is kept with the tiles
+    QSettings settings;
+    QString directory = settings.value("scan_directory").toString();
+    if (!directory.isEmpty())
+        report.write(QDir(directory).absoluteFilePath("stitch.report"));
+
+    std::vector<int> flagged = report.flaggedTiles();
+    if (flagged.empty()) {
+        statusBar()->showMessage(
+            tr("All tiles are sharp, well exposed and registered.")
+        );
+        return;
+    }
+    statusBar()->showMessage(
+        tr("%1 tiles are flagged: %2").arg(flagged.size())
+            .arg(report.summary())
+    );
+    if (cameraConnected && controllerConnected)
+        retakeFlaggedTiles();
+}
+
+void MainWin::retakeTiles(const std::vector<int> &indices)
+{
+    std::vector<cv::Point> cells;
+    for (size_t i = 0; i < indices.size(); i++)
+        cells.push_back(tiles->cell(indices[i]));
+
+    guiMode = GuiMode::AUTOMATIC_CAMERA_STITCHING;
+    retakingTiles = true;
+    retakenTiles.clear();
+    retakeTargets.clear();
+    stopAutoScanning = false;
+    statusWidget->setVisible(true);
+    statusWidget->setLabel(
+        tr("Taking picture %1 of %2 again").arg(1).arg(cells.size())
+    );
+    statusWidget->setProgressInformation(static_cast<int>(cells.size()), 0);
+
+    // The stage goes the shortest way over the flagged cells only
+    cv::Size grid(
+        controller->maxMoves().x() + 1, controller->maxMoves().y() + 1
+    );
+    cv::Point cell = alignStageToCell(grid);
+    adaptiveScan->setGrid(grid.width, grid.height);
+    adaptiveScan->setSteps(scanSteps.x, scanSteps.y);
+    adaptiveScan->setReferenceInterval(0);
+    adaptiveScan->revisit(cell, cells);
+}
+
+void MainWin::recomposeRetakenTiles()
+{
+    std::vector<int> indices = retakenTiles;
+    retakenTiles.clear();
+    if (indices.empty())
+        return;
+
+    // Only the area of the new tiles is composed again
+    QVector<cv::Mat> mats = stitchWidget->getImages();
+    StitchingEngine::Status status = stitchingEngine->replaceTiles(
+        mats.toStdVector(), indices, currMat
+    );
+    if (status != StitchingEngine::Status::OK) {
+        QMessageBox::critical(
+            this, tr("Take tiles again"),
+            tr("The new tiles cannot be composed into the mosaic, stitch the "
+                "images again!")
+        );
+        return;
+    }
+
+    QPixmap tmpPix = matToPixmap(currMat);
+    preview->setPixmap(tmpPix);
+    preview->setVisible(true);
+    reviewStitchReport();
+}
+
+void MainWin::scanPositionReached(int x, int y)
+{
+    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+        return;
+
+    // The exposure is done with the copy, so the next move can start while
+    // the tile is processed
+    cv::Mat liveMat;
+    liveCamera->getCurrentImage().copyTo(liveMat);
+    qint64 time = QDateTime::currentMSecsSinceEpoch();
+    bool adaptive = adaptiveScan->isRunning();
+    if (!adaptive) {
+        // The firmware moves on to the next cell of the plan, which is
+        // recorded before it is sent there
+        cv::Point next(x, y);
+        auto it = std::find(scanPath.begin(), scanPath.end(), next);
+        if (!stopAutoScanning && it != scanPath.end()
+                && it + 1 != scanPath.end())
+            next = *(it + 1);
+        recordStage(cv::Point(next.x * scanSteps.x, next.y * scanSteps.y));
+    }
+    if (stopAutoScanning && !adaptive)
+        controller->abortScan();
+    else if (!adaptive)
+        controller->acknowledgeCapture();
+
+    if (retakingTiles) {
+        // The new tile replaces the old one, the preview follows when it has
+        // been processed
+        int index = tiles->indexOf(cv::Point(x, y));
+        if (index >= 0) {
+            tiles->replace(index, liveMat, time);
+            retakenTiles.push_back(index);
+            retakeTargets[scanPipeline->submit(liveMat, cv::Point(x, y))]
+                = index;
+        }
+    } else {
+        tiles->append(liveMat, cv::Point(x, y), time);
+        scanPipeline->submit(liveMat, cv::Point(x, y));
+    }
+
+    int numTiles = (controller->maxMoves().x() + 1)
+        * (controller->maxMoves().y() + 1);
+    if (!adaptive) {
+        statusWidget->setLabel(
+            tr("Scanning picture number %1 from %2").arg(tiles->size() + 1)
+                .arg(numTiles)
+        );
+        statusWidget->setProgressInformation(numTiles, tiles->size());
+        return;
+    }
+
+    // The adaptive scan decides with the tile where to go, it adds cells
+    // next to every tile with content and may finish right here
+    if (stopAutoScanning) {
+        adaptiveScan->abort();
+        return;
+    }
+    adaptiveScan->tileCaptured(liveMat);
+    if (!adaptiveScan->isRunning())
+        return;
+    cv::Point next = adaptiveScan->position();
+    recordStage(cv::Point(next.x * scanSteps.x, next.y * scanSteps.y));
+    if (retakingTiles) {
+        int count = static_cast<int>(retakenTiles.size());
+        statusWidget->setLabel(
+            tr("Taking picture %1 of %2 again").arg(count + 1)
+                .arg(count + adaptiveScan->remaining())
+        );
+        statusWidget->setProgressInformation(
+            count + adaptiveScan->remaining(), count
+        );
+        return;
+    }
+    numTiles = tiles->size() + adaptiveScan->remaining();
+    statusWidget->setLabel(
+        tr("Scanning picture number %1, %2 more planned")
+            .arg(tiles->size() + 1).arg(adaptiveScan->remaining())
+    );
+    statusWidget->setProgressInformation(numTiles, tiles->size());
+}
+
+void MainWin::scanFinished(bool completed)
+{
+    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+        return;
+
+    guiMode = GuiMode::NORMAL;
+    stopAutoScanning = false;
+    statusWidget->setVisible(false);
+
+    // The tiles taken so far are composed in, also if aborted
+    if (retakingTiles) {
+        retakingTiles = false;
+        if (scanPipeline->pending() > 0)
+            recomposeAfterProcessing = true;
+        else
+            recomposeRetakenTiles();
+        return;
+    }
+    scanJournal->finish(completed);
+
+    // Stitch when the last previews are there
+    if (completed && scanPipeline->pending() > 0)
+        stitchAfterProcessing = true;
+    else if (completed)
+        stitchImages();
+}
+
+void MainWin::continuousTileCaptured(const cv::Mat &frame, int x, int y)
+{
+    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+        return;
+
+    tiles->append(frame, cv::Point(x, y), QDateTime::currentMSecsSinceEpoch());
+    scanPipeline->submit(frame, cv::Point(x, y));
+    if (stopAutoScanning) {
+        continuousScan->abort();
+        return;
+    }
+    recordStage(continuousScan->stageSteps());
+
+    int numTiles = (controller->maxMoves().x() + 1)
+        * (controller->maxMoves().y() + 1);
+    statusWidget->setLabel(
+        tr("Scanning picture number %1 from %2").arg(tiles->size() + 1)
+            .arg(numTiles)
+    );
+    statusWidget->setProgressInformation(numTiles, tiles->size());
+}
+
+void MainWin::scanReferenceReached()
+{
+    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+        return;
+    recordStage(cv::Point());
+    if (stopAutoScanning) {
+        adaptiveScan->abort();
+        continuousScan->abort();
+        return;
+    }
+
+    // The first frame is the reference, every later one gives the drift
+    cv::Mat liveMat;
+    liveCamera->getCurrentImage().copyTo(liveMat);
+    qint64 time = QDateTime::currentMSecsSinceEpoch();
+    if (!driftModel->hasReference()) {
+        driftModel->setReference(liveMat);
+        driftModel->addSample(time, cv::Point2d());
+        scanJournal->appendDrift(time, cv::Point2d());
+
+        // Kept to measure the drift of a resumed scan
+        QSettings settings;
+        QString directory = settings.value("scan_directory").toString();
+        if (!directory.isEmpty()) {
+            QString fileName = QDir(directory).absoluteFilePath(
+                "drift_reference.png"
+            );
+            if (cv::imwrite(fileName.toStdString(), liveMat))
+                scanJournal->appendReference(fileName);
+        }
+    } else {
+        cv::Point2d drift;
+        if (driftModel->measure(liveMat, time, drift)) {
+            scanJournal->appendDrift(time, drift);
+            statusBar()->showMessage(
+                tr("The stage has drifted by %1, %2 pixels.")
+                    .arg(drift.x, 0, 'f', 1).arg(drift.y, 0, 'f', 1)
+            );
+        } else {
+            statusBar()->showMessage(
+                tr("The drift of the stage cannot be measured, the "
+                    "reference tile is not recognized.")
+            );
+        }
+    }
+
+    if (adaptiveScan->isRunning()) {
+        adaptiveScan->referenceCaptured();
+        if (adaptiveScan->isRunning()) {
+            cv::Point next = adaptiveScan->position();
+            recordStage(cv::Point(next.x * scanSteps.x, next.y * scanSteps.y));
+        }
+    } else if (continuousScan->isRunning()) {
+        continuousScan->referenceCaptured();
+        recordStage(continuousScan->stageSteps());
+    }
+}
+
+void MainWin::scanTileProcessed(const ProcessedTile &tile)
+{
+    // A tile taken again replaces the preview of the old one
+    auto it = retakeTargets.find(tile.index);
+    if (it != retakeTargets.end()) {
+        int index = it->second;
+        retakeTargets.erase(it);
+        scanJournal->appendTile(tile.cell, tile.fileName, tiles->time(index));
+        stitchWidget->replaceImage(index, tiles->image(index), tile.thumbnail);
+        return;
+    }
+
+    if (tile.index >= tiles->size())
+        return;
+    scanJournal->appendTile(
+        tile.cell, tile.fileName, tiles->time(tile.index)
+    );
+    stitchWidget->addImage(tiles->image(tile.index), tile.thumbnail);
+}
+
+void MainWin::scanProcessingDone()
+{
+    if (stitchAfterProcessing && guiMode == GuiMode::NORMAL) {
+        stitchAfterProcessing = false;
+        stitchImages();
+    }
+    if (recomposeAfterProcessing && guiMode == GuiMode::NORMAL) {
+        recomposeAfterProcessing = false;
+        recomposeRetakenTiles();
+    }
+}
+
+void MainWin::openImage()
+{
+    QString fileName = QFileDialog::getOpenFileName(
+        this, tr("Open image file"), QDir::homePath()
+    );
+    if (fileName.isEmpty())
+        return;
+    if (openLargeImage(fileName)) {
+        addImagePathToRecent(fileName);
+        return;
+    }
+
+    cv::Mat matTmp = cv::imread(fileName.toStdString());
+    if (matTmp.empty()) {
+        QMessageBox::warning(
+            this, tr("Cannot load image"),
+            tr("Cannot load image from file name!")
+        );
+        return;
+    }
+
+    matTmp.copyTo(currMat);
+    stitchWidget->addImage(matTmp);
+    addImagePathToRecent(fileName);
+}
+
+void MainWin::stitchImages()
+{
+    QPixmap tmpPix;
+    cv::Mat stitchedMat;
+    QVector<cv::Mat> mats = stitchWidget->getImages();
+
+    if (mats.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Stitch Images"), tr("There are no images to stitch!")
+        );
+        return;
+    }
+
+    // No need to stitch, when there is only one in pipe
+    if (mats.size() > 1) {
+        // The mode is choosen for every stitching, so the user can trade
+        // quality for speed.
+        StitchingMode mode;
+        if (!selectStitchingMode(mode))
+            return;
+
+        // The engine keeps the positions, so tiles taken again can be
+        // composed into the mosaic
+        stitchingEngine->setMode(mode);
+        if (mode != StitchingMode::SCANS) {
+            std::vector<cv::Point> cells;
+            if (!selectTileCells(mats.size(), cells))
+                return;
+            stitchingEngine->setCells(cells);
+        }
+
+        // The tiles of a long scan are shifted by the drift of the stage
+        std::vector<cv::Point2d> priors;
+        if (isScanStitched() && !driftModel->isEmpty())
+            priors = driftModel->tileShifts(tiles->times());
+        stitchingEngine->setPositionPriors(priors);
+
+        StitchingEngine::Status status = stitchingEngine->stitch(
+            mats.toStdVector(), stitchedMat
+        );
+        if (status != StitchingEngine::Status::OK) {
+            QMessageBox::critical(
+                this, tr("Stitch Images"), tr("Cannot stitch images!")
+            );
+            return;
+        }
+
+        tmpPix = matToPixmap(stitchedMat);
+        stitchedMat.copyTo(currMat);
+    } else {
+        tmpPix = matToPixmap(mats.first());
+    }
+
+    // Send picture to preview widget
+    preview->setPixmap(tmpPix);
+    preview->setVisible(true);
+    if (mats.size() > 1)
+        reviewStitchReport();
+}
+
+bool MainWin::selectStitchingMode(StitchingMode &mode)
+{
+    QSettings settings;
+    StitchingMode lastMode = StitchingMode::SCANS;
+    StitchingEngine::modeFromName(
+        settings.value("stitching_mode").toString(), lastMode
+    );
+
+    std::vector<StitchingMode> modes = StitchingEngine::modes();
+    QStringList items;
+    int current = 0;
+    for (size_t i = 0; i < modes.size(); i++) {
+        items.append(StitchingEngine::modeDescription(modes[i]));
+        if (modes[i] == lastMode)
+            current = static_cast<int>(i);
+    }
+
+    bool ok = false;
+    QString item = QInputDialog::getItem(
+        this, tr("Stitch Images"), tr("Stitching mode"), items, current,
+        false, &ok
+    );
+    if (!ok)
+        return false;
+
+    mode = modes[items.indexOf(item)];
+    settings.setValue("stitching_mode", StitchingEngine::modeName(mode));
+    settings.sync();
+    return true;
+}
+
+bool MainWin::selectTileCells(int count, std::vector<cv::Point> &cells)
+{
+    // Images of the last auto scan know their grid cells
+    if (tiles->size() == count && tiles->hasCells()) {
+        cells = tiles->cells();
+        return true;
+    }
+
+    bool ok = false;
+    int columns = QInputDialog::getInt(
+        this, tr("Stitch Images"), tr("Number of images per row"),
+        static_cast<int>(std::ceil(std::sqrt(count))), 1, count, 1, &ok
+    );
+    if (!ok)
+        return false;
+
+    cells = TileGrid::fromColumns(count, columns).cells(count);
+    return true;
+}
+
+void MainWin::deleteImage()
+{
+    ImagePreview *preview = stitchWidget->getSelectedImagePreview();
+    if (preview == nullptr)
+        return;
+    stitchWidget->removeImage(preview);
+}
+
+void MainWin::saveSelectedImage()
+{
+    if (!stitchWidget->isImageSelected()) {
+        QMessageBox::critical(
+            this, tr("Save selected image"), 
+            tr("No image selected for saving!")
+        );
+        return;
+    }
+    cv::Mat mat = stitchWidget->getSelectedImage();
+    QString fileName = QFileDialog::getSaveFileName(
+        this, tr("Save selected image"), QDir::homePath()
+    );
+    if (fileName.isEmpty())
+        return;
+    if (!cv::imwrite(fileName.toStdString(), mat)) {
+        QMessageBox::critical(
+            this, tr("Save selected image"), 
+            tr("Error while saving image!")
+        );
+    }
+}
+
+void MainWin::saveAllImages()
+{
+    if (tileExporter->isRunning()) {
+        QMessageBox::critical(
+            this, tr("Save all images"), tr("The images are being saved!")
+        );
+        return;
+    }
+    QVector<cv::Mat> mats = stitchWidget->getImages();
+    if (mats.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Save all images"), tr("There are no images to save!")
+        );
+        return;
+    }
+
+    // Get a folder path
+    QString path = QFileDialog::getExistingDirectory(
+        this, tr("Folder for saving images"), QDir::homePath()
+    );
+    if (path.isEmpty())
+        return;
+
+    // Format and compression, the last choice is kept
+    QSettings settings;
+    QStringList items;
+    items << tr("PNG") << tr("JPEG") << tr("WebP, lossless")
+        << tr("TIFF, uncompressed");
+    const TileExporter::Format formats[] = {
+        TileExporter::Format::PNG, TileExporter::Format::JPEG,
+        TileExporter::Format::WEBP, TileExporter::Format::TIFF
+    };
+    int current = qBound(0, settings.value("export_format", 0).toInt(), 3);
+    bool ok = false;
+    QString item = QInputDialog::getItem(
+        this, tr("Save all images"), tr("Format of the files"), items,
+        current, false, &ok
+    );
+    if (!ok)
+        return;
+    int choice = items.indexOf(item);
+    TileExporter::Format format = formats[choice];
+
+    int level = 0;
+    if (format == TileExporter::Format::PNG) {
+        level = QInputDialog::getInt(
+            this, tr("Save all images"),
+            tr("Compression (0 is the fastest, 9 the smallest)"),
+            settings.value("export_png_level", 3).toInt(), 0, 9, 1, &ok
+        );
+        if (!ok)
+            return;
+        settings.setValue("export_png_level", level);
+    } else if (format == TileExporter::Format::JPEG) {
+        level = QInputDialog::getInt(
+            this, tr("Save all images"), tr("Quality in percent"),
+            settings.value("export_jpeg_quality", 95).toInt(), 0, 100, 1, &ok
+        );
+        if (!ok)
+            return;
+        settings.setValue("export_jpeg_quality", level);
+    }
+    settings.setValue("export_format", choice);
+
+    // Cells are only known for the tiles of a scan
+    std::vector<cv::Point> cells;
+    if (tiles->size() == mats.size()) {
+        for (int i = 0; i < tiles->size(); i++)
+            cells.push_back(tiles->cell(i));
+    }
+
+    tileExporter->setFormat(format, level);
+    if (!tileExporter->start(path, mats.toStdVector(), cells)) {
+        QMessageBox::critical(
+            this, tr("Save all images"), tileExporter->errorString()
+        );
+        return;
+    }
+    fileStatus->setWindowTitle(tr("Save all images"));
+    fileStatus->setWindowModality(Qt::NonModal);
+    fileStatus->setLabel(tr("Saving images to %1").arg(path));
+    fileStatus->setProgressInformation(mats.size(), 0);
+    fileStatus->setVisible(true);
+}
+
+void MainWin::saveAllImagesFinished(bool success)
+{
+    fileStatus->setVisible(false);
+    if (success) {
+        QMessageBox::information(
+            this, tr("Save all images"), tr("All images have been saved!")
+        );
+    } else {
+        QMessageBox::critical(
+            this, tr("Save all images"), tileExporter->errorString()
+        );
+    }
+}
+
+void MainWin::importTiles()
+{
+    if (guiMode != GuiMode::NORMAL)
+        return;
+    if (tileExporter->isRunning()) {
+        QMessageBox::critical(
+            this, tr("Import tiles"), tr("The images are being saved!")
+        );
+        return;
+    }
+
+    QString path = QFileDialog::getExistingDirectory(
+        this, tr("Folder with tiles"), QDir::homePath()
+    );
+    if (path.isEmpty())
+        return;
+
+    // Save all images writes the manifest next to the tiles
+    QStringList files;
+    std::vector<cv::Point> cells;
+    QString manifest = QDir(path).absoluteFilePath("manifest.txt");
+    if (QFileInfo(manifest).isFile()) {
+        if (!TileImporter::readManifest(manifest, files, cells)) {
+            QMessageBox::critical(
+                this, tr("Import tiles"),
+                tr("Cannot read the manifest %1!").arg(manifest)
+            );
+            return;
+        }
+    } else {
+        files = TileImporter::readDirectory(path);
+    }
+    if (files.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Import tiles"), tr("There are no tiles in %1!").arg(path)
+        );
+        return;
+    }
+    if (!stitchWidget->getImages().isEmpty()) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, tr("Import tiles"),
+            tr("The %1 tiles replace the current images. Import the tiles?")
+                .arg(files.size())
+        );
+        if (answer != QMessageBox::Yes)
+            return;
+    }
+
+    stitchWidget->clear();
+    tiles->clear();
+    scanSteps = cv::Point();
+    driftModel->clear();
+    if (!tileImporter->start(files, cells)) {
+        QMessageBox::critical(
+            this, tr("Import tiles"), tileImporter->errorString()
+        );
+        return;
+    }
+    fileStatus->setWindowTitle(tr("Import tiles"));
+    fileStatus->setWindowModality(Qt::ApplicationModal);
+    fileStatus->setLabel(tr("Reading tiles from %1").arg(path));
+    fileStatus->setProgressInformation(files.size(), 0);
+    fileStatus->setVisible(true);
+}
+
+void MainWin::importTileLoaded(const ImportedTile &tile)
+{
+    tiles->append(tile.image, tile.cell);
+    stitchWidget->addImage(tile.image, tile.thumbnail);
+}
+
+void MainWin::importTilesFinished(bool success)
+{
+    fileStatus->setVisible(false);
+    statusBar()->showMessage(
+        tr("%1 tiles have been imported.").arg(tiles->size())
+    );
+    if (!success) {
+        QMessageBox::warning(
+            this, tr("Import tiles"), tileImporter->errorString()
+        );
+    }
+}
+
+void MainWin::saveSession()
+{
+    QVector<cv::Mat> mats = stitchWidget->getImages();
+    if (mats.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Save session"), tr("There are no images to save!")
+        );
+        return;
+    }
+
+    QString fileName = QFileDialog::getSaveFileName(
+        this, tr("Save session"), QDir::homePath(),
+        tr("Microscope sessions (*.msession)")
+    );
+    if (fileName.isEmpty())
+        return;
+    if (QFileInfo(fileName).suffix().isEmpty())
+        fileName += ".msession";
+
+    QStringList items;
+    items << tr("Uncompressed, opens at once")
+        << tr("PNG, smaller, decoded when opened");
+    bool ok = false;
+    QString item = QInputDialog::getItem(
+        this, tr("Save session"), tr("Storage of the tiles"), items, 0,
+        false, &ok
+    );
+    if (!ok)
+        return;
+    SessionFile::Compression compression = items.indexOf(item) == 0
+        ? SessionFile::Compression::RAW : SessionFile::Compression::PNG;
+
+    // Cells, times and quality are only known for the tiles of a scan and of
+    // its last stitching
+    bool known = tiles->size() == mats.size();
+    const StitchReport &report = stitchingEngine->report();
+    bool rated = known
+        && static_cast<int>(report.tiles().size()) == mats.size();
+    std::vector<SessionFile::Tile> infos;
+    for (int i = 0; i < mats.size(); i++) {
+        SessionFile::Tile info = SessionFile::unknownTile();
+        if (known) {
+            info.cell = tiles->cell(i);
+            info.time = tiles->time(i);
+            if (info.cell.x >= 0 && scanSteps != cv::Point()) {
+                info.stage = cv::Point(
+                    info.cell.x * scanSteps.x, info.cell.y * scanSteps.y
+                );
+            }
+        }
+        if (rated) {
+            const StitchReport::Tile &quality = report.tiles()[i];
+            info.sharpness = quality.sharpness;
+            info.clipped = quality.clipped;
+            info.confidence = quality.confidence;
+            info.problems = quality.problems;
+        }
+        infos.push_back(info);
+    }
+
+    QJsonObject metadata;
+    metadata["created"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+    metadata["lens_calibrated"] = lensCalibration->isValid();
+    QString objective = StageCalibration::currentObjective();
+    StageCalibration stage;
+    if (!objective.isEmpty() && stage.readSettings(objective)) {
+        cv::Point2d motionX = stage.motion(true);
+        cv::Point2d motionY = stage.motion(false);
+        metadata["objective"] = objective;
+        metadata["motion_x"] = QJsonArray({motionX.x, motionX.y});
+        metadata["motion_y"] = QJsonArray({motionY.x, motionY.y});
+    }
+    if (scanSteps != cv::Point())
+        metadata["steps"] = QJsonArray({scanSteps.x, scanSteps.y});
+    if (!driftModel->isEmpty())
+        metadata["drift"] = driftModel->toJson();
+
+    SessionFile output;
+    if (!output.save(fileName, mats.toStdVector(), infos, metadata,
+            compression)) {
+        QMessageBox::critical(
+            this, tr("Save session"),
+            tr("Cannot save the session: %1").arg(output.errorString())
+        );
+        return;
+    }
+    statusBar()->showMessage(
+        tr("%1 images have been saved to %2.").arg(mats.size()).arg(fileName)
+    );
+}
+
+void MainWin::openSession()
+{
+    if (guiMode != GuiMode::NORMAL)
+        return;
+
+    QString fileName = QFileDialog::getOpenFileName(
+        this, tr("Open session"), QDir::homePath(),
+        tr("Microscope sessions (*.msession)")
+    );
+    if (fileName.isEmpty())
+        return;
+
+    // The mapped tiles of the open session may still be written
+    if (tileExporter->isRunning()) {
+        QMessageBox::critical(
+            this, tr("Open session"), tr("The images are being saved!")
+        );
+        return;
+    }
+    if (!stitchWidget->getImages().isEmpty()) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, tr("Open session"),
+            tr("The images of the session replace the current ones. Open "
+                "the session?")
+        );
+        if (answer != QMessageBox::Yes)
+            return;
+    }
+
+    // The images of the last session point into its file, they are removed
+    // before it is closed
+    stitchWidget->clear();
+    tiles->clear();
+    if (!session->open(fileName)) {
+        QMessageBox::critical(
+            this, tr("Open session"),
+            tr("Cannot open the session: %1").arg(session->errorString())
+        );
+        return;
+    }
+
+    // Uncompressed tiles point into the file and are paged in when used,
+    // compressed ones have to be decoded all now
+    bool mapped = session->isMapped();
+    if (!mapped)
+        QApplication::setOverrideCursor(Qt::WaitCursor);
+    for (int i = 0; i < session->size(); i++) {
+        const SessionFile::Tile &info = session->tiles()[i];
+        cv::Mat image = session->image(i);
+        tiles->append(image, info.cell, info.time);
+        stitchWidget->addImage(image, session->thumbnail(i));
+    }
+    if (!mapped)
+        QApplication::restoreOverrideCursor();
+
+    // The steps and the drift of the scan are known again for stitching
+    QJsonObject metadata = session->metadata();
+    QJsonArray steps = metadata.value("steps").toArray();
+    scanSteps = steps.size() == 2
+        ? cv::Point(steps.at(0).toInt(), steps.at(1).toInt()) : cv::Point();
+    driftModel->clear();
+    driftModel->addJson(metadata.value("drift").toArray());
+    tileServer->setMetadata(metadata);
+    statusBar()->showMessage(
+        tr("%1 images have been opened from %2.").arg(session->size())
+            .arg(fileName)
+    );
+}
+
+void MainWin::calibrateLens()
+{
+    // Images taken with an active calibration are already undistorted and
+    // cannot be used for a new calibration.
+    if (lensCalibration->isValid()) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, tr("Calibrate lens"),
+            tr("The camera is already calibrated. Remove the calibration and "
+               "take new images of the target?")
+        );
+        if (answer == QMessageBox::Yes)
+            clearLensCalibration();
+        return;
+    }
+
+    QVector<cv::Mat> views = stitchWidget->getImages();
+    if (views.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Calibrate lens"),
+            tr("Take some images of the chessboard target first!")
+        );
+        return;
+    }
+
+    bool ok = false;
+    int cornersX = QInputDialog::getInt(
+        this, tr("Calibrate lens"), tr("Inner corners per chessboard row"),
+        9, 2, 50, 1, &ok
+    );
+    if (!ok)
+        return;
+    int cornersY = QInputDialog::getInt(
+        this, tr("Calibrate lens"), tr("Inner corners per chessboard column"),
+        6, 2, 50, 1, &ok
+    );
+    if (!ok)
+        return;
+
+    lensCalibration->clearViews();
+    lensCalibration->setBoardSize(cv::Size(cornersX, cornersY));
+    for (int i = 0; i < views.size(); i++)
+        lensCalibration->addView(views.at(i));
+
+    if (lensCalibration->numViews() == 0) {
+        QMessageBox::critical(
+            this, tr("Calibrate lens"),
+            tr("The chessboard target has not been found in any image!")
+        );
+        return;
+    }
+
+    double rms = lensCalibration->calibrate();
+    if (rms < 0) {
+        QMessageBox::critical(
+            this, tr("Calibrate lens"), tr("Cannot calibrate the lens!")
+        );
+        return;
+    }
+
+    lensCalibration->writeSettings();
+    liveCamera->setLensCalibration(*lensCalibration);
+
+    // Show the first view undistorted. Straight lines of the target can be
+    // checked with the calibration widget.
+    cv::Mat undistorted;
+    lensCalibration->undistort(views.first(), undistorted);
+    QPixmap pix = matToPixmap(undistorted);
+    calibrationPreview->setPixmap(pix);
+    calibrationPreview->setVisible(true);
+
+    statusBar()->showMessage(
+        tr("Lens calibrated from %1 of %2 images, error %3 pixels").arg(
+            lensCalibration->numViews()).arg(views.size()).arg(rms, 0, 'f', 3)
+    );
+}
+
+void MainWin::clearLensCalibration()
+{
+    lensCalibration->clear();
+    lensCalibration->writeSettings();
+    liveCamera->setLensCalibration(*lensCalibration);
+    calibrationPreview->setVisible(false);
+    statusBar()->showMessage(tr("Lens calibration removed!"));
+}
+
+void MainWin::calibrateBacklash()
+{
+    if (backlashCalibration->isRunning()) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, tr("Calibrate backlash"),
+            tr("The backlash is being measured. Abort the calibration?")
+        );
+        if (answer == QMessageBox::Yes)
+            backlashCalibration->abort();
+        return;
+    }
+
+    if (!cameraConnected || !controllerConnected) {
+        QMessageBox::critical(
+            this, tr("Calibrate backlash"),
+            tr("Connect the camera and the controller first!")
+        );
+        return;
+    }
+
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Calibrate backlash"),
+        tr("The stage is moved back and forth along the second motor, which "
+           "takes about a minute. Put a sample with some structure under the "
+           "microscope and focus it. Start the calibration?")
+    );
+    if (answer != QMessageBox::Yes)
+        return;
+
+    backlashCalibration->start();
+}
+
+void MainWin::backlashCalibrationFinished(bool success)
+{
+    if (!success) {
+        statusBar()->clearMessage();
+        QMessageBox::critical(
+            this, tr("Calibrate backlash"),
+            backlashCalibration->errorString()
+        );
+        return;
+    }
+
+    QSettings settings;
+    settings.setValue("backlash_m2", backlashCalibration->backlash());
+    settings.setValue(
+        "pixels_per_step_y", backlashCalibration->pixelsPerStep()
+    );
+    statusBar()->showMessage(
+        tr("Backlash calibrated: %1 steps, %2 pixels per step").arg(
+            backlashCalibration->backlash()).arg(
+            backlashCalibration->pixelsPerStep(), 0, 'f', 3)
+    );
+}
+
+void MainWin::calibrateStage()
+{
+    if (stageCalibrator->isRunning()) {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+            this, tr("Calibrate stage"),
+            tr("The stage is being calibrated. Abort the calibration?")
+        );
+        if (answer == QMessageBox::Yes)
+            stageCalibrator->abort();
+        return;
+    }
+
+    if (!cameraConnected || !controllerConnected) {
+        QMessageBox::critical(
+            this, tr("Calibrate stage"),
+            tr("Connect the camera and the controller first!")
+        );
+        return;
+    }
+
+    // A new name calibrates a new objective
+    QStringList names = StageCalibration::objectives();
+    QString current = StageCalibration::currentObjective();
+    if (!current.isEmpty() && !names.contains(current))
+        names.prepend(current);
+    if (names.isEmpty())
+        names << tr("10x");
+    bool ok = false;
+    QString name = QInputDialog::getItem(
+        this, tr("Calibrate stage"), tr("Objective:"), names,
+        std::max(0, names.indexOf(current)), true, &ok
+    ).trimmed();
+    if (!ok || name.isEmpty())
+        return;
+
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Calibrate stage"),
+        tr("Both motors are moved about a third of the image while its motion "
+           "is measured. Put a sample with some structure under the "
+           "microscope and focus it. Start the calibration?")
+    );
+    if (answer != QMessageBox::Yes)
+        return;
+
+    stageObjective = name;
+    stageCalibrator->start();
+}
+
+void MainWin::stageCalibrationFinished(bool success)
+{
+    if (!success) {
+        statusBar()->clearMessage();
+        QMessageBox::critical(
+            this, tr("Calibrate stage"), stageCalibrator->errorString()
+        );
+        return;
+    }
+
+    StageCalibration stage = stageCalibrator->calibration();
+    stage.setObjective(stageObjective);
+    stage.writeSettings();
+    StageCalibration::setCurrentObjective(stageObjective);
+    statusBar()->showMessage(
+        tr("Stage calibrated for %1: %2 x %3 steps per image").arg(
+            stageObjective).arg(
+            stage.stepsPerFrame(true), 0, 'f', 0).arg(
+            stage.stepsPerFrame(false), 0, 'f', 0)
+    );
+}
+
+void MainWin::selectObjective()
+{
+    QStringList names = StageCalibration::objectives();
+    if (names.isEmpty()) {
+        QMessageBox::critical(
+            this, tr("Select objective"),
+            tr("Calibrate the stage for an objective first!")
+        );
+        return;
+    }
+
+    bool ok = false;
+    QString name = QInputDialog::getItem(
+        this, tr("Select objective"), tr("Objective:"), names,
+        std::max(0, names.indexOf(StageCalibration::currentObjective())),
+        false, &ok
+    );
+    if (!ok)
+        return;
+
+    StageCalibration::setCurrentObjective(name);
+    statusBar()->showMessage(tr("Objective %1 selected").arg(name));
+}
+
+bool MainWin::selectScanArea(
+    const StageCalibration &stage, cv::Point &steps, cv::Size &grid)
+{
+    QSettings settings;
+    bool ok = false;
+    double overlap = QInputDialog::getDouble(
+        this, tr("Auto camera stitching"),
+        tr("Overlap of neighbouring tiles in percent:"),
+        settings.value("scan_overlap", 20.0).toDouble(), 0, 90, 0, &ok
+    );
+    if (!ok)
+        return false;
+
+    // The travel per step only depends on the mechanics of the stage
+    cv::Point2d micrometers(
+        settings.value("stage_micrometers_per_step_x", 0).toDouble(),
+        settings.value("stage_micrometers_per_step_y", 0).toDouble()
+    );
+    if (micrometers.x <= 0 || micrometers.y <= 0) {
+        micrometers.x = QInputDialog::getDouble(
+            this, tr("Auto camera stitching"),
+            tr("Travel of the stage per step of the first motor in "
+               "micrometers:"), 1.0, 0.001, 1000, 3, &ok
+        );
+        if (!ok)
+            return false;
+        micrometers.y = QInputDialog::getDouble(
+            this, tr("Auto camera stitching"),
+            tr("Travel of the stage per step of the second motor in "
+               "micrometers:"), micrometers.x, 0.001, 1000, 3, &ok
+        );
+        if (!ok)
+            return false;
+        settings.setValue("stage_micrometers_per_step_x", micrometers.x);
+        settings.setValue("stage_micrometers_per_step_y", micrometers.y);
+    }
+
+    double width = QInputDialog::getDouble(
+        this, tr("Auto camera stitching"),
+        tr("Width of the area along the first motor in millimeters:"),
+        settings.value("scan_width_mm", 2.0).toDouble(), 0, 1000, 2, &ok
+    );
+    if (!ok)
+        return false;
+    double height = QInputDialog::getDouble(
+        this, tr("Auto camera stitching"),
+        tr("Height of the area along the second motor in millimeters:"),
+        settings.value("scan_height_mm", 2.0).toDouble(), 0, 1000, 2, &ok
+    );
+    if (!ok)
+        return false;
+
+    settings.setValue("scan_overlap", overlap);
+    settings.setValue("scan_width_mm", width);
+    settings.setValue("scan_height_mm", height);
+
+    steps = stage.stepsForOverlap(overlap / 100);
+    grid = stage.gridForArea(
+        cv::Size2d(width * 1000, height * 1000), micrometers, steps
+    );
+    return true;
+}
+
+// ---- NEW NEW NEW
+
+void MainWin::abortCameraStitching()
+{
+    liveCamera->exitLiveCamera();
+    guiMode = GuiMode::NORMAL;
+}
+
+void MainWin::abortAutoCameraStitching()
+{
+    if (guiMode != GuiMode::AUTOMATIC_CAMERA_STITCHING)
+        return;
+
+    liveCamera->exitLiveCamera();
+    guiMode = GuiMode::NORMAL;
+}
+
+QPixmap MainWin::matToPixmap(cv::Mat mat)
 {
     // Not my code!!! Put information about source here!!!
 
@@ -553,7 +2107,7 @@ void MainWin::reset()
     currMat.release();
 
     // Reset stitched images object
-    mats->clear();
+    tiles->clear();
 
     // Hide all previews and widgets
     preview->setVisible(false);
@@ -582,6 +2136,17 @@ void MainWin::saveImage()
     if (fileName.isEmpty())
         return;
 
+    // A pyramid opens large mosaics at once
+    if (QFileInfo(fileName).suffix().toLower() == "mpyramid") {
+        PyramidImage pyramid;
+        if (!pyramid.save(fileName, currMat)) {
+            QMessageBox::critical(
+                this, tr("Save image"),
+                tr("Could not save image: %1").arg(pyramid.errorString())
+            );
+        }
+        return;
+    }
     if (!cv::imwrite(fileName.toStdString(), currMat)) {
         QMessageBox::critical(
             this, tr("Save image"),
@@ -655,6 +2220,111 @@ void MainWin::addImagePathToRecent(QString &path)
     updateRecentMenu();
 }
 
+bool MainWin::openLargeImage(const QString &fileName)
+{
+    QString pyramidFile;
+    if (QFileInfo(fileName).suffix().toLower() == "mpyramid") {
+        pyramidFile = fileName;
+    } else {
+        // Only the header is read for the size
+        QSettings settings;
+        qint64 limit = static_cast<qint64>(
+            settings.value("large_image_megapixels", 64).toDouble() * 1e6
+        );
+        QSize size = QImageReader(fileName).size();
+        if (!size.isValid()
+                || static_cast<qint64>(size.width()) * size.height() < limit)
+            return false;
+
+        if (!pyramidCache->isCached(fileName)) {
+            pyramidCache->convert(fileName);
+            statusBar()->showMessage(
+                tr("%1 is converted into tiles, it is shown when done.")
+                    .arg(fileName)
+            );
+            return true;
+        }
+        pyramidFile = pyramidCache->cacheFile(fileName);
+    }
+
+    showMosaic(pyramidFile, QFileInfo(fileName).fileName());
+    return true;
+}
+
+void MainWin::pyramidConverted(const QString &source,
+    const QString &fileName, bool success, const QString &error)
+{
+    if (!success) {
+        QMessageBox::warning(
+            this, tr("Cannot load image"),
+            tr("Cannot convert %1 into tiles: %2").arg(source).arg(error)
+        );
+        return;
+    }
+    statusBar()->clearMessage();
+    showMosaic(fileName, QFileInfo(source).fileName());
+}
+
+void MainWin::showMosaic(const QString &fileName, const QString &title)
+{
+    if (!mosaicView->open(fileName)) {
+        QMessageBox::warning(
+            this, tr("Cannot load image"),
+            tr("Cannot open the tiles of the image: %1")
+                .arg(mosaicView->errorString())
+        );
+        return;
+    }
+    mosaicView->setWindowTitle(title);
+    mosaicView->setVisible(true);
+    mosaicView->raise();
+    tileServer->setPyramid(fileName);
+}
+
+void MainWin::shareMosaic(bool enabled)
+{
+    if (!enabled) {
+        tileServer->stop();
+        statusBar()->showMessage(tr("The mosaic is not shared any more."));
+        return;
+    }
+
+    QSettings settings;
+    QHostAddress address(
+        settings.value("tile_server_address", "127.0.0.1").toString()
+    );
+    quint16 port = static_cast<quint16>(
+        settings.value("tile_server_port", 8080).toInt()
+    );
+    tileServer->setCacheSize(
+        settings.value("tile_server_cache_mb", 64).toInt() * 1024 * 1024
+    );
+    tileServer->setHotTiles(
+        settings.value("tile_server_hot_tiles", 64).toInt()
+    );
+    tileServer->setMetadata(
+        session->isOpen() ? session->metadata() : QJsonObject()
+    );
+    tileServer->listen(address, port);
+}
+
+void MainWin::tileServerListening(bool success, const QString &message)
+{
+    if (success) {
+        statusBar()->showMessage(tr("The mosaic is shared at %1").arg(message));
+        return;
+    }
+
+    // Nothing to stop
+    ui.actShareMosaic->blockSignals(true);
+    ui.actShareMosaic->setChecked(false);
+    ui.actShareMosaic->blockSignals(false);
+    QMessageBox::critical(
+        this, tr("Share mosaic"),
+        tr("Cannot start the tile server: %1").arg(message)
+    );
+}
+
 void MainWin::clearRecentImages()
 {
     QSettings settings;
@@ -668,10 +2338,13 @@ void MainWin::openRecentImage()
 {
     QAction *act = qobject_cast<QAction*>(sender());
     QString fileName = act->text();
+    if (openLargeImage(fileName)) {
+        addImagePathToRecent(fileName);
+        return;
+    }
 
     cv::Mat matTmp = cv::imread(fileName.toStdString());
-    QPixmap tmpPix;
-    if (!tmpPix.load(fileName) || matTmp.data == nullptr) {
+    if (matTmp.empty()) {
         QMessageBox::warning(
             this, tr("Cannot load image"),
             tr("Cannot load image from file name!")
@@ -681,7 +2354,7 @@ void MainWin::openRecentImage()
 
     matTmp.copyTo(currMat);
     preview->setVisible(true);
-    preview->setPixmap(tmpPix);
+    preview->setPixmap(matToPixmap(matTmp));
     addImagePathToRecent(fileName);
 }
 
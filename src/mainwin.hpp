@@ -20,11 +20,14 @@
 #ifndef MAINWIN_H
 #define MAINWIN_H
 
+#include <map>
 #include <QtWidgets/QMainWindow>
 #include <opencv2/opencv.hpp>
 
 #include "ui_mainwin.h"
 #include "ui_about.h"
+#include "scanpipeline.hpp"
+#include "tileimporter.hpp"
 
 
 // Forward declarations
@@ -36,6 +39,23 @@ class QGridLayout;
 class QVBoxLayout;
 class StitchingWidget;
 class AutoStitchingStatus;
+class LensCalibration;
+class TileSet;
+class ImageCalibration;
+class BacklashCalibration;
+class StageCalibration;
+class StageCalibrator;
+class AdaptiveScan;
+class ContinuousScan;
+class ScanJournal;
+class StitchingEngine;
+class DriftModel;
+class SessionFile;
+class TileExporter;
+class PyramidCache;
+class MosaicView;
+class TileServer;
+enum class StitchingMode;
 
 ///
 /// Enum class for declaration of different gui modes:
@@ -116,6 +136,21 @@ public slots:
     ///
     void runAutoCameraStitching();
 
+    ///
+    /// \brief Continue the last scan of the scan directory
+    /// The tiles on disk are loaded again. The stage is expected where the
+    /// journal of the scan left it.
+    ///
+    void resumeAutoCameraStitching();
+
+    ///
+    /// \brief Take the tiles flagged by the last stitching again
+    /// Only the tiles of the last scan can be taken again, the stage is
+    /// expected where the scan left it. The new tiles are composed into the
+    /// mosaic.
+    ///
+    void retakeFlaggedTiles();
+
     ///
     /// Stop the camera stitching process
     ///
@@ -133,9 +168,72 @@ public slots:
 
     ///
     /// \brief Save all images that are in the stitching widget
+    /// The images are written in the background in the chosen format, with a
+    /// manifest of their grid cells.
     ///
     void saveAllImages();
 
+    ///
+    /// \brief Saving all images has been finished
+    /// \param success True if every image has been written, else false
+    ///
+    void saveAllImagesFinished(bool success);
+
+    ///
+    /// \brief Read all tiles of a directory in the background
+    /// A manifest.txt in the directory gives the files and their cells, else
+    /// every image is read and the cells are taken from the file names.
+    /// The tiles replace the current images.
+    ///
+    void importTiles();
+
+    ///
+    /// \brief A tile of the import has been read
+    /// \param tile The tile
+    ///
+    void importTileLoaded(const ImportedTile &tile);
+
+    ///
+    /// \brief Reading the tiles has been finished
+    /// \param success True if every file has been read, else false
+    ///
+    void importTilesFinished(bool success);
+
+    ///
+    /// \brief A large image has been converted into a pyramid
+    /// \param source The image
+    /// \param fileName The file of the pyramid
+    /// \param success True if converted, else false
+    /// \param error The description of the error
+    ///
+    void pyramidConverted(const QString &source, const QString &fileName,
+        bool success, const QString &error);
+
+    ///
+    /// \brief Serve the mosaic view over http or stop it
+    /// The address and the port are taken from the settings, by default the
+    /// server is only reachable from this machine.
+    /// \param enabled True to serve, else false
+    ///
+    void shareMosaic(bool enabled);
+
+    ///
+    /// \brief The tile server has started listening or has failed
+    /// \param success True if listening, else false
+    /// \param message The address of the server or the error
+    ///
+    void tileServerListening(bool success, const QString &message);
+
+    ///
+    /// \brief Save all images with their metadata in one session file
+    ///
+    void saveSession();
+
+    ///
+    /// \brief Open a session file, its images replace the current ones
+    ///
+    void openSession();
+
     ///
     /// \brief Save the selected image
     ///
@@ -187,9 +285,53 @@ public slots:
     void saveImage();
 
     /**
-     * Controller is ready for doing more
+     * The scan reached a position, capture the tile
+     * @param x Column of the position
+     * @param y Row of the position
+     */
+    void scanPositionReached(int x, int y);
+
+    /**
+     * The scan has been finished or aborted
+     * @param completed True if all positions were visited
+     */
+    void scanFinished(bool completed);
+
+    /**
+     * The continuous scan captured a tile
+     * @param frame The tile
+     * @param x Column of the tile
+     * @param y Row of the tile
+     */
+    void continuousTileCaptured(const cv::Mat &frame, int x, int y);
+
+    /**
+     * The scan reached the reference cell, measure the drift of the stage
+     */
+    void scanReferenceReached();
+
+    /**
+     * A scanned tile has been processed, show its preview
+     * @param tile The result of the processing
      */
-    void controllerReady();
+    void scanTileProcessed(const ProcessedTile &tile);
+
+    /**
+     * All scanned tiles have been processed
+     */
+    void scanProcessingDone();
+
+    /**
+     * The controller has been connected or disconnected
+     * @param connected True if connected, else false
+     */
+    void controllerConnectionChanged(bool connected);
+
+    /**
+     * The controller reported an error
+     * @param message Description of the error
+     */
+    void controllerError(const QString &message);
 
     /**
      * Open an image
@@ -211,6 +353,50 @@ public slots:
     ///
     void stopAutoScanningProcess();
 
+    ///
+    /// \brief Calibrate the lens distortion
+    /// The images in the stitching widget are used as views of a chessboard
+    /// target. The result is saved in the settings and used for the live
+    /// camera.
+    ///
+    void calibrateLens();
+
+    ///
+    /// \brief Remove the lens distortion calibration
+    ///
+    void clearLensCalibration();
+
+    ///
+    /// \brief Measure the backlash of the second motor with the camera
+    /// The result is saved in the settings and sent to the controller on
+    /// every connect.
+    ///
+    void calibrateBacklash();
+
+    ///
+    /// \brief The backlash calibration has been finished
+    /// \param success True if the backlash has been measured, else false
+    ///
+    void backlashCalibrationFinished(bool success);
+
+    ///
+    /// \brief Measure the image motion per step of both motors
+    /// The user names the objective, the result is saved in the settings for
+    /// it and the objective becomes the current one.
+    ///
+    void calibrateStage();
+
+    ///
+    /// \brief The stage calibration has been finished
+    /// \param success True if both motors have been measured, else false
+    ///
+    void stageCalibrationFinished(bool success);
+
+    ///
+    /// \brief Choose the current objective among the calibrated ones
+    ///
+    void selectObjective();
+
 signals:
     /**
      * Run camera
@@ -246,6 +432,22 @@ private:
     ///
     void addImagePathToRecent(QString &path);
 
+    ///
+    /// \brief Show pyramids and large images in the mosaic view
+    /// Large flat images are converted into a pyramid first, in the
+    /// background. The size is read from the header of the file.
+    /// \param fileName The image
+    /// \return True if the image is shown or converted, false if it is small
+    ///
+    bool openLargeImage(const QString &fileName);
+
+    ///
+    /// \brief Show a pyramid in the mosaic view and share it
+    /// \param fileName The file of the pyramid
+    /// \param title The title of the view
+    ///
+    void showMosaic(const QString &fileName, const QString &title);
+
     /**
      * Create recent menu from list
      * @param entries List of entries to set
@@ -257,6 +459,93 @@ private:
      */
     void clearRecentMenu();
 
+    ///
+    /// \brief Ask the user for the stitching mode
+    /// \param mode The choosen mode
+    /// \return True if a mode has been choosen, else false
+    ///
+    bool selectStitchingMode(StitchingMode &mode);
+
+    ///
+    /// \brief Get the grid cells of the images to stitch
+    /// Images of an auto scan know their cells, for all others the user is
+    /// asked for the number of columns.
+    /// \param count Number of images
+    /// \param cells The cell of every image
+    /// \return True if the cells are known, else false
+    ///
+    bool selectTileCells(int count, std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Ask the user for the overlap and the area of a scan
+    /// The travel of the stage per step is asked for once and kept in the
+    /// settings.
+    /// \param stage Calibration of the current objective
+    /// \param steps Steps between two tiles of the first (x) and the second
+    /// motor (y)
+    /// \param grid Columns and rows of the scan
+    /// \return True if the user has accepted, else false
+    ///
+    bool selectScanArea(const StageCalibration &stage, cv::Point &steps,
+        cv::Size &grid);
+
+    ///
+    /// \brief Connect the camera and the controller, if they are not
+    /// \return True if both are connected, else false
+    ///
+    bool connectScanHardware();
+
+    ///
+    /// \brief Switch to the automatic scan with empty tiles
+    /// \param steps Steps between two cells of both motors
+    /// \param grid Columns and rows of the scan
+    ///
+    void beginAutoScan(cv::Point steps, cv::Size grid);
+
+    ///
+    /// \brief Record where the stage is or is sent to
+    /// \param steps Steps of both motors from the first cell, see
+    /// ScanJournal::appendStage
+    ///
+    void recordStage(cv::Point steps);
+
+    ///
+    /// \brief Get the time between two visits of the reference cell
+    /// \return Time in milliseconds, 0 without drift correction
+    ///
+    int referenceInterval() const;
+
+    ///
+    /// \brief Move the stage to the nearest cell of the scan
+    /// \param grid Columns and rows of the scan
+    /// \return The cell
+    ///
+    cv::Point alignStageToCell(cv::Size grid);
+
+    ///
+    /// \brief Get the info if the images to stitch are the last scan
+    /// \return True if every image has its cell from the scan, else false
+    ///
+    bool isScanStitched() const;
+
+    ///
+    /// \brief Show the quality of the last stitching
+    /// The report is written to the scan directory. If tiles have been
+    /// flagged, taking them again is offered.
+    ///
+    void reviewStitchReport();
+
+    ///
+    /// \brief Take some tiles of the last scan again
+    /// \param indices The indices of the tiles
+    ///
+    void retakeTiles(const std::vector<int> &indices);
+
+    ///
+    /// \brief Compose the tiles taken again into the mosaic
+    ///
+    void recomposeRetakenTiles();
+
     /**
      * Constructor
      * @param parent Parent window pointer
@@ -271,7 +560,9 @@ private:
 
     /**
      * Initialize the microscope controller
-     * @return True if controller available and connected, else false
+     * The connection is made in the thread of the controller, the result is
+     * reported with controllerConnectionChanged.
+     * @return True if a device has been choosen, else false
      */
     bool initController();
 
@@ -287,7 +578,7 @@ private:
 
 private:
     cv::Mat currMat;
-    QVector<cv::Mat> *mats;
+    TileSet *tiles;
     cv::VideoCapture *cap;
 
     static MainWin* _instance;
@@ -311,12 +602,41 @@ private:
     QGridLayout *layoutImages;
 
     Controller *controller;
+    QThread *controllerThread;
+    ScanPipeline *scanPipeline;
+    bool stitchAfterProcessing;
+    bool recomposeAfterProcessing;
 
     int gridNumMaxX;
     int gridNumMaxY;
 
     StitchingWidget * stitchWidget;
     AutoStitchingStatus * statusWidget;
+
+    LensCalibration *lensCalibration;
+    ImageCalibration *calibrationPreview;
+    BacklashCalibration *backlashCalibration;
+    StageCalibrator *stageCalibrator;
+    QString stageObjective;
+    AdaptiveScan *adaptiveScan;
+    ContinuousScan *continuousScan;
+    ScanJournal *scanJournal;
+    std::vector<cv::Point> scanPath;
+    cv::Point scanSteps;
+    cv::Point scanStage;
+    StitchingEngine *stitchingEngine;
+    bool retakingTiles;
+    std::vector<int> retakenTiles;
+    std::map<int, int> retakeTargets;
+    DriftModel *driftModel;
+    SessionFile *session;
+    TileExporter *tileExporter;
+    TileImporter *tileImporter;
+    AutoStitchingStatus *fileStatus;
+    PyramidCache *pyramidCache;
+    MosaicView *mosaicView;
+    QThread *serverThread;
+    TileServer *tileServer;
 };
 
 
@@ -0,0 +1,172 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <cmath>
+#include <algorithm>
+#include <QtGui/QPainter>
+#include <QtGui/QMouseEvent>
+#include <QtGui/QWheelEvent>
+#include <opencv2/core.hpp>
+
+#include "mosaicview.hpp"
+#include "pyramidimage.hpp"
+#include "mainwin.hpp"
+
+
+// Change of the zoom for one step of the wheel
+static const double ZOOM_STEP = 1.25;
+
+// Largest zoom, in screen pixels per pixel of the image
+static const double MAX_ZOOM = 8.0;
+
+
+MosaicView::MosaicView(QWidget *parent)
+    : QWidget(parent),
+    pyramid(new PyramidImage()),
+    zoom(1.0),
+    fitPending(false)
+{
+}
+
+MosaicView::~MosaicView()
+{
+    delete pyramid;
+}
+
+bool MosaicView::open(const QString &fileName)
+{
+    bool opened = pyramid->open(fileName);
+    fitPending = opened;
+    update();
+    return opened;
+}
+
+QString MosaicView::errorString() const
+{
+    return pyramid->errorString();
+}
+
+void MosaicView::fit()
+{
+    cv::Size full = pyramid->size();
+    if (full.area() <= 0 || width() <= 0 || height() <= 0)
+        return;
+
+    zoom = std::min(
+        static_cast<double>(width()) / full.width,
+        static_cast<double>(height()) / full.height
+    );
+    center = QPointF(full.width / 2.0, full.height / 2.0);
+    fitPending = false;
+    update();
+}
+
+void MosaicView::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), Qt::darkGray);
+    if (!pyramid->isOpen())
+        return;
+    if (fitPending)
+        fit();
+
+    // The visible part in pixels of the full image and of the level
+    QRectF visible(
+        center.x() - width() / (2 * zoom), center.y() - height() / (2 * zoom),
+        width() / zoom, height() / zoom
+    );
+    int level = pyramid->levelFor(zoom);
+    cv::Size full = pyramid->size();
+    cv::Size reduced = pyramid->size(level);
+    double scaleX = static_cast<double>(reduced.width) / full.width;
+    double scaleY = static_cast<double>(reduced.height) / full.height;
+    int left = static_cast<int>(std::floor(visible.left() * scaleX));
+    int top = static_cast<int>(std::floor(visible.top() * scaleY));
+    cv::Rect part(
+        left, top,
+        static_cast<int>(std::ceil(visible.right() * scaleX)) - left + 1,
+        static_cast<int>(std::ceil(visible.bottom() * scaleY)) - top + 1
+    );
+    part &= cv::Rect(cv::Point(), reduced);
+    cv::Mat pixels = pyramid->region(level, part);
+    if (pixels.empty())
+        return;
+
+    QRectF target(
+        (part.x / scaleX - visible.left()) * zoom,
+        (part.y / scaleY - visible.top()) * zoom,
+        part.width / scaleX * zoom, part.height / scaleY * zoom
+    );
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    painter.drawPixmap(
+        target, MainWin::matToPixmap(pixels),
+        QRectF(0, 0, pixels.cols, pixels.rows)
+    );
+}
+
+void MosaicView::wheelEvent(QWheelEvent *event)
+{
+    if (!pyramid->isOpen() || event->angleDelta().y() == 0) {
+        QWidget::wheelEvent(event);
+        return;
+    }
+
+    // The pixel under the mouse stays there
+    QPointF offset = QPointF(event->pos()) - QPointF(width(), height()) / 2;
+    QPointF anchor = center + offset / zoom;
+    cv::Size full = pyramid->size();
+    double smallest = 0.5 * std::min(
+        static_cast<double>(std::max(1, width())) / full.width,
+        static_cast<double>(std::max(1, height())) / full.height
+    );
+    double factor = event->angleDelta().y() > 0 ? ZOOM_STEP : 1 / ZOOM_STEP;
+    zoom = std::max(smallest, std::min(MAX_ZOOM, zoom * factor));
+    center = anchor - offset / zoom;
+    update();
+}
+
+void MosaicView::mousePressEvent(QMouseEvent *event)
+{
+    if (event->button() == Qt::LeftButton)
+        lastMouse = event->pos();
+    else
+        QWidget::mousePressEvent(event);
+}
+
+void MosaicView::mouseMoveEvent(QMouseEvent *event)
+{
+    if (!(event->buttons() & Qt::LeftButton)) {
+        QWidget::mouseMoveEvent(event);
+        return;
+    }
+
+    QPoint delta = event->pos() - lastMouse;
+    lastMouse = event->pos();
+    center -= QPointF(delta) / zoom;
+    update();
+}
+
+void MosaicView::mouseDoubleClickEvent(QMouseEvent *event)
+{
+    if (event->button() == Qt::LeftButton)
+        fit();
+    else
+        QWidget::mouseDoubleClickEvent(event);
+}
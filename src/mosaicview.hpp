@@ -0,0 +1,106 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef MOSAICVIEW_H
+#define MOSAICVIEW_H
+
+#include <QtCore/QPointF>
+#include <QtWidgets/QWidget>
+
+
+class PyramidImage;
+
+///
+/// \brief Viewer of large mosaics stored as pyramid
+/// Only the visible part is read, from the smallest level that still has
+/// enough pixels for the zoom. The wheel zooms around the mouse, dragging
+/// moves the image and a double click fits it into the window again.
+///
+class MosaicView : public QWidget
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param parent Parent widget
+    ///
+    explicit MosaicView(QWidget *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~MosaicView() override;
+
+    ///
+    /// \brief Show a pyramid
+    /// \param fileName The file of the pyramid
+    /// \return True if opened, else false
+    ///
+    bool open(const QString &fileName);
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+public slots:
+    ///
+    /// \brief Fit the whole image into the window
+    ///
+    void fit();
+
+protected:
+    ///
+    /// \brief Draw the visible part of the image
+    ///
+    virtual void paintEvent(QPaintEvent *event) override;
+
+    ///
+    /// \brief Zoom around the mouse
+    ///
+    virtual void wheelEvent(QWheelEvent *event) override;
+
+    ///
+    /// \brief Start moving the image
+    ///
+    virtual void mousePressEvent(QMouseEvent *event) override;
+
+    ///
+    /// \brief Move the image
+    ///
+    virtual void mouseMoveEvent(QMouseEvent *event) override;
+
+    ///
+    /// \brief Fit the image into the window
+    ///
+    virtual void mouseDoubleClickEvent(QMouseEvent *event) override;
+
+private:
+    PyramidImage *pyramid;
+    double zoom;
+    QPointF center;
+    QPoint lastMouse;
+    bool fitPending;
+};
+
+
+#endif // MOSAICVIEW_H
@@ -0,0 +1,135 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "pyramidcache.hpp"
+
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
+#include <QtCore/QFileInfo>
+#include <QtCore/QDir>
+#include <QtCore/QStandardPaths>
+#include <opencv2/imgcodecs.hpp>
+
+#include "pyramidimage.hpp"
+
+
+///
+/// \brief Job of the thread pool for one image
+///
+class ConversionJob : public QRunnable
+{
+public:
+    ConversionJob(PyramidCache *cache, const QString &source,
+            const QString &fileName)
+        : cache(cache),
+        source(source),
+        fileName(fileName)
+    {
+    }
+
+    void run() override
+    {
+        cache->run(source, fileName);
+    }
+
+private:
+    PyramidCache *cache;
+    QString source;
+    QString fileName;
+};
+
+PyramidCache::PyramidCache(QObject *parent)
+    : QObject(parent),
+    threadPool(new QThreadPool(this)),
+    directory(QDir(QStandardPaths::writableLocation(
+        QStandardPaths::CacheLocation)).absoluteFilePath("pyramids"))
+{
+    // A large image needs its memory while it is converted, one at a time
+    threadPool->setMaxThreadCount(1);
+}
+
+PyramidCache::~PyramidCache()
+{
+    threadPool->waitForDone();
+}
+
+void PyramidCache::setDirectory(const QString &directory)
+{
+    QMutexLocker locker(&mutex);
+    this->directory = directory;
+}
+
+QString PyramidCache::cacheFile(const QString &source) const
+{
+    QFileInfo info(source);
+    QByteArray key = info.absoluteFilePath().toUtf8() + '\n'
+        + QByteArray::number(info.size()) + '\n'
+        + QByteArray::number(info.lastModified().toMSecsSinceEpoch());
+    QString name = QString::fromLatin1(
+        QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()
+    );
+
+    QMutexLocker locker(&mutex);
+    return QDir(directory).absoluteFilePath(name + ".mpyramid");
+}
+
+bool PyramidCache::isCached(const QString &source) const
+{
+    return QFileInfo(cacheFile(source)).isFile();
+}
+
+bool PyramidCache::convert(const QString &source)
+{
+    QString fileName = cacheFile(source);
+    {
+        QMutexLocker locker(&mutex);
+        if (converting.contains(fileName))
+            return false;
+        converting.insert(fileName);
+    }
+    threadPool->start(new ConversionJob(this, source, fileName));
+    return true;
+}
+
+void PyramidCache::run(const QString &source, const QString &fileName)
+{
+    QString error;
+    bool success = false;
+    cv::Mat image = cv::imread(source.toStdString(), cv::IMREAD_COLOR);
+    if (image.empty()) {
+        error = tr("The image cannot be read.");
+    } else if (!QDir().mkpath(QFileInfo(fileName).absolutePath())) {
+        error = tr("The cache directory cannot be created.");
+    } else {
+        PyramidImage pyramid;
+        success = pyramid.save(fileName, image);
+        if (!success)
+            error = pyramid.errorString();
+    }
+
+    {
+        QMutexLocker locker(&mutex);
+        converting.remove(fileName);
+    }
+    emit converted(source, fileName, success, error);
+}
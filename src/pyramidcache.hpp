@@ -0,0 +1,109 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef PYRAMIDCACHE_H
+#define PYRAMIDCACHE_H
+
+#include <QtCore/QObject>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+
+
+class QThreadPool;
+
+///
+/// \brief Pyramids of large flat images, converted once in the background
+/// A png, jpeg or tiff has to be decoded as a whole. The first time it is
+/// opened, it is converted into a pyramid of tiles in the cache directory.
+/// The pyramid is found again by the path, the size and the modification
+/// time of the image, a changed image is converted again.
+///
+class PyramidCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param parent Parent object
+    ///
+    explicit PyramidCache(QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    /// Waits for the running conversion.
+    ///
+    virtual ~PyramidCache() override;
+
+    ///
+    /// \brief Set the directory of the pyramids
+    /// \param directory The directory, it is created when needed
+    ///
+    void setDirectory(const QString &directory);
+
+    ///
+    /// \brief Get the pyramid of an image
+    /// \param source The image
+    /// \return The file of the pyramid, it may not exist yet
+    ///
+    QString cacheFile(const QString &source) const;
+
+    ///
+    /// \brief Get the info if an image has been converted
+    /// \param source The image
+    /// \return True if its pyramid exists, else false
+    ///
+    bool isCached(const QString &source) const;
+
+    ///
+    /// \brief Convert an image in the background
+    /// \param source The image
+    /// \return True if started, false if it is converted already
+    ///
+    bool convert(const QString &source);
+
+signals:
+    ///
+    /// \brief A conversion has been finished
+    /// \param source The image
+    /// \param fileName The file of the pyramid
+    /// \param success True if converted, else false
+    /// \param error The description of the error
+    ///
+    void converted(const QString &source, const QString &fileName,
+        bool success, const QString &error);
+
+private:
+    friend class ConversionJob;
+
+    ///
+    /// \brief Convert one image, runs on a worker thread
+    ///
+    void run(const QString &source, const QString &fileName);
+
+    QThreadPool *threadPool;
+    mutable QMutex mutex;
+    QString directory;
+    QSet<QString> converting;
+};
+
+
+#endif // PYRAMIDCACHE_H
@@ -0,0 +1,333 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "pyramidimage.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <QtCore/QFile>
+#include <QtCore/QSaveFile>
+#include <QtCore/QDataStream>
+#include <QtCore/QObject>
+#include <opencv2/imgproc.hpp>
+
+
+// First bytes of every pyramid and the version of the format
+static const char PYRAMID_MAGIC[8] = {'M', 'P', 'Y', 'R', 'A', 'M', 'I', 'D'};
+static const quint32 PYRAMID_VERSION = 1;
+
+// The header with the table of levels fills the first page, the tiles are
+// multiples of a page and start at page boundaries
+static const int HEADER_SIZE = 4096;
+
+// Size of the header without the table and of one entry of the table
+static const int HEADER_FIXED_SIZE = 28;
+static const int LEVEL_SIZE = 16;
+
+// The smallest level has one tile, more than this are never needed
+static const int MAX_LEVELS = 32;
+
+// Larger tiles are of no use, the limit keeps the size of a tile in range
+static const int MAX_TILE_SIZE = 8192;
+
+///
+/// \brief Test for a pixel type of the pyramids
+/// \param type The OpenCV type
+/// \return True for gray and color images with 8 bits per channel
+///
+static bool isPyramidType(int type)
+{
+    return type == CV_8UC1 || type == CV_8UC3;
+}
+
+
+PyramidImage::PyramidImage()
+    : file(new QFile()),
+    data(nullptr),
+    dataSize(0),
+    tileWidth(0),
+    pixelType(0)
+{
+}
+
+PyramidImage::~PyramidImage()
+{
+    close();
+    delete file;
+}
+
+bool PyramidImage::save(
+    const QString &fileName, const cv::Mat &image, int tileSize)
+{
+    if (image.empty() || !isPyramidType(image.type()) || tileSize < 64
+            || tileSize > MAX_TILE_SIZE || tileSize % 64 != 0) {
+        lastError = QObject::tr("There is no image, its type or the tile "
+            "size is wrong.");
+        return false;
+    }
+
+    QSaveFile out(fileName);
+    if (!out.open(QIODevice::WriteOnly)) {
+        lastError = out.errorString();
+        return false;
+    }
+    if (out.write(QByteArray(HEADER_SIZE, '\0')) != HEADER_SIZE) {
+        lastError = out.errorString();
+        return false;
+    }
+
+    // Every level is reduced from the one before and dropped when written
+    std::vector<Level> written;
+    cv::Mat level = image;
+    while (true) {
+        Level info;
+        info.size = level.size();
+        info.offset = static_cast<quint64>(out.pos());
+        written.push_back(info);
+        if (!writeLevel(&out, level, tileSize))
+            return false;
+        if ((level.cols <= tileSize && level.rows <= tileSize)
+                || static_cast<int>(written.size()) == MAX_LEVELS)
+            break;
+
+        cv::Mat smaller;
+        cv::resize(
+            level, smaller,
+            cv::Size((level.cols + 1) / 2, (level.rows + 1) / 2), 0, 0,
+            cv::INTER_AREA
+        );
+        level = smaller;
+    }
+
+    QByteArray head(HEADER_SIZE, '\0');
+    QDataStream stream(&head, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.writeRawData(PYRAMID_MAGIC, sizeof(PYRAMID_MAGIC));
+    stream << PYRAMID_VERSION << qint32(image.type()) << qint32(tileSize)
+        << qint32(written.size()) << quint32(0);
+    for (size_t i = 0; i < written.size(); i++) {
+        stream << qint32(written[i].size.width)
+            << qint32(written[i].size.height) << written[i].offset;
+    }
+
+    if (!out.seek(0) || out.write(head) != head.size() || !out.commit()) {
+        lastError = out.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool PyramidImage::writeLevel(
+    QIODevice *out, const cv::Mat &image, int tileSize)
+{
+    // Tiles at the edges are filled up with zeros to the full size
+    cv::Mat buffer(tileSize, tileSize, image.type());
+    qint64 bytes = static_cast<qint64>(buffer.total() * buffer.elemSize());
+    for (int y = 0; y < image.rows; y += tileSize) {
+        for (int x = 0; x < image.cols; x += tileSize) {
+            cv::Rect rect(
+                x, y, std::min(tileSize, image.cols - x),
+                std::min(tileSize, image.rows - y)
+            );
+            buffer.setTo(cv::Scalar::all(0));
+            image(rect).copyTo(buffer(cv::Rect(cv::Point(), rect.size())));
+            if (out->write(reinterpret_cast<const char *>(buffer.data), bytes)
+                    != bytes) {
+                lastError = out->errorString();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool PyramidImage::open(const QString &fileName)
+{
+    close();
+    file->setFileName(fileName);
+    if (!file->open(QIODevice::ReadOnly)) {
+        lastError = file->errorString();
+        return false;
+    }
+    dataSize = file->size();
+    if (dataSize >= HEADER_SIZE) {
+        // Privately, so the tiles can be changed like any other image
+        data = file->map(0, dataSize, QFileDevice::MapPrivateOption);
+    }
+    if (data == nullptr) {
+        lastError = dataSize < HEADER_SIZE
+            ? QObject::tr("The file is no pyramid.") : file->errorString();
+        close();
+        return false;
+    }
+
+    QByteArray head = QByteArray::fromRawData(
+        reinterpret_cast<const char *>(data), HEADER_SIZE
+    );
+    QDataStream stream(head);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setByteOrder(QDataStream::LittleEndian);
+
+    char magic[sizeof(PYRAMID_MAGIC)];
+    quint32 version = 0;
+    qint32 type = 0;
+    qint32 tileSize = 0;
+    qint32 count = 0;
+    quint32 reserved = 0;
+    stream.readRawData(magic, sizeof(magic));
+    stream >> version >> type >> tileSize >> count >> reserved;
+    if (!std::equal(magic, magic + sizeof(magic), PYRAMID_MAGIC)
+            || version != PYRAMID_VERSION || !isPyramidType(type)
+            || tileSize < 64 || tileSize > MAX_TILE_SIZE
+            || count < 1 || count > MAX_LEVELS
+            || HEADER_FIXED_SIZE + count * LEVEL_SIZE > HEADER_SIZE) {
+        lastError = QObject::tr("The file is no pyramid or it is damaged.");
+        close();
+        return false;
+    }
+
+    // Every tile of every level must be inside of the file
+    tileWidth = tileSize;
+    pixelType = type;
+    quint64 tileBytes = static_cast<quint64>(tileSize) * tileSize
+        * CV_ELEM_SIZE(type);
+    for (qint32 i = 0; i < count; i++) {
+        qint32 width = 0;
+        qint32 height = 0;
+        Level level;
+        stream >> width >> height >> level.offset;
+        level.size = cv::Size(width, height);
+        levelInfo.push_back(level);
+        cv::Size tiles = grid(i);
+        quint64 end = level.offset + tileBytes
+            * static_cast<quint64>(tiles.area());
+        if (width <= 0 || height <= 0 || end > static_cast<quint64>(dataSize)) {
+            lastError = QObject::tr("The pyramid is damaged.");
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void PyramidImage::close()
+{
+    if (data != nullptr)
+        file->unmap(data);
+    data = nullptr;
+    dataSize = 0;
+    file->close();
+    levelInfo.clear();
+}
+
+bool PyramidImage::isOpen() const
+{
+    return data != nullptr;
+}
+
+int PyramidImage::levels() const
+{
+    return static_cast<int>(levelInfo.size());
+}
+
+cv::Size PyramidImage::size(int level) const
+{
+    if (level < 0 || level >= levels())
+        return cv::Size();
+    return levelInfo[level].size;
+}
+
+cv::Size PyramidImage::grid(int level) const
+{
+    cv::Size pixels = size(level);
+    if (tileWidth <= 0)
+        return cv::Size();
+    return cv::Size(
+        (pixels.width + tileWidth - 1) / tileWidth,
+        (pixels.height + tileWidth - 1) / tileWidth
+    );
+}
+
+int PyramidImage::tileSize() const
+{
+    return tileWidth;
+}
+
+int PyramidImage::type() const
+{
+    return pixelType;
+}
+
+cv::Mat PyramidImage::tile(int level, int column, int row) const
+{
+    cv::Size tiles = grid(level);
+    if (data == nullptr || column < 0 || row < 0 || column >= tiles.width
+            || row >= tiles.height)
+        return cv::Mat();
+
+    size_t step = static_cast<size_t>(tileWidth) * CV_ELEM_SIZE(pixelType);
+    quint64 offset = levelInfo[level].offset + static_cast<quint64>(step)
+        * tileWidth * (static_cast<quint64>(row) * tiles.width + column);
+    cv::Mat full(tileWidth, tileWidth, pixelType, data + offset, step);
+    cv::Size pixels = size(level);
+    return full(cv::Rect(
+        0, 0, std::min(tileWidth, pixels.width - column * tileWidth),
+        std::min(tileWidth, pixels.height - row * tileWidth)
+    ));
+}
+
+cv::Mat PyramidImage::region(int level, const cv::Rect &rect) const
+{
+    cv::Rect part = rect & cv::Rect(cv::Point(), size(level));
+    if (data == nullptr || part.area() <= 0)
+        return cv::Mat();
+
+    cv::Mat result(part.size(), pixelType);
+    int firstColumn = part.x / tileWidth;
+    int firstRow = part.y / tileWidth;
+    int lastColumn = (part.x + part.width - 1) / tileWidth;
+    int lastRow = (part.y + part.height - 1) / tileWidth;
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int column = firstColumn; column <= lastColumn; column++) {
+            cv::Point origin(column * tileWidth, row * tileWidth);
+            cv::Mat source = tile(level, column, row);
+            cv::Rect overlap = part & cv::Rect(origin, source.size());
+            source(overlap - origin).copyTo(result(overlap - part.tl()));
+        }
+    }
+    return result;
+}
+
+int PyramidImage::levelFor(double scale) const
+{
+    if (levelInfo.empty() || scale <= 0)
+        return 0;
+
+    // Each level has half the pixels of the one before on every axis
+    int level = static_cast<int>(std::floor(std::log2(1.0 / scale)));
+    return std::max(0, std::min(levels() - 1, level));
+}
+
+QString PyramidImage::errorString() const
+{
+    return lastError;
+}
@@ -0,0 +1,174 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef PYRAMIDIMAGE_H
+#define PYRAMIDIMAGE_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <opencv2/core.hpp>
+
+
+class QFile;
+class QIODevice;
+
+///
+/// \brief Large image stored as a pyramid of square tiles
+/// Every level halves the one before, till the whole image fits into one
+/// tile. The tiles are stored uncompressed and all of the same size, level by
+/// level and row by row, so the place of a tile follows from its position.
+/// The file is mapped into memory, opening it takes the same time for every
+/// size and only the tiles that are used are read by the system.
+///
+class PyramidImage
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    PyramidImage();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~PyramidImage();
+
+    ///
+    /// \brief Write an image as a pyramid
+    /// The file is replaced at once, when everything has been written.
+    /// \param fileName The file
+    /// \param image The image, gray or color with 8 bits per channel
+    /// \param tileSize Width and height of the tiles, a multiple of 64 up
+    /// to 8192
+    /// \return True if written, else false
+    ///
+    bool save(const QString &fileName, const cv::Mat &image,
+        int tileSize = 512);
+
+    ///
+    /// \brief Open a pyramid and map it into memory
+    /// An open pyramid is closed before.
+    /// \param fileName The file
+    /// \return True if opened, else false
+    ///
+    bool open(const QString &fileName);
+
+    ///
+    /// \brief Close the pyramid
+    /// The tiles are not valid any more.
+    ///
+    void close();
+
+    ///
+    /// \brief Get the info if a pyramid is open
+    /// \return True if open, else false
+    ///
+    bool isOpen() const;
+
+    ///
+    /// \brief Get the number of levels
+    /// \return Number of levels, the first one has the full size
+    ///
+    int levels() const;
+
+    ///
+    /// \brief Get the size of the image at a level
+    /// \param level The level
+    /// \return The size in pixels
+    ///
+    cv::Size size(int level = 0) const;
+
+    ///
+    /// \brief Get the number of tiles of a level
+    /// \param level The level
+    /// \return Columns and rows of tiles
+    ///
+    cv::Size grid(int level) const;
+
+    ///
+    /// \brief Get the width and height of the tiles
+    /// \return Size in pixels
+    ///
+    int tileSize() const;
+
+    ///
+    /// \brief Get the type of the pixels
+    /// \return The OpenCV type
+    ///
+    int type() const;
+
+    ///
+    /// \brief Get a tile
+    /// The tile points into the mapped file and is only valid while the
+    /// pyramid is open. Tiles at the right and bottom edge are smaller.
+    /// \param level The level
+    /// \param column Column of the tile
+    /// \param row Row of the tile
+    /// \return The tile, empty if there is none
+    ///
+    cv::Mat tile(int level, int column, int row) const;
+
+    ///
+    /// \brief Get a part of the image at a level
+    /// Only the tiles under the part are read.
+    /// \param level The level
+    /// \param rect The part in pixels of the level, clipped to the image
+    /// \return A copy of the part
+    ///
+    cv::Mat region(int level, const cv::Rect &rect) const;
+
+    ///
+    /// \brief Get the smallest level that still has enough pixels
+    /// \param scale Wanted pixels per pixel of the full image
+    /// \return The level
+    ///
+    int levelFor(double scale) const;
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+private:
+    ///
+    /// \brief Size of a level and where its tiles start
+    ///
+    struct Level {
+        cv::Size size;
+        quint64 offset;
+    };
+
+    ///
+    /// \brief Write the tiles of a level
+    ///
+    bool writeLevel(QIODevice *out, const cv::Mat &image, int tileSize);
+
+    QFile *file;
+    uchar *data;
+    qint64 dataSize;
+    int tileWidth;
+    int pixelType;
+    std::vector<Level> levelInfo;
+    QString lastError;
+};
+
+
+#endif // PYRAMIDIMAGE_H
@@ -0,0 +1,314 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "scanjournal.hpp"
+
+#include <map>
+#include <QtCore/QFile>
+#include <QtCore/QDir>
+#include <QtCore/QStringList>
+#include <QtCore/QObject>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+
+// First line of every journal, with the version of the format
+static const char *JOURNAL_HEADER = "microscope-scan 1";
+
+
+ScanJournal::ScanJournal()
+    : file(new QFile()),
+    scanMode(Mode::GRID),
+    finished(false)
+{
+}
+
+ScanJournal::~ScanJournal()
+{
+    delete file;
+}
+
+bool ScanJournal::start(const QString &directory, cv::Size grid,
+    cv::Point steps, Mode mode)
+{
+    file->close();
+    this->directory = directory;
+    gridSize = grid;
+    gridSteps = steps;
+    scanMode = mode;
+    tileCells.clear();
+    tileFiles.clear();
+    tileTimes.clear();
+    recorded.clear();
+    reference.clear();
+    driftModel.clear();
+    stageSteps = cv::Point();
+    finished = false;
+
+    file->setFileName(fileName(directory));
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        lastError = file->errorString();
+        return false;
+    }
+    return append(JOURNAL_HEADER)
+        && append(QString("grid %1 %2").arg(grid.width).arg(grid.height))
+        && append(QString("steps %1 %2").arg(steps.x).arg(steps.y))
+        && append(QString("mode %1").arg(
+            mode == Mode::ADAPTIVE ? "adaptive" : "grid"))
+        && append("stage 0 0");
+}
+
+bool ScanJournal::read(const QString &directory)
+{
+    file->close();
+    this->directory = directory;
+    tileCells.clear();
+    tileFiles.clear();
+    tileTimes.clear();
+    recorded.clear();
+    reference.clear();
+    driftModel.clear();
+    stageSteps = cv::Point();
+    finished = false;
+
+    QFile input(fileName(directory));
+    if (!input.open(QIODevice::ReadOnly)) {
+        lastError = input.errorString();
+        return false;
+    }
+
+    // A last line without its end has been cut off by a crash
+    QStringList lines = QString::fromUtf8(input.readAll()).split('\n');
+    lines.removeLast();
+    if (lines.isEmpty() || lines.first() != JOURNAL_HEADER) {
+        lastError = QObject::tr("The file is no scan journal.");
+        return false;
+    }
+
+    // The time of a tile is recorded right before its file
+    QDir dir(directory);
+    gridSize = cv::Size();
+    std::map<std::pair<int, int>, qint64> cellTimes;
+    for (int i = 1; i < lines.size(); i++) {
+        const QString &line = lines.at(i);
+        QStringList fields = line.split(' ', QString::SkipEmptyParts);
+        if (fields.isEmpty())
+            continue;
+
+        bool okX = false;
+        bool okY = false;
+        int x = fields.size() >= 3 ? fields.at(1).toInt(&okX) : 0;
+        int y = fields.size() >= 3 ? fields.at(2).toInt(&okY) : 0;
+        QString key = fields.at(0);
+        if (key == "grid" && okX && okY) {
+            gridSize = cv::Size(x, y);
+        } else if (key == "steps" && okX && okY) {
+            gridSteps = cv::Point(x, y);
+        } else if (key == "mode" && fields.size() == 2) {
+            scanMode = fields.at(1) == "adaptive" ? Mode::ADAPTIVE : Mode::GRID;
+        } else if (key == "stage" && okX && okY) {
+            stageSteps = cv::Point(x, y);
+        } else if (key == "time" && okX && okY && fields.size() == 4) {
+            bool ok = false;
+            qint64 time = fields.at(3).toLongLong(&ok);
+            if (ok)
+                cellTimes[std::make_pair(x, y)] = time;
+        } else if (key == "tile" && okX && okY && fields.size() >= 4) {
+            // The name may contain spaces, it is the rest of the line
+            QString name = line.section(' ', 3).trimmed();
+            if (recorded.contains(name))
+                continue;
+            recorded.insert(name);
+            auto time = cellTimes.find(std::make_pair(x, y));
+            tileCells.push_back(cv::Point(x, y));
+            tileFiles.push_back(dir.absoluteFilePath(name));
+            tileTimes.push_back(time != cellTimes.end() ? time->second : -1);
+        } else if (key == "reference" && fields.size() >= 2) {
+            reference = dir.absoluteFilePath(line.section(' ', 1).trimmed());
+        } else if (key == "drift" && fields.size() == 4) {
+            bool okTime = false;
+            bool okDx = false;
+            bool okDy = false;
+            qint64 time = fields.at(1).toLongLong(&okTime);
+            double dx = fields.at(2).toDouble(&okDx);
+            double dy = fields.at(3).toDouble(&okDy);
+            if (okTime && okDx && okDy)
+                driftModel.addSample(time, cv::Point2d(dx, dy));
+        } else if (key == "done") {
+            finished = true;
+        }
+    }
+
+    if (gridSize.area() <= 0) {
+        lastError = QObject::tr("The journal has no grid.");
+        return false;
+    }
+    return true;
+}
+
+bool ScanJournal::resume()
+{
+    file->close();
+    file->setFileName(fileName(directory));
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+        lastError = file->errorString();
+        return false;
+    }
+
+    // A line cut off by a crash must not swallow the next one
+    return append(QString());
+}
+
+void ScanJournal::appendTile(cv::Point cell, const QString &fileName,
+    qint64 time)
+{
+    if (!file->isOpen() || fileName.isEmpty())
+        return;
+
+    QString name = QDir(directory).relativeFilePath(fileName);
+    if (recorded.contains(name))
+        return;
+    recorded.insert(name);
+    tileCells.push_back(cell);
+    tileFiles.push_back(fileName);
+    tileTimes.push_back(time);
+    if (time >= 0)
+        append(QString("time %1 %2 %3").arg(cell.x).arg(cell.y).arg(time));
+    append(QString("tile %1 %2 %3").arg(cell.x).arg(cell.y).arg(name));
+}
+
+void ScanJournal::appendStage(cv::Point steps)
+{
+    if (!file->isOpen())
+        return;
+
+    stageSteps = steps;
+    append(QString("stage %1 %2").arg(steps.x).arg(steps.y));
+}
+
+void ScanJournal::appendReference(const QString &fileName)
+{
+    if (!file->isOpen() || fileName.isEmpty())
+        return;
+
+    reference = fileName;
+    append(QString("reference %1").arg(
+        QDir(directory).relativeFilePath(fileName)));
+}
+
+void ScanJournal::appendDrift(qint64 time, cv::Point2d drift)
+{
+    if (!file->isOpen())
+        return;
+
+    driftModel.addSample(time, drift);
+    append(QString("drift %1 %2 %3").arg(time)
+        .arg(drift.x, 0, 'f', 2).arg(drift.y, 0, 'f', 2));
+}
+
+void ScanJournal::finish(bool completed)
+{
+    if (!file->isOpen() || !completed)
+        return;
+
+    append("done");
+    finished = true;
+}
+
+bool ScanJournal::isOpen() const
+{
+    return file->isOpen();
+}
+
+bool ScanJournal::isFinished() const
+{
+    return finished;
+}
+
+cv::Size ScanJournal::grid() const
+{
+    return gridSize;
+}
+
+cv::Point ScanJournal::steps() const
+{
+    return gridSteps;
+}
+
+ScanJournal::Mode ScanJournal::mode() const
+{
+    return scanMode;
+}
+
+const std::vector<cv::Point>& ScanJournal::cells() const
+{
+    return tileCells;
+}
+
+const std::vector<QString>& ScanJournal::fileNames() const
+{
+    return tileFiles;
+}
+
+const std::vector<qint64>& ScanJournal::times() const
+{
+    return tileTimes;
+}
+
+QString ScanJournal::referenceFile() const
+{
+    return reference;
+}
+
+const DriftModel& ScanJournal::drift() const
+{
+    return driftModel;
+}
+
+cv::Point ScanJournal::stage() const
+{
+    return stageSteps;
+}
+
+QString ScanJournal::errorString() const
+{
+    return lastError;
+}
+
+QString ScanJournal::fileName(const QString &directory)
+{
+    return QDir(directory).absoluteFilePath("scan.journal");
+}
+
+bool ScanJournal::append(const QString &line)
+{
+    QByteArray data = line.toUtf8() + '\n';
+    if (file->write(data) != data.size() || !file->flush()) {
+        lastError = file->errorString();
+        return false;
+    }
+
+    // The data must survive a crash of the system as well
+#ifdef Q_OS_UNIX
+    ::fsync(file->handle());
+#endif
+    return true;
+}
@@ -0,0 +1,225 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SCANJOURNAL_H
+#define SCANJOURNAL_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QSet>
+#include <opencv2/core.hpp>
+
+#include "driftmodel.hpp"
+
+
+class QFile;
+
+///
+/// \brief On disk record of a running scan
+/// The journal lives next to the tiles in the scan directory. Every tile
+/// written to disk and every position the stage is sent to is appended as
+/// one line and synced before the scan goes on, so after a crash or a lost
+/// connection the scan can go on from the last position with the tiles
+/// already taken. The drift of the stage measured during the scan and the
+/// time of every tile are kept as well. A finished scan is marked as such.
+///
+class ScanJournal
+{
+public:
+    ///
+    /// \brief How the cells of the scan are chosen
+    ///
+    enum class Mode { GRID, ADAPTIVE };
+
+    ///
+    /// \brief Constructor
+    ///
+    ScanJournal();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~ScanJournal();
+
+    ///
+    /// \brief Start the journal of a new scan, an old one is replaced
+    /// \param directory The scan directory
+    /// \param grid Columns and rows of the scan
+    /// \param steps Steps between two cells of both motors
+    /// \param mode How the cells are chosen
+    /// \return True if the journal has been written, else false
+    ///
+    bool start(const QString &directory, cv::Size grid, cv::Point steps,
+        Mode mode);
+
+    ///
+    /// \brief Read the journal of a directory
+    /// A line cut off by a crash is ignored.
+    /// \param directory The scan directory
+    /// \return True if there is a journal, else false
+    ///
+    bool read(const QString &directory);
+
+    ///
+    /// \brief Continue the journal that has been read
+    /// \return True if it can be appended to, else false
+    ///
+    bool resume();
+
+    ///
+    /// \brief Record a tile written to disk
+    /// Tiles already recorded are skipped.
+    /// \param cell The grid cell of the tile
+    /// \param fileName The file of the tile
+    /// \param time Milliseconds since the epoch the tile has been taken at,
+    /// -1 if unknown
+    ///
+    void appendTile(cv::Point cell, const QString &fileName, qint64 time = -1);
+
+    ///
+    /// \brief Record where the stage is or is sent to
+    /// \param steps Steps of both motors from the first cell, higher columns
+    /// and rows are positive
+    ///
+    void appendStage(cv::Point steps);
+
+    ///
+    /// \brief Record the frame of the reference cell taken at the start
+    /// \param fileName The file of the frame
+    ///
+    void appendReference(const QString &fileName);
+
+    ///
+    /// \brief Record a measure of the drift
+    /// \param time Milliseconds since the epoch
+    /// \param drift Shift of the image in pixels, see DriftModel
+    ///
+    void appendDrift(qint64 time, cv::Point2d drift);
+
+    ///
+    /// \brief Mark the end of the scan
+    /// The journal stays open for the tiles still written to disk.
+    /// \param completed True to mark the scan as finished, an incomplete
+    /// scan can be resumed
+    ///
+    void finish(bool completed);
+
+    ///
+    /// \brief Get the info if the journal is written to
+    /// \return True if open, else false
+    ///
+    bool isOpen() const;
+
+    ///
+    /// \brief Get the info if the scan has been finished
+    /// \return True if finished, else false
+    ///
+    bool isFinished() const;
+
+    ///
+    /// \brief Get the grid of the scan
+    /// \return Columns and rows
+    ///
+    cv::Size grid() const;
+
+    ///
+    /// \brief Get the steps between two cells
+    /// \return Steps of the first and the second motor
+    ///
+    cv::Point steps() const;
+
+    ///
+    /// \brief Get how the cells are chosen
+    /// \return The mode
+    ///
+    Mode mode() const;
+
+    ///
+    /// \brief Get the cells of the recorded tiles
+    /// \return The cells in the order they have been taken
+    ///
+    const std::vector<cv::Point>& cells() const;
+
+    ///
+    /// \brief Get the files of the recorded tiles
+    /// \return The absolute file names, in the order of cells
+    ///
+    const std::vector<QString>& fileNames() const;
+
+    ///
+    /// \brief Get the times of the recorded tiles
+    /// \return Milliseconds since the epoch or -1, in the order of cells
+    ///
+    const std::vector<qint64>& times() const;
+
+    ///
+    /// \brief Get the file of the frame of the reference cell
+    /// \return The absolute file name, empty if there is none
+    ///
+    QString referenceFile() const;
+
+    ///
+    /// \brief Get the recorded drift
+    /// \return The measures, without the frame of the reference
+    ///
+    const DriftModel& drift() const;
+
+    ///
+    /// \brief Get the last recorded stage position
+    /// \return Steps from the first cell, see appendStage
+    ///
+    cv::Point stage() const;
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+    ///
+    /// \brief Get the file of the journal of a directory
+    /// \param directory The scan directory
+    /// \return The absolute file name
+    ///
+    static QString fileName(const QString &directory);
+
+private:
+    ///
+    /// \brief Append a line and wait till it is on the disk
+    ///
+    bool append(const QString &line);
+
+    QFile *file;
+    QString directory;
+    cv::Size gridSize;
+    cv::Point gridSteps;
+    Mode scanMode;
+    std::vector<cv::Point> tileCells;
+    std::vector<QString> tileFiles;
+    std::vector<qint64> tileTimes;
+    QSet<QString> recorded;
+    QString reference;
+    DriftModel driftModel;
+    cv::Point stageSteps;
+    bool finished;
+    QString lastError;
+};
+
+
+#endif // SCANJOURNAL_H
@@ -0,0 +1,202 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "scanpipeline.hpp"
+
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QDir>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+
+
+///
+/// \brief Job of the thread pool for one tile
+///
+class TileJob : public QRunnable
+{
+public:
+    TileJob(ScanPipeline *pipeline, int index, const cv::Mat &frame,
+            cv::Point cell, const QString &fileName)
+        : pipeline(pipeline),
+        index(index),
+        frame(frame),
+        cell(cell),
+        fileName(fileName)
+    {
+    }
+
+    void run() override
+    {
+        pipeline->process(index, frame, cell, fileName);
+    }
+
+private:
+    ScanPipeline *pipeline;
+    int index;
+    cv::Mat frame;
+    cv::Point cell;
+    QString fileName;
+};
+
+ScanPipeline::ScanPipeline(QObject *parent)
+    : QObject(parent),
+    threadPool(new QThreadPool(this)),
+    thumbnailWidth(320),
+    nextIndex(0),
+    nextReport(0)
+{
+    qRegisterMetaType<ProcessedTile>("ProcessedTile");
+
+    // Leave one core for the gui and the camera
+    threadPool->setMaxThreadCount(
+        std::max(1, QThread::idealThreadCount() - 1)
+    );
+}
+
+ScanPipeline::~ScanPipeline()
+{
+    threadPool->waitForDone();
+}
+
+void ScanPipeline::setThumbnailWidth(int width)
+{
+    QMutexLocker locker(&mutex);
+    thumbnailWidth = std::max(16, width);
+}
+
+void ScanPipeline::setOutputDirectory(const QString &directory)
+{
+    QMutexLocker locker(&mutex);
+    outputDirectory = directory;
+}
+
+void ScanPipeline::setMaxThreads(int threads)
+{
+    threadPool->setMaxThreadCount(std::max(1, threads));
+}
+
+void ScanPipeline::reset()
+{
+    threadPool->waitForDone();
+    QMutexLocker locker(&mutex);
+    finished.clear();
+    nextIndex = 0;
+    nextReport = 0;
+}
+
+int ScanPipeline::submit(const cv::Mat &frame, cv::Point cell)
+{
+    return submit(frame, cell, QString());
+}
+
+int ScanPipeline::submit(
+    const cv::Mat &frame, cv::Point cell, const QString &fileName)
+{
+    int index;
+    {
+        QMutexLocker locker(&mutex);
+        index = nextIndex++;
+    }
+    threadPool->start(new TileJob(this, index, frame, cell, fileName));
+    return index;
+}
+
+int ScanPipeline::pending() const
+{
+    QMutexLocker locker(&mutex);
+    return nextIndex - nextReport;
+}
+
+void ScanPipeline::waitForDone()
+{
+    threadPool->waitForDone();
+}
+
+double ScanPipeline::sharpness(const cv::Mat &gray)
+{
+    cv::Mat laplacian;
+    cv::Laplacian(gray, laplacian, CV_32F);
+    cv::Scalar mean;
+    cv::Scalar stddev;
+    cv::meanStdDev(laplacian, mean, stddev);
+    return stddev[0] * stddev[0];
+}
+
+void ScanPipeline::process(int index, const cv::Mat &frame, cv::Point cell,
+    const QString &fileName)
+{
+    int width;
+    QString directory;
+    {
+        QMutexLocker locker(&mutex);
+        width = thumbnailWidth;
+        directory = outputDirectory;
+    }
+
+    ProcessedTile tile;
+    tile.index = index;
+    tile.cell = cell;
+    tile.sharpness = 0;
+    tile.brightness = 0;
+    tile.fileName = fileName;
+
+    if (!frame.empty()) {
+        double scale = std::min(1.0, static_cast<double>(width) / frame.cols);
+        cv::resize(
+            frame, tile.thumbnail, cv::Size(), scale, scale, cv::INTER_AREA
+        );
+
+        // The quality is measured at half size, which is enough to detect
+        // blur and saves most of the time
+        cv::Mat gray;
+        if (frame.channels() == 3)
+            cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+        else
+            gray = frame;
+        cv::Mat half;
+        cv::pyrDown(gray, half);
+        tile.sharpness = sharpness(half);
+        tile.brightness = cv::mean(half)[0];
+
+        if (!directory.isEmpty() && fileName.isEmpty()) {
+            tile.fileName = QDir(directory).absoluteFilePath(
+                QString("tile_%1_%2_%3.png").arg(index, 4, 10, QChar('0'))
+                    .arg(cell.x).arg(cell.y)
+            );
+            if (!cv::imwrite(tile.fileName.toStdString(), frame,
+                    {cv::IMWRITE_PNG_COMPRESSION, 1}))
+                tile.fileName.clear();
+        }
+    }
+
+    // Report in the order of submission. Emitting under the lock keeps the
+    // order in the queue of the receiver.
+    QMutexLocker locker(&mutex);
+    finished.insert(index, tile);
+    while (finished.contains(nextReport)) {
+        emit tileProcessed(finished.take(nextReport));
+        nextReport++;
+    }
+    if (nextReport == nextIndex)
+        emit idle();
+}
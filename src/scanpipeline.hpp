@@ -0,0 +1,160 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SCANPIPELINE_H
+#define SCANPIPELINE_H
+
+#include <QtCore/QObject>
+#include <QtCore/QMetaType>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+#include <QtCore/QMap>
+#include <opencv2/core.hpp>
+
+
+class QThreadPool;
+
+///
+/// \brief Result of the processing of one tile
+///
+struct ProcessedTile {
+    int index;
+    cv::Point cell;
+    cv::Mat thumbnail;
+    double sharpness;
+    double brightness;
+    QString fileName;
+};
+
+Q_DECLARE_METATYPE(ProcessedTile)
+
+///
+/// \brief Processing of the scanned tiles on worker threads
+/// The scan only grabs the frame and moves on, thumbnails, quality measures
+/// and disk writes are done here while the motors move. The results are
+/// reported in the order the tiles have been submitted.
+///
+class ScanPipeline : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param parent Parent object
+    ///
+    explicit ScanPipeline(QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    /// Waits for the running jobs.
+    ///
+    virtual ~ScanPipeline() override;
+
+    ///
+    /// \brief Set the width of the thumbnails
+    /// \param width Width in pixels
+    ///
+    void setThumbnailWidth(int width);
+
+    ///
+    /// \brief Set the directory the tiles are written to
+    /// \param directory The directory or an empty string to write nothing
+    ///
+    void setOutputDirectory(const QString &directory);
+
+    ///
+    /// \brief Set the number of worker threads
+    /// \param threads Number of threads
+    ///
+    void setMaxThreads(int threads);
+
+    ///
+    /// \brief Start counting the tiles from zero
+    /// Jobs of the last scan are finished first.
+    ///
+    void reset();
+
+    ///
+    /// \brief Process a tile
+    /// \param frame The frame, it must not be changed afterwards
+    /// \param cell The grid cell of the tile
+    /// \return The index of the tile
+    ///
+    int submit(const cv::Mat &frame, cv::Point cell);
+
+    ///
+    /// \brief Process a tile that is on disk already, it is not written again
+    /// \param frame The frame, it must not be changed afterwards
+    /// \param cell The grid cell of the tile
+    /// \param fileName The file of the tile
+    /// \return The index of the tile
+    ///
+    int submit(const cv::Mat &frame, cv::Point cell, const QString &fileName);
+
+    ///
+    /// \brief Get the number of tiles still in processing
+    /// \return Number of tiles
+    ///
+    int pending() const;
+
+    ///
+    /// \brief Wait till every tile has been processed
+    ///
+    void waitForDone();
+
+    ///
+    /// \brief Sharpness measure used for the tiles
+    /// \param gray Gray image
+    /// \return Variance of the laplacian
+    ///
+    static double sharpness(const cv::Mat &gray);
+
+signals:
+    ///
+    /// \brief A tile has been processed
+    /// \param tile The result
+    ///
+    void tileProcessed(const ProcessedTile &tile);
+
+    ///
+    /// \brief All submitted tiles have been processed
+    ///
+    void idle();
+
+private:
+    friend class TileJob;
+
+    ///
+    /// \brief Process one tile, runs on a worker thread
+    ///
+    void process(int index, const cv::Mat &frame, cv::Point cell,
+        const QString &fileName);
+
+    QThreadPool *threadPool;
+    mutable QMutex mutex;
+    QMap<int, ProcessedTile> finished;
+    QString outputDirectory;
+    int thumbnailWidth;
+    int nextIndex;
+    int nextReport;
+};
+
+
+#endif // SCANPIPELINE_H
@@ -0,0 +1,199 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "scanplanner.hpp"
+#include "motion.h"
+
+#include <set>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <QtCore/QCoreApplication>
+
+
+ScanPlanner::ScanPlanner()
+    : stepsPerRevolution(2048),
+    rpm(5),
+    backlashSteps(1900),
+    maxSpeed(500),
+    acceleration(1000),
+    stepsX(0),
+    stepsY(0),
+    tileTime(0)
+{
+}
+
+ScanPlanner::~ScanPlanner()
+{
+}
+
+void ScanPlanner::setMotorModel(
+    int stepsPerRevolution, double rpm, int backlashSteps)
+{
+    this->stepsPerRevolution = stepsPerRevolution;
+    this->rpm = rpm;
+    this->backlashSteps = backlashSteps;
+}
+
+void ScanPlanner::setSteps(int stepsX, int stepsY)
+{
+    this->stepsX = stepsX;
+    this->stepsY = stepsY;
+}
+
+void ScanPlanner::setRamp(double maxSpeed, double acceleration)
+{
+    this->maxSpeed = maxSpeed;
+    this->acceleration = acceleration;
+}
+
+void ScanPlanner::setTileTime(double seconds)
+{
+    tileTime = seconds;
+}
+
+void ScanPlanner::estimatePath(
+    const std::vector<cv::Point> &cells, ScanPlan &plan) const
+{
+    plan.cells = cells;
+    plan.motorSteps = 0;
+    plan.reversals = 0;
+
+    double stepsPerSecond = stepsPerRevolution * rpm / 60.0;
+    bool ramp = maxSpeed > stepsPerSecond && acceleration > 0;
+    Motion motion(
+        static_cast<float>(stepsPerSecond), static_cast<float>(maxSpeed),
+        static_cast<float>(acceleration)
+    );
+    double moveSeconds = 0;
+
+    // Like the firmware, the first move of the second motor has no backlash
+    int lastDirection = 0;
+    for (size_t i = 1; i < cells.size(); i++) {
+        cv::Point delta = cells[i] - cells[i - 1];
+        long stepsM1 = static_cast<long>(std::abs(delta.x)) * stepsX;
+        long stepsM2 = static_cast<long>(std::abs(delta.y)) * stepsY;
+        if (delta.y != 0) {
+            int direction = delta.y > 0 ? 1 : -1;
+            if (lastDirection != 0 && direction != lastDirection) {
+                plan.reversals++;
+                stepsM2 += backlashSteps;
+            }
+            lastDirection = direction;
+        }
+        plan.motorSteps += stepsM1 + stepsM2;
+
+        // Both motors of a move run at once with acceleration, old firmware
+        // runs them one after another
+        if (ramp)
+            moveSeconds += motion.duration(stepsM1, stepsM2) / 1e6;
+        else
+            moveSeconds += (stepsM1 + stepsM2) / stepsPerSecond;
+    }
+
+    plan.seconds = moveSeconds + cells.size() * tileTime;
+}
+
+ScanPlan ScanPlanner::estimate(
+    int columns, int rows, GridOrder order, bool serpentine) const
+{
+    ScanPlan plan;
+    plan.columns = columns;
+    plan.rows = rows;
+    plan.order = order;
+    plan.serpentine = serpentine;
+
+    TileGrid grid(columns, rows, order, serpentine);
+    estimatePath(grid.cells(grid.size()), plan);
+    return plan;
+}
+
+ScanPlan ScanPlanner::plan(int columns, int rows) const
+{
+    std::vector<cv::Point> region;
+    for (int x = 0; x < columns; x++) {
+        for (int y = 0; y < rows; y++)
+            region.push_back(cv::Point(x, y));
+    }
+    return plan(region);
+}
+
+ScanPlan ScanPlanner::plan(const std::vector<cv::Point> &region) const
+{
+    ScanPlan best;
+    best.columns = 0;
+    best.rows = 0;
+    best.order = GridOrder::COLUMN_MAJOR;
+    best.serpentine = true;
+    best.motorSteps = 0;
+    best.reversals = 0;
+    best.seconds = 0;
+    if (region.empty())
+        return best;
+
+    // Bounding grid of the region
+    int columns = 0;
+    int rows = 0;
+    std::set<std::pair<int, int> > wanted;
+    for (size_t i = 0; i < region.size(); i++) {
+        columns = std::max(columns, region[i].x + 1);
+        rows = std::max(rows, region[i].y + 1);
+        wanted.insert(std::make_pair(region[i].x, region[i].y));
+    }
+
+    // Every sweep of the bounding grid, skipping the cells not wanted
+    const GridOrder orders[] = {GridOrder::COLUMN_MAJOR, GridOrder::ROW_MAJOR};
+    bool first = true;
+    for (int o = 0; o < 2; o++) {
+        for (int serpentine = 1; serpentine >= 0; serpentine--) {
+            TileGrid grid(columns, rows, orders[o], serpentine != 0);
+            std::vector<cv::Point> path;
+            for (int i = 0; i < grid.size(); i++) {
+                cv::Point cell = grid.cell(i);
+                if (wanted.count(std::make_pair(cell.x, cell.y)) > 0)
+                    path.push_back(cell);
+            }
+
+            ScanPlan candidate;
+            candidate.columns = columns;
+            candidate.rows = rows;
+            candidate.order = orders[o];
+            candidate.serpentine = serpentine != 0;
+            estimatePath(path, candidate);
+            if (first || candidate.seconds < best.seconds) {
+                best = candidate;
+                first = false;
+            }
+        }
+    }
+    return best;
+}
+
+QString ScanPlanner::formatDuration(double seconds)
+{
+    int total = static_cast<int>(std::ceil(seconds));
+    if (total < 60)
+        return QCoreApplication::translate("ScanPlanner", "%1 s").arg(total);
+    if (total < 3600) {
+        return QCoreApplication::translate("ScanPlanner", "%1 min %2 s")
+            .arg(total / 60).arg(total % 60);
+    }
+    return QCoreApplication::translate("ScanPlanner", "%1 h %2 min")
+        .arg(total / 3600).arg((total % 3600) / 60);
+}
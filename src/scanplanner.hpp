@@ -0,0 +1,152 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SCANPLANNER_H
+#define SCANPLANNER_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <opencv2/core.hpp>
+
+#include "tilegrid.hpp"
+
+
+///
+/// \brief A planned scan
+/// The cells are in the order they are visited, x is the column (first
+/// motor) and y the row (second motor).
+///
+struct ScanPlan {
+    int columns;
+    int rows;
+    GridOrder order;
+    bool serpentine;
+    std::vector<cv::Point> cells;
+    long motorSteps;
+    int reversals;
+    double seconds;
+};
+
+///
+/// \brief Chooses the order of a scan with the least motor time
+/// The time model follows the firmware: every move starts and ends with a
+/// fixed speed and accelerates between, both motors run at once and the
+/// second one adds a backlash move on every change of its direction. Both the row and the column order are tried, each
+/// serpentine and as raster with a return move, and the fastest one wins.
+///
+class ScanPlanner
+{
+public:
+    ///
+    /// \brief Constructor
+    /// The motor model defaults to the firmware: 2048 steps per turn, starting
+    /// at 5 rpm, accelerating with 1000 steps/s² to 500 steps/s and 1900 steps
+    /// backlash on the second motor.
+    ///
+    ScanPlanner();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~ScanPlanner();
+
+    ///
+    /// \brief Set the model of the motors
+    /// \param stepsPerRevolution Steps of one turn
+    /// \param rpm Speed at the start and end of a move in turns per minute
+    /// \param backlashSteps Steps added to the second motor on a reversal
+    ///
+    void setMotorModel(int stepsPerRevolution, double rpm, int backlashSteps);
+
+    ///
+    /// \brief Set the steps between two neighbouring cells
+    /// \param stepsX Steps of the first motor
+    /// \param stepsY Steps of the second motor
+    ///
+    void setSteps(int stepsX, int stepsY);
+
+    ///
+    /// \brief Set the acceleration ramp of the moves
+    /// \param maxSpeed Highest speed in steps per second, not above the speed
+    /// of the motor model for firmware that moves the motors one after
+    /// another without acceleration
+    /// \param acceleration Acceleration in steps per second²
+    ///
+    void setRamp(double maxSpeed, double acceleration);
+
+    ///
+    /// \brief Set the time spent at every position
+    /// \param seconds Time for settling, exposure and capture
+    ///
+    void setTileTime(double seconds);
+
+    ///
+    /// \brief Plan a rectangular scan
+    /// \param columns Number of columns
+    /// \param rows Number of rows
+    /// \return The fastest plan
+    ///
+    ScanPlan plan(int columns, int rows) const;
+
+    ///
+    /// \brief Plan a scan of an arbitrary region
+    /// Cells outside of the region are passed without stopping.
+    /// \param region The cells to take, in any order
+    /// \return The fastest plan, its columns and rows cover the region
+    ///
+    ScanPlan plan(const std::vector<cv::Point> &region) const;
+
+    ///
+    /// \brief Estimate a scan in a fixed order
+    /// \param columns Number of columns
+    /// \param rows Number of rows
+    /// \param order Order of the scan
+    /// \param serpentine True to reverse every second line
+    /// \return The plan with its estimated time
+    ///
+    ScanPlan estimate(int columns, int rows, GridOrder order,
+        bool serpentine) const;
+
+    ///
+    /// \brief Estimate the time of a path
+    /// \param cells The cells in the order they are visited
+    /// \param plan The plan, the cells and estimates are set
+    ///
+    void estimatePath(const std::vector<cv::Point> &cells, ScanPlan &plan) const;
+
+    ///
+    /// \brief Format a duration for the user
+    /// \param seconds The duration
+    /// \return The duration like "3 min 20 s"
+    ///
+    static QString formatDuration(double seconds);
+
+private:
+    int stepsPerRevolution;
+    double rpm;
+    int backlashSteps;
+    double maxSpeed;
+    double acceleration;
+    int stepsX;
+    int stepsY;
+    double tileTime;
+};
+
+
+#endif // SCANPLANNER_H
@@ -0,0 +1,184 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "serialframe.hpp"
+
+
+// Sync, type, seq and length in front of the payload
+static const int HEADER_SIZE = 4;
+
+// Checksum after the payload
+static const int CRC_SIZE = 2;
+
+
+///
+/// \brief Get the info if a byte is the type of a frame of the protocol
+///
+static bool isFrameType(quint8 type)
+{
+    switch (static_cast<FrameType>(type)) {
+    case FrameType::MOVE:
+    case FrameType::SCAN:
+    case FrameType::CAPTURED:
+    case FrameType::ABORT:
+    case FrameType::BACKLASH:
+    case FrameType::SWEEP:
+    case FrameType::ACK:
+    case FrameType::READY:
+    case FrameType::AT:
+    case FrameType::DONE:
+    case FrameType::ABORTED:
+    case FrameType::NAK:
+    case FrameType::POSITION:
+        return true;
+    }
+    return false;
+}
+
+void SerialFrame::appendInt32(qint32 value)
+{
+    quint32 v = static_cast<quint32>(value);
+    for (int i = 0; i < 4; i++)
+        payload.append(static_cast<char>((v >> (8 * i)) & 0xFF));
+}
+
+qint32 SerialFrame::int32At(int offset) const
+{
+    if (offset < 0 || offset + 4 > payload.size())
+        return 0;
+
+    quint32 v = 0;
+    for (int i = 0; i < 4; i++)
+        v |= static_cast<quint32>(static_cast<quint8>(payload.at(offset + i)))
+            << (8 * i);
+    return static_cast<qint32>(v);
+}
+
+QByteArray SerialFrame::encode() const
+{
+    QByteArray data;
+    data.reserve(HEADER_SIZE + payload.size() + CRC_SIZE);
+    data.append(static_cast<char>(FrameParser::SYNC));
+    data.append(static_cast<char>(type));
+    data.append(static_cast<char>(seq));
+    data.append(static_cast<char>(payload.size()));
+    data.append(payload);
+
+    quint16 crc = FrameParser::crc16(data.constData() + 1, data.size() - 1);
+    data.append(static_cast<char>(crc >> 8));
+    data.append(static_cast<char>(crc & 0xFF));
+    return data;
+}
+
+FrameParser::FrameParser()
+    : dropped(0)
+{
+}
+
+FrameParser::~FrameParser()
+{
+}
+
+void FrameParser::append(const QByteArray &data)
+{
+    buffer.append(data);
+}
+
+bool FrameParser::next(SerialFrame &frame)
+{
+    while (!buffer.isEmpty()) {
+        // Skip everything in front of the next sync byte
+        int start = buffer.indexOf(static_cast<char>(SYNC));
+        if (start < 0) {
+            dropped += buffer.size();
+            buffer.clear();
+            return false;
+        }
+        if (start > 0) {
+            dropped += start;
+            buffer.remove(0, start);
+        }
+
+        if (buffer.size() < HEADER_SIZE)
+            return false;
+        int length = static_cast<quint8>(buffer.at(3));
+        if (length > MAX_PAYLOAD
+                || !isFrameType(static_cast<quint8>(buffer.at(1)))) {
+            // Cannot be a header, search the next sync byte without a NAK
+            dropped++;
+            buffer.remove(0, 1);
+            continue;
+        }
+        int size = HEADER_SIZE + length + CRC_SIZE;
+        if (buffer.size() < size)
+            return false;
+
+        quint16 crc = (static_cast<quint8>(buffer.at(size - 2)) << 8)
+            | static_cast<quint8>(buffer.at(size - 1));
+        if (crc != crc16(buffer.constData() + 1, size - 1 - CRC_SIZE)) {
+            // The sync byte might have been part of the noise, so only this
+            // byte is skipped and the search goes on behind it. The header
+            // is plausible here, so its sequence number is worth a NAK.
+            corrupted.append(buffer.at(2));
+            dropped++;
+            buffer.remove(0, 1);
+            continue;
+        }
+
+        frame.type = static_cast<FrameType>(static_cast<quint8>(buffer.at(1)));
+        frame.seq = static_cast<quint8>(buffer.at(2));
+        frame.payload = buffer.mid(HEADER_SIZE, length);
+        buffer.remove(0, size);
+        return true;
+    }
+    return false;
+}
+
+QByteArray FrameParser::takeCorrupted()
+{
+    QByteArray seqs = corrupted;
+    corrupted.clear();
+    return seqs;
+}
+
+void FrameParser::clear()
+{
+    buffer.clear();
+    corrupted.clear();
+}
+
+qint64 FrameParser::droppedBytes() const
+{
+    return dropped;
+}
+
+quint16 FrameParser::crc16(const char *data, int length)
+{
+    quint16 crc = 0xFFFF;
+    for (int i = 0; i < length; i++) {
+        crc ^= static_cast<quint16>(static_cast<quint8>(data[i])) << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            if (crc & 0x8000)
+                crc = static_cast<quint16>((crc << 1) ^ 0x1021);
+            else
+                crc = static_cast<quint16>(crc << 1);
+        }
+    }
+    return crc;
+}
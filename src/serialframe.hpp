@@ -0,0 +1,152 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SERIALFRAME_H
+#define SERIALFRAME_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QtGlobal>
+
+
+///
+/// Types of the binary frames. Commands go from the host to the controller,
+/// events (bit 7 set) from the controller to the host.
+///
+enum class FrameType : quint8 {
+    MOVE = 0x01,        ///< motor (1 byte), steps (int32)
+    SCAN = 0x02,        ///< columns, rows, stepsX, stepsY, dwell, serpentine
+    CAPTURED = 0x03,    ///< no payload
+    ABORT = 0x04,       ///< no payload
+    BACKLASH = 0x05,    ///< backlash of the second motor in steps (int32)
+    SWEEP = 0x06,       ///< motor (1 byte), steps, steps/s, sample ms (int32)
+    ACK = 0x80,         ///< command with the same sequence number received
+    READY = 0x81,       ///< the move has been finished
+    AT = 0x82,          ///< x (int32), y (int32)
+    DONE = 0x83,        ///< the scan has been finished
+    ABORTED = 0x84,     ///< the scan has been aborted
+    NAK = 0x85,         ///< frame with the sequence number was corrupted
+    POSITION = 0x86     ///< controller time in µs, steps of the sweep (int32)
+};
+
+///
+/// \brief One frame of the binary controller protocol
+/// On the wire a frame is
+///
+///     0xA5 | type | seq | length | payload (length bytes) | crc16 (2 bytes)
+///
+/// The CRC-16/CCITT (polynomial 0x1021, initial 0xFFFF) covers type, seq,
+/// length and payload and is sent high byte first. Integers in the payload
+/// are little endian like on the controller.
+///
+struct SerialFrame {
+    FrameType type;
+    quint8 seq;
+    QByteArray payload;
+
+    ///
+    /// \brief Append a 32 bit integer to the payload
+    /// \param value The integer
+    ///
+    void appendInt32(qint32 value);
+
+    ///
+    /// \brief Read a 32 bit integer from the payload
+    /// \param offset Offset in the payload
+    /// \return The integer or 0 if the payload is too short
+    ///
+    qint32 int32At(int offset) const;
+
+    ///
+    /// \brief Encode the frame for the wire
+    /// \return The frame with sync byte and checksum
+    ///
+    QByteArray encode() const;
+};
+
+///
+/// \brief Streaming parser for the binary frames
+/// Bytes can be appended in chunks of any size. Corrupted frames and noise
+/// between frames are skipped by searching the next sync byte.
+///
+class FrameParser
+{
+public:
+    /// Sync byte starting every frame
+    static const quint8 SYNC = 0xA5;
+
+    /// Maximum payload length, the controller has a small buffer
+    static const int MAX_PAYLOAD = 32;
+
+    ///
+    /// \brief Constructor
+    ///
+    FrameParser();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~FrameParser();
+
+    ///
+    /// \brief Append received bytes
+    /// \param data The bytes
+    ///
+    void append(const QByteArray &data);
+
+    ///
+    /// \brief Take the next complete frame
+    /// Call it till it returns false to drain all frames of a read.
+    /// \param frame The frame, if one is available
+    /// \return True if a frame has been taken, else false
+    ///
+    bool next(SerialFrame &frame);
+
+    ///
+    /// \brief Get the sequence numbers of corrupted frames since the last call
+    /// \return Sequence number of every frame with a wrong checksum
+    ///
+    QByteArray takeCorrupted();
+
+    ///
+    /// \brief Remove all buffered bytes
+    ///
+    void clear();
+
+    ///
+    /// \brief Get the number of bytes skipped as noise or corrupted
+    /// \return Number of skipped bytes
+    ///
+    qint64 droppedBytes() const;
+
+    ///
+    /// \brief CRC-16/CCITT of the bytes
+    /// \param data The bytes
+    /// \param length Number of bytes
+    /// \return The checksum
+    ///
+    static quint16 crc16(const char *data, int length);
+
+private:
+    QByteArray buffer;
+    QByteArray corrupted;
+    qint64 dropped;
+};
+
+
+#endif // SERIALFRAME_H
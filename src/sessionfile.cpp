@@ -0,0 +1,403 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "sessionfile.hpp"
+
+#include <limits>
+#include <algorithm>
+#include <QtCore/QFile>
+#include <QtCore/QSaveFile>
+#include <QtCore/QDataStream>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QObject>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+
+// First bytes of every session and the version of the format
+static const char SESSION_MAGIC[8] = {'M', 'S', 'E', 'S', 'S', 'I', 'O', 'N'};
+static const quint32 SESSION_VERSION = 1;
+
+// Sizes of the header and of one record of the table, both leave room for
+// later fields
+static const int HEADER_SIZE = 64;
+static const int RECORD_SIZE = 192;
+
+// Every block of pixels starts at a page boundary
+static const qint64 ALIGNMENT = 4096;
+
+// Width of the thumbnails, like the scan pipeline
+static const int THUMBNAIL_WIDTH = 320;
+
+///
+/// \brief Test for a pixel type of the tiles
+/// \param type The OpenCV type
+/// \return True for gray and color images with 8 bits per channel
+///
+static bool isSessionType(int type)
+{
+    return type == CV_8UC1 || type == CV_8UC3;
+}
+
+
+SessionFile::SessionFile()
+    : file(new QFile()),
+    data(nullptr),
+    dataSize(0)
+{
+}
+
+SessionFile::~SessionFile()
+{
+    close();
+    delete file;
+}
+
+bool SessionFile::save(const QString &fileName,
+    const std::vector<cv::Mat> &images, const std::vector<Tile> &tiles,
+    const QJsonObject &metadata, Compression compression)
+{
+    if (images.size() != tiles.size()) {
+        lastError = QObject::tr("Every tile needs its metadata.");
+        return false;
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].empty() || !isSessionType(images[i].type())) {
+            lastError = QObject::tr("A tile is empty or of a wrong type.");
+            return false;
+        }
+    }
+
+    QSaveFile out(fileName);
+    if (!out.open(QIODevice::WriteOnly)) {
+        lastError = out.errorString();
+        return false;
+    }
+
+    // The header and the table are written when the blocks are known
+    quint32 count = static_cast<quint32>(images.size());
+    quint64 tableOffset = HEADER_SIZE;
+    quint64 metadataOffset = tableOffset + static_cast<quint64>(count)
+        * RECORD_SIZE;
+    QByteArray json = QJsonDocument(metadata).toJson(QJsonDocument::Compact);
+    if (out.write(QByteArray(static_cast<int>(metadataOffset), '\0'))
+            != static_cast<qint64>(metadataOffset)
+            || out.write(json) != json.size()) {
+        lastError = out.errorString();
+        return false;
+    }
+
+    std::vector<Block> blocks(count);
+    std::vector<Block> thumbnails(count);
+    for (quint32 i = 0; i < count; i++) {
+        cv::Mat small;
+        double scale = std::min(
+            1.0, static_cast<double>(THUMBNAIL_WIDTH) / images[i].cols
+        );
+        cv::resize(images[i], small, cv::Size(), scale, scale, cv::INTER_AREA);
+        if (!writeBlock(&out, images[i], compression, blocks[i])
+                || !writeBlock(&out, small, Compression::RAW, thumbnails[i]))
+            return false;
+    }
+
+    // Every part is filled up with zeros to its size
+    QByteArray head(static_cast<int>(metadataOffset), '\0');
+    QDataStream stream(&head, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.writeRawData(SESSION_MAGIC, sizeof(SESSION_MAGIC));
+    stream << SESSION_VERSION << count << static_cast<quint32>(RECORD_SIZE)
+        << quint32(0) << tableOffset << metadataOffset
+        << static_cast<quint64>(json.size());
+    for (quint32 i = 0; i < count; i++) {
+        stream.device()->seek(static_cast<qint64>(
+            tableOffset + static_cast<quint64>(i) * RECORD_SIZE
+        ));
+        const Block *pair[2] = {&blocks[i], &thumbnails[i]};
+        for (int k = 0; k < 2; k++) {
+            stream << pair[k]->offset << pair[k]->size << pair[k]->rows
+                << pair[k]->cols << pair[k]->type << pair[k]->compression
+                << pair[k]->step;
+        }
+        const Tile &tile = tiles[i];
+        stream << qint32(tile.cell.x) << qint32(tile.cell.y)
+            << qint32(tile.stage.x) << qint32(tile.stage.y) << tile.time
+            << tile.sharpness << tile.clipped << tile.confidence
+            << qint32(tile.problems);
+    }
+
+    if (!out.seek(0) || out.write(head) != head.size() || !out.commit()) {
+        lastError = out.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool SessionFile::writeBlock(QIODevice *out, const cv::Mat &image,
+    Compression compression, Block &block)
+{
+    // Zeros up to the next page
+    qint64 padding = (ALIGNMENT - out->pos() % ALIGNMENT) % ALIGNMENT;
+    if (padding > 0 && out->write(QByteArray(static_cast<int>(padding), '\0'))
+            != padding) {
+        lastError = out->errorString();
+        return false;
+    }
+
+    block.offset = static_cast<quint64>(out->pos());
+    block.rows = image.rows;
+    block.cols = image.cols;
+    block.type = image.type();
+    block.compression = static_cast<qint32>(compression);
+    if (compression == Compression::PNG) {
+        // The fastest compression, to open the session quickly
+        std::vector<uchar> buffer;
+        std::vector<int> params = {cv::IMWRITE_PNG_COMPRESSION, 1};
+        if (!cv::imencode(".png", image, buffer, params)) {
+            lastError = QObject::tr("A tile cannot be compressed.");
+            return false;
+        }
+        block.step = 0;
+        block.size = buffer.size();
+        if (out->write(reinterpret_cast<const char *>(buffer.data()),
+                static_cast<qint64>(buffer.size()))
+                != static_cast<qint64>(buffer.size())) {
+            lastError = out->errorString();
+            return false;
+        }
+        return true;
+    }
+
+    // Row by row, the image may be a part of a larger one
+    qint64 rowSize = static_cast<qint64>(image.cols * image.elemSize());
+    block.step = static_cast<quint64>(rowSize);
+    block.size = static_cast<quint64>(rowSize) * image.rows;
+    for (int y = 0; y < image.rows; y++) {
+        if (out->write(reinterpret_cast<const char *>(image.ptr(y)), rowSize)
+                != rowSize) {
+            lastError = out->errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SessionFile::open(const QString &fileName)
+{
+    close();
+    file->setFileName(fileName);
+    if (!file->open(QIODevice::ReadOnly)) {
+        lastError = file->errorString();
+        return false;
+    }
+    dataSize = file->size();
+    if (dataSize >= HEADER_SIZE) {
+        // Privately, so the tiles can be changed like any other image
+        data = file->map(0, dataSize, QFileDevice::MapPrivateOption);
+    }
+    if (data == nullptr) {
+        lastError = dataSize < HEADER_SIZE
+            ? QObject::tr("The file is no session.") : file->errorString();
+        close();
+        return false;
+    }
+
+    // The header, the table and the metadata are at the start, a byte array
+    // cannot hold more than 2 GB
+    QByteArray bytes = QByteArray::fromRawData(
+        reinterpret_cast<const char *>(data), static_cast<int>(
+            std::min<qint64>(dataSize, std::numeric_limits<int>::max()))
+    );
+    QDataStream stream(bytes);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setByteOrder(QDataStream::LittleEndian);
+
+    char magic[sizeof(SESSION_MAGIC)];
+    quint32 version = 0;
+    quint32 count = 0;
+    quint32 recordSize = 0;
+    quint32 reserved = 0;
+    quint64 tableOffset = 0;
+    quint64 metadataOffset = 0;
+    quint64 metadataSize = 0;
+    stream.readRawData(magic, sizeof(magic));
+    stream >> version >> count >> recordSize >> reserved >> tableOffset
+        >> metadataOffset >> metadataSize;
+    // Offsets and sizes are compared without sums, which could wrap around
+    quint64 size = static_cast<quint64>(bytes.size());
+    if (!std::equal(magic, magic + sizeof(magic), SESSION_MAGIC)
+            || version != SESSION_VERSION || recordSize < 132
+            || tableOffset > size
+            || static_cast<quint64>(count) * recordSize > size - tableOffset
+            || metadataOffset > size
+            || metadataSize > size - metadataOffset) {
+        lastError = QObject::tr("The file is no session or it is damaged.");
+        close();
+        return false;
+    }
+
+    size = static_cast<quint64>(dataSize);
+    for (quint32 i = 0; i < count; i++) {
+        stream.device()->seek(static_cast<qint64>(
+            tableOffset + static_cast<quint64>(i) * recordSize
+        ));
+        Block blocks[2];
+        for (int k = 0; k < 2; k++) {
+            stream >> blocks[k].offset >> blocks[k].size >> blocks[k].rows
+                >> blocks[k].cols >> blocks[k].type >> blocks[k].compression
+                >> blocks[k].step;
+        }
+        Tile tile;
+        qint32 cellX = 0;
+        qint32 cellY = 0;
+        qint32 stageX = 0;
+        qint32 stageY = 0;
+        qint32 problems = 0;
+        stream >> cellX >> cellY >> stageX >> stageY >> tile.time
+            >> tile.sharpness >> tile.clipped >> tile.confidence >> problems;
+        tile.cell = cv::Point(cellX, cellY);
+        tile.stage = cv::Point(stageX, stageY);
+        tile.problems = problems;
+
+        // The blocks must be inside of the file, again compared without
+        // sums or products that could wrap around
+        for (int k = 0; k < 2; k++) {
+            const Block &block = blocks[k];
+            bool raw = block.compression
+                == static_cast<qint32>(Compression::RAW);
+            bool valid = (raw || block.compression
+                    == static_cast<qint32>(Compression::PNG))
+                && isSessionType(block.type)
+                && block.rows >= 0 && block.cols >= 0
+                && block.offset <= size && block.size <= size - block.offset;
+            if (valid && raw && block.rows > 0) {
+                valid = block.step >= static_cast<quint64>(block.cols)
+                        * CV_ELEM_SIZE(block.type)
+                    && block.step > 0
+                    && static_cast<quint64>(block.rows)
+                        <= (size - block.offset) / block.step;
+            }
+            if (!valid) {
+                lastError = QObject::tr("The session is damaged.");
+                close();
+                return false;
+            }
+        }
+        tileInfo.push_back(tile);
+        tileBlocks.push_back(blocks[0]);
+        thumbnailBlocks.push_back(blocks[1]);
+    }
+
+    sessionMetadata = QJsonDocument::fromJson(
+        bytes.mid(static_cast<int>(metadataOffset),
+            static_cast<int>(metadataSize))
+    ).object();
+    return true;
+}
+
+void SessionFile::close()
+{
+    if (data != nullptr)
+        file->unmap(data);
+    data = nullptr;
+    dataSize = 0;
+    file->close();
+    tileInfo.clear();
+    tileBlocks.clear();
+    thumbnailBlocks.clear();
+    sessionMetadata = QJsonObject();
+}
+
+bool SessionFile::isOpen() const
+{
+    return data != nullptr;
+}
+
+bool SessionFile::isMapped() const
+{
+    for (size_t i = 0; i < tileBlocks.size(); i++) {
+        if (tileBlocks[i].compression != static_cast<qint32>(Compression::RAW))
+            return false;
+    }
+    return true;
+}
+
+int SessionFile::size() const
+{
+    return static_cast<int>(tileInfo.size());
+}
+
+const std::vector<SessionFile::Tile>& SessionFile::tiles() const
+{
+    return tileInfo;
+}
+
+cv::Mat SessionFile::image(int index) const
+{
+    if (index < 0 || index >= size())
+        return cv::Mat();
+    return blockImage(tileBlocks[index]);
+}
+
+cv::Mat SessionFile::thumbnail(int index) const
+{
+    if (index < 0 || index >= size())
+        return cv::Mat();
+    return blockImage(thumbnailBlocks[index]);
+}
+
+QJsonObject SessionFile::metadata() const
+{
+    return sessionMetadata;
+}
+
+QString SessionFile::errorString() const
+{
+    return lastError;
+}
+
+SessionFile::Tile SessionFile::unknownTile()
+{
+    Tile tile;
+    tile.cell = cv::Point(-1, -1);
+    tile.stage = cv::Point(-1, -1);
+    tile.time = -1;
+    tile.sharpness = -1;
+    tile.clipped = -1;
+    tile.confidence = -1;
+    tile.problems = 0;
+    return tile;
+}
+
+cv::Mat SessionFile::blockImage(const Block &block) const
+{
+    if (data == nullptr || block.rows == 0 || block.cols == 0)
+        return cv::Mat();
+
+    // Compressed tiles are decoded on every call
+    uchar *start = data + block.offset;
+    if (block.compression == static_cast<qint32>(Compression::PNG)) {
+        cv::Mat encoded(1, static_cast<int>(block.size), CV_8U, start);
+        return cv::imdecode(encoded, cv::IMREAD_UNCHANGED);
+    }
+    return cv::Mat(
+        block.rows, block.cols, block.type, start,
+        static_cast<size_t>(block.step)
+    );
+}
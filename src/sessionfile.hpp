@@ -0,0 +1,200 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SESSIONFILE_H
+#define SESSIONFILE_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QJsonObject>
+#include <opencv2/core.hpp>
+
+
+class QFile;
+class QIODevice;
+
+///
+/// \brief All tiles of a scan with their metadata in one file
+/// The file starts with a header and a table with one fixed size record per
+/// tile: the grid cell, the stage steps, the time, the quality and where
+/// its pixels are. The metadata of the session (objective, calibration,
+/// drift, ...) follows as json. The pixels of every tile and of its
+/// thumbnail start at a page boundary, uncompressed tiles are mapped into
+/// memory as they are. Opening a session only reads the table, the pixels
+/// are paged in by the system when they are used. Compressed tiles are
+/// decoded whenever their image is asked for.
+///
+class SessionFile
+{
+public:
+    ///
+    /// \brief How the pixels of the tiles are stored
+    ///
+    enum class Compression { RAW, PNG };
+
+    ///
+    /// \brief Metadata of one tile
+    /// Unknown cells and stage steps are (-1, -1), an unknown time is -1,
+    /// unknown quality measures are -1.
+    ///
+    struct Tile {
+        cv::Point cell;
+        cv::Point stage;
+        qint64 time;
+        double sharpness;
+        double clipped;
+        double confidence;
+        int problems;
+    };
+
+    ///
+    /// \brief Constructor
+    ///
+    SessionFile();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~SessionFile();
+
+    ///
+    /// \brief Write a session
+    /// The file is replaced at once, when everything has been written.
+    /// \param fileName The file
+    /// \param images The tiles
+    /// \param tiles The metadata of every tile, in the order of images
+    /// \param metadata The metadata of the session
+    /// \param compression How the pixels are stored
+    /// \return True if written, else false
+    ///
+    bool save(const QString &fileName, const std::vector<cv::Mat> &images,
+        const std::vector<Tile> &tiles, const QJsonObject &metadata,
+        Compression compression);
+
+    ///
+    /// \brief Open a session and map it into memory
+    /// An open session is closed before.
+    /// \param fileName The file
+    /// \return True if opened, else false
+    ///
+    bool open(const QString &fileName);
+
+    ///
+    /// \brief Close the session
+    /// The images of uncompressed tiles are not valid any more.
+    ///
+    void close();
+
+    ///
+    /// \brief Get the info if a session is open
+    /// \return True if open, else false
+    ///
+    bool isOpen() const;
+
+    ///
+    /// \brief Get the info if the tiles point into the mapped file
+    /// Compressed tiles are decoded on every call of image instead.
+    /// \return True if all tiles are uncompressed, else false
+    ///
+    bool isMapped() const;
+
+    ///
+    /// \brief Get the number of tiles
+    /// \return Number of tiles
+    ///
+    int size() const;
+
+    ///
+    /// \brief Get the metadata of the tiles
+    /// \return The tiles in the order of the session
+    ///
+    const std::vector<Tile>& tiles() const;
+
+    ///
+    /// \brief Get the image of a tile
+    /// Uncompressed tiles point into the mapped file and are only valid
+    /// while the session is open. They are mapped privately, changing them
+    /// does not change the file.
+    /// \param index Index of the tile
+    /// \return The image, empty if it cannot be read
+    ///
+    cv::Mat image(int index) const;
+
+    ///
+    /// \brief Get the thumbnail of a tile
+    /// \param index Index of the tile
+    /// \return The thumbnail, pointing into the mapped file like image
+    ///
+    cv::Mat thumbnail(int index) const;
+
+    ///
+    /// \brief Get the metadata of the session
+    /// \return The metadata
+    ///
+    QJsonObject metadata() const;
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+    ///
+    /// \brief Get metadata of a tile with everything unknown
+    /// \return The tile
+    ///
+    static Tile unknownTile();
+
+private:
+    ///
+    /// \brief Where the pixels of a tile and its thumbnail are
+    ///
+    struct Block {
+        quint64 offset;
+        quint64 size;
+        qint32 rows;
+        qint32 cols;
+        qint32 type;
+        qint32 compression;
+        quint64 step;
+    };
+
+    ///
+    /// \brief Write the pixels of an image at the next page boundary
+    ///
+    bool writeBlock(QIODevice *out, const cv::Mat &image,
+        Compression compression, Block &block);
+
+    ///
+    /// \brief Get the image of a block of the mapped file
+    ///
+    cv::Mat blockImage(const Block &block) const;
+
+    QFile *file;
+    uchar *data;
+    qint64 dataSize;
+    std::vector<Tile> tileInfo;
+    std::vector<Block> tileBlocks;
+    std::vector<Block> thumbnailBlocks;
+    QJsonObject sessionMetadata;
+    QString lastError;
+};
+
+
+#endif // SESSIONFILE_H
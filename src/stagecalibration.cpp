@@ -0,0 +1,176 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "stagecalibration.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <QtCore/QPointF>
+#include <QtCore/QSettings>
+
+
+// Least image motion of a calibrated motor in pixels per step
+static const double MIN_MOTION = 1e-3;
+
+///
+/// \brief Settings group of an objective
+/// Slashes would open sub groups.
+///
+static QString objectiveGroup(const QString &name)
+{
+    return QString("stage_calibration/%1").arg(
+        QString(name).replace('/', '_')
+    );
+}
+
+StageCalibration::StageCalibration()
+{
+}
+
+StageCalibration::~StageCalibration()
+{
+}
+
+void StageCalibration::setObjective(const QString &name)
+{
+    this->name = name;
+}
+
+QString StageCalibration::objective() const
+{
+    return name;
+}
+
+void StageCalibration::setMotion(
+    cv::Point2d motionX, cv::Point2d motionY, cv::Size frameSize)
+{
+    this->motionX = motionX;
+    this->motionY = motionY;
+    size = frameSize;
+}
+
+cv::Point2d StageCalibration::motion(bool xAxis) const
+{
+    return xAxis ? motionX : motionY;
+}
+
+cv::Size StageCalibration::frameSize() const
+{
+    return size;
+}
+
+bool StageCalibration::isValid() const
+{
+    return cv::norm(motionX) > MIN_MOTION && cv::norm(motionY) > MIN_MOTION
+        && size.area() > 0;
+}
+
+double StageCalibration::stepsPerFrame(bool xAxis) const
+{
+    cv::Point2d v = motion(xAxis);
+    if (std::abs(v.x) >= std::abs(v.y))
+        return std::abs(v.x) > 0 ? size.width / std::abs(v.x) : 0;
+    return size.height / std::abs(v.y);
+}
+
+cv::Point StageCalibration::stepsForOverlap(double overlap) const
+{
+    if (!isValid())
+        return cv::Point();
+
+    overlap = std::max(0.0, std::min(overlap, 0.95));
+    return cv::Point(
+        std::max(1, static_cast<int>((1 - overlap) * stepsPerFrame(true))),
+        std::max(1, static_cast<int>((1 - overlap) * stepsPerFrame(false)))
+    );
+}
+
+cv::Size StageCalibration::gridForArea(
+    cv::Size2d area, cv::Point2d micrometersPerStep, cv::Point steps) const
+{
+    if (!isValid() || micrometersPerStep.x <= 0 || micrometersPerStep.y <= 0
+            || steps.x <= 0 || steps.y <= 0)
+        return cv::Size(1, 1);
+
+    // The first tile covers a frame, every further one a step
+    double areaX = area.width / micrometersPerStep.x;
+    double areaY = area.height / micrometersPerStep.y;
+    int columns = 1 + static_cast<int>(
+        std::ceil(std::max(0.0, areaX - stepsPerFrame(true)) / steps.x)
+    );
+    int rows = 1 + static_cast<int>(
+        std::ceil(std::max(0.0, areaY - stepsPerFrame(false)) / steps.y)
+    );
+    return cv::Size(columns, rows);
+}
+
+bool StageCalibration::readSettings(const QString &name)
+{
+    QSettings settings;
+    settings.beginGroup(objectiveGroup(name));
+    QPointF x = settings.value("motion_x").toPointF();
+    QPointF y = settings.value("motion_y").toPointF();
+    cv::Size frame(
+        settings.value("frame_width", 0).toInt(),
+        settings.value("frame_height", 0).toInt()
+    );
+    settings.endGroup();
+
+    this->name = name;
+    setMotion(cv::Point2d(x.x(), x.y()), cv::Point2d(y.x(), y.y()), frame);
+    return isValid();
+}
+
+void StageCalibration::writeSettings() const
+{
+    if (name.isEmpty())
+        return;
+
+    QSettings settings;
+    settings.beginGroup(objectiveGroup(name));
+    if (isValid()) {
+        settings.setValue("motion_x", QPointF(motionX.x, motionX.y));
+        settings.setValue("motion_y", QPointF(motionY.x, motionY.y));
+        settings.setValue("frame_width", size.width);
+        settings.setValue("frame_height", size.height);
+    } else {
+        settings.remove("");
+    }
+    settings.endGroup();
+    settings.sync();
+}
+
+QStringList StageCalibration::objectives()
+{
+    QSettings settings;
+    settings.beginGroup("stage_calibration");
+    return settings.childGroups();
+}
+
+QString StageCalibration::currentObjective()
+{
+    QSettings settings;
+    return settings.value("objective").toString();
+}
+
+void StageCalibration::setCurrentObjective(const QString &name)
+{
+    QSettings settings;
+    settings.setValue("objective", name);
+}
@@ -0,0 +1,154 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef STAGECALIBRATION_H
+#define STAGECALIBRATION_H
+
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Image motion per motor step of one objective
+/// Every motor moves the image along a vector, measured in pixels per step
+/// by the StageCalibrator. From it the steps between two tiles follow for a
+/// wanted overlap, and with the travel of the stage per step the grid for a
+/// physical area. The calibration of every objective is kept in the
+/// application settings.
+///
+class StageCalibration
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    StageCalibration();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~StageCalibration();
+
+    ///
+    /// \brief Set the name of the objective
+    /// \param name The name like "10x"
+    ///
+    void setObjective(const QString &name);
+
+    ///
+    /// \brief Get the name of the objective
+    /// \return The name
+    ///
+    QString objective() const;
+
+    ///
+    /// \brief Set the measured image motion
+    /// \param motionX Pixels per step of the first motor
+    /// \param motionY Pixels per step of the second motor
+    /// \param frameSize Size of the camera frames
+    ///
+    void setMotion(cv::Point2d motionX, cv::Point2d motionY,
+        cv::Size frameSize);
+
+    ///
+    /// \brief Get the image motion of a motor
+    /// \param xAxis True for the first motor, false for the second
+    /// \return Pixels per step
+    ///
+    cv::Point2d motion(bool xAxis) const;
+
+    ///
+    /// \brief Get the size of the frames of the calibration
+    /// \return The frame size
+    ///
+    cv::Size frameSize() const;
+
+    ///
+    /// \brief Get the calibration state
+    /// \return True if both motors move the image, else false
+    ///
+    bool isValid() const;
+
+    ///
+    /// \brief Get the steps of a motor that move the image by a whole frame
+    /// The frame side the motor mainly moves along is used.
+    /// \param xAxis True for the first motor, false for the second
+    /// \return Steps per frame
+    ///
+    double stepsPerFrame(bool xAxis) const;
+
+    ///
+    /// \brief Get the steps between two tiles for an overlap
+    /// The steps are rounded down, so the overlap is at least the wanted one.
+    /// \param overlap Overlap of neighbouring tiles (0-1)
+    /// \return Steps of the first (x) and the second motor (y)
+    ///
+    cv::Point stepsForOverlap(double overlap) const;
+
+    ///
+    /// \brief Get the grid that covers an area
+    /// \param area Extent along the first (width) and the second motor
+    /// (height) in micrometers
+    /// \param micrometersPerStep Travel of the stage per step of both motors
+    /// \param steps Steps between two tiles, see stepsForOverlap
+    /// \return Columns and rows, at least one each
+    ///
+    cv::Size gridForArea(cv::Size2d area, cv::Point2d micrometersPerStep,
+        cv::Point steps) const;
+
+    ///
+    /// \brief Read the calibration of an objective from the settings
+    /// \param name The name of the objective
+    /// \return True if a calibration has been found, else false
+    ///
+    bool readSettings(const QString &name);
+
+    ///
+    /// \brief Write the calibration to the settings
+    ///
+    void writeSettings() const;
+
+    ///
+    /// \brief Get the names of all calibrated objectives
+    /// \return The names
+    ///
+    static QStringList objectives();
+
+    ///
+    /// \brief Get the objective in use
+    /// \return The name or an empty string
+    ///
+    static QString currentObjective();
+
+    ///
+    /// \brief Set the objective in use
+    /// \param name The name
+    ///
+    static void setCurrentObjective(const QString &name);
+
+private:
+    QString name;
+    cv::Point2d motionX;
+    cv::Point2d motionY;
+    cv::Size size;
+};
+
+
+#endif // STAGECALIBRATION_H
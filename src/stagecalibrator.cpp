@@ -0,0 +1,247 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "stagecalibrator.hpp"
+#include "controller.hpp"
+#include "livecamera.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <QtCore/QTimer>
+#include <opencv2/imgproc.hpp>
+
+
+// Scale of the frames for the registration
+static const double REGISTRATION_SCALE = 0.5;
+
+// Steps to take up the slack of a motor before measuring
+static const int TAKE_UP_STEPS = 200;
+
+// Steps of the first measuring move. The steps double as long as a move
+// shifts the image less than MIN_SHIFT of the shorter frame side.
+static const int FIRST_STEP = 8;
+static const int MAX_STEP = 512;
+static const double MIN_SHIFT = 0.05;
+
+// The motion is measured till it adds up to this part of the shorter frame
+// side or the motor has made MAX_STEPS
+static const double TARGET_SHIFT = 1.0 / 3;
+static const long MAX_STEPS = 8192;
+
+// Lowest phase correlation response accepted as registration
+static const double MIN_RESPONSE = 0.05;
+
+// Least image motion of a measured motor in pixels
+static const double MIN_MOTION = 2.0;
+
+
+StageCalibrator::StageCalibrator(
+        Controller *controller, LiveCamera *camera, QObject *parent)
+    : QObject(parent),
+    controller(controller),
+    camera(camera),
+    settleTime(300),
+    phase(Phase::IDLE),
+    xAxis(true),
+    pendingCommand(-1),
+    stepSize(FIRST_STEP),
+    steps(0)
+{
+    // The controller runs in its own thread, its results arrive queued
+    connect(
+        controller, &Controller::commandFinished,
+        this, &StageCalibrator::controllerCommandFinished
+    );
+}
+
+StageCalibrator::~StageCalibrator()
+{
+}
+
+void StageCalibrator::setSettleTime(int ms)
+{
+    settleTime = std::max(0, ms);
+}
+
+void StageCalibrator::start()
+{
+    if (isRunning())
+        return;
+
+    result = StageCalibration();
+    lastError.clear();
+    lastFrame.release();
+
+    xAxis = true;
+    phase = Phase::TAKE_UP;
+    emit progress(tr("Taking up the slack of the first motor..."));
+    move(TAKE_UP_STEPS);
+}
+
+void StageCalibrator::abort()
+{
+    if (isRunning())
+        fail(tr("The calibration has been aborted."));
+}
+
+bool StageCalibrator::isRunning() const
+{
+    return phase != Phase::IDLE;
+}
+
+StageCalibration StageCalibrator::calibration() const
+{
+    return result;
+}
+
+QString StageCalibrator::errorString() const
+{
+    return lastError;
+}
+
+cv::Mat StageCalibrator::registrationFrame(const cv::Mat &image)
+{
+    if (image.empty())
+        return cv::Mat();
+
+    cv::Mat gray;
+    if (image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+    cv::Mat resized;
+    cv::resize(
+        gray, resized, cv::Size(), REGISTRATION_SCALE, REGISTRATION_SCALE,
+        cv::INTER_AREA
+    );
+    cv::Mat frame;
+    resized.convertTo(frame, CV_32F);
+    return frame;
+}
+
+double StageCalibrator::registerFrames(
+    const cv::Mat &a, const cv::Mat &b, cv::Point2d &shift)
+{
+    if (a.empty() || a.size() != b.size()) {
+        shift = cv::Point2d();
+        return 0;
+    }
+
+    cv::Mat window;
+    cv::createHanningWindow(window, a.size(), CV_32F);
+    double response = 0;
+    shift = cv::phaseCorrelate(a, b, window, &response)
+        * (1.0 / REGISTRATION_SCALE);
+    return response;
+}
+
+void StageCalibrator::controllerCommandFinished(int id, bool success)
+{
+    if (id != pendingCommand || !isRunning())
+        return;
+    pendingCommand = -1;
+
+    if (!success) {
+        fail(tr("The stage could not be moved."));
+        return;
+    }
+    QTimer::singleShot(settleTime, this, &StageCalibrator::measure);
+}
+
+void StageCalibrator::measure()
+{
+    if (!isRunning())
+        return;
+
+    cv::Mat image = camera->getCurrentImage();
+    cv::Mat frame = registrationFrame(image);
+    if (frame.empty()) {
+        fail(tr("There is no camera image."));
+        return;
+    }
+
+    if (phase == Phase::TAKE_UP) {
+        lastFrame = frame;
+        frameSize = image.size();
+        phase = Phase::MEASURE;
+        motion = cv::Point2d();
+        steps = 0;
+        stepSize = FIRST_STEP;
+        emit progress(xAxis
+            ? tr("Measuring the image motion of the first motor...")
+            : tr("Measuring the image motion of the second motor..."));
+        move(stepSize);
+        return;
+    }
+
+    cv::Point2d shift;
+    double response = registerFrames(lastFrame, frame, shift);
+    lastFrame = frame;
+    if (response < MIN_RESPONSE) {
+        fail(tr("The images cannot be registered, use a sample with more "
+            "structure."));
+        return;
+    }
+    motion += shift;
+    steps += stepSize;
+
+    double side = std::min(frameSize.width, frameSize.height);
+    if (cv::norm(motion) < TARGET_SHIFT * side && steps < MAX_STEPS) {
+        if (cv::norm(shift) < MIN_SHIFT * side)
+            stepSize = std::min(2 * stepSize, MAX_STEP);
+        move(stepSize);
+        return;
+    }
+
+    if (cv::norm(motion) < MIN_MOTION) {
+        fail(xAxis
+            ? tr("The image does not move with the first motor.")
+            : tr("The image does not move with the second motor."));
+        return;
+    }
+
+    cv::Point2d pixelsPerStep = motion * (1.0 / steps);
+    if (xAxis) {
+        motionX = pixelsPerStep;
+        xAxis = false;
+        phase = Phase::TAKE_UP;
+        emit progress(tr("Taking up the slack of the second motor..."));
+        move(TAKE_UP_STEPS);
+        return;
+    }
+
+    result.setMotion(motionX, pixelsPerStep, frameSize);
+    phase = Phase::IDLE;
+    emit finished(true);
+}
+
+void StageCalibrator::move(int steps)
+{
+    pendingCommand = controller->moveSteps(
+        xAxis ? MotorNumber::ONE : MotorNumber::TWO, steps
+    );
+}
+
+void StageCalibrator::fail(const QString &message)
+{
+    lastError = message;
+    phase = Phase::IDLE;
+    pendingCommand = -1;
+    emit finished(false);
+}
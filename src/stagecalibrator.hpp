@@ -0,0 +1,174 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef STAGECALIBRATOR_H
+#define STAGECALIBRATOR_H
+
+#include <QtCore/QObject>
+#include <QtCore/QString>
+#include <opencv2/core.hpp>
+
+#include "stagecalibration.hpp"
+
+
+class Controller;
+class LiveCamera;
+
+///
+/// \brief Measures the image motion per step of both motors
+/// Every motor first takes up its slack, then it moves in steps that grow
+/// until the image moves visibly. The motion is measured by registering
+/// every frame with the one before, until it adds up to a third of the
+/// frame.
+///
+class StageCalibrator : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param controller The connected controller
+    /// \param camera The running camera
+    /// \param parent Parent object
+    ///
+    StageCalibrator(
+        Controller *controller, LiveCamera *camera, QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~StageCalibrator() override;
+
+    ///
+    /// \brief Set the time to wait for a still image after every move
+    /// \param ms Time in milliseconds
+    ///
+    void setSettleTime(int ms);
+
+    ///
+    /// \brief Start the calibration
+    /// The result is reported with finished.
+    ///
+    void start();
+
+    ///
+    /// \brief Stop the calibration
+    ///
+    void abort();
+
+    ///
+    /// \brief Get the info if the calibration is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Get the result, without the name of the objective
+    /// \return The calibration, invalid if not measured
+    ///
+    StageCalibration calibration() const;
+
+    ///
+    /// \brief Get the reason of the last failure
+    /// \return The error message
+    ///
+    QString errorString() const;
+
+    ///
+    /// \brief Prepare a camera frame for registerFrames
+    /// \param image The camera frame
+    /// \return Downscaled gray frame
+    ///
+    static cv::Mat registrationFrame(const cv::Mat &image);
+
+    ///
+    /// \brief Register two frames of registrationFrame
+    /// \param a The first frame
+    /// \param b The second frame
+    /// \param shift Motion of the content from a to b in camera pixels
+    /// \return Response of the phase correlation, low if unreliable
+    ///
+    static double registerFrames(
+        const cv::Mat &a, const cv::Mat &b, cv::Point2d &shift);
+
+signals:
+    ///
+    /// \brief Description of the current state for the status bar
+    /// \param message The description
+    ///
+    void progress(const QString &message);
+
+    ///
+    /// \brief The calibration has been finished
+    /// \param success True if both motors have been measured, else false
+    /// with the reason in errorString
+    ///
+    void finished(bool success);
+
+private slots:
+    ///
+    /// \brief A command of the controller has been finished
+    /// \param id The id of the command
+    /// \param success True if it has been executed, else false
+    ///
+    void controllerCommandFinished(int id, bool success);
+
+    ///
+    /// \brief Grab a frame after the move and plan the next move
+    ///
+    void measure();
+
+private:
+    ///
+    /// Parts of the calibration of one motor
+    ///
+    enum class Phase { TAKE_UP, MEASURE, IDLE };
+
+    ///
+    /// \brief Move the motor being measured
+    /// \param steps Steps to move
+    ///
+    void move(int steps);
+
+    ///
+    /// \brief Stop with an error
+    /// \param message Description of the error
+    ///
+    void fail(const QString &message);
+
+    Controller *controller;
+    LiveCamera *camera;
+    int settleTime;
+
+    Phase phase;
+    bool xAxis;
+    int pendingCommand;
+    cv::Mat lastFrame;
+    cv::Size frameSize;
+    cv::Point2d motion;
+    cv::Point2d motionX;
+    int stepSize;
+    long steps;
+    StageCalibration result;
+    QString lastError;
+};
+
+
+#endif // STAGECALIBRATOR_H
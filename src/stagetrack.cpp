@@ -0,0 +1,125 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "stagetrack.hpp"
+
+#include <chrono>
+#include <algorithm>
+
+
+StageTrack::StageTrack()
+    : offset(0),
+    lastRaw(0),
+    wraps(0)
+{
+}
+
+StageTrack::~StageTrack()
+{
+}
+
+void StageTrack::clear()
+{
+    samples.clear();
+    offset = 0;
+    lastRaw = 0;
+    wraps = 0;
+}
+
+void StageTrack::addSample(qint64 received, quint32 controllerTime, int steps)
+{
+    // The clock of the firmware wraps after 2^32 microseconds
+    if (!samples.empty() && controllerTime < lastRaw)
+        wraps++;
+    lastRaw = controllerTime;
+
+    Sample sample;
+    sample.time = (wraps << 32) + controllerTime;
+    sample.steps = steps;
+
+    // Every delay on the way makes the difference larger
+    qint64 difference = received - sample.time;
+    if (samples.empty() || difference < offset)
+        offset = difference;
+    samples.push_back(sample);
+}
+
+bool StageTrack::isEmpty() const
+{
+    return samples.empty();
+}
+
+qint64 StageTrack::lastTime() const
+{
+    if (samples.empty())
+        return 0;
+    return samples.back().time + offset;
+}
+
+int StageTrack::segment(qint64 controllerTime) const
+{
+    if (samples.size() < 2 || controllerTime < samples.front().time
+            || controllerTime > samples.back().time)
+        return -1;
+
+    auto after = std::upper_bound(
+        samples.begin(), samples.end(), controllerTime,
+        [](qint64 time, const Sample &sample) { return time < sample.time; }
+    );
+    if (after == samples.end())
+        return static_cast<int>(samples.size()) - 1;
+    return std::max(1, static_cast<int>(after - samples.begin()));
+}
+
+bool StageTrack::positionAt(qint64 time, double &steps) const
+{
+    int i = segment(time - offset);
+    if (i < 0)
+        return false;
+
+    const Sample &a = samples[i - 1];
+    const Sample &b = samples[i];
+    if (b.time == a.time) {
+        steps = b.steps;
+        return true;
+    }
+    double t = static_cast<double>(time - offset - a.time) / (b.time - a.time);
+    steps = a.steps + t * (b.steps - a.steps);
+    return true;
+}
+
+double StageTrack::speedAt(qint64 time) const
+{
+    int i = segment(time - offset);
+    if (i < 0)
+        return 0;
+
+    const Sample &a = samples[i - 1];
+    const Sample &b = samples[i];
+    if (b.time == a.time)
+        return 0;
+    return (b.steps - a.steps) * 1e6 / (b.time - a.time);
+}
+
+qint64 StageTrack::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
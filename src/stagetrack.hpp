@@ -0,0 +1,115 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef STAGETRACK_H
+#define STAGETRACK_H
+
+#include <vector>
+#include <QtCore/QtGlobal>
+
+
+///
+/// \brief Position of a sweeping motor over time
+/// The firmware reports the steps of a sweep with the time of its own clock.
+/// The offset to the clock of the host is taken from the position that
+/// arrived fastest, every other one has been delayed on its way. Positions
+/// between two reports are interpolated linearly.
+///
+class StageTrack
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    StageTrack();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~StageTrack();
+
+    ///
+    /// \brief Forget all positions
+    ///
+    void clear();
+
+    ///
+    /// \brief Add a reported position
+    /// \param received Time it has been sent, see now
+    /// \param controllerTime Time of the firmware in microseconds
+    /// \param steps Steps of the sweep done
+    ///
+    void addSample(qint64 received, quint32 controllerTime, int steps);
+
+    ///
+    /// \brief Get the info if there are no positions
+    /// \return True if empty, else false
+    ///
+    bool isEmpty() const;
+
+    ///
+    /// \brief Get the time of the last position
+    /// \return The time in the clock of the host or 0 if empty
+    ///
+    qint64 lastTime() const;
+
+    ///
+    /// \brief Get the position at a time
+    /// \param time Time in the clock of the host, see now
+    /// \param steps The interpolated steps of the sweep
+    /// \return True if the time is between two positions, else false
+    ///
+    bool positionAt(qint64 time, double &steps) const;
+
+    ///
+    /// \brief Get the speed at a time
+    /// \param time Time in the clock of the host, see now
+    /// \return Steps per second, 0 outside of the positions
+    ///
+    double speedAt(qint64 time) const;
+
+    ///
+    /// \brief Monotonic clock shared by the camera and the controller
+    /// \return Microseconds since an arbitrary start
+    ///
+    static qint64 now();
+
+private:
+    ///
+    /// \brief Reported position with the unwrapped time of the firmware
+    ///
+    struct Sample {
+        qint64 time;
+        int steps;
+    };
+
+    ///
+    /// \brief Find the reports around a time of the firmware
+    /// \return Index of the first report after the time or -1 if outside
+    ///
+    int segment(qint64 controllerTime) const;
+
+    std::vector<Sample> samples;
+    qint64 offset;
+    quint32 lastRaw;
+    qint64 wraps;
+};
+
+
+#endif // STAGETRACK_H
@@ -0,0 +1,212 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "stitchingengine.hpp"
+#include "gaincompensator.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <QtCore/QCoreApplication>
+#include <opencv2/stitching.hpp>
+
+
+StitchingEngine::StitchingEngine(StitchingMode mode)
+    : stitchingMode(mode),
+    memoryBudget(0),
+    gridStitched(false)
+{
+}
+
+StitchingEngine::~StitchingEngine()
+{
+}
+
+void StitchingEngine::setMode(StitchingMode mode)
+{
+    stitchingMode = mode;
+}
+
+StitchingMode StitchingEngine::mode() const
+{
+    return stitchingMode;
+}
+
+void StitchingEngine::setCells(const std::vector<cv::Point> &cells)
+{
+    tileCells = cells;
+}
+
+void StitchingEngine::setPositionPriors(const std::vector<cv::Point2d> &priors)
+{
+    tilePriors = priors;
+}
+
+void StitchingEngine::setMemoryBudget(size_t bytes)
+{
+    memoryBudget = bytes;
+}
+
+std::vector<cv::Point> StitchingEngine::corners() const
+{
+    return tileCorners;
+}
+
+const StitchReport& StitchingEngine::report() const
+{
+    return gridStitched ? gridStitcher.report() : emptyReport;
+}
+
+StitchingEngine::Status StitchingEngine::stitch(
+    const std::vector<cv::Mat> &tiles, cv::Mat &pano)
+{
+    tileCorners.clear();
+    gridStitched = false;
+    if (tiles.empty())
+        return Status::ERR_NEED_MORE_IMGS;
+
+    // No need to stitch, when there is only one in pipe
+    if (tiles.size() == 1) {
+        tiles.front().copyTo(pano);
+        tileCorners.push_back(cv::Point(0, 0));
+        return Status::OK;
+    }
+
+    if (stitchingMode == StitchingMode::SCANS) {
+        cv::Ptr<cv::Stitcher> stitcher = cv::Stitcher::create(
+            cv::Stitcher::SCANS
+        );
+        stitcher->setExposureCompensator(cv::makePtr<GainCompensator>());
+        cv::Stitcher::Status status = stitcher->stitch(tiles, pano);
+        if (status == cv::Stitcher::ERR_NEED_MORE_IMGS)
+            return Status::ERR_NEED_MORE_IMGS;
+        if (status != cv::Stitcher::OK)
+            return Status::ERR_STITCHING_FAILED;
+
+        // The affine cameras of the scans mode map the image origin to the
+        // translation of their matrix (at registration scale). Positions are
+        // only known if no tile has been dropped.
+        std::vector<cv::detail::CameraParams> cameras = stitcher->cameras();
+        if (cameras.size() == tiles.size() && stitcher->workScale() > 0) {
+            for (size_t i = 0; i < cameras.size(); i++) {
+                cv::Mat_<float> R = cameras[i].R;
+                tileCorners.push_back(cv::Point(
+                    cvRound(R(0, 2) / stitcher->workScale()),
+                    cvRound(R(1, 2) / stitcher->workScale())
+                ));
+            }
+        }
+        return Status::OK;
+    }
+
+    // The stitcher is kept for the report and to replace tiles later
+    gridStitcher = GridStitcher();
+    gridStitcher.setCells(tileCells);
+    gridStitcher.setPositionPriors(tilePriors);
+    gridStitcher.setBlendMode(
+        stitchingMode == StitchingMode::GRID_MULTIBAND
+        ? BlendMode::MULTIBAND : BlendMode::FEATHER
+    );
+    if (memoryBudget > 0) {
+        // A multiband block needs about 64 bytes per pixel for the pyramids
+        // of the image, the mask and the blended bands.
+        int size = static_cast<int>(std::sqrt(memoryBudget / 64.0));
+        gridStitcher.setBlockSize(std::max(256, std::min(size, 4096)));
+    }
+    gridStitched = true;
+    GridStitcher::Status status = gridStitcher.stitch(tiles, pano);
+    if (status == GridStitcher::Status::ERR_NEED_MORE_IMGS)
+        return Status::ERR_NEED_MORE_IMGS;
+    if (status != GridStitcher::Status::OK)
+        return Status::ERR_STITCHING_FAILED;
+    tileCorners = gridStitcher.corners();
+    return Status::OK;
+}
+
+StitchingEngine::Status StitchingEngine::replaceTiles(
+    const std::vector<cv::Mat> &tiles, const std::vector<int> &indices,
+    cv::Mat &pano)
+{
+    if (tiles.size() == 1 && indices.size() == 1 && indices.front() == 0) {
+        tiles.front().copyTo(pano);
+        return Status::OK;
+    }
+    if (!gridStitched || tiles.size() != tileCorners.size())
+        return Status::ERR_STITCHING_FAILED;
+
+    GridStitcher::Status status = gridStitcher.replaceTiles(
+        tiles, indices, pano
+    );
+    if (status != GridStitcher::Status::OK)
+        return Status::ERR_STITCHING_FAILED;
+    tileCorners = gridStitcher.corners();
+    return Status::OK;
+}
+
+QString StitchingEngine::modeName(StitchingMode mode)
+{
+    switch (mode) {
+    case StitchingMode::SCANS:
+        return "scans";
+    case StitchingMode::GRID_FEATHER:
+        return "feather";
+    case StitchingMode::GRID_MULTIBAND:
+        return "multiband";
+    }
+    return QString();
+}
+
+bool StitchingEngine::modeFromName(const QString &name, StitchingMode &mode)
+{
+    std::vector<StitchingMode> all = modes();
+    for (size_t i = 0; i < all.size(); i++) {
+        if (modeName(all[i]) == name) {
+            mode = all[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<StitchingMode> StitchingEngine::modes()
+{
+    return {
+        StitchingMode::SCANS,
+        StitchingMode::GRID_FEATHER,
+        StitchingMode::GRID_MULTIBAND
+    };
+}
+
+QString StitchingEngine::modeDescription(StitchingMode mode)
+{
+    switch (mode) {
+    case StitchingMode::SCANS:
+        return QCoreApplication::translate(
+            "StitchingEngine", "Feature based (slow, any arrangement)"
+        );
+    case StitchingMode::GRID_FEATHER:
+        return QCoreApplication::translate(
+            "StitchingEngine", "Grid with feather blending (fast)"
+        );
+    case StitchingMode::GRID_MULTIBAND:
+        return QCoreApplication::translate(
+            "StitchingEngine", "Grid with multiband blending (best quality)"
+        );
+    }
+    return QString();
+}
@@ -0,0 +1,177 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef STITCHINGENGINE_H
+#define STITCHINGENGINE_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <opencv2/core.hpp>
+
+#include "gridstitcher.hpp"
+
+///
+/// Stitching modes offered by the application:
+/// - SCANS: cv::Stitcher in scans mode (feature based, slowest)
+/// - GRID_FEATHER: Grid stitcher with feather blending (fastest)
+/// - GRID_MULTIBAND: Grid stitcher with multiband blending
+///
+enum class StitchingMode {
+    SCANS,
+    GRID_FEATHER,
+    GRID_MULTIBAND
+};
+
+///
+/// \brief Common entry point for all stitching modes
+/// The grid modes need the grid cell of every tile. Without cells they assume
+/// an almost square row major grid.
+///
+class StitchingEngine
+{
+public:
+    ///
+    /// Status of the stitching process
+    ///
+    enum class Status {
+        OK,
+        ERR_NEED_MORE_IMGS,
+        ERR_STITCHING_FAILED
+    };
+
+    ///
+    /// \brief Constructor
+    /// \param mode The stitching mode
+    ///
+    explicit StitchingEngine(StitchingMode mode = StitchingMode::SCANS);
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~StitchingEngine();
+
+    ///
+    /// \brief Set the stitching mode
+    /// \param mode The stitching mode
+    ///
+    void setMode(StitchingMode mode);
+
+    ///
+    /// \brief Get the stitching mode
+    /// \return The stitching mode
+    ///
+    StitchingMode mode() const;
+
+    ///
+    /// \brief Set the grid cell of every tile for the grid modes
+    /// \param cells Cell per tile with x as column and y as row
+    ///
+    void setCells(const std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Set the known shift of every tile for the grid modes
+    /// \param priors Shift per tile in pixels, empty for none, see
+    /// GridStitcher::setPositionPriors
+    ///
+    void setPositionPriors(const std::vector<cv::Point2d> &priors);
+
+    ///
+    /// \brief Set the memory available for blending
+    /// The grid modes choose their block size from it, the scans mode
+    /// ignores it.
+    /// \param bytes Memory in bytes or 0 for the default
+    ///
+    void setMemoryBudget(size_t bytes);
+
+    ///
+    /// \brief Stitch the tiles
+    /// \param tiles The tiles
+    /// \param pano The mosaic
+    /// \return The status
+    ///
+    Status stitch(const std::vector<cv::Mat> &tiles, cv::Mat &pano);
+
+    ///
+    /// \brief Get the estimated top left positions of the last stitching
+    /// \return The positions in the mosaic, empty if they are not known (the
+    /// scans mode has dropped tiles)
+    ///
+    std::vector<cv::Point> corners() const;
+
+    ///
+    /// \brief Get the quality of the tiles of the last stitching
+    /// \return The report, empty for the scans mode
+    ///
+    const StitchReport& report() const;
+
+    ///
+    /// \brief Replace some tiles in the mosaic of the last stitching
+    /// Only the grid modes can compose a part of the mosaic again, see
+    /// GridStitcher::replaceTiles.
+    /// \param tiles All tiles with the new ones, in the order of the last
+    /// stitching
+    /// \param indices The indices of the new tiles
+    /// \param pano The mosaic of the last stitching, changed in place
+    /// \return The status
+    ///
+    Status replaceTiles(const std::vector<cv::Mat> &tiles,
+        const std::vector<int> &indices, cv::Mat &pano);
+
+    ///
+    /// \brief Get the name of a mode for settings and command line
+    /// \param mode The stitching mode
+    /// \return The name
+    ///
+    static QString modeName(StitchingMode mode);
+
+    ///
+    /// \brief Get the mode of a name
+    /// \param name The name of the mode
+    /// \param mode The mode if the name is known
+    /// \return True if the name is known, else false
+    ///
+    static bool modeFromName(const QString &name, StitchingMode &mode);
+
+    ///
+    /// \brief Get all modes
+    /// \return List of all modes
+    ///
+    static std::vector<StitchingMode> modes();
+
+    ///
+    /// \brief Get a translated description of a mode for the gui
+    /// \param mode The stitching mode
+    /// \return The description
+    ///
+    static QString modeDescription(StitchingMode mode);
+
+private:
+    StitchingMode stitchingMode;
+    std::vector<cv::Point> tileCells;
+    std::vector<cv::Point2d> tilePriors;
+    std::vector<cv::Point> tileCorners;
+    size_t memoryBudget;
+    GridStitcher gridStitcher;
+    StitchReport emptyReport;
+    bool gridStitched;
+};
+
+
+#endif // STITCHINGENGINE_H
@@ -76,11 +76,16 @@ bool StitchingWidget::isImageSelected() const
 }
 
 void StitchingWidget::addImage(cv::Mat mat)
+{
+    addImage(mat, mat);
+}
+
+void StitchingWidget::addImage(cv::Mat mat, cv::Mat thumbnail)
 {
     mats->append(mat);
 
     // Get pixmap of the mat object and add it as new preview
-    QPixmap pix = MainWin::matToPixmap(mat);
+    QPixmap pix = MainWin::matToPixmap(thumbnail);
     ImagePreview *preview = new ImagePreview(this);
     preview->setVisible(true);
     preview->setPixmap(pix);
@@ -96,6 +101,17 @@ void StitchingWidget::addImage(cv::Mat mat)
     updatePreviews();
 }
 
+bool StitchingWidget::replaceImage(int index, cv::Mat mat, cv::Mat thumbnail)
+{
+    if (index < 0 || index >= mats->size())
+        return false;
+
+    (*mats)[index] = mat;
+    QPixmap pix = MainWin::matToPixmap(thumbnail);
+    previews->at(index)->setPixmap(pix);
+    return true;
+}
+
 void StitchingWidget::selectionChangedByMouse(bool state)
 {
     if (!state) {
@@ -130,6 +146,15 @@ bool StitchingWidget::removeImage(ImagePreview *imagePreview)
     return true;
 }
 
+void StitchingWidget::clear()
+{
+    selected = nullptr;
+    while (!previews->isEmpty())
+        delete previews->takeFirst();
+    mats->clear();
+    updatePreviews();
+}
+
 void StitchingWidget::deselectAll()
 {
     for (int i = 0; i < previews->size(); i++) {
@@ -144,7 +169,11 @@ void StitchingWidget::showSinglePreview()
     if (obj != nullptr)
         previewCalled = qobject_cast<ImagePreview *>(obj);
     
-    QPixmap pix = previewCalled->getPixmap();
+    // The preview might only hold a thumbnail, show the full image
+    int idx = previews->indexOf(previewCalled);
+    if (idx < 0)
+        return;
+    QPixmap pix = MainWin::matToPixmap(mats->at(idx));
     previewSingle->setPixmap(pix);
     previewSingle->show();
 }
@@ -53,6 +53,22 @@ public:
     ///
     void addImage(cv::Mat mat);
 
+    ///
+    /// \brief Add an image with an already scaled preview
+    /// \param mat An openvc map of the image
+    /// \param thumbnail A small version of the image for the preview
+    ///
+    void addImage(cv::Mat mat, cv::Mat thumbnail);
+
+    ///
+    /// \brief Replace an image, its preview keeps its place
+    /// \param index Index of the image
+    /// \param mat An openvc map of the new image
+    /// \param thumbnail A small version of the image for the preview
+    /// \return True if replaced, else false
+    ///
+    bool replaceImage(int index, cv::Mat mat, cv::Mat thumbnail);
+
     ///
     /// \brief Get the mats vector object
     /// \return The mats vector
@@ -98,6 +114,11 @@ public:
     ///
     bool removeImage(ImagePreview *imagePreview);
 
+    ///
+    /// \brief Remove all images
+    ///
+    void clear();
+
 public slots:
     ///
     /// \brief Selection changed by mouse click
@@ -0,0 +1,272 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "stitchreport.hpp"
+#include "scanpipeline.hpp"
+
+#include <map>
+#include <algorithm>
+#include <QtCore/QFile>
+#include <QtCore/QTextStream>
+#include <QtCore/QStringList>
+#include <QtCore/QCoreApplication>
+#include <opencv2/imgproc.hpp>
+
+
+StitchReport::StitchReport()
+    : blurRatio(0.4),
+    clipLimit(0.05),
+    minConfidence(0.3)
+{
+}
+
+StitchReport::~StitchReport()
+{
+}
+
+void StitchReport::setBlurRatio(double ratio)
+{
+    blurRatio = std::max(0.0, ratio);
+}
+
+void StitchReport::setClipLimit(double fraction)
+{
+    clipLimit = std::max(0.0, std::min(fraction, 1.0));
+}
+
+void StitchReport::setMinConfidence(double confidence)
+{
+    minConfidence = confidence;
+}
+
+void StitchReport::clear()
+{
+    tileQuality.clear();
+    edgeQuality.clear();
+}
+
+void StitchReport::measureTile(int index, cv::Point cell, const cv::Mat &gray)
+{
+    if (index < 0)
+        return;
+    if (index >= static_cast<int>(tileQuality.size())) {
+        Tile empty = {cv::Point(-1, -1), 0, 0, -1, 0};
+        tileQuality.resize(index + 1, empty);
+    }
+
+    // Like the scan pipeline at half size, so both measures compare
+    Tile &tile = tileQuality[index];
+    tile.cell = cell;
+    tile.problems = 0;
+    cv::Mat half;
+    cv::pyrDown(gray, half);
+    tile.sharpness = ScanPipeline::sharpness(half);
+    tile.clipped = clippedFraction(gray);
+}
+
+void StitchReport::setEdge(int i, int j, bool horizontal, double confidence,
+    double residual)
+{
+    for (size_t e = 0; e < edgeQuality.size(); e++) {
+        if (edgeQuality[e].i == i && edgeQuality[e].j == j) {
+            edgeQuality[e].horizontal = horizontal;
+            edgeQuality[e].confidence = confidence;
+            edgeQuality[e].residual = residual;
+            return;
+        }
+    }
+
+    Edge edge = {i, j, horizontal, confidence, residual};
+    edgeQuality.push_back(edge);
+}
+
+void StitchReport::evaluate()
+{
+    int numTiles = static_cast<int>(tileQuality.size());
+    std::map<std::pair<int, int>, int> cellIndex;
+    for (int i = 0; i < numTiles; i++) {
+        cv::Point cell = tileQuality[i].cell;
+        cellIndex[std::make_pair(cell.x, cell.y)] = i;
+    }
+
+    // Best registration of every tile
+    std::vector<bool> hasEdge(numTiles, false);
+    std::vector<bool> reliable(numTiles, false);
+    for (int i = 0; i < numTiles; i++)
+        tileQuality[i].confidence = -1;
+    for (size_t e = 0; e < edgeQuality.size(); e++) {
+        const Edge &edge = edgeQuality[e];
+        int ends[2] = {edge.i, edge.j};
+        for (int k = 0; k < 2; k++) {
+            if (ends[k] < 0 || ends[k] >= numTiles)
+                continue;
+            Tile &tile = tileQuality[ends[k]];
+            tile.confidence = std::max(tile.confidence, edge.confidence);
+            hasEdge[ends[k]] = true;
+            if (edge.confidence >= minConfidence)
+                reliable[ends[k]] = true;
+        }
+    }
+
+    for (int i = 0; i < numTiles; i++) {
+        Tile &tile = tileQuality[i];
+        tile.problems = 0;
+
+        // Empty glass is as unsharp as its neighbours, a blurred tile on the
+        // specimen is not
+        std::vector<double> around;
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                auto it = cellIndex.find(
+                    std::make_pair(tile.cell.x + dx, tile.cell.y + dy)
+                );
+                if ((dx != 0 || dy != 0) && it != cellIndex.end())
+                    around.push_back(tileQuality[it->second].sharpness);
+            }
+        }
+        if (!around.empty()) {
+            size_t mid = around.size() / 2;
+            std::nth_element(around.begin(), around.begin() + mid, around.end());
+            if (tile.sharpness < blurRatio * around[mid])
+                tile.problems |= BLURRED;
+        }
+
+        if (tile.clipped > clipLimit)
+            tile.problems |= CLIPPED;
+
+        // Next to the specimen empty glass does not register either, that is
+        // no fault of the tile. A tile with as much structure as a
+        // registered neighbour should have been registered.
+        if (hasEdge[i] && !reliable[i]) {
+            for (size_t e = 0; e < edgeQuality.size(); e++) {
+                const Edge &edge = edgeQuality[e];
+                int other = edge.i == i ? edge.j : (edge.j == i ? edge.i : -1);
+                if (other >= 0 && other < numTiles && reliable[other]
+                        && tile.sharpness
+                            >= blurRatio * tileQuality[other].sharpness) {
+                    tile.problems |= UNREGISTERED;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+bool StitchReport::isEmpty() const
+{
+    return tileQuality.empty();
+}
+
+const std::vector<StitchReport::Tile>& StitchReport::tiles() const
+{
+    return tileQuality;
+}
+
+const std::vector<StitchReport::Edge>& StitchReport::edges() const
+{
+    return edgeQuality;
+}
+
+std::vector<int> StitchReport::flaggedTiles() const
+{
+    std::vector<int> flagged;
+    for (size_t i = 0; i < tileQuality.size(); i++) {
+        if (tileQuality[i].problems != 0)
+            flagged.push_back(static_cast<int>(i));
+    }
+    return flagged;
+}
+
+QString StitchReport::summary() const
+{
+    int blurred = 0;
+    int clipped = 0;
+    int unregistered = 0;
+    for (size_t i = 0; i < tileQuality.size(); i++) {
+        if (tileQuality[i].problems & BLURRED)
+            blurred++;
+        if (tileQuality[i].problems & CLIPPED)
+            clipped++;
+        if (tileQuality[i].problems & UNREGISTERED)
+            unregistered++;
+    }
+
+    QStringList parts;
+    if (blurred > 0) {
+        parts << QCoreApplication::translate(
+            "StitchReport", "%1 blurred").arg(blurred);
+    }
+    if (clipped > 0) {
+        parts << QCoreApplication::translate(
+            "StitchReport", "%1 overexposed").arg(clipped);
+    }
+    if (unregistered > 0) {
+        parts << QCoreApplication::translate(
+            "StitchReport", "%1 not registered").arg(unregistered);
+    }
+    return parts.join(", ");
+}
+
+bool StitchReport::write(const QString &fileName) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return false;
+
+    QTextStream out(&file);
+    out << "# tile index column row sharpness clipped confidence problems\n";
+    for (size_t i = 0; i < tileQuality.size(); i++) {
+        const Tile &tile = tileQuality[i];
+        out << QString("tile %1 %2 %3 %4 %5 %6 %7\n").arg(static_cast<int>(i))
+            .arg(tile.cell.x).arg(tile.cell.y)
+            .arg(tile.sharpness, 0, 'f', 2).arg(tile.clipped, 0, 'f', 4)
+            .arg(tile.confidence, 0, 'f', 3).arg(problemNames(tile.problems));
+    }
+    out << "# edge first second direction confidence residual\n";
+    for (size_t e = 0; e < edgeQuality.size(); e++) {
+        const Edge &edge = edgeQuality[e];
+        out << QString("edge %1 %2 %3 %4 %5\n").arg(edge.i).arg(edge.j)
+            .arg(edge.horizontal ? "h" : "v")
+            .arg(edge.confidence, 0, 'f', 3).arg(edge.residual, 0, 'f', 1);
+    }
+    out.flush();
+    return file.error() == QFile::NoError;
+}
+
+QString StitchReport::problemNames(int problems)
+{
+    QStringList names;
+    if (problems & BLURRED)
+        names << "blurred";
+    if (problems & CLIPPED)
+        names << "clipped";
+    if (problems & UNREGISTERED)
+        names << "unregistered";
+    return names.isEmpty() ? QString("-") : names.join(",");
+}
+
+double StitchReport::clippedFraction(const cv::Mat &gray)
+{
+    if (gray.empty())
+        return 0;
+
+    cv::Mat inside;
+    cv::inRange(gray, cv::Scalar(1), cv::Scalar(254), inside);
+    return 1.0 - static_cast<double>(cv::countNonZero(inside)) / gray.total();
+}
@@ -0,0 +1,197 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef STITCHREPORT_H
+#define STITCHREPORT_H
+
+#include <vector>
+#include <QtCore/QString>
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Quality of the tiles and their registration of a grid stitching
+/// Every tile gets its sharpness, the part of clipped pixels and the best
+/// correlation with one of its neighbours. Every registered pair of
+/// neighbours gets its correlation and how far the solved positions are
+/// away from it. Tiles that are blurred compared to their neighbours,
+/// overexposed or not registered while their neighbours are, are flagged to
+/// be taken again.
+///
+class StitchReport
+{
+public:
+    ///
+    /// Problems of a tile, combined as bits:
+    /// - BLURRED: Much less sharp than the tiles around
+    /// - CLIPPED: Too many pixels at the limits of the range
+    /// - UNREGISTERED: No neighbour has been registered, though a neighbour
+    ///   with no more structure has been registered with others
+    ///
+    enum Problem {
+        BLURRED = 1,
+        CLIPPED = 2,
+        UNREGISTERED = 4
+    };
+
+    ///
+    /// \brief Quality of one tile
+    ///
+    struct Tile {
+        cv::Point cell;
+        double sharpness;
+        double clipped;
+        double confidence;
+        int problems;
+    };
+
+    ///
+    /// \brief Quality of the registration of two neighbouring tiles
+    /// The residual is the distance of the solved positions to the
+    /// registered offset in pixels, -1 if not solved.
+    ///
+    struct Edge {
+        int i;
+        int j;
+        bool horizontal;
+        double confidence;
+        double residual;
+    };
+
+    ///
+    /// \brief Constructor
+    ///
+    StitchReport();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~StitchReport();
+
+    ///
+    /// \brief Set the sharpness a tile needs compared to its neighbours
+    /// \param ratio Least part of the median sharpness of the neighbours
+    ///
+    void setBlurRatio(double ratio);
+
+    ///
+    /// \brief Set the part of clipped pixels a tile may have
+    /// \param fraction Largest part between 0 and 1
+    ///
+    void setClipLimit(double fraction);
+
+    ///
+    /// \brief Set the correlation of a reliable registration
+    /// \param confidence Least normalized cross correlation
+    ///
+    void setMinConfidence(double confidence);
+
+    ///
+    /// \brief Remove all tiles and edges
+    ///
+    void clear();
+
+    ///
+    /// \brief Measure a tile
+    /// \param index Index of the tile
+    /// \param cell Grid cell of the tile
+    /// \param gray Gray image of the tile
+    ///
+    void measureTile(int index, cv::Point cell, const cv::Mat &gray);
+
+    ///
+    /// \brief Add or update the registration of two tiles
+    /// \param i Index of the first tile
+    /// \param j Index of the right or lower neighbour
+    /// \param horizontal True if j is the right neighbour
+    /// \param confidence Normalized cross correlation or -1
+    /// \param residual Distance to the solved positions or -1
+    ///
+    void setEdge(int i, int j, bool horizontal, double confidence,
+        double residual);
+
+    ///
+    /// \brief Flag the tiles with the measures and edges known so far
+    ///
+    void evaluate();
+
+    ///
+    /// \brief Get the info if there is anything in the report
+    /// \return True if there are no tiles, else false
+    ///
+    bool isEmpty() const;
+
+    ///
+    /// \brief Get the quality of the tiles
+    /// \return The tiles in the order of stitching
+    ///
+    const std::vector<Tile>& tiles() const;
+
+    ///
+    /// \brief Get the quality of the registrations
+    /// \return The edges
+    ///
+    const std::vector<Edge>& edges() const;
+
+    ///
+    /// \brief Get the tiles with problems
+    /// \return The indices of the tiles
+    ///
+    std::vector<int> flaggedTiles() const;
+
+    ///
+    /// \brief Get a short translated summary of the problems
+    /// \return The summary, empty if no tile is flagged
+    ///
+    QString summary() const;
+
+    ///
+    /// \brief Write the report as text
+    /// One line per tile (tile index column row sharpness clipped
+    /// confidence problems) and per edge (edge i j h|v confidence
+    /// residual), lines starting with # are comments.
+    /// \param fileName The file
+    /// \return True if written, else false
+    ///
+    bool write(const QString &fileName) const;
+
+    ///
+    /// \brief Get the names of problems
+    /// \param problems Combination of Problem bits
+    /// \return Comma separated names, "-" for none
+    ///
+    static QString problemNames(int problems);
+
+    ///
+    /// \brief Part of the pixels at the limits of the range
+    /// \param gray Gray image with 8 bit
+    /// \return Part between 0 and 1
+    ///
+    static double clippedFraction(const cv::Mat &gray);
+
+private:
+    std::vector<Tile> tileQuality;
+    std::vector<Edge> edgeQuality;
+    double blurRatio;
+    double clipLimit;
+    double minConfidence;
+};
+
+
+#endif // STITCHREPORT_H
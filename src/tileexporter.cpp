@@ -0,0 +1,255 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "tileexporter.hpp"
+
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+#include <QtCore/QTextStream>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+
+
+// Name of the manifest in the export directory
+static const char *MANIFEST_NAME = "manifest.txt";
+
+// Value of the tiff compression tag for uncompressed strips
+static const int TIFF_UNCOMPRESSED = 1;
+
+
+///
+/// \brief Job of the thread pool for one tile
+///
+class ExportJob : public QRunnable
+{
+public:
+    ExportJob(TileExporter *exporter, int index)
+        : exporter(exporter),
+        index(index)
+    {
+    }
+
+    void run() override
+    {
+        exporter->write(index);
+    }
+
+private:
+    TileExporter *exporter;
+    int index;
+};
+
+TileExporter::TileExporter(QObject *parent)
+    : QObject(parent),
+    threadPool(new QThreadPool(this)),
+    canceled(0),
+    running(false),
+    format(Format::PNG),
+    level(3),
+    done(0),
+    failed(0)
+{
+    // Leave one core for the gui and the camera
+    threadPool->setMaxThreadCount(
+        std::max(1, QThread::idealThreadCount() - 1)
+    );
+}
+
+TileExporter::~TileExporter()
+{
+    cancel();
+    threadPool->waitForDone();
+}
+
+void TileExporter::setFormat(Format format, int level)
+{
+    QMutexLocker locker(&mutex);
+    this->format = format;
+    this->level = level;
+}
+
+void TileExporter::setMaxThreads(int threads)
+{
+    threadPool->setMaxThreadCount(std::max(1, threads));
+}
+
+bool TileExporter::start(const QString &directory,
+    const std::vector<cv::Mat> &images, const std::vector<cv::Point> &cells)
+{
+    {
+        QMutexLocker locker(&mutex);
+        if (running) {
+            lastError = tr("An export is running.");
+            return false;
+        }
+        if (images.empty()) {
+            lastError = tr("There are no tiles.");
+            return false;
+        }
+
+        running = true;
+        canceled.store(0);
+        this->directory = directory;
+        this->images = images;
+        this->cells = cells;
+        if (this->cells.size() != images.size())
+            this->cells.clear();
+        fileNames.clear();
+        for (size_t i = 0; i < images.size(); i++)
+            fileNames.append(QString());
+        done = 0;
+        failed = 0;
+        lastError.clear();
+    }
+
+    for (size_t i = 0; i < images.size(); i++)
+        threadPool->start(new ExportJob(this, static_cast<int>(i)));
+    return true;
+}
+
+void TileExporter::cancel()
+{
+    canceled.store(1);
+}
+
+bool TileExporter::isRunning() const
+{
+    QMutexLocker locker(&mutex);
+    return running;
+}
+
+void TileExporter::waitForDone()
+{
+    threadPool->waitForDone();
+}
+
+QString TileExporter::errorString() const
+{
+    QMutexLocker locker(&mutex);
+    return lastError;
+}
+
+QString TileExporter::suffix(Format format)
+{
+    switch (format) {
+    case Format::JPEG:
+        return "jpg";
+    case Format::WEBP:
+        return "webp";
+    case Format::TIFF:
+        return "tif";
+    default:
+        return "png";
+    }
+}
+
+void TileExporter::write(int index)
+{
+    Format format;
+    int level;
+    QString fileName;
+    cv::Mat image;
+    {
+        QMutexLocker locker(&mutex);
+        format = this->format;
+        level = this->level;
+        fileName = QDir(directory).absoluteFilePath(
+            QString("img_%1.%2").arg(index).arg(suffix(format))
+        );
+        image = images[index];
+    }
+
+    // Canceled jobs still count, so the last one always finishes the export
+    bool written = false;
+    if (!canceled.load()) {
+        std::vector<int> params;
+        switch (format) {
+        case Format::PNG:
+            params = {cv::IMWRITE_PNG_COMPRESSION, std::min(9, level)};
+            break;
+        case Format::JPEG:
+            params = {cv::IMWRITE_JPEG_QUALITY, std::min(100, level)};
+            break;
+        case Format::WEBP:
+            // A quality above 100 is lossless
+            params = {cv::IMWRITE_WEBP_QUALITY, 101};
+            break;
+        case Format::TIFF:
+            params = {cv::IMWRITE_TIFF_COMPRESSION, TIFF_UNCOMPRESSED};
+            break;
+        }
+        try {
+            written = cv::imwrite(fileName.toStdString(), image, params);
+        } catch (const cv::Exception &) {
+            written = false;
+        }
+    }
+
+    QMutexLocker locker(&mutex);
+    if (written)
+        fileNames[index] = QFileInfo(fileName).fileName();
+    else if (!canceled.load())
+        failed++;
+    done++;
+    int total = static_cast<int>(images.size());
+    emit progress(done, total);
+    if (done < total)
+        return;
+
+    bool success = false;
+    if (canceled.load()) {
+        lastError = tr("The export has been canceled.");
+    } else if (failed > 0) {
+        lastError = tr("%1 of %2 tiles could not be written.").arg(failed)
+            .arg(total);
+    } else if (!writeManifest()) {
+        lastError = tr("The manifest could not be written.");
+    } else {
+        success = true;
+    }
+
+    // Free the tiles before anyone reacts on the end
+    images.clear();
+    running = false;
+    emit finished(success);
+}
+
+bool TileExporter::writeManifest()
+{
+    QSaveFile file(QDir(directory).absoluteFilePath(MANIFEST_NAME));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return false;
+
+    QTextStream out(&file);
+    out << "# file column row\n";
+    for (int i = 0; i < fileNames.size(); i++) {
+        out << fileNames.at(i);
+        if (!cells.empty() && cells[i].x >= 0 && cells[i].y >= 0)
+            out << " " << cells[i].x << " " << cells[i].y;
+        out << "\n";
+    }
+    out.flush();
+    return out.status() == QTextStream::Ok && file.commit();
+}
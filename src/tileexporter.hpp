@@ -0,0 +1,159 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef TILEEXPORTER_H
+#define TILEEXPORTER_H
+
+#include <vector>
+#include <QtCore/QObject>
+#include <QtCore/QMutex>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <opencv2/core.hpp>
+
+
+class QThreadPool;
+
+///
+/// \brief Writes tiles to a directory on worker threads
+/// Every tile is encoded by a job of its own. When all jobs are done, a
+/// manifest with the file and the grid cell of every tile is written next to
+/// them, which the batch stitching reads as input.
+///
+class TileExporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief File format of the tiles
+    ///
+    enum class Format { PNG, JPEG, WEBP, TIFF };
+
+    ///
+    /// \brief Constructor
+    /// \param parent Parent object
+    ///
+    explicit TileExporter(QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    /// Cancels the export and waits for the running jobs.
+    ///
+    virtual ~TileExporter() override;
+
+    ///
+    /// \brief Set the format of the files
+    /// \param format The format, WebP is lossless and TIFF uncompressed
+    /// \param level PNG compression from 0 to 9 or JPEG quality from 0 to
+    /// 100, unused for the other formats
+    ///
+    void setFormat(Format format, int level);
+
+    ///
+    /// \brief Set the number of worker threads
+    /// \param threads Number of threads
+    ///
+    void setMaxThreads(int threads);
+
+    ///
+    /// \brief Start writing tiles
+    /// \param directory The directory
+    /// \param images The tiles, they must not be changed till finished
+    /// \param cells The grid cell of every tile or none if unknown
+    /// \return True if started, false if an export is running
+    ///
+    bool start(const QString &directory, const std::vector<cv::Mat> &images,
+        const std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Stop the export, tiles in writing are finished
+    ///
+    void cancel();
+
+    ///
+    /// \brief Get the info if an export is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Wait till every job has been done
+    ///
+    void waitForDone();
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+    ///
+    /// \brief Get the file suffix of a format
+    /// \param format The format
+    /// \return Suffix without dot
+    ///
+    static QString suffix(Format format);
+
+signals:
+    ///
+    /// \brief A tile has been written or skipped
+    /// \param done Number of tiles done
+    /// \param total Number of tiles
+    ///
+    void progress(int done, int total);
+
+    ///
+    /// \brief All jobs are done
+    /// \param success True if every tile and the manifest have been written
+    ///
+    void finished(bool success);
+
+private:
+    friend class ExportJob;
+
+    ///
+    /// \brief Write one tile, runs on a worker thread
+    ///
+    void write(int index);
+
+    ///
+    /// \brief Write the manifest of the written tiles
+    ///
+    bool writeManifest();
+
+    QThreadPool *threadPool;
+    mutable QMutex mutex;
+    QAtomicInt canceled;
+    bool running;
+    Format format;
+    int level;
+    QString directory;
+    std::vector<cv::Mat> images;
+    std::vector<cv::Point> cells;
+    QStringList fileNames;
+    int done;
+    int failed;
+    QString lastError;
+};
+
+
+#endif // TILEEXPORTER_H
@@ -0,0 +1,90 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "tilegrid.hpp"
+
+
+TileGrid::TileGrid(int columns, int rows, GridOrder order, bool serpentine)
+    : numColumns(columns),
+    numRows(rows),
+    order(order),
+    serpentine(serpentine)
+{
+}
+
+int TileGrid::columns() const
+{
+    return numColumns;
+}
+
+int TileGrid::rows() const
+{
+    return numRows;
+}
+
+int TileGrid::size() const
+{
+    return numColumns * numRows;
+}
+
+cv::Point TileGrid::cell(int index) const
+{
+    if (numColumns <= 0 || numRows <= 0)
+        return cv::Point(-1, -1);
+
+    // Length of one line in taking order and the line number
+    int lineLength = order == GridOrder::ROW_MAJOR ? numColumns : numRows;
+    int line = index / lineLength;
+    int pos = index % lineLength;
+    if (serpentine && line % 2 != 0)
+        pos = lineLength - 1 - pos;
+
+    if (order == GridOrder::ROW_MAJOR)
+        return cv::Point(pos, line);
+    return cv::Point(line, pos);
+}
+
+int TileGrid::index(cv::Point cell) const
+{
+    if (cell.x < 0 || cell.y < 0 || cell.x >= numColumns || cell.y >= numRows)
+        return -1;
+
+    int lineLength = order == GridOrder::ROW_MAJOR ? numColumns : numRows;
+    int line = order == GridOrder::ROW_MAJOR ? cell.y : cell.x;
+    int pos = order == GridOrder::ROW_MAJOR ? cell.x : cell.y;
+    if (serpentine && line % 2 != 0)
+        pos = lineLength - 1 - pos;
+    return line * lineLength + pos;
+}
+
+std::vector<cv::Point> TileGrid::cells(int count) const
+{
+    std::vector<cv::Point> result;
+    for (int i = 0; i < count; i++)
+        result.push_back(cell(i));
+    return result;
+}
+
+TileGrid TileGrid::fromColumns(int count, int columns)
+{
+    if (columns <= 0)
+        columns = 1;
+    int rows = (count + columns - 1) / columns;
+    return TileGrid(columns, rows, GridOrder::ROW_MAJOR, false);
+}
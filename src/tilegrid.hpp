@@ -0,0 +1,108 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TILEGRID_H
+#define TILEGRID_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+///
+/// Order in which the tiles of a grid have been taken:
+/// - ROW_MAJOR: One row after another
+/// - COLUMN_MAJOR: One column after another (like the auto scan does)
+///
+enum class GridOrder {
+    ROW_MAJOR,
+    COLUMN_MAJOR
+};
+
+///
+/// \brief Regular arrangement of tiles in columns and rows
+/// Describes which grid cell the n-th taken tile belongs to. Serpentine grids
+/// reverse the direction on every second row (or column).
+///
+class TileGrid
+{
+public:
+    ///
+    /// \brief Constructor
+    /// \param columns Number of columns
+    /// \param rows Number of rows
+    /// \param order Order the tiles have been taken in
+    /// \param serpentine True if every second line is reversed
+    ///
+    TileGrid(
+        int columns = 0, int rows = 0, GridOrder order = GridOrder::ROW_MAJOR,
+        bool serpentine = false);
+
+    ///
+    /// \brief Get the number of columns
+    ///
+    int columns() const;
+
+    ///
+    /// \brief Get the number of rows
+    ///
+    int rows() const;
+
+    ///
+    /// \brief Get the number of cells
+    ///
+    int size() const;
+
+    ///
+    /// \brief Get the grid cell of a tile
+    /// \param index Index of the tile in the order of taking
+    /// \return The cell with x as column and y as row
+    ///
+    cv::Point cell(int index) const;
+
+    ///
+    /// \brief Get the index of a grid cell
+    /// \param cell The cell with x as column and y as row
+    /// \return The index in the order of taking or -1 if outside the grid
+    ///
+    int index(cv::Point cell) const;
+
+    ///
+    /// \brief Get the cells of the first tiles
+    /// \param count Number of tiles
+    /// \return The cells in the order of taking
+    ///
+    std::vector<cv::Point> cells(int count) const;
+
+    ///
+    /// \brief Create a row major grid with enough rows for the tiles
+    /// \param count Number of tiles
+    /// \param columns Number of columns
+    /// \return The grid
+    ///
+    static TileGrid fromColumns(int count, int columns);
+
+private:
+    int numColumns;
+    int numRows;
+    GridOrder order;
+    bool serpentine;
+};
+
+
+#endif // TILEGRID_H
@@ -0,0 +1,277 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "tileimporter.hpp"
+
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QCollator>
+#include <QtCore/QRegExp>
+#include <QtCore/QTextStream>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QDir>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+
+
+///
+/// \brief Job of the thread pool for one tile
+///
+class ImportJob : public QRunnable
+{
+public:
+    ImportJob(TileImporter *importer, int index)
+        : importer(importer),
+        index(index)
+    {
+    }
+
+    void run() override
+    {
+        importer->read(index);
+    }
+
+private:
+    TileImporter *importer;
+    int index;
+};
+
+TileImporter::TileImporter(QObject *parent)
+    : QObject(parent),
+    threadPool(new QThreadPool(this)),
+    canceled(0),
+    running(false),
+    thumbnailWidth(320),
+    nextReport(0),
+    failed(0)
+{
+    qRegisterMetaType<ImportedTile>("ImportedTile");
+
+    // Leave one core for the gui
+    threadPool->setMaxThreadCount(
+        std::max(1, QThread::idealThreadCount() - 1)
+    );
+}
+
+TileImporter::~TileImporter()
+{
+    cancel();
+    threadPool->waitForDone();
+}
+
+void TileImporter::setThumbnailWidth(int width)
+{
+    QMutexLocker locker(&mutex);
+    thumbnailWidth = std::max(16, width);
+}
+
+void TileImporter::setMaxThreads(int threads)
+{
+    threadPool->setMaxThreadCount(std::max(1, threads));
+}
+
+bool TileImporter::start(
+    const QStringList &files, const std::vector<cv::Point> &cells)
+{
+    {
+        QMutexLocker locker(&mutex);
+        if (running) {
+            lastError = tr("An import is running.");
+            return false;
+        }
+        if (files.isEmpty()) {
+            lastError = tr("There are no tiles.");
+            return false;
+        }
+
+        running = true;
+        canceled.store(0);
+        this->files = files;
+        this->cells = cells.size() == static_cast<size_t>(files.size())
+            ? cells : cellsFromNames(files);
+        finishedTiles.clear();
+        nextReport = 0;
+        failed = 0;
+        lastError.clear();
+    }
+
+    for (int i = 0; i < files.size(); i++)
+        threadPool->start(new ImportJob(this, i));
+    return true;
+}
+
+void TileImporter::cancel()
+{
+    canceled.store(1);
+}
+
+bool TileImporter::isRunning() const
+{
+    QMutexLocker locker(&mutex);
+    return running;
+}
+
+void TileImporter::waitForDone()
+{
+    threadPool->waitForDone();
+}
+
+QString TileImporter::errorString() const
+{
+    QMutexLocker locker(&mutex);
+    return lastError;
+}
+
+QStringList TileImporter::readDirectory(const QString &path)
+{
+    QDir dir(path);
+    QStringList names = dir.entryList(
+        QStringList() << "*.png" << "*.jpg" << "*.jpeg" << "*.tif" << "*.tiff"
+            << "*.bmp" << "*.webp",
+        QDir::Files
+    );
+
+    QCollator collator;
+    collator.setNumericMode(true);
+    std::sort(
+        names.begin(), names.end(),
+        [&collator](const QString &a, const QString &b) {
+            return collator.compare(a, b) < 0;
+        }
+    );
+
+    QStringList files;
+    for (int i = 0; i < names.size(); i++)
+        files.append(dir.absoluteFilePath(names.at(i)));
+    return files;
+}
+
+bool TileImporter::readManifest(
+    const QString &path, QStringList &files, std::vector<cv::Point> &cells)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QDir base = QFileInfo(path).absoluteDir();
+    bool allCells = true;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        QStringList parts = line.split(
+            QRegExp("\\s+"), QString::SkipEmptyParts
+        );
+        files.append(base.absoluteFilePath(parts.at(0)));
+        if (parts.size() >= 3) {
+            cells.push_back(
+                cv::Point(parts.at(1).toInt(), parts.at(2).toInt())
+            );
+        } else {
+            allCells = false;
+        }
+    }
+
+    if (!allCells)
+        cells.clear();
+    return true;
+}
+
+cv::Point TileImporter::cellFromName(const QString &fileName)
+{
+    QRegExp pattern("tile_\\d+_(\\d+)_(\\d+)\\.\\w+");
+    if (!pattern.exactMatch(QFileInfo(fileName).fileName()))
+        return cv::Point(-1, -1);
+    return cv::Point(pattern.cap(1).toInt(), pattern.cap(2).toInt());
+}
+
+std::vector<cv::Point> TileImporter::cellsFromNames(const QStringList &files)
+{
+    std::vector<cv::Point> cells;
+    for (int i = 0; i < files.size(); i++) {
+        cv::Point cell = cellFromName(files.at(i));
+        if (cell.x < 0)
+            return std::vector<cv::Point>();
+        cells.push_back(cell);
+    }
+    return cells;
+}
+
+void TileImporter::read(int index)
+{
+    int width;
+    ImportedTile tile;
+    {
+        QMutexLocker locker(&mutex);
+        width = thumbnailWidth;
+        tile.index = index;
+        tile.fileName = files.at(index);
+        tile.cell = cells.empty() ? cv::Point(-1, -1) : cells[index];
+    }
+
+    // Canceled jobs still count, so the last one always finishes the import
+    if (!canceled.load()) {
+        tile.image = cv::imread(tile.fileName.toStdString(), cv::IMREAD_COLOR);
+        if (!tile.image.empty()) {
+            double scale = std::min(
+                1.0, static_cast<double>(width) / tile.image.cols
+            );
+            cv::resize(
+                tile.image, tile.thumbnail, cv::Size(), scale, scale,
+                cv::INTER_AREA
+            );
+        }
+    }
+
+    // Report in the order of the files. Emitting under the lock keeps the
+    // order in the queue of the receiver.
+    QMutexLocker locker(&mutex);
+    if (tile.image.empty() && !canceled.load())
+        failed++;
+    finishedTiles.insert(index, tile);
+    while (finishedTiles.contains(nextReport)) {
+        ImportedTile next = finishedTiles.take(nextReport);
+        if (!next.image.empty())
+            emit tileImported(next);
+        nextReport++;
+    }
+    int total = files.size();
+    emit progress(nextReport, total);
+    if (nextReport < total)
+        return;
+
+    bool success = false;
+    if (canceled.load()) {
+        lastError = tr("The import has been canceled.");
+    } else if (failed > 0) {
+        lastError = tr("%1 of %2 files could not be read.").arg(failed)
+            .arg(total);
+    } else {
+        success = true;
+    }
+    running = false;
+    emit finished(success);
+}
@@ -0,0 +1,194 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef TILEIMPORTER_H
+#define TILEIMPORTER_H
+
+#include <vector>
+#include <QtCore/QObject>
+#include <QtCore/QMetaType>
+#include <QtCore/QMutex>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QMap>
+#include <opencv2/core.hpp>
+
+
+class QThreadPool;
+
+///
+/// \brief A tile read from disk
+///
+struct ImportedTile {
+    int index;
+    cv::Point cell;
+    cv::Mat image;
+    cv::Mat thumbnail;
+    QString fileName;
+};
+
+Q_DECLARE_METATYPE(ImportedTile)
+
+///
+/// \brief Reads the tiles of a directory or manifest on worker threads
+/// Every file is decoded once by a job of its own, the thumbnail is scaled
+/// from the decoded image. The tiles are reported in the order of the files,
+/// files that cannot be read are left out.
+///
+class TileImporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param parent Parent object
+    ///
+    explicit TileImporter(QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    /// Cancels the import and waits for the running jobs.
+    ///
+    virtual ~TileImporter() override;
+
+    ///
+    /// \brief Set the width of the thumbnails
+    /// \param width Width in pixels
+    ///
+    void setThumbnailWidth(int width);
+
+    ///
+    /// \brief Set the number of worker threads
+    /// \param threads Number of threads
+    ///
+    void setMaxThreads(int threads);
+
+    ///
+    /// \brief Start reading tiles
+    /// \param files The tile files
+    /// \param cells The grid cell of every file, if empty they are taken
+    /// from the file names when every name has one
+    /// \return True if started, false if an import is running
+    ///
+    bool start(const QStringList &files, const std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Stop the import, tiles in reading are still reported
+    ///
+    void cancel();
+
+    ///
+    /// \brief Get the info if an import is running
+    /// \return True if running, else false
+    ///
+    bool isRunning() const;
+
+    ///
+    /// \brief Wait till every job has been done
+    ///
+    void waitForDone();
+
+    ///
+    /// \brief Get the description of the last error
+    /// \return The message
+    ///
+    QString errorString() const;
+
+    ///
+    /// \brief List the image files of a directory in natural order
+    /// img_2.png comes before img_10.png like they have been saved.
+    /// \param path The directory
+    /// \return The files with absolute paths
+    ///
+    static QStringList readDirectory(const QString &path);
+
+    ///
+    /// \brief Read the tile list of a manifest
+    /// Every line holds a file name (relative to the manifest) and optionally
+    /// the column and row of the tile. Empty lines and lines starting with #
+    /// are ignored.
+    /// \param path The manifest file
+    /// \param files The tile files
+    /// \param cells The cells, empty if not all lines have one
+    /// \return True if the manifest could be read, else false
+    ///
+    static bool readManifest(
+        const QString &path, QStringList &files, std::vector<cv::Point> &cells);
+
+    ///
+    /// \brief Get the cell of a tile from its file name
+    /// The scan writes its tiles as tile_<index>_<column>_<row>.<suffix>.
+    /// \param fileName The file
+    /// \return The cell or (-1, -1) if the name has none
+    ///
+    static cv::Point cellFromName(const QString &fileName);
+
+    ///
+    /// \brief Get the cells of tiles from their file names
+    /// \param files The files
+    /// \return The cells, empty if not every name has one
+    ///
+    static std::vector<cv::Point> cellsFromNames(const QStringList &files);
+
+signals:
+    ///
+    /// \brief A tile has been read
+    /// \param tile The tile
+    ///
+    void tileImported(const ImportedTile &tile);
+
+    ///
+    /// \brief A file has been read or skipped
+    /// \param done Number of files done
+    /// \param total Number of files
+    ///
+    void progress(int done, int total);
+
+    ///
+    /// \brief All jobs are done
+    /// \param success True if every file has been read
+    ///
+    void finished(bool success);
+
+private:
+    friend class ImportJob;
+
+    ///
+    /// \brief Read one tile, runs on a worker thread
+    ///
+    void read(int index);
+
+    QThreadPool *threadPool;
+    mutable QMutex mutex;
+    QAtomicInt canceled;
+    bool running;
+    int thumbnailWidth;
+    QStringList files;
+    std::vector<cv::Point> cells;
+    QMap<int, ImportedTile> finishedTiles;
+    int nextReport;
+    int failed;
+    QString lastError;
+};
+
+
+#endif // TILEIMPORTER_H
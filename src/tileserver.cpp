@@ -0,0 +1,627 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "tileserver.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QDateTime>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QRegExp>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <opencv2/imgcodecs.hpp>
+
+#include "pyramidimage.hpp"
+
+
+// Largest header of a request
+static const int MAX_HEADER_SIZE = 16 * 1024;
+
+// The name of a tile contains the id of its pyramid file, so a tile of a
+// name never changes, also not between two runs of the server
+static const char *TILE_CACHE_CONTROL = "public, max-age=86400";
+
+// Bytes of the head of the pyramid file in its id, the header with the levels
+static const int ID_HEAD_SIZE = 4096;
+
+// Quality of the jpeg tiles
+static const int JPEG_QUALITY = 90;
+
+// Viewer of the tiles, one level at a time
+static const char *VIEWER_PAGE = R"(<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>microscope</title>
+<style>
+body { margin: 0; background: #333; color: #eee; font-family: sans-serif; }
+#bar { height: 24px; padding: 4px 8px; }
+#view { position: absolute; top: 32px; bottom: 0; left: 0; right: 0;
+    overflow: auto; }
+#plane { position: relative; }
+#plane img { position: absolute; display: block; }
+</style>
+</head>
+<body>
+<div id="bar">
+<button id="out">-</button> <button id="in">+</button> <span id="label"></span>
+</div>
+<div id="view"><div id="plane"></div></div>
+<script>
+var info = null;
+var level = 0;
+function show() {
+    var current = info.levels[level];
+    var plane = document.getElementById('plane');
+    var size = info.tile_size;
+    plane.innerHTML = '';
+    plane.style.width = current.width + 'px';
+    plane.style.height = current.height + 'px';
+    for (var row = 0; row < current.rows; row++) {
+        for (var column = 0; column < current.columns; column++) {
+            var img = document.createElement('img');
+            img.loading = 'lazy';
+            img.width = Math.min(size, current.width - column * size);
+            img.height = Math.min(size, current.height - row * size);
+            img.style.left = column * size + 'px';
+            img.style.top = row * size + 'px';
+            img.src = 'tiles/' + info.id + '/' + level + '/' + column + '/'
+                + row + '.jpg';
+            plane.appendChild(img);
+        }
+    }
+    document.getElementById('label').textContent = 'level ' + level + ', '
+        + current.width + ' x ' + current.height;
+}
+document.getElementById('in').onclick = function() {
+    if (info && level > 0) { level--; show(); }
+};
+document.getElementById('out').onclick = function() {
+    if (info && level < info.levels.length - 1) { level++; show(); }
+};
+fetch('info.json').then(function(response) {
+    return response.json();
+}).then(function(result) {
+    info = result;
+    level = info.levels.length - 1;
+    while (level > 0 && info.levels[level].width < window.innerWidth)
+        level--;
+    show();
+}).catch(function() {
+    document.getElementById('label').textContent = 'No mosaic is shared.';
+});
+</script>
+</body>
+</html>
+)";
+
+
+///
+/// \brief Get the id of a pyramid file for the names of its tiles
+/// \param fileName The file
+/// \return Hash of the size, the time of the last change and the header
+///
+static QString fileId(const QString &fileName)
+{
+    QFileInfo fileInfo(fileName);
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray::number(fileInfo.size()));
+    hash.addData(QByteArray::number(
+        fileInfo.lastModified().toMSecsSinceEpoch()
+    ));
+    QFile file(fileName);
+    if (file.open(QIODevice::ReadOnly))
+        hash.addData(file.read(ID_HEAD_SIZE));
+    return QString::fromLatin1(hash.result().toHex().left(16));
+}
+
+///
+/// \brief Job of the thread pool for one tile
+///
+class EncodeJob : public QRunnable
+{
+public:
+    EncodeJob(TileServer *server, int generation, const QString &key,
+            int level, int column, int row, bool png, bool hot)
+        : server(server),
+        generation(generation),
+        key(key),
+        level(level),
+        column(column),
+        row(row),
+        png(png),
+        hot(hot)
+    {
+    }
+
+    void run() override
+    {
+        server->encode(generation, key, level, column, row, png, hot);
+    }
+
+private:
+    TileServer *server;
+    int generation;
+    QString key;
+    int level;
+    int column;
+    int row;
+    bool png;
+    bool hot;
+};
+
+TileServer::TileServer(QObject *parent)
+    : QObject(parent),
+    threadPool(new QThreadPool(this)),
+    server(nullptr),
+    pyramid(new PyramidImage()),
+    port(0),
+    cacheSize(64 * 1024 * 1024),
+    hotTiles(64),
+    generation(0)
+{
+    // Half of the cores, the rest stays with the scan
+    threadPool->setMaxThreadCount(
+        std::max(1, QThread::idealThreadCount() / 2)
+    );
+}
+
+TileServer::~TileServer()
+{
+    threadPool->waitForDone();
+    delete pyramid;
+}
+
+void TileServer::setCacheSize(int bytes)
+{
+    QMutexLocker locker(&mutex);
+    cacheSize = std::max(0, bytes);
+}
+
+void TileServer::setHotTiles(int count)
+{
+    QMutexLocker locker(&mutex);
+    hotTiles = std::max(0, count);
+}
+
+void TileServer::setMaxThreads(int threads)
+{
+    threadPool->setMaxThreadCount(std::max(1, threads));
+}
+
+void TileServer::listen(const QHostAddress &address, quint16 port)
+{
+    {
+        QMutexLocker locker(&mutex);
+        this->address = address;
+        this->port = port;
+    }
+
+    // Runs in the thread of the server
+    QMetaObject::invokeMethod(this, "startListening", Qt::QueuedConnection);
+}
+
+void TileServer::stop()
+{
+    QMetaObject::invokeMethod(this, "stopListening", Qt::QueuedConnection);
+}
+
+void TileServer::setPyramid(const QString &fileName)
+{
+    {
+        QMutexLocker locker(&mutex);
+        pyramidFile = fileName;
+    }
+    QMetaObject::invokeMethod(this, "openPyramid", Qt::QueuedConnection);
+}
+
+void TileServer::setMetadata(const QJsonObject &metadata)
+{
+    QMutexLocker locker(&mutex);
+    this->metadata = metadata;
+}
+
+void TileServer::startListening()
+{
+    if (server == nullptr) {
+        server = new QTcpServer(this);
+        connect(
+            server, &QTcpServer::newConnection, this,
+            &TileServer::acceptConnections
+        );
+    }
+    stopListening();
+
+    QHostAddress host;
+    quint16 hostPort;
+    {
+        QMutexLocker locker(&mutex);
+        host = address;
+        hostPort = port;
+        cache.setMaxCost(cacheSize);
+    }
+    if (!server->listen(host, hostPort)) {
+        emit listening(false, server->errorString());
+        return;
+    }
+
+    // The smallest levels are encoded ahead now that someone may ask
+    openPyramid();
+    QString name = host.protocol() == QAbstractSocket::IPv6Protocol
+        ? QString("[%1]").arg(host.toString()) : host.toString();
+    emit listening(
+        true, QString("http://%1:%2/").arg(name).arg(server->serverPort())
+    );
+}
+
+void TileServer::stopListening()
+{
+    if (server != nullptr)
+        server->close();
+    QList<QTcpSocket *> sockets = connections.keys();
+    for (int i = 0; i < sockets.size(); i++)
+        sockets.at(i)->disconnectFromHost();
+}
+
+void TileServer::openPyramid()
+{
+    QString fileName;
+    int count;
+    {
+        QMutexLocker locker(&mutex);
+        fileName = pyramidFile;
+        count = hotTiles;
+    }
+
+    // The jobs read the tiles of the mapped file
+    threadPool->waitForDone();
+    pyramid->close();
+    generation++;
+    cache.clear();
+    hot.clear();
+    pyramidId.clear();
+    if (fileName.isEmpty() || !pyramid->open(fileName))
+        return;
+    pyramidId = fileId(fileName);
+    if (server == nullptr || !server->isListening())
+        return;
+
+    // Whole levels from the smallest one, as many as fit into the count
+    for (int level = pyramid->levels() - 1; level >= 0; level--) {
+        cv::Size tiles = pyramid->grid(level);
+        count -= tiles.area();
+        if (count < 0)
+            break;
+        for (int row = 0; row < tiles.height; row++) {
+            for (int column = 0; column < tiles.width; column++) {
+                QString key = QString("%1/%2/%3/%4.jpg").arg(pyramidId)
+                    .arg(level).arg(column).arg(row);
+                waiting.insert(key, QList<QPointer<QTcpSocket>>());
+                threadPool->start(new EncodeJob(
+                    this, generation, key, level, column, row, false, true
+                ));
+            }
+        }
+    }
+}
+
+void TileServer::acceptConnections()
+{
+    while (server->hasPendingConnections()) {
+        QTcpSocket *socket = server->nextPendingConnection();
+        Connection connection;
+        connection.busy = false;
+        connection.head = false;
+        connection.keepAlive = true;
+        connections.insert(socket, connection);
+        connect(
+            socket, &QTcpSocket::readyRead, this, &TileServer::readSocket
+        );
+        connect(
+            socket, &QTcpSocket::disconnected, this,
+            &TileServer::socketDisconnected
+        );
+    }
+}
+
+void TileServer::readSocket()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (socket == nullptr || !connections.contains(socket))
+        return;
+    connections[socket].buffer.append(socket->readAll());
+    processRequests(socket);
+}
+
+void TileServer::socketDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (socket == nullptr)
+        return;
+    connections.remove(socket);
+    socket->deleteLater();
+}
+
+void TileServer::processRequests(QTcpSocket *socket)
+{
+    while (connections.contains(socket)
+            && socket->state() == QAbstractSocket::ConnectedState) {
+        Connection &connection = connections[socket];
+        if (connection.busy)
+            return;
+        int end = connection.buffer.indexOf("\r\n\r\n");
+        if (end < 0) {
+            if (connection.buffer.size() > MAX_HEADER_SIZE) {
+                connection.busy = true;
+                connection.head = false;
+                connection.keepAlive = false;
+                respond(socket, 431, "text/plain", "Header too large\n");
+            }
+            return;
+        }
+
+        // Request line and the headers that matter here
+        QList<QByteArray> lines = connection.buffer.left(end).split('\n');
+        connection.buffer.remove(0, end + 4);
+        QList<QByteArray> request = lines.at(0).trimmed().split(' ');
+        QByteArray connectionHeader;
+        QByteArray ifNoneMatch;
+        for (int i = 1; i < lines.size(); i++) {
+            int colon = lines.at(i).indexOf(':');
+            if (colon < 0)
+                continue;
+            QByteArray name = lines.at(i).left(colon).trimmed().toLower();
+            QByteArray value = lines.at(i).mid(colon + 1).trimmed();
+            if (name == "connection")
+                connectionHeader = value.toLower();
+            else if (name == "if-none-match")
+                ifNoneMatch = value;
+        }
+
+        connection.busy = true;
+        if (request.size() != 3) {
+            connection.head = false;
+            connection.keepAlive = false;
+            respond(socket, 400, "text/plain", "Bad request\n");
+            continue;
+        }
+        QByteArray method = request.at(0);
+        QByteArray path = request.at(1);
+        connection.head = method == "HEAD";
+        connection.keepAlive = request.at(2) == "HTTP/1.1"
+            ? connectionHeader != "close" : connectionHeader == "keep-alive";
+        int query = path.indexOf('?');
+        if (query >= 0)
+            path.truncate(query);
+
+        if (method != "GET" && method != "HEAD") {
+            respond(socket, 405, "text/plain", "Method not allowed\n");
+        } else if (path == "/" || path == "/index.html") {
+            respond(socket, 200, "text/html; charset=utf-8", viewerPage());
+        } else if (path == "/info.json") {
+            if (pyramid->isOpen())
+                respond(socket, 200, "application/json", info());
+            else
+                respond(socket, 404, "text/plain", "No mosaic is shared\n");
+        } else if (path == "/metadata.json") {
+            QJsonObject object;
+            {
+                QMutexLocker locker(&mutex);
+                object = metadata;
+            }
+            respond(
+                socket, 200, "application/json",
+                QJsonDocument(object).toJson(QJsonDocument::Compact)
+            );
+        } else {
+            QRegExp pattern(
+                "/tiles/([0-9a-f]+)/(\\d+)/(\\d+)/(\\d+)\\.(jpg|png)"
+            );
+            int level = -1;
+            int column = -1;
+            int row = -1;
+            if (pattern.exactMatch(QString::fromLatin1(path))
+                    && pattern.cap(1) == pyramidId) {
+                level = pattern.cap(2).toInt();
+                column = pattern.cap(3).toInt();
+                row = pattern.cap(4).toInt();
+            }
+            cv::Size tiles = pyramid->grid(level);
+            if (!pyramid->isOpen() || level < 0 || level >= pyramid->levels()
+                    || column < 0 || row < 0 || column >= tiles.width
+                    || row >= tiles.height) {
+                respond(socket, 404, "text/plain", "Not found\n");
+                continue;
+            }
+
+            // The id in the name keeps the tiles of two pyramids apart, also
+            // in the cache of the browser
+            bool png = pattern.cap(5) == "png";
+            QString key = QString("%1/%2/%3/%4.%5").arg(pyramidId)
+                .arg(level).arg(column).arg(row).arg(pattern.cap(5));
+            QByteArray etag = "\"" + key.toLatin1() + "\"";
+            QByteArray type = png ? "image/png" : "image/jpeg";
+            if (ifNoneMatch == etag) {
+                respond(socket, 304, type, QByteArray(), etag);
+            } else if (hot.contains(key)) {
+                respond(socket, 200, type, hot.value(key), etag);
+            } else if (cache.contains(key)) {
+                respond(socket, 200, type, *cache.object(key), etag);
+            } else {
+                // One job per tile, however many ask for it
+                bool pending = waiting.contains(key);
+                waiting[key].append(QPointer<QTcpSocket>(socket));
+                if (!pending) {
+                    threadPool->start(new EncodeJob(
+                        this, generation, key, level, column, row, png, false
+                    ));
+                }
+                return;
+            }
+        }
+    }
+}
+
+void TileServer::respond(QTcpSocket *socket, int status,
+    const QByteArray &type, const QByteArray &body, const QByteArray &etag)
+{
+    if (!connections.contains(socket))
+        return;
+    Connection &connection = connections[socket];
+
+    QByteArray reason;
+    switch (status) {
+    case 200:
+        reason = "OK";
+        break;
+    case 304:
+        reason = "Not Modified";
+        break;
+    case 400:
+        reason = "Bad Request";
+        break;
+    case 404:
+        reason = "Not Found";
+        break;
+    case 405:
+        reason = "Method Not Allowed";
+        break;
+    case 431:
+        reason = "Request Header Fields Too Large";
+        break;
+    default:
+        reason = "Internal Server Error";
+        break;
+    }
+
+    QByteArray header = "HTTP/1.1 " + QByteArray::number(status) + " "
+        + reason + "\r\n";
+    if (status != 304) {
+        header += "Content-Type: " + type + "\r\n";
+        header += "Content-Length: " + QByteArray::number(body.size())
+            + "\r\n";
+    }
+    if (etag.isEmpty()) {
+        header += "Cache-Control: no-cache\r\n";
+    } else {
+        header += "ETag: " + etag + "\r\n";
+        header += QByteArray("Cache-Control: ") + TILE_CACHE_CONTROL + "\r\n";
+    }
+    header += "Access-Control-Allow-Origin: *\r\n";
+    header += connection.keepAlive ? "Connection: keep-alive\r\n"
+        : "Connection: close\r\n";
+    header += "\r\n";
+
+    bool keepAlive = connection.keepAlive;
+    bool withBody = !connection.head && status != 304;
+    connection.busy = false;
+    socket->write(header);
+    if (withBody)
+        socket->write(body);
+    if (!keepAlive)
+        socket->disconnectFromHost();
+}
+
+void TileServer::encode(int generation, const QString &key, int level,
+    int column, int row, bool png, bool hot)
+{
+    QByteArray data;
+    cv::Mat tile = pyramid->tile(level, column, row);
+    if (!tile.empty()) {
+        std::vector<uchar> buffer;
+        std::vector<int> params = png
+            ? std::vector<int>({cv::IMWRITE_PNG_COMPRESSION, 1})
+            : std::vector<int>({cv::IMWRITE_JPEG_QUALITY, JPEG_QUALITY});
+        if (cv::imencode(png ? ".png" : ".jpg", tile, buffer, params)) {
+            data = QByteArray(
+                reinterpret_cast<const char *>(buffer.data()),
+                static_cast<int>(buffer.size())
+            );
+        }
+    }
+
+    // Back into the thread of the server
+    QMetaObject::invokeMethod(
+        this, "tileEncoded", Qt::QueuedConnection, Q_ARG(int, generation),
+        Q_ARG(QString, key), Q_ARG(QByteArray, data), Q_ARG(bool, hot)
+    );
+}
+
+void TileServer::tileEncoded(int generation, const QString &key,
+    const QByteArray &data, bool hot)
+{
+    if (generation == this->generation && !data.isEmpty()) {
+        if (hot)
+            this->hot.insert(key, data);
+        else
+            cache.insert(key, new QByteArray(data), data.size());
+    }
+
+    QByteArray etag = "\"" + key.toLatin1() + "\"";
+    QByteArray type = key.endsWith(".png") ? "image/png" : "image/jpeg";
+    QList<QPointer<QTcpSocket>> sockets = waiting.take(key);
+    for (int i = 0; i < sockets.size(); i++) {
+        QTcpSocket *socket = sockets.at(i).data();
+        if (socket == nullptr || !connections.contains(socket))
+            continue;
+        if (data.isEmpty())
+            respond(socket, 404, "text/plain", "Not found\n");
+        else
+            respond(socket, 200, type, data, etag);
+        processRequests(socket);
+    }
+}
+
+QByteArray TileServer::info() const
+{
+    QJsonArray levels;
+    for (int i = 0; i < pyramid->levels(); i++) {
+        cv::Size size = pyramid->size(i);
+        cv::Size tiles = pyramid->grid(i);
+        QJsonObject level;
+        level["width"] = size.width;
+        level["height"] = size.height;
+        level["columns"] = tiles.width;
+        level["rows"] = tiles.height;
+        levels.append(level);
+    }
+
+    QJsonObject object;
+    object["id"] = pyramidId;
+    object["width"] = pyramid->size().width;
+    object["height"] = pyramid->size().height;
+    object["tile_size"] = pyramid->tileSize();
+    object["levels"] = levels;
+    return QJsonDocument(object).toJson(QJsonDocument::Compact);
+}
+
+QByteArray TileServer::viewerPage()
+{
+    return QByteArray(VIEWER_PAGE);
+}
@@ -0,0 +1,221 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef TILESERVER_H
+#define TILESERVER_H
+
+#include <QtCore/QObject>
+#include <QtCore/QMutex>
+#include <QtCore/QHash>
+#include <QtCore/QCache>
+#include <QtCore/QList>
+#include <QtCore/QPointer>
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/QJsonObject>
+#include <QtNetwork/QHostAddress>
+
+
+class QThreadPool;
+class QTcpServer;
+class QTcpSocket;
+class PyramidImage;
+
+///
+/// \brief Small http server for the tiles of a mosaic pyramid
+/// Serves a viewer page (/), the levels of the pyramid (/info.json), the
+/// metadata of the session (/metadata.json) and the tiles
+/// (/tiles/<id>/<level>/<column>/<row>.jpg or .png, level 0 is the full
+/// size). The id is derived from the pyramid file and named in info.json.
+/// Tiles are encoded on worker threads when they are asked for and kept in
+/// a cache of the least recently used ones, the tiles of the smallest
+/// levels are encoded as soon as the pyramid is set. All sockets are handled
+/// in the thread of the server, the public methods may be called from any
+/// thread.
+///
+class TileServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    ///
+    /// \brief Constructor
+    /// \param parent Parent object
+    ///
+    explicit TileServer(QObject *parent = nullptr);
+
+    ///
+    /// \brief Destructor
+    /// Waits for the running jobs.
+    ///
+    virtual ~TileServer() override;
+
+    ///
+    /// \brief Set the size of the cache of encoded tiles
+    /// \param bytes Size in bytes
+    ///
+    void setCacheSize(int bytes);
+
+    ///
+    /// \brief Set the number of tiles encoded ahead
+    /// \param count Number of tiles of the smallest levels
+    ///
+    void setHotTiles(int count);
+
+    ///
+    /// \brief Set the number of worker threads for encoding
+    /// \param threads Number of threads
+    ///
+    void setMaxThreads(int threads);
+
+    ///
+    /// \brief Start listening, listening emits the result
+    /// \param address The address to bind to, a local one keeps the server
+    /// private to this machine
+    /// \param port The port
+    ///
+    void listen(const QHostAddress &address, quint16 port);
+
+    ///
+    /// \brief Stop listening and close all connections
+    ///
+    void stop();
+
+    ///
+    /// \brief Set the pyramid to serve
+    /// \param fileName The file of the pyramid or an empty string for none
+    ///
+    void setPyramid(const QString &fileName);
+
+    ///
+    /// \brief Set the metadata of the session
+    /// \param metadata The metadata
+    ///
+    void setMetadata(const QJsonObject &metadata);
+
+signals:
+    ///
+    /// \brief Listening has been started or has failed
+    /// \param success True if listening, else false
+    /// \param message The address of the server or the error
+    ///
+    void listening(bool success, const QString &message);
+
+private slots:
+    ///
+    /// \brief Start listening in the thread of the server
+    ///
+    void startListening();
+
+    ///
+    /// \brief Stop listening in the thread of the server
+    ///
+    void stopListening();
+
+    ///
+    /// \brief Open the pyramid in the thread of the server
+    ///
+    void openPyramid();
+
+    ///
+    /// \brief Accept the waiting connections
+    ///
+    void acceptConnections();
+
+    ///
+    /// \brief Read the data of a connection
+    ///
+    void readSocket();
+
+    ///
+    /// \brief Forget a closed connection
+    ///
+    void socketDisconnected();
+
+    ///
+    /// \brief A tile has been encoded
+    /// \param generation The pyramid the tile belongs to
+    /// \param key The name of the tile
+    /// \param data The encoded tile, empty if there is none
+    /// \param hot True if the tile is kept for good, else false
+    ///
+    void tileEncoded(int generation, const QString &key,
+        const QByteArray &data, bool hot);
+
+private:
+    friend class EncodeJob;
+
+    ///
+    /// \brief State of one connection
+    ///
+    struct Connection {
+        QByteArray buffer;
+        bool busy;
+        bool head;
+        bool keepAlive;
+    };
+
+    ///
+    /// \brief Encode a tile, runs on a worker thread
+    ///
+    void encode(int generation, const QString &key, int level, int column,
+        int row, bool png, bool hot);
+
+    ///
+    /// \brief Answer the complete requests of a connection, one at a time
+    ///
+    void processRequests(QTcpSocket *socket);
+
+    ///
+    /// \brief Send a response and go on with the next request
+    ///
+    void respond(QTcpSocket *socket, int status, const QByteArray &type,
+        const QByteArray &body, const QByteArray &etag = QByteArray());
+
+    ///
+    /// \brief Get the description of the pyramid as json
+    ///
+    QByteArray info() const;
+
+    ///
+    /// \brief Get the page with the viewer
+    ///
+    static QByteArray viewerPage();
+
+    QThreadPool *threadPool;
+    QTcpServer *server;
+    PyramidImage *pyramid;
+    mutable QMutex mutex;
+    QHostAddress address;
+    quint16 port;
+    QString pyramidFile;
+    QString pyramidId;
+    QJsonObject metadata;
+    int cacheSize;
+    int hotTiles;
+    int generation;
+    QCache<QString, QByteArray> cache;
+    QHash<QString, QByteArray> hot;
+    QHash<QString, QList<QPointer<QTcpSocket>>> waiting;
+    QHash<QTcpSocket *, Connection> connections;
+};
+
+
+#endif // TILESERVER_H
@@ -0,0 +1,107 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "tileset.hpp"
+
+
+TileSet::TileSet()
+{
+}
+
+TileSet::~TileSet()
+{
+}
+
+void TileSet::append(const cv::Mat &image, cv::Point cell, qint64 time)
+{
+    tileImages.push_back(image);
+    tileCells.push_back(cell);
+    tileTimes.push_back(time);
+}
+
+void TileSet::replace(int index, const cv::Mat &image, qint64 time)
+{
+    tileImages.at(index) = image;
+    tileTimes.at(index) = time;
+}
+
+int TileSet::indexOf(cv::Point cell) const
+{
+    for (size_t i = 0; i < tileCells.size(); i++) {
+        if (tileCells[i] == cell)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+void TileSet::clear()
+{
+    tileImages.clear();
+    tileCells.clear();
+    tileTimes.clear();
+}
+
+int TileSet::size() const
+{
+    return static_cast<int>(tileImages.size());
+}
+
+bool TileSet::isEmpty() const
+{
+    return tileImages.empty();
+}
+
+cv::Mat TileSet::image(int index) const
+{
+    return tileImages.at(index);
+}
+
+cv::Point TileSet::cell(int index) const
+{
+    return tileCells.at(index);
+}
+
+qint64 TileSet::time(int index) const
+{
+    return tileTimes.at(index);
+}
+
+const std::vector<cv::Mat>& TileSet::images() const
+{
+    return tileImages;
+}
+
+const std::vector<cv::Point>& TileSet::cells() const
+{
+    return tileCells;
+}
+
+const std::vector<qint64>& TileSet::times() const
+{
+    return tileTimes;
+}
+
+bool TileSet::hasCells() const
+{
+    for (size_t i = 0; i < tileCells.size(); i++) {
+        if (tileCells[i].x < 0 || tileCells[i].y < 0)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,141 @@
+//
+// Copyright (¢) 2019 by Christian Krippendorf
+//
+// This file is part of microscope.
+//
+// microscope is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// microscope is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with microscope. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TILESET_H
+#define TILESET_H
+
+#include <vector>
+#include <QtCore/QtGlobal>
+#include <opencv2/core.hpp>
+
+
+///
+/// \brief Container for the tiles of a scan
+/// Every tile keeps the grid cell it has been taken at. Tiles without a
+/// known cell (taken manually or loaded) have the cell (-1, -1). Tiles of
+/// a scan also keep the time they have been taken at, to correct the drift
+/// of the stage.
+///
+class TileSet
+{
+public:
+    ///
+    /// \brief Constructor
+    ///
+    TileSet();
+
+    ///
+    /// \brief Destructor
+    ///
+    virtual ~TileSet();
+
+    ///
+    /// \brief Append a tile
+    /// \param image The image of the tile
+    /// \param cell The grid cell or (-1, -1) if unknown
+    /// \param time Milliseconds since the epoch or -1 if unknown
+    ///
+    void append(const cv::Mat &image, cv::Point cell = cv::Point(-1, -1),
+        qint64 time = -1);
+
+    ///
+    /// \brief Replace the image of a tile, it keeps its cell
+    /// \param index Index of the tile
+    /// \param image The new image
+    /// \param time Milliseconds since the epoch or -1 if unknown
+    ///
+    void replace(int index, const cv::Mat &image, qint64 time = -1);
+
+    ///
+    /// \brief Find the tile of a cell
+    /// \param cell The grid cell
+    /// \return The index of the first tile of the cell or -1
+    ///
+    int indexOf(cv::Point cell) const;
+
+    ///
+    /// \brief Remove all tiles
+    ///
+    void clear();
+
+    ///
+    /// \brief Get the number of tiles
+    /// \return Number of tiles
+    ///
+    int size() const;
+
+    ///
+    /// \brief Get the info if there are no tiles
+    /// \return True if empty, else false
+    ///
+    bool isEmpty() const;
+
+    ///
+    /// \brief Get the image of a tile
+    /// \param index Index of the tile
+    /// \return The image
+    ///
+    cv::Mat image(int index) const;
+
+    ///
+    /// \brief Get the cell of a tile
+    /// \param index Index of the tile
+    /// \return The cell or (-1, -1) if unknown
+    ///
+    cv::Point cell(int index) const;
+
+    ///
+    /// \brief Get the time a tile has been taken at
+    /// \param index Index of the tile
+    /// \return Milliseconds since the epoch or -1 if unknown
+    ///
+    qint64 time(int index) const;
+
+    ///
+    /// \brief Get all images
+    /// \return The images in the order of taking
+    ///
+    const std::vector<cv::Mat>& images() const;
+
+    ///
+    /// \brief Get all cells
+    /// \return The cells in the order of taking
+    ///
+    const std::vector<cv::Point>& cells() const;
+
+    ///
+    /// \brief Get all times
+    /// \return The times in the order of taking, see time
+    ///
+    const std::vector<qint64>& times() const;
+
+    ///
+    /// \brief Get the info if every tile knows its cell
+    /// \return True if all cells are known, else false
+    ///
+    bool hasCells() const;
+
+private:
+    std::vector<cv::Mat> tileImages;
+    std::vector<cv::Point> tileCells;
+    std::vector<qint64> tileTimes;
+};
+
+
+#endif // TILESET_H